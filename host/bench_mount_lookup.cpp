@@ -0,0 +1,82 @@
+// Micro-benchmark for devoptab path-to-mount resolution.
+// Compares the old lookup (std::string copy + mutex + vector scan) against the
+// lock-free FatfsMountTable and the r->deviceData shortcut newlib provides, both of
+// which take and drop a reference on the mount like every devoptab call does.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../source/utils/fatfs/fatfs_mount_table.h"
+
+struct FatfsMount {
+    std::string name;
+    std::atomic<int> refs{0};
+    std::atomic<bool> dead{false};
+};
+
+static std::vector<FatfsMount*> legacy_mounts;
+static std::mutex legacy_mutex;
+static FatfsMountTable<FatfsMount, 16> table;
+
+static FatfsMount* legacy_lookup(const char* path) {
+    std::string p(path);
+    size_t colon = p.find(':');
+    if (colon == std::string::npos) return nullptr;
+    std::string name = p.substr(0, colon);
+
+    std::lock_guard<std::mutex> lock(legacy_mutex);
+    for (const auto& m : legacy_mounts) {
+        if (m->name == name) return m;
+    }
+    return nullptr;
+}
+
+template<typename F>
+static double run(const char* label, F&& lookup, const char* const* paths, size_t count, size_t iterations) {
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        if (lookup(paths[i % count]) != nullptr) hits++;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    printf("%-12s %8.2f ns/lookup (%zu hits)\n", label, ns, hits);
+    return ns;
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+
+    static FatfsMount mounts[] = {{"fatsd"}, {"usb"}, {"usb2"}, {"usb3"}};
+    for (auto& m : mounts) {
+        legacy_mounts.push_back(&m);
+        table.insert(&m);
+    }
+
+    // Typical extraction paths, the long ones force heap allocations in the old lookup
+    static const char* const paths[] = {
+        "usb:/wiiu/environments/aroma/plugins/AromaBaseTweak.wps",
+        "usb:/wiiu/environments/aroma/modules/setup/50_hbl_installer.rpx",
+        "usb3:/",
+        "fatsd:/wiiu/apps/homebrew_launcher/homebrew_launcher.wuhb",
+    };
+    const size_t count = sizeof(paths) / sizeof(paths[0]);
+
+    FatfsMount* volatile device_data = &mounts[1];
+    double legacy = run("legacy", legacy_lookup, paths, count, iterations);
+    double fixed = run("table", [](const char* p) {
+        FatfsMount* m = table.acquire(p);
+        if (m != nullptr) table.release(m);
+        return m;
+    }, paths, count, iterations);
+    double direct = run("deviceData", [&](const char*) {
+        FatfsMount* m = table.acquire((FatfsMount*)device_data);
+        if (m != nullptr) table.release(m);
+        return m;
+    }, paths, count, iterations);
+    printf("speedup: table %.1fx, deviceData %.1fx\n", legacy / fixed, legacy / direct);
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "devoptab_host.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <mutex>
+
+// newlib's device table has 16 entries on the console as well
+#define HOST_MAX_DEVICES 16
+
+static const devoptab_t* devices[HOST_MAX_DEVICES] = {};
+static std::mutex devicesMutex;
+
+struct HostFile {
+    const devoptab_t* dev;
+    void* fileStruct;
+};
+static std::vector<HostFile> files;
+
+int AddDevice(const devoptab_t* device) {
+    std::lock_guard<std::mutex> lock(devicesMutex);
+    int freeSlot = -1;
+    for (int i = 0; i < HOST_MAX_DEVICES; i++) {
+        if (devices[i] != nullptr && strcmp(devices[i]->name, device->name) == 0) {
+            devices[i] = device;
+            return i;
+        }
+        if (devices[i] == nullptr && freeSlot < 0) freeSlot = i;
+    }
+    if (freeSlot >= 0) devices[freeSlot] = device;
+    return freeSlot;
+}
+
+int RemoveDevice(const char* name) {
+    std::lock_guard<std::mutex> lock(devicesMutex);
+    size_t len = strcspn(name, ":");
+    for (auto& device : devices) {
+        if (device != nullptr && strlen(device->name) == len && strncmp(device->name, name, len) == 0) {
+            device = nullptr;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const devoptab_t* GetDeviceOpTab(const char* name) {
+    std::lock_guard<std::mutex> lock(devicesMutex);
+    size_t len = strcspn(name, ":");
+    for (auto* device : devices) {
+        if (device != nullptr && strlen(device->name) == len && strncmp(device->name, name, len) == 0) return device;
+    }
+    return nullptr;
+}
+
+namespace hostio {
+
+// Looks up the device of a path and prepares the reent structure like newlib's _open_r & co
+static const devoptab_t* device_for(const char* path, struct _reent& r) {
+    r._errno = 0;
+    r.deviceData = nullptr;
+    const devoptab_t* dev = strchr(path, ':') ? GetDeviceOpTab(path) : nullptr;
+    if (dev != nullptr) r.deviceData = dev->deviceData;
+    return dev;
+}
+
+static ssize_t finish(ssize_t result, const struct _reent& r) {
+    if (result < 0) errno = r._errno;
+    return result;
+}
+
+static HostFile* get_file(int fd) {
+    if (fd < 0 || (size_t)fd >= files.size() || files[fd].dev == nullptr) return nullptr;
+    return &files[fd];
+}
+
+int open(const char* path, int flags, int mode) {
+    struct _reent r;
+    const devoptab_t* dev = device_for(path, r);
+    if (dev == nullptr || dev->open_r == nullptr) {
+        errno = ENODEV;
+        return -1;
+    }
+    void* fileStruct = calloc(1, dev->structSize);
+    if (dev->open_r(&r, fileStruct, path, flags, mode) < 0) {
+        free(fileStruct);
+        return finish(-1, r);
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        if (files[i].dev == nullptr) {
+            files[i] = {dev, fileStruct};
+            return (int)i;
+        }
+    }
+    files.push_back({dev, fileStruct});
+    return (int)files.size() - 1;
+}
+
+int close(int fd) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    int res = file->dev->close_r(&r, file->fileStruct);
+    free(file->fileStruct);
+    *file = {nullptr, nullptr};
+    return finish(res, r);
+}
+
+ssize_t read(int fd, void* buf, size_t len) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    return finish(file->dev->read_r(&r, file->fileStruct, (char*)buf, len), r);
+}
+
+ssize_t write(int fd, const void* buf, size_t len) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    return finish(file->dev->write_r(&r, file->fileStruct, (const char*)buf, len), r);
+}
+
+off_t seek(int fd, off_t pos, int dir) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    off_t res = file->dev->seek_r(&r, file->fileStruct, pos, dir);
+    if (res < 0) errno = r._errno;
+    return res;
+}
+
+int fstat(int fd, struct stat* st) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    return finish(file->dev->fstat_r(&r, file->fileStruct, st), r);
+}
+
+// The extended members are optional, newlib fails them with ENOSYS when a device leaves them out
+int fsync(int fd) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (file->dev->fsync_r == nullptr) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    return finish(file->dev->fsync_r(&r, file->fileStruct), r);
+}
+
+int ftruncate(int fd, off_t len) {
+    HostFile* file = get_file(fd);
+    if (file == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (file->dev->ftruncate_r == nullptr) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct _reent r = {0, file->dev->deviceData};
+    return finish(file->dev->ftruncate_r(&r, file->fileStruct, len), r);
+}
+
+// Path based calls that map one to one onto a devoptab member
+#define PATH_CALL(member, path, ...)                                 \
+    struct _reent r;                                                 \
+    const devoptab_t* dev = device_for(path, r);                     \
+    if (dev == nullptr || dev->member == nullptr) {                  \
+        errno = dev == nullptr ? ENODEV : ENOSYS;                    \
+        return -1;                                                   \
+    }                                                                \
+    return finish(dev->member(&r, path, ##__VA_ARGS__), r)
+
+int stat(const char* path, struct stat* st) { PATH_CALL(stat_r, path, st); }
+int unlink(const char* path) { PATH_CALL(unlink_r, path); }
+int rename(const char* oldName, const char* newName) { PATH_CALL(rename_r, oldName, newName); }
+int mkdir(const char* path, int mode) { PATH_CALL(mkdir_r, path, mode); }
+int statvfs(const char* path, struct statvfs* buf) { PATH_CALL(statvfs_r, path, buf); }
+int lstat(const char* path, struct stat* st) { PATH_CALL(lstat_r, path, st); }
+int utimes(const char* path, const struct timeval times[2]) { PATH_CALL(utimes_r, path, times); }
+int rmdir(const char* path) { PATH_CALL(rmdir_r, path); }
+
+int listdir(const char* path, std::vector<std::string>& names) {
+    struct _reent r;
+    const devoptab_t* dev = device_for(path, r);
+    if (dev == nullptr || dev->diropen_r == nullptr) {
+        errno = ENODEV;
+        return -1;
+    }
+    DIR_ITER dirState = {(void*)dev, calloc(1, dev->dirStateSize)};
+    if (dev->diropen_r(&r, &dirState, path) == nullptr) {
+        free(dirState.dirStruct);
+        return finish(-1, r);
+    }
+    char filename[NAME_MAX + 1];
+    struct stat st;
+    while (dev->dirnext_r(&r, &dirState, filename, &st) == 0) {
+        if (strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0) names.emplace_back(filename);
+    }
+    int res = r._errno != 0 ? -1 : 0;
+    dev->dirclose_r(&r, &dirState);
+    free(dirState.dirStruct);
+    return finish(res, r);
+}
+
+}
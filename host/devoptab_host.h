@@ -0,0 +1,28 @@
+#pragma once
+#include <sys/iosupport.h>
+#include <string>
+#include <vector>
+
+// Calls the devoptab registered for the "name:" prefix of a path the way newlib does on the console,
+// so host tools exercise fatfs_devoptab.cpp through the same entry points as fopen/stat/opendir.
+// Every call returns -1 and sets errno on failure.
+namespace hostio {
+    int open(const char* path, int flags, int mode = 0666);
+    int close(int fd);
+    ssize_t read(int fd, void* buf, size_t len);
+    ssize_t write(int fd, const void* buf, size_t len);
+    off_t seek(int fd, off_t pos, int dir);
+    int fstat(int fd, struct stat* st);
+    int stat(const char* path, struct stat* st);
+    int unlink(const char* path);
+    int rename(const char* oldName, const char* newName);
+    int mkdir(const char* path, int mode = 0777);
+    int statvfs(const char* path, struct statvfs* buf);
+    int fsync(int fd);
+    int ftruncate(int fd, off_t len);
+    int lstat(const char* path, struct stat* st);
+    int utimes(const char* path, const struct timeval times[2]);
+    int rmdir(const char* path);
+    // Names of the entries of a directory, without "." and ".."
+    int listdir(const char* path, std::vector<std::string>& names);
+}
@@ -0,0 +1,280 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "diskio_file.h"
+#include "diskio.h"
+#include "diskqueue.h"
+#include "ffprofile.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_VOLUMES 4
+#define FILE_MAX_QUEUE_DEPTH 16
+
+typedef struct {
+    int fd;
+    WORD sectorSize;
+    LBA_t realSectors;
+    LBA_t fakeSectors;
+    int present;
+    unsigned latency;
+    unsigned bandwidth;
+    pthread_mutex_t media;
+    DISKIO_FILE_STATS stats;
+    DISK_STATS diskStats;
+    DISKQUEUE* queue;
+} FileDrive;
+
+#define FILE_DRIVE_INIT {.fd = -1, .media = PTHREAD_MUTEX_INITIALIZER}
+static FileDrive drives[FILE_VOLUMES] = {FILE_DRIVE_INIT, FILE_DRIVE_INIT, FILE_DRIVE_INIT, FILE_DRIVE_INIT};
+
+static int get_pdrv_index(void* pdrv) {
+    if (!pdrv) return -1;
+    // Handle direct indices (e.g. from f_fdisk)
+    if ((uintptr_t)pdrv < FILE_VOLUMES) {
+        return (int)(uintptr_t)pdrv;
+    }
+    const char* s = (const char*)pdrv;
+    if (s[0] >= '0' && s[0] <= '3' && (s[1] == ':' || s[1] == '\0')) {
+        return s[0] - '0';
+    }
+    return -1;
+}
+
+int diskio_file_attach(int pdrv, const char* path, WORD sectorSize, LBA_t fakeSectors) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES || sectorSize < FF_MIN_SS || sectorSize > FF_MAX_SS) return -1;
+    diskio_file_detach(pdrv);
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sectorSize) {
+        close(fd);
+        return -1;
+    }
+    drives[pdrv].fd = fd;
+    drives[pdrv].sectorSize = sectorSize;
+    drives[pdrv].realSectors = (LBA_t)(st.st_size / sectorSize);
+    drives[pdrv].fakeSectors = fakeSectors;
+    drives[pdrv].present = 1;
+    drives[pdrv].latency = 0;
+    drives[pdrv].bandwidth = 0;
+    memset(&drives[pdrv].stats, 0, sizeof(DISKIO_FILE_STATS));
+    memset(&drives[pdrv].diskStats, 0, sizeof(DISK_STATS));
+    return 0;
+}
+
+void diskio_file_detach(int pdrv) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES || drives[pdrv].fd < 0) return;
+    dq_destroy(drives[pdrv].queue);
+    drives[pdrv].queue = NULL;
+    close(drives[pdrv].fd);
+    drives[pdrv].fd = -1;
+}
+
+void diskio_file_set_present(int pdrv, int present) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES) return;
+    __atomic_store_n(&drives[pdrv].present, present, __ATOMIC_RELAXED);
+}
+
+void diskio_file_set_latency(int pdrv, unsigned usecPerCall, unsigned kibPerSec) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES) return;
+    // Can be changed while the queue workers are busy
+    __atomic_store_n(&drives[pdrv].latency, usecPerCall, __ATOMIC_RELAXED);
+    __atomic_store_n(&drives[pdrv].bandwidth, kibPerSec, __ATOMIC_RELAXED);
+}
+
+static DRESULT transfer(int idx, BYTE* buff, LBA_t sector, UINT count, int write);
+
+// pread/pwrite don't share a file position, so every channel of the queue can use the same descriptor
+static DRESULT queue_io(void* channel, BYTE* buff, LBA_t sector, UINT count, BYTE write) {
+    return transfer((int)((FileDrive*)channel - drives), buff, sector, count, write);
+}
+
+int diskio_file_set_queue_depth(int pdrv, unsigned depth) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES || drives[pdrv].fd < 0 || depth > FILE_MAX_QUEUE_DEPTH) return -1;
+    dq_destroy(drives[pdrv].queue);
+    drives[pdrv].queue = NULL;
+    if (depth == 0) return 0;
+
+    void* channels[FILE_MAX_QUEUE_DEPTH];
+    for (unsigned i = 0; i < depth; i++) channels[i] = &drives[pdrv];
+    drives[pdrv].queue = dq_create(queue_io, channels, depth, drives[pdrv].sectorSize);
+    return drives[pdrv].queue ? 0 : -1;
+}
+
+void diskio_file_get_stats(int pdrv, DISKIO_FILE_STATS* stats, int reset) {
+    if (pdrv < 0 || pdrv >= FILE_VOLUMES) return;
+    QWORD* counters[] = {&drives[pdrv].stats.reads, &drives[pdrv].stats.writes, &drives[pdrv].stats.syncs,
+                         &drives[pdrv].stats.sectorsRead, &drives[pdrv].stats.sectorsWritten,
+                         &drives[pdrv].stats.trims, &drives[pdrv].stats.sectorsTrimmed};
+    QWORD* out[] = {&stats->reads, &stats->writes, &stats->syncs, &stats->sectorsRead, &stats->sectorsWritten,
+                    &stats->trims, &stats->sectorsTrimmed};
+    for (int i = 0; i < 7; i++) {
+        *out[i] = reset ? __atomic_exchange_n(counters[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(counters[i], __ATOMIC_RELAXED);
+    }
+}
+
+static QWORD now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (QWORD)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(QWORD usec) {
+    struct timespec ts = {(time_t)(usec / 1000000), (long)(usec % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0) {}
+}
+
+// The round trip overlaps between requests in flight, moving the data doesn't: the drive has one medium
+static void inject_latency(int idx, UINT count) {
+    unsigned latency = __atomic_load_n(&drives[idx].latency, __ATOMIC_RELAXED);
+    unsigned bandwidth = __atomic_load_n(&drives[idx].bandwidth, __ATOMIC_RELAXED);
+    if (latency != 0) sleep_us(latency);
+    if (bandwidth != 0 && count != 0) {
+        pthread_mutex_lock(&drives[idx].media);
+        sleep_us((QWORD)count * drives[idx].sectorSize * 1000000 / 1024 / bandwidth);
+        pthread_mutex_unlock(&drives[idx].media);
+    }
+}
+
+// Counterfeit drives only decode the low address bits, so requests crossing the real end are split
+static DRESULT transfer(int idx, BYTE* buff, LBA_t sector, UINT count, int write) {
+    WORD ss = drives[idx].sectorSize;
+    QWORD start = now_us();
+    UINT total = count;
+    DRESULT res = RES_OK;
+    inject_latency(idx, count);
+    // Queue workers call in from several threads
+    if (write) {
+        __atomic_fetch_add(&drives[idx].stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&drives[idx].stats.sectorsWritten, count, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&drives[idx].stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&drives[idx].stats.sectorsRead, count, __ATOMIC_RELAXED);
+    }
+    while (count > 0) {
+        LBA_t phys = sector % drives[idx].realSectors;
+        UINT n = count;
+        if (phys + n > drives[idx].realSectors) n = (UINT)(drives[idx].realSectors - phys);
+        size_t len = (size_t)n * ss;
+        off_t off = (off_t)phys * ss;
+        ssize_t done = write ? pwrite(drives[idx].fd, buff, len, off) : pread(drives[idx].fd, buff, len, off);
+        if (done != (ssize_t)len) {
+            res = RES_ERROR;
+            break;
+        }
+        buff += len;
+        sector += n;
+        count -= n;
+    }
+    // The injected latency counts, it stands in for the IPC round trip GET_DISK_STATS times on the console
+    disk_stats_add(&drives[idx].diskStats, (BYTE)write, total, now_us() - start, res);
+    return res;
+}
+
+// Unplugged drives keep their image attached, they just stop answering
+static int ready(int idx) {
+    return idx >= 0 && drives[idx].fd >= 0 && __atomic_load_n(&drives[idx].present, __ATOMIC_RELAXED);
+}
+
+DSTATUS disk_status(void* pdrv) {
+    int idx = get_pdrv_index(pdrv);
+    if (idx < 0 || drives[idx].fd < 0) return STA_NOINIT;
+    if (!ready(idx)) return STA_NOINIT | STA_NODISK;
+    return 0;
+}
+
+DSTATUS disk_initialize(void* pdrv) {
+    return disk_status(pdrv);
+}
+
+DRESULT disk_read(void* pdrv, BYTE* buff, LBA_t sector, UINT count) {
+    int idx = get_pdrv_index(pdrv);
+    if (!ready(idx)) return RES_NOTRDY;
+    FF_PROFILE_START(t0);
+    DRESULT res = drives[idx].queue ? dq_read(drives[idx].queue, buff, sector, count) : transfer(idx, buff, sector, count, 0);
+    FF_PROFILE_STOP(FF_PROF_DISK_READ, t0);
+    return res;
+}
+
+DRESULT disk_write(void* pdrv, const BYTE* buff, LBA_t sector, UINT count) {
+    int idx = get_pdrv_index(pdrv);
+    if (!ready(idx)) return RES_NOTRDY;
+    FF_PROFILE_START(t0);
+    DRESULT res = drives[idx].queue ? dq_write(drives[idx].queue, buff, sector, count) : transfer(idx, (BYTE*)buff, sector, count, 1);
+    FF_PROFILE_STOP(FF_PROF_DISK_WRITE, t0);
+    return res;
+}
+
+// Stands in for a flash drive's discard: the sectors read back as zeros afterwards, so a discard of data still
+// in use shows up as corrupted files. Punching fails on file systems without hole support, which is fine here.
+static DRESULT trim(int idx, LBA_t first, LBA_t last) {
+    LBA_t total = drives[idx].fakeSectors ? drives[idx].fakeSectors : drives[idx].realSectors;
+    if (first > last || last >= total) return RES_PARERR;
+    // Writes still queued for these sectors must not land after the discard
+    if (drives[idx].queue && dq_sync(drives[idx].queue) != RES_OK) return RES_ERROR;
+    __atomic_fetch_add(&drives[idx].stats.trims, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&drives[idx].stats.sectorsTrimmed, last - first + 1, __ATOMIC_RELAXED);
+    // Past the real end a counterfeit drive wraps onto sectors in use, those are left alone
+    if (first >= drives[idx].realSectors) return RES_OK;
+    if (last >= drives[idx].realSectors) last = drives[idx].realSectors - 1;
+    WORD ss = drives[idx].sectorSize;
+    fallocate(drives[idx].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * ss, (off_t)(last - first + 1) * ss);
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(void* pdrv, BYTE cmd, void* buff) {
+    int idx = get_pdrv_index(pdrv);
+    if (!ready(idx)) return RES_NOTRDY;
+
+    switch (cmd) {
+        case CTRL_SYNC: {
+            FF_PROFILE_START(t0);
+            inject_latency(idx, 0);
+            __atomic_fetch_add(&drives[idx].stats.syncs, 1, __ATOMIC_RELAXED);
+            // The host page cache stands in for the drive, flushing it would only add noise to benchmarks
+            DRESULT res = drives[idx].queue ? dq_sync(drives[idx].queue) : RES_OK;
+            FF_PROFILE_STOP(FF_PROF_DISK_SYNC, t0);
+            return res;
+        }
+        case GET_SECTOR_COUNT:
+            *(LBA_t*)buff = drives[idx].fakeSectors ? drives[idx].fakeSectors : drives[idx].realSectors;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *(WORD*)buff = drives[idx].sectorSize;
+            return RES_OK;
+        case GET_SECTOR_SHIFT: {
+            BYTE shift = 0;
+            while ((1U << shift) < drives[idx].sectorSize) shift++;
+            *(BYTE*)buff = shift;
+            return RES_OK;
+        }
+        case GET_BLOCK_SIZE:
+            *(DWORD*)buff = 1;
+            return RES_OK;
+        case CTRL_EJECT:
+            return RES_OK;
+        case CTRL_TRIM:
+            return trim(idx, ((LBA_t*)buff)[0], ((LBA_t*)buff)[1]);
+        case GET_DISK_STATS:
+            disk_stats_take(&drives[idx].diskStats, (DISK_STATS*)buff, 0);
+            return RES_OK;
+        case CTRL_RESET_STATS:
+            disk_stats_take(&drives[idx].diskStats, (DISK_STATS*)buff, 1);
+            return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+DWORD get_fattime(void) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    return (DWORD)(tm.tm_year - 80) << 25 | (DWORD)(tm.tm_mon + 1) << 21 | (DWORD)tm.tm_mday << 16 |
+           (DWORD)tm.tm_hour << 11 | (DWORD)tm.tm_min << 5 | (DWORD)tm.tm_sec >> 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Backs physical drive pdrv (0-3, addressed as "N:" like on the console) with an image file.
+// fakeSectors != 0 reports that many sectors and wraps every address past the real end of
+// the image back to its start, the way counterfeit flash drives behave.
+int diskio_file_attach(int pdrv, const char* path, WORD sectorSize, LBA_t fakeSectors);
+void diskio_file_detach(int pdrv);
+
+// Simulates unplugging (0) and plugging the drive back in (1)
+void diskio_file_set_present(int pdrv, int present);
+
+// Delays every read, write and sync request by usecPerCall to mimic the IOSU IPC round trip of the console,
+// and limits transfers to kibPerSec like a real drive would (0 turns either off)
+void diskio_file_set_latency(int pdrv, unsigned usecPerCall, unsigned kibPerSec);
+
+// Serves the drive through a request queue with depth channels like on the console (0 turns it off)
+int diskio_file_set_queue_depth(int pdrv, unsigned depth);
+
+// Requests the FatFs stack issued since the drive was attached or the counters were last reset
+typedef struct {
+    QWORD reads;
+    QWORD writes;
+    QWORD syncs;
+    QWORD sectorsRead;
+    QWORD sectorsWritten;
+    QWORD trims;           // CTRL_TRIM requests, the discarded sectors are punched out of the image and read back as zeros
+    QWORD sectorsTrimmed;
+} DISKIO_FILE_STATS;
+
+void diskio_file_get_stats(int pdrv, DISKIO_FILE_STATS* stats, int reset);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1296 @@
+// Test and benchmark runner for the FatFs stack on Linux, using image files instead of a USB drive.
+//   fatfs_host test [-d dir]
+//       formats FAT16/FAT32/exFAT images with 512 and 4096 byte sectors and checks the devoptab on each
+//   fatfs_host bench [-d dir] [-f fat32|exfat] [-s sector_size] [-F fats] [-l usec_per_call] [-b kib_per_sec] [-q queue_depth] [-n files]
+//       runs a fixed workload and prints time and drive requests per phase as CSV
+//   fatfs_host fsck [-r] [-s sector_size] image
+//       checks the FAT12/16/32 volume in an image (or its 1st partition), -r repairs what was found
+//       exits with 0 if it's clean, 1 if problems were repaired, 4 if problems are left and 8 on errors
+// Test and benchmark images are sparse files in dir (default /tmp) and get deleted afterwards.
+#include "devoptab_host.h"
+#include "diskio_file.h"
+#include "../source/utils/fatfs/fatfs_devoptab.h"
+#include "../source/utils/fatfs/fatfs_volumes.h"
+#include "../source/utils/fatfs/ff.h"
+#include "../source/utils/fatfs/diskbench.h"
+#include "../source/utils/fatfs/ffprofile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define HOST_PDRV 1
+// Drive the hot-plug test plugs in and out behind the volume manager's back
+#define HOTPLUG_PDRV 2
+#define HOTPLUG_POLL_MS 20
+#define HOTPLUG_TIMEOUT_MS 2000
+#define MKFS_WORK_SIZE (1024 * 1024)
+// The FAT is read through this in one request per chunk
+#define CHECK_WORK_SIZE (4 * 1024 * 1024)
+// Size of the I/O requests the runner makes through the devoptab, like newlib's default buffer on the console
+#define IO_CHUNK_SIZE (64 * 1024)
+
+struct VolumeConfig {
+    const char* name;
+    BYTE fmt;
+    WORD sectorSize;
+    unsigned long long imageSize;
+    BYTE nFats;
+};
+
+static const VolumeConfig testConfigs[] = {
+    {"fat16-512", FM_FAT, 512, 64ULL * 1024 * 1024, 2},
+    {"fat32-512", FM_FAT32, 512, 512ULL * 1024 * 1024, 2},
+    {"fat32-4096", FM_FAT32, 4096, 512ULL * 1024 * 1024, 1},
+    {"exfat-512", FM_EXFAT, 512, 512ULL * 1024 * 1024, 1},
+    {"exfat-4096", FM_EXFAT, 4096, 512ULL * 1024 * 1024, 1},
+};
+
+static std::string imageDir = "/tmp";
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                   \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fail(__LINE__, #cond, ##__VA_ARGS__);                          \
+            return false;                                                  \
+        }                                                                  \
+    } while (0)
+
+static void fail(int line, const char* cond, const char* fmt = nullptr, ...) {
+    fprintf(stderr, "  line %d: %s failed (errno %d)", line, cond, errno);
+    if (fmt) {
+        va_list args;
+        va_start(args, fmt);
+        fputs(": ", stderr);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+    fputc('\n', stderr);
+}
+
+// Creates a sparse image, formats it and mounts it as "test:"
+static bool createVolume(const VolumeConfig& config, unsigned queueDepth, std::string& imagePath) {
+    imagePath = imageDir + "/fatfs_host_" + config.name + ".img";
+    int fd = ::open(imagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool sized = ftruncate(fd, (off_t)config.imageSize) == 0;
+    ::close(fd);
+    if (!sized) return false;
+    if (diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) != 0) return false;
+
+    std::vector<BYTE> work(MKFS_WORK_SIZE);
+    MKFS_PARM opt = {config.fmt, config.nFats, 0, 0, 0, nullptr};
+    FRESULT res = f_mkfs("1:", &opt, work.data(), (UINT)work.size());
+    if (res != FR_OK) {
+        fprintf(stderr, "  f_mkfs failed: %d\n", res);
+        return false;
+    }
+    // The queue can only be switched while nothing has the drive mounted
+    return diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0 && fatfs_mount("test", HOST_PDRV);
+}
+
+static void destroyVolume(const std::string& imagePath) {
+    fatfs_unmount("test");
+    diskio_file_detach(HOST_PDRV);
+    ::unlink(imagePath.c_str());
+}
+
+static BYTE patternByte(size_t offset, unsigned seed) {
+    return (BYTE)((offset * 2654435761u + seed) >> 7);
+}
+
+static bool writePatternFile(const char* path, size_t size, unsigned seed) {
+    int fd = hostio::open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    CHECK(fd >= 0, "%s", path);
+    std::vector<BYTE> chunk(IO_CHUNK_SIZE);
+    for (size_t done = 0; done < size;) {
+        size_t len = std::min(chunk.size(), size - done);
+        for (size_t i = 0; i < len; i++) chunk[i] = patternByte(done + i, seed);
+        CHECK(hostio::write(fd, chunk.data(), len) == (ssize_t)len, "%s", path);
+        done += len;
+    }
+    CHECK(hostio::close(fd) == 0);
+    return true;
+}
+
+static bool checkPatternFile(const char* path, size_t size, unsigned seed) {
+    int fd = hostio::open(path, O_RDONLY);
+    CHECK(fd >= 0, "%s", path);
+    struct stat st;
+    CHECK(hostio::fstat(fd, &st) == 0 && (size_t)st.st_size == size, "%s", path);
+    std::vector<BYTE> chunk(IO_CHUNK_SIZE);
+    for (size_t done = 0; done < size;) {
+        ssize_t len = hostio::read(fd, chunk.data(), chunk.size());
+        CHECK(len > 0, "%s at %zu", path, done);
+        for (ssize_t i = 0; i < len; i++) CHECK(chunk[i] == patternByte(done + i, seed), "%s at %zu", path, done + i);
+        done += len;
+    }
+    CHECK(hostio::read(fd, chunk.data(), chunk.size()) == 0);
+    CHECK(hostio::close(fd) == 0);
+    return true;
+}
+
+static bool freeClusters(unsigned long long& free) {
+    struct statvfs vfs;
+    CHECK(hostio::statvfs("test:/", &vfs) == 0);
+    free = vfs.f_bfree;
+    return true;
+}
+
+static const size_t fileSizes[] = {0, 1, 511, 4096, 65537, 1024 * 1024, 5 * 1024 * 1024 + 3};
+
+static bool testFiles() {
+    unsigned long long freeBefore, freeAfter;
+    CHECK(freeClusters(freeBefore));
+
+    CHECK(hostio::mkdir("test:/dir") == 0);
+    CHECK(hostio::mkdir("test:/dir/nested with a long name") == 0);
+    CHECK(hostio::mkdir("test:/dir") < 0 && errno == EEXIST);
+
+    char path[256];
+    for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); i++) {
+        snprintf(path, sizeof(path), "test:/dir/nested with a long name/file %zu.bin", i);
+        CHECK(writePatternFile(path, fileSizes[i], (unsigned)i));
+    }
+    for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); i++) {
+        snprintf(path, sizeof(path), "test:/dir/nested with a long name/file %zu.bin", i);
+        CHECK(checkPatternFile(path, fileSizes[i], (unsigned)i));
+    }
+
+    std::vector<std::string> names;
+    CHECK(hostio::listdir("test:/dir/nested with a long name", names) == 0);
+    CHECK(names.size() == sizeof(fileSizes) / sizeof(fileSizes[0]), "%zu entries", names.size());
+
+    CHECK(hostio::rename("test:/dir/nested with a long name/file 4.bin", "test:/dir/moved.bin") == 0);
+    CHECK(checkPatternFile("test:/dir/moved.bin", fileSizes[4], 4));
+    struct stat st;
+    CHECK(hostio::stat("test:/dir/nested with a long name/file 4.bin", &st) < 0 && errno == ENOENT);
+
+    // Overwrite in the middle of a file and extend it past its end
+    int fd = hostio::open("test:/dir/moved.bin", O_RDWR);
+    CHECK(fd >= 0);
+    CHECK(hostio::seek(fd, 100, SEEK_SET) == 100);
+    BYTE marker[3] = {1, 2, 3};
+    CHECK(hostio::write(fd, marker, sizeof(marker)) == 3);
+    CHECK(hostio::seek(fd, 10, SEEK_END) == (off_t)fileSizes[4] + 10);
+    CHECK(hostio::write(fd, marker, sizeof(marker)) == 3);
+    CHECK(hostio::close(fd) == 0);
+    CHECK(hostio::stat("test:/dir/moved.bin", &st) == 0 && (size_t)st.st_size == fileSizes[4] + 13);
+
+    unsigned long long freeUsed;
+    CHECK(freeClusters(freeUsed));
+    CHECK(freeUsed < freeBefore);
+
+    for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); i++) {
+        if (i == 4) continue;
+        snprintf(path, sizeof(path), "test:/dir/nested with a long name/file %zu.bin", i);
+        CHECK(hostio::unlink(path) == 0, "%s", path);
+    }
+    CHECK(hostio::unlink("test:/dir/moved.bin") == 0);
+    CHECK(hostio::unlink("test:/dir/nested with a long name") == 0);
+    CHECK(hostio::unlink("test:/dir") == 0);
+    CHECK(hostio::unlink("test:/dir") < 0 && errno == ENOENT);
+
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    return true;
+}
+
+// The extended devoptab members: ftruncate, fsync, lstat, utimes and rmdir
+static bool testExtendedCalls() {
+    unsigned long long freeBefore, freeGrown, freeAfter;
+    CHECK(freeClusters(freeBefore));
+    CHECK(writePatternFile("test:/stale.bin", 4 * 1024 * 1024, 9));
+    CHECK(hostio::unlink("test:/stale.bin") == 0);
+    CHECK(writePatternFile("test:/trunc.bin", 300000, 7));
+
+    int fd = hostio::open("test:/trunc.bin", O_RDWR);
+    CHECK(fd >= 0);
+    CHECK(hostio::seek(fd, 1000, SEEK_SET) == 1000);
+    CHECK(hostio::ftruncate(fd, 8 * 1024 * 1024) == 0);
+    CHECK(hostio::seek(fd, 0, SEEK_CUR) == 1000);
+    struct stat st;
+    CHECK(hostio::fstat(fd, &st) == 0 && st.st_size == 8 * 1024 * 1024);
+    CHECK(hostio::fsync(fd) == 0);
+    CHECK(hostio::stat("test:/trunc.bin", &st) == 0 && st.st_size == 8 * 1024 * 1024);
+    CHECK(freeClusters(freeGrown));
+    CHECK(freeGrown < freeBefore);
+    // The grown part reads back as zeros, not as what the deleted file left in the clusters
+    std::vector<BYTE> grown(8 * 1024 * 1024 - 300000);
+    CHECK(hostio::seek(fd, 300000, SEEK_SET) == 300000);
+    CHECK(hostio::read(fd, grown.data(), grown.size()) == (ssize_t)grown.size());
+    CHECK(std::all_of(grown.begin(), grown.end(), [](BYTE b) { return b == 0; }));
+    CHECK(hostio::ftruncate(fd, 123456) == 0);
+    CHECK(hostio::ftruncate(fd, -1) < 0 && errno == EINVAL);
+    CHECK(hostio::close(fd) == 0);
+    CHECK(checkPatternFile("test:/trunc.bin", 123456, 7));
+
+    fd = hostio::open("test:/trunc.bin", O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(hostio::ftruncate(fd, 0) < 0 && errno == EBADF);
+    CHECK(hostio::close(fd) == 0);
+
+    CHECK(hostio::lstat("test:/trunc.bin", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 123456);
+    struct timeval times[2] = {{0, 0}, {0, 0}};
+    struct tm tm = {};
+    tm.tm_year = 2021 - 1900; tm.tm_mon = 5; tm.tm_mday = 15; tm.tm_hour = 12; tm.tm_min = 34; tm.tm_sec = 56;
+    tm.tm_isdst = -1;
+    times[0].tv_sec = times[1].tv_sec = mktime(&tm);
+    CHECK(hostio::utimes("test:/trunc.bin", times) == 0);
+    CHECK(hostio::stat("test:/trunc.bin", &st) == 0 && st.st_mtime == times[1].tv_sec, "%lld", (long long)st.st_mtime);
+    CHECK(hostio::utimes("test:/missing.bin", times) < 0 && errno == ENOENT);
+
+    CHECK(hostio::mkdir("test:/rmdir") == 0);
+    CHECK(hostio::lstat("test:/rmdir", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(hostio::rmdir("test:/trunc.bin") < 0);
+    CHECK(hostio::rmdir("test:/rmdir") == 0);
+    CHECK(hostio::lstat("test:/rmdir", &st) < 0 && errno == ENOENT);
+    CHECK(hostio::unlink("test:/trunc.bin") == 0);
+
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    return true;
+}
+
+static bool testManyEntries(const VolumeConfig& config) {
+    CHECK(hostio::mkdir("test:/many") == 0);
+    // A plain 8.3 name that the numbered short names of the long ones below have to skip
+    int fd = hostio::open("test:/many/ENTRYN~2.TXT", O_WRONLY | O_CREAT | O_EXCL);
+    CHECK(fd >= 0 && hostio::write(fd, "x", 1) == 1 && hostio::close(fd) == 0);
+    char path[256];
+    for (int i = 0; i < 300; i++) {
+        snprintf(path, sizeof(path), "test:/many/Entry number %03d with a long file name.txt", i);
+        fd = hostio::open(path, O_WRONLY | O_CREAT | O_EXCL);
+        CHECK(fd >= 0, "%s", path);
+        CHECK(hostio::write(fd, path, strlen(path)) == (ssize_t)strlen(path));
+        CHECK(hostio::close(fd) == 0);
+    }
+    std::vector<std::string> names;
+    CHECK(hostio::listdir("test:/many", names) == 0);
+    CHECK(names.size() == 301, "%zu entries", names.size());
+    struct stat st;
+    CHECK(hostio::stat("test:/many/ENTRY NUMBER 150 WITH A LONG FILE NAME.TXT", &st) == 0);
+    CHECK(hostio::stat("test:/many/ENTRYN~2.TXT", &st) == 0 && st.st_size == 1);
+    // exFAT has no short names, on FAT the second long name got the next free number
+    if (config.fmt != FM_EXFAT) {
+        char data[64] = {};
+        fd = hostio::open("test:/many/ENTRYN~3.TXT", O_RDONLY);
+        CHECK(fd >= 0 && hostio::read(fd, data, sizeof(data) - 1) == 53 && hostio::close(fd) == 0);
+        CHECK(strcmp(data, "test:/many/Entry number 001 with a long file name.txt") == 0, "%s", data);
+    }
+
+    // Names that were looked up before must not be found at their old place after they were removed or moved
+    CHECK(hostio::unlink("test:/many/Entry number 150 with a long file name.txt") == 0);
+    CHECK(hostio::stat("test:/many/Entry number 150 with a long file name.txt", &st) != 0);
+    CHECK(hostio::stat("test:/many/Entry number 151 with a long file name.txt", &st) == 0);
+    CHECK(hostio::rename("test:/many/Entry number 151 with a long file name.txt", "test:/many/Entry number 150 with a long file name.txt") == 0);
+    CHECK(hostio::stat("test:/many/Entry number 151 with a long file name.txt", &st) != 0);
+    CHECK(hostio::stat("test:/many/Entry number 150 with a long file name.txt", &st) == 0 && st.st_size == 53, "%lld bytes", (long long)st.st_size);
+    CHECK(hostio::mkdir("test:/many/sub") == 0);
+    fd = hostio::open("test:/many/sub/inner.txt", O_WRONLY | O_CREAT);
+    CHECK(fd >= 0 && hostio::close(fd) == 0);
+    CHECK(hostio::stat("test:/many/sub/inner.txt", &st) == 0);
+    CHECK(hostio::unlink("test:/many/sub/inner.txt") == 0 && hostio::unlink("test:/many/sub") == 0);
+    CHECK(hostio::mkdir("test:/many/sub") == 0);
+    CHECK(hostio::stat("test:/many/sub/inner.txt", &st) != 0);
+
+    // The same for directories that were passed through on the way to a file
+    CHECK(hostio::mkdir("test:/many/sub/deep") == 0);
+    fd = hostio::open("test:/many/sub/deep/inner.txt", O_WRONLY | O_CREAT);
+    CHECK(fd >= 0 && hostio::close(fd) == 0);
+    CHECK(hostio::stat("test:/many/sub/deep/inner.txt", &st) == 0);
+    CHECK(hostio::rename("test:/many/sub", "test:/many/moved") == 0);
+    CHECK(hostio::stat("test:/many/sub/deep/inner.txt", &st) != 0);
+    CHECK(hostio::stat("test:/MANY/Moved/deep/inner.txt", &st) == 0);
+    CHECK(hostio::unlink("test:/many/moved/deep/inner.txt") == 0 && hostio::unlink("test:/many/moved/deep") == 0);
+    CHECK(hostio::mkdir("test:/many/moved/deep") == 0);
+    CHECK(hostio::stat("test:/many/moved/deep/inner.txt", &st) != 0);
+    return true;
+}
+
+// Checks the chains of what is on the image right now, through a second drive behind the mounted volume's back
+static bool checkImage(const std::string& imagePath, WORD sectorSize, FFCHECK& report) {
+    std::vector<BYTE> work(CHECK_WORK_SIZE);
+    FATFS fs = {};
+    CHECK(diskio_file_attach(HOTPLUG_PDRV, imagePath.c_str(), sectorSize, 0) == 0);
+    FRESULT res = f_mount(&fs, (void*)"2:", 1 | FV_RDONLY); // A dirty volume would get its 2nd FAT rebuilt otherwise
+    if (res == FR_OK) res = f_check(&fs, 0, &report, work.data(), (UINT)work.size());
+    f_umount(&fs);
+    diskio_file_detach(HOTPLUG_PDRV);
+    CHECK(res == FR_OK, "f_check failed: %d", res);
+    return true;
+}
+
+// Reads a file straight from the image through a read-only mount of its own, to see what reached the volume
+static bool readImageFile(const std::string& imagePath, WORD sectorSize, const char* path, std::vector<BYTE>& data) {
+    FATFS fs = {};
+    FFFIL fil = {};
+    CHECK(diskio_file_attach(HOTPLUG_PDRV, imagePath.c_str(), sectorSize, 0) == 0);
+    FRESULT res = f_mount(&fs, (void*)"2:", 1 | FV_RDONLY);
+    if (res == FR_OK) res = f_open(&fil, &fs, path, FA_READ);
+    UINT read = 0;
+    if (res == FR_OK) {
+        data.resize((size_t)f_size(&fil));
+        res = f_read(&fil, data.data(), (UINT)data.size(), &read);
+        f_close(&fil);
+    }
+    f_umount(&fs);
+    diskio_file_detach(HOTPLUG_PDRV);
+    CHECK(res == FR_OK && read == data.size(), "reading %s from the image failed: %d", path, res);
+    return true;
+}
+
+// Files created in a batch are visible right away, and on the volume once the batch is closed or the volume unmounted
+static bool testBatch(const VolumeConfig& config, const std::string& imagePath, unsigned queueDepth) {
+    char path[256];
+    struct stat st;
+    CHECK(fatfs_batch("test:/", true));
+    CHECK(hostio::mkdir("test:/batch") == 0);
+    for (int i = 0; i < 400; i++) {
+        snprintf(path, sizeof(path), "test:/batch/held back %03d.txt", i);
+        int fd = hostio::open(path, O_WRONLY | O_CREAT | O_EXCL);
+        CHECK(fd >= 0 && hostio::write(fd, path, strlen(path)) == (ssize_t)strlen(path) && hostio::close(fd) == 0, "%s", path);
+    }
+    // More directory sectors than the batch holds, the ones written early never point at clusters the FAT
+    // on the volume doesn't have yet. The queue could still hold writes, so only without it.
+    if (config.fmt != FM_EXFAT && queueDepth == 0) {
+        FFCHECK report;
+        CHECK(checkImage(imagePath, config.sectorSize, report));
+        CHECK(report.bad_chains == 0 && report.cross_links == 0 && report.size_errors == 0, "%u bad chains, %u cross-links, %u size errors",
+              report.bad_chains, report.cross_links, report.size_errors);
+    }
+    // fsync doesn't wait for the batch, the file and its entry are on the volume once it returns
+    std::vector<BYTE> synced(70000), onImage;
+    for (size_t i = 0; i < synced.size(); i++) synced[i] = patternByte(i, 9);
+    int fd = hostio::open("test:/batch/synced.bin", O_WRONLY | O_CREAT | O_EXCL);
+    CHECK(fd >= 0 && hostio::write(fd, synced.data(), synced.size()) == (ssize_t)synced.size() && hostio::fsync(fd) == 0);
+    bool onVolume = readImageFile(imagePath, config.sectorSize, "batch/synced.bin", onImage);
+    CHECK(hostio::close(fd) == 0);
+    CHECK(onVolume && onImage == synced);
+    // Nested batches only write back when the outer one closes, data written directly in between has to win
+    CHECK(fatfs_batch("test:/batch", true));
+    CHECK(writePatternFile("test:/batch/direct.bin", 256 * 1024 + 5, 7));
+    CHECK(fatfs_batch("test:/batch", false));
+    std::vector<std::string> names;
+    CHECK(hostio::listdir("test:/batch", names) == 0 && names.size() == 402, "%zu entries", names.size());
+    CHECK(hostio::stat("test:/batch/held back 042.txt", &st) == 0 && st.st_size == 29);
+    CHECK(checkPatternFile("test:/batch/direct.bin", 256 * 1024 + 5, 7));
+    CHECK(fatfs_batch("test:/", false));
+
+    // Batches left open are written back by the unmount
+    CHECK(fatfs_batch("test:/", true));
+    CHECK(fatfs_batch("test:/", true));
+    CHECK(hostio::unlink("test:/batch/held back 000.txt") == 0);
+    CHECK(writePatternFile("test:/batch/unmounted.bin", 1000, 8));
+    CHECK(fatfs_unmount("test"));
+    diskio_file_detach(HOST_PDRV);
+    CHECK(diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+    CHECK(diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0);
+    CHECK(fatfs_mount("test", HOST_PDRV));
+
+    names.clear();
+    CHECK(hostio::listdir("test:/batch", names) == 0 && names.size() == 402, "%zu entries", names.size());
+    CHECK(hostio::stat("test:/batch/held back 000.txt", &st) != 0);
+    char data[64] = {};
+    fd = hostio::open("test:/batch/held back 099.txt", O_RDONLY);
+    CHECK(fd >= 0 && hostio::read(fd, data, sizeof(data) - 1) == 29 && hostio::close(fd) == 0);
+    CHECK(strcmp(data, "test:/batch/held back 099.txt") == 0, "%s", data);
+    CHECK(checkPatternFile("test:/batch/direct.bin", 256 * 1024 + 5, 7));
+    CHECK(checkPatternFile("test:/batch/unmounted.bin", 1000, 8));
+    CHECK(!fatfs_batch("nomount:/", true));
+    return true;
+}
+
+// The 1st FAT and the layout of a FAT12/16/32 volume, read straight from the image
+struct RawFat {
+    WORD sectorSize;
+    bool fat32;
+    BYTE nFats;
+    BYTE clusterSectors;
+    DWORD fatSize;
+    off_t fatBase;
+    off_t rootBase;
+    DWORD rootEntries;
+    DWORD rootCluster;
+    std::vector<BYTE> fat1;
+
+    off_t dataBase() const { return rootBase + (off_t)(rootEntries * 32 + sectorSize - 1) / sectorSize * sectorSize; }
+    DWORD next(DWORD clst) const {
+        return fat32 ? (fat1[clst * 4] | fat1[clst * 4 + 1] << 8 | fat1[clst * 4 + 2] << 16 | (DWORD)fat1[clst * 4 + 3] << 24) & 0x0FFFFFFF
+                     : fat1[clst * 2] | fat1[clst * 2 + 1] << 8;
+    }
+    bool isEnd(DWORD clst) const { return clst < 2 || clst >= (fat32 ? 0x0FFFFFF8u : 0xFFF8u); }
+    void set(DWORD clst, DWORD val) {
+        if (fat32) {
+            for (int i = 0; i < 4; i++) fat1[clst * 4 + i] = (BYTE)(val >> (i * 8));
+        } else {
+            fat1[clst * 2] = (BYTE)val;
+            fat1[clst * 2 + 1] = (BYTE)(val >> 8);
+        }
+    }
+    DWORD endMark() const { return fat32 ? 0x0FFFFFFF : 0xFFFF; }
+};
+
+static bool readRawFat(int fd, WORD sectorSize, RawFat& raw) {
+    std::vector<BYTE> sect(sectorSize);
+    off_t vol = 0;
+    bool ok = pread(fd, sect.data(), sectorSize, 0) == sectorSize;
+    if (ok && memcmp(&sect[54], "FAT", 3) != 0 && memcmp(&sect[82], "FAT", 3) != 0) { // MBR, the volume is the 1st partition
+        vol = (off_t)(sect[454] | sect[455] << 8 | sect[456] << 16 | (DWORD)sect[457] << 24) * sectorSize;
+        ok = pread(fd, sect.data(), sectorSize, vol) == sectorSize;
+    }
+    raw.sectorSize = sectorSize;
+    raw.fatSize = sect[22] | sect[23] << 8;
+    raw.fat32 = raw.fatSize == 0;
+    if (raw.fat32) raw.fatSize = sect[36] | sect[37] << 8 | sect[38] << 16 | (DWORD)sect[39] << 24;
+    raw.fatBase = vol + (off_t)(sect[14] | sect[15] << 8) * sectorSize;
+    raw.nFats = sect[16];
+    raw.clusterSectors = sect[13];
+    raw.rootEntries = sect[17] | sect[18] << 8;
+    raw.rootCluster = sect[44] | sect[45] << 8 | sect[46] << 16 | (DWORD)sect[47] << 24;
+    raw.rootBase = raw.fatBase + (off_t)raw.nFats * raw.fatSize * sectorSize;
+    raw.fat1.resize((size_t)raw.fatSize * sectorSize);
+    return ok && pread(fd, raw.fat1.data(), raw.fat1.size(), raw.fatBase) == (ssize_t)raw.fat1.size();
+}
+
+// Writes the 1st FAT back over every FAT copy
+static bool writeRawFat(int fd, const RawFat& raw) {
+    for (BYTE i = 0; i < raw.nFats; i++) {
+        off_t ofs = raw.fatBase + (off_t)i * raw.fatSize * raw.sectorSize;
+        if (pwrite(fd, raw.fat1.data(), raw.fat1.size(), ofs) != (ssize_t)raw.fat1.size()) return false;
+    }
+    return true;
+}
+
+// Reads the clean shutdown bit in FAT[1] and compares the FAT copies straight from the image
+static bool readFatState(const std::string& imagePath, WORD sectorSize, bool& clean, bool& mirrored) {
+    int fd = ::open(imagePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    RawFat raw;
+    bool ok = readRawFat(fd, sectorSize, raw);
+    std::vector<BYTE> fat2(raw.fat1.size());
+    ok = ok && (raw.nFats == 1 || pread(fd, fat2.data(), fat2.size(), raw.fatBase + (off_t)fat2.size()) == (ssize_t)fat2.size());
+    ::close(fd);
+    clean = raw.fat32 ? (raw.fat1[7] & 0x08) != 0 : (raw.fat1[3] & 0x80) != 0;
+    mirrored = raw.nFats == 1 || raw.fat1 == fat2;
+    return ok;
+}
+
+// Start cluster of a file in the root directory, sfn is the 8.3 name as stored (0:not found)
+static DWORD findRootFile(int fd, const RawFat& raw, const char* sfn) {
+    std::vector<BYTE> root;
+    bool ok = true;
+    if (raw.fat32) {
+        size_t bcs = (size_t)raw.clusterSectors * raw.sectorSize;
+        for (DWORD clst = raw.rootCluster; ok && !raw.isEnd(clst); clst = raw.next(clst)) {
+            root.resize(root.size() + bcs);
+            ok = pread(fd, &root[root.size() - bcs], bcs, raw.dataBase() + (off_t)(clst - 2) * bcs) == (ssize_t)bcs;
+        }
+    } else {
+        root.resize(raw.rootEntries * 32);
+        ok = pread(fd, root.data(), root.size(), raw.rootBase) == (ssize_t)root.size();
+    }
+    for (size_t i = 0; ok && i < root.size() && root[i] != 0; i += 32) {
+        if (root[i + 11] != 0x0F && memcmp(&root[i], sfn, 11) == 0) {
+            return (DWORD)(root[i + 20] | root[i + 21] << 8) << 16 | root[i + 26] | root[i + 27] << 8;
+        }
+    }
+    return 0;
+}
+
+// Counts the fragments of the cluster chain of a file in the root directory
+static bool countFragments(const std::string& imagePath, WORD sectorSize, const char* sfn, int& fragments) {
+    int fd = ::open(imagePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    RawFat raw;
+    bool ok = readRawFat(fd, sectorSize, raw);
+    DWORD clst = ok ? findRootFile(fd, raw, sfn) : 0;
+    ::close(fd);
+    if (clst < 2) return false;
+    for (fragments = 1; !raw.isEnd(raw.next(clst)); clst = raw.next(clst)) {
+        if (raw.next(clst) != clst + 1) fragments++;
+    }
+    return true;
+}
+
+// FAT volumes are marked dirty while the 2nd FAT and FSInfo lag behind, and get repaired when mounted that way
+static bool testDirtyVolume(const VolumeConfig& config, const std::string& imagePath, unsigned queueDepth) {
+    if (config.fmt == FM_EXFAT) return true;
+    bool clean, mirrored;
+    CHECK(writePatternFile("test:/dirty1.bin", 200000, 11));
+    CHECK(readFatState(imagePath, config.sectorSize, clean, mirrored));
+    CHECK(!clean);
+    CHECK(mirrored == (config.nFats == 1));
+    CHECK(fatfs_sync("test:/"));
+    CHECK(readFatState(imagePath, config.sectorSize, clean, mirrored));
+    CHECK(clean && mirrored);
+
+    // Pull the drive without syncing, as if the power went off
+    CHECK(writePatternFile("test:/dirty2.bin", 300000, 12));
+    unsigned long long freeBefore, freeAfter;
+    CHECK(freeClusters(freeBefore));
+    diskio_file_set_present(HOST_PDRV, 0);
+    fatfs_unmount("test");
+    diskio_file_set_present(HOST_PDRV, 1);
+    CHECK(readFatState(imagePath, config.sectorSize, clean, mirrored));
+    CHECK(!clean);
+    diskio_file_detach(HOST_PDRV);
+    CHECK(diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+    CHECK(diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0);
+    CHECK(fatfs_mount("test", HOST_PDRV));
+    CHECK(readFatState(imagePath, config.sectorSize, clean, mirrored));
+    CHECK(clean && mirrored);
+    CHECK(checkPatternFile("test:/dirty1.bin", 200000, 11));
+    CHECK(checkPatternFile("test:/dirty2.bin", 300000, 12));
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    return true;
+}
+
+// Files growing side by side in small writes get one run per doubling of their size, a file written in one go or
+// preallocated with ftruncate gets a single one, and the clusters reserved past the end are given back on close
+static bool testContiguous(const VolumeConfig& config, const std::string& imagePath) {
+    const size_t size = 2 * 1024 * 1024 + 3;
+    struct statvfs vfs;
+    CHECK(hostio::statvfs("test:/", &vfs) == 0); // Also completes the free cluster bitmap
+    unsigned long long freeBefore = vfs.f_bfree, freeAfter;
+    unsigned long long clusters = (size + vfs.f_bsize - 1) / vfs.f_bsize;
+
+    const char* paths[] = {"test:/runa.bin", "test:/runb.bin", "test:/runc.bin", "test:/rund.bin"};
+    int fds[4];
+    for (int i = 0; i < 4; i++) {
+        fds[i] = hostio::open(paths[i], O_WRONLY | O_CREAT | O_TRUNC);
+        CHECK(fds[i] >= 0, "%s", paths[i]);
+    }
+    CHECK(hostio::ftruncate(fds[2], (off_t)size) == 0);
+    std::vector<BYTE> chunk(16 * 1024), whole(size);
+    for (size_t done = 0; done < size;) {
+        size_t len = std::min(chunk.size(), size - done);
+        for (int i = 0; i < 3; i++) {
+            for (size_t j = 0; j < len; j++) chunk[j] = patternByte(done + j, 21 + i);
+            CHECK(hostio::write(fds[i], chunk.data(), len) == (ssize_t)len, "%s at %zu", paths[i], done);
+        }
+        done += len;
+        if (done == 512 * 1024) { // Lands in the middle of the others
+            for (size_t j = 0; j < size; j++) whole[j] = patternByte(j, 24);
+            CHECK(hostio::write(fds[3], whole.data(), size) == (ssize_t)size);
+        }
+    }
+    for (int i = 0; i < 4; i++) CHECK(hostio::close(fds[i]) == 0, "%s", paths[i]);
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore - 4 * clusters, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    for (int i = 0; i < 4; i++) CHECK(checkPatternFile(paths[i], size, 21 + i), "%s", paths[i]);
+
+    if (config.fmt == FM_EXFAT) return true;
+    CHECK(fatfs_sync("test:/"));
+    const char* names[] = {"RUNA    BIN", "RUNB    BIN", "RUNC    BIN", "RUND    BIN"};
+    int most = 2;
+    while (most < 20 && (1ULL << (most - 1)) * 16 * 1024 < size) most++;
+    for (int i = 0; i < 4; i++) {
+        int fragments;
+        CHECK(countFragments(imagePath, config.sectorSize, names[i], fragments), "%s", names[i]);
+        CHECK(fragments <= (i < 2 ? most : 1), "%s has %d fragments", names[i], fragments);
+    }
+    return true;
+}
+
+// f_check finds nothing on a healthy volume, then a cross-link, a chain cut short and lost clusters put into the FAT
+// behind its back, and leaves a volume it finds nothing on again after the repair
+static bool checkVolume(BYTE opt, FFCHECK& report) {
+    std::vector<BYTE> work(MKFS_WORK_SIZE);
+    FATFS fs = {};
+    FRESULT res = f_mount(&fs, (void*)"1:", 1);
+    if (res == FR_OK) res = f_check(&fs, opt, &report, work.data(), (UINT)work.size());
+    if (res == FR_OK && (opt & FC_REPAIR)) res = f_syncvol(&fs);
+    f_umount(&fs);
+    if (res != FR_OK) fprintf(stderr, "  f_check failed: %d\n", res);
+    return res == FR_OK;
+}
+
+static bool checkIsClean(const FFCHECK& r) {
+    return r.bad_chains == 0 && r.cross_links == 0 && r.size_errors == 0 && r.lost_chains == 0 && r.lost_clusters == 0 && !r.free_wrong;
+}
+
+static bool testCheck(const VolumeConfig& config, const std::string& imagePath, unsigned queueDepth) {
+    FFCHECK report;
+    CHECK(fatfs_unmount("test"));
+    if (config.fmt == FM_EXFAT) {
+        std::vector<BYTE> work(MKFS_WORK_SIZE);
+        FATFS fs = {};
+        CHECK(f_mount(&fs, (void*)"1:", 1) == FR_OK);
+        CHECK(f_check(&fs, 0, &report, work.data(), (UINT)work.size()) == FR_INVALID_PARAMETER);
+        f_umount(&fs);
+        return fatfs_mount("test", HOST_PDRV);
+    }
+    CHECK(checkVolume(0, report));
+    CHECK(checkIsClean(report), "%u/%u/%u/%u", report.bad_chains, report.cross_links, report.size_errors, report.lost_chains);
+    CHECK(report.files >= 4 && report.dirs >= 2, "%u files, %u dirs", report.files, report.dirs);
+
+    // runb.bin jumps into runa.bin after its 2nd cluster, rund.bin ends after its 1st one and three free clusters form
+    // a chain no file owns
+    int fd = ::open(imagePath.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    RawFat raw;
+    bool ok = readRawFat(fd, config.sectorSize, raw);
+    DWORD a = ok ? findRootFile(fd, raw, "RUNA    BIN") : 0, b = ok ? findRootFile(fd, raw, "RUNB    BIN") : 0;
+    DWORD d = ok ? findRootFile(fd, raw, "RUND    BIN") : 0, lost[3] = {}, n = 0;
+    ok = ok && a >= 2 && b >= 2 && d >= 2;
+    for (DWORD clst = 2; ok && n < 3 && clst < raw.fat1.size() / (raw.fat32 ? 4 : 2); clst++) {
+        if (raw.next(clst) == 0) lost[n++] = clst;
+    }
+    if (ok && n == 3) {
+        raw.set(raw.next(b), raw.next(a));
+        raw.set(d, raw.endMark());
+        raw.set(lost[0], lost[1]);
+        raw.set(lost[1], lost[2]);
+        raw.set(lost[2], raw.endMark());
+        ok = writeRawFat(fd, raw);
+    }
+    ::close(fd);
+    CHECK(ok && n == 3);
+
+    CHECK(checkVolume(0, report));
+    CHECK(report.cross_links == 1, "%u cross-links", report.cross_links);
+    CHECK(report.size_errors >= 1, "%u size errors", report.size_errors);
+    CHECK(report.lost_chains == 3, "%u lost chains", report.lost_chains); // The rests of runb.bin and rund.bin too
+    CHECK(!report.repaired);
+    CHECK(checkVolume(FC_REPAIR, report));
+    CHECK(report.repaired);
+    DWORD freeRepaired = report.free_clst;
+    CHECK(checkVolume(0, report));
+    CHECK(checkIsClean(report), "%u/%u/%u/%u", report.bad_chains, report.cross_links, report.size_errors, report.lost_chains);
+    CHECK(report.free_clst == freeRepaired, "%u free clusters after the repair, %u on the next check", freeRepaired, report.free_clst);
+
+    diskio_file_detach(HOST_PDRV);
+    CHECK(diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+    CHECK(diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0);
+    CHECK(fatfs_mount("test", HOST_PDRV));
+    CHECK(checkPatternFile("test:/runa.bin", 2 * 1024 * 1024 + 3, 21));
+    CHECK(checkPatternFile("test:/runc.bin", 2 * 1024 * 1024 + 3, 23));
+    struct stat st;
+    CHECK(hostio::stat("test:/rund.bin", &st) == 0);
+    CHECK(st.st_size > 0 && st.st_size < 2 * 1024 * 1024, "%lld bytes", (long long)st.st_size);
+    unsigned long long freeNow;
+    CHECK(freeClusters(freeNow));
+    CHECK(freeNow == freeRepaired, "%llu free clusters, %u after the repair", freeNow, freeRepaired);
+    CHECK(hostio::unlink("test:/runb.bin") == 0 && hostio::unlink("test:/rund.bin") == 0);
+    return true;
+}
+
+// Everything has to survive an unmount, and the free count has to match a fresh scan
+static bool testRemount(const VolumeConfig& config, const std::string& imagePath, unsigned queueDepth) {
+    CHECK(writePatternFile("test:/persist.bin", 3 * 1024 * 1024 + 17, 99));
+    unsigned long long freeBefore, freeAfter;
+    CHECK(freeClusters(freeBefore));
+    CHECK(fatfs_unmount("test"));
+    diskio_file_detach(HOST_PDRV);
+
+    CHECK(diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+    CHECK(diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0);
+    // Overwriting a file follows its chain, nothing needs the FAT loaded in full into the free cluster bitmap
+    FATFS fs = {};
+    FFFIL fil = {};
+    std::vector<BYTE> chunk(IO_CHUNK_SIZE);
+    FRESULT res = f_mount(&fs, (void*)"1:", 1);
+    if (res == FR_OK) res = f_open(&fil, &fs, "persist.bin", FA_WRITE);
+    for (size_t done = 0, size = 3 * 1024 * 1024 + 17; res == FR_OK && done < size;) {
+        UINT len = (UINT)std::min(chunk.size(), size - done), written = 0;
+        for (UINT j = 0; j < len; j++) chunk[j] = patternByte(done + j, 99);
+        res = f_write(&fil, chunk.data(), len, &written);
+        if (res == FR_OK && written != len) res = FR_DENIED;
+        done += written;
+    }
+    if (res == FR_OK) res = f_close(&fil);
+    bool loaded = fs.fmap != nullptr && fs.fmap_scan >= fs.n_fatent;
+    if (res == FR_OK) res = f_syncvol(&fs);
+    f_umount(&fs);
+    CHECK(res == FR_OK, "overwriting persist.bin failed: %d", res);
+    CHECK(!loaded);
+    CHECK(fatfs_mount("test", HOST_PDRV));
+    CHECK(checkPatternFile("test:/persist.bin", 3 * 1024 * 1024 + 17, 99));
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    return true;
+}
+
+// Reads persist.bin and runa.bin in turns with unaligned chunks, so the data sectors going through the disk access
+// window keep pushing the FAT sectors out of it
+static bool readInTurns(QWORD& sectorsRead) {
+    const char* paths[] = {"test:/persist.bin", "test:/runa.bin"};
+    DISKIO_FILE_STATS stats;
+    diskio_file_get_stats(HOST_PDRV, &stats, 1);
+    int fds[2];
+    for (int i = 0; i < 2; i++) {
+        fds[i] = hostio::open(paths[i], O_RDONLY);
+        CHECK(fds[i] >= 0, "%s", paths[i]);
+    }
+    char buf[1000];
+    for (bool more = true; more;) {
+        more = false;
+        for (int i = 0; i < 2; i++) {
+            ssize_t len = hostio::read(fds[i], buf, sizeof(buf));
+            CHECK(len >= 0, "%s", paths[i]);
+            more = more || len > 0;
+        }
+    }
+    for (int i = 0; i < 2; i++) CHECK(hostio::close(fds[i]) == 0);
+    diskio_file_get_stats(HOST_PDRV, &stats, 0);
+    sectorsRead = stats.sectorsRead;
+    return true;
+}
+
+// A read-only mount refuses every change, never writes to the drive, not even to repair a dirty volume, and reads
+// each FAT sector only once
+static bool testReadOnly(const VolumeConfig& config, const std::string& imagePath, unsigned queueDepth) {
+    QWORD writableReads, readOnlyReads;
+    CHECK(readInTurns(writableReads));
+    CHECK(writePatternFile("test:/dirty3.bin", 300000, 13));
+    unsigned long long freeBefore, freeAfter;
+    CHECK(freeClusters(freeBefore));
+    diskio_file_set_present(HOST_PDRV, 0); // Pulled, so the volume stays marked dirty with a stale FSInfo
+    fatfs_unmount("test");
+    diskio_file_set_present(HOST_PDRV, 1);
+    diskio_file_detach(HOST_PDRV);
+    CHECK(diskio_file_attach(HOST_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+    CHECK(diskio_file_set_queue_depth(HOST_PDRV, queueDepth) == 0);
+
+    DISKIO_FILE_STATS stats;
+    diskio_file_get_stats(HOST_PDRV, &stats, 1);
+    CHECK(fatfs_mount("test", HOST_PDRV, true));
+    CHECK(checkPatternFile("test:/dirty3.bin", 300000, 13));
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    CHECK(hostio::open("test:/new.bin", O_WRONLY | O_CREAT) < 0 && errno == EROFS);
+    CHECK(hostio::open("test:/persist.bin", O_RDWR) < 0 && errno == EROFS);
+    CHECK(hostio::mkdir("test:/newdir") < 0 && errno == EROFS);
+    CHECK(hostio::unlink("test:/persist.bin") < 0 && errno == EROFS);
+    CHECK(hostio::rename("test:/persist.bin", "test:/moved.bin") < 0 && errno == EROFS);
+    CHECK(!fatfs_batch("test:/", true) && !fatfs_sync("test:/"));
+    struct statvfs vfs;
+    struct stat st;
+    CHECK(hostio::statvfs("test:/", &vfs) == 0 && (vfs.f_flag & ST_RDONLY));
+    CHECK(hostio::stat("test:/persist.bin", &st) == 0 && !(st.st_mode & S_IWUSR));
+    CHECK(readInTurns(readOnlyReads));
+    FatfsVolumeStats counters;
+    CHECK(fatfs_stats("test:/", counters));
+    CHECK(config.fmt == FM_EXFAT || counters.fatCacheHits > counters.fatCacheMisses, "%llu FAT cache hits, %llu misses",
+          (unsigned long long)counters.fatCacheHits, (unsigned long long)counters.fatCacheMisses);
+    // Every cluster boundary takes a FAT sector read on the writable mount. exFAT files written in one go have no
+    // chain on the FAT to follow, and the read-ahead of the request queue blurs the counts.
+    CHECK(queueDepth != 0 || (config.fmt == FM_EXFAT ? readOnlyReads <= writableReads : readOnlyReads * 20 < writableReads * 19),
+          "%llu sectors read, %llu on a writable mount", (unsigned long long)readOnlyReads, (unsigned long long)writableReads);
+    CHECK(fatfs_unmount("test"));
+    diskio_file_get_stats(HOST_PDRV, &stats, 0);
+    CHECK(stats.writes == 0, "%llu writes", (unsigned long long)stats.writes);
+
+    CHECK(fatfs_mount("test", HOST_PDRV)); // Writable again, this repairs it
+    CHECK(checkPatternFile("test:/dirty3.bin", 300000, 13));
+    CHECK(freeClusters(freeAfter));
+    CHECK(freeAfter == freeBefore, "%llu free clusters before, %llu after", freeBefore, freeAfter);
+    CHECK(hostio::unlink("test:/dirty3.bin") == 0);
+    return true;
+}
+
+static uint64_t latencySum(const uint64_t* buckets) {
+    uint64_t sum = 0;
+    for (int i = 0; i < FATFS_LATENCY_BUCKETS; i++) sum += buckets[i];
+    return sum;
+}
+
+// The volume counters follow what the lookups and reads did, the drive counters match the requests the drive saw
+static bool testStats(const VolumeConfig& config, unsigned queueDepth) {
+    FatfsVolumeStats st;
+    FatfsDriveStats ds;
+    CHECK(!fatfs_stats("nothere:/", st) && !fatfs_drive_stats("nothere:/", ds));
+    CHECK(hostio::mkdir("test:/stats") == 0);
+    CHECK(writePatternFile("test:/stats/data.bin", 200000, 21));
+    CHECK(fatfs_drive_stats("test:/", ds, true));
+    CHECK(ds.writes > 0 && ds.bytesWritten >= 200000 && latencySum(ds.writeLatency) == ds.writes);
+    CHECK(fatfs_stats("test:/", st, true));
+    CHECK(fatfs_stats("test:/", st) && fatfs_drive_stats("test:/", ds));
+    CHECK(ds.reads == 0 && ds.writes == 0 && st.windowLoads == 0 && st.dirScans == 0, "not reset");
+
+    DISKIO_FILE_STATS drive;
+    diskio_file_get_stats(HOST_PDRV, &drive, 1);
+    struct stat info;
+    for (int i = 0; i < 2; i++) CHECK(hostio::stat("test:/stats/data.bin", &info) == 0);
+    CHECK(checkPatternFile("test:/persist.bin", 3 * 1024 * 1024 + 17, 99));
+    CHECK(fatfs_stats("test:/", st) && fatfs_drive_stats("test:/", ds));
+    diskio_file_get_stats(HOST_PDRV, &drive, 0);
+    // Read-ahead of the request queue can still be in flight between the two snapshots
+    CHECK(queueDepth != 0 || (ds.reads == drive.reads && ds.sectorsRead == drive.sectorsRead),
+          "%llu reads, the drive saw %llu", (unsigned long long)ds.reads, (unsigned long long)drive.reads);
+    CHECK(ds.reads > 0 && ds.bytesRead == ds.sectorsRead * config.sectorSize && ds.errors == 0);
+    CHECK(latencySum(ds.readLatency) == ds.reads);
+    CHECK(st.dirCacheHits > 0 && st.pathCacheHits > 0 && st.pathCacheMisses > 0);
+    CHECK(st.windowHits + st.windowLoads > 0);
+    // exFAT files written in one go are contiguous and never touch the FAT
+    CHECK(config.fmt == FM_EXFAT || st.fatLookups > 0);
+
+    CHECK(hostio::unlink("test:/stats/data.bin") == 0);
+    CHECK(hostio::rmdir("test:/stats") == 0);
+    return true;
+}
+
+// Freed clusters reach the drive as discards, batched across deletes, never after they were taken again, and the
+// free space can be discarded as a whole. The image punches discarded sectors out, so any mistake zeroes live data.
+static bool testTrim(const VolumeConfig& config) {
+    char path[64];
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "test:/trim%d.bin", i);
+        CHECK(writePatternFile(path, 70000, 60 + i));
+    }
+    DISKIO_FILE_STATS stats;
+    diskio_file_get_stats(HOST_PDRV, &stats, 1);
+    CHECK(fatfs_batch("test:/", true));
+    for (int i = 0; i < 6; i++) {
+        snprintf(path, sizeof(path), "test:/trim%d.bin", i);
+        CHECK(hostio::unlink(path) == 0);
+    }
+    diskio_file_get_stats(HOST_PDRV, &stats, 0);
+    CHECK(stats.trims == 0, "%llu discards before the batch closed", (unsigned long long)stats.trims);
+    CHECK(fatfs_batch("test:/", false));
+    diskio_file_get_stats(HOST_PDRV, &stats, 0);
+    // The files were written one after the other, so their runs merge
+    CHECK(stats.trims > 0 && stats.trims < 6, "%llu discards", (unsigned long long)stats.trims);
+    CHECK(stats.sectorsTrimmed * config.sectorSize >= 6 * 70000, "%llu sectors discarded", (unsigned long long)stats.sectorsTrimmed);
+    CHECK(checkPatternFile("test:/trim6.bin", 70000, 66) && checkPatternFile("test:/trim7.bin", 70000, 67));
+    CHECK(checkPatternFile("test:/persist.bin", 3 * 1024 * 1024 + 17, 99));
+
+    // A file cut down to its first cluster grows back into the clusters it freed in the same batch
+    std::vector<BYTE> data(70000);
+    for (size_t i = 0; i < data.size(); i++) data[i] = patternByte(i, 66);
+    CHECK(fatfs_batch("test:/", true));
+    int fd = hostio::open("test:/trim6.bin", O_RDWR);
+    CHECK(fd >= 0 && hostio::ftruncate(fd, 1) == 0);
+    CHECK(hostio::write(fd, data.data(), data.size()) == (ssize_t)data.size() && hostio::close(fd) == 0);
+    CHECK(fatfs_batch("test:/", false));
+    CHECK(checkPatternFile("test:/trim6.bin", 70000, 66));
+    CHECK(writePatternFile("test:/reused.bin", 300000, 68));
+
+    uint64_t bytes = 0;
+    CHECK(fatfs_trim("nothere:/", bytes) == ENODEV);
+    diskio_file_get_stats(HOST_PDRV, &stats, 1);
+    CHECK(fatfs_trim("test:/", bytes) == 0);
+    diskio_file_get_stats(HOST_PDRV, &stats, 0);
+    struct statvfs vfs;
+    CHECK(hostio::statvfs("test:/", &vfs) == 0);
+    CHECK(bytes == (uint64_t)vfs.f_bfree * vfs.f_bsize && stats.sectorsTrimmed * config.sectorSize == bytes,
+          "%llu bytes discarded, %llu free", (unsigned long long)bytes, (unsigned long long)vfs.f_bfree * vfs.f_bsize);
+    CHECK(checkPatternFile("test:/reused.bin", 300000, 68) && checkPatternFile("test:/trim7.bin", 70000, 67));
+    CHECK(checkPatternFile("test:/persist.bin", 3 * 1024 * 1024 + 17, 99));
+    CHECK(hostio::unlink("test:/reused.bin") == 0 && hostio::unlink("test:/trim6.bin") == 0 && hostio::unlink("test:/trim7.bin") == 0);
+    return true;
+}
+
+static bool waitForState(int pdrv, FatfsVolumeState state) {
+    for (int waited = 0; waited < HOTPLUG_TIMEOUT_MS; waited += HOTPLUG_POLL_MS) {
+        for (const auto& info : fatfs_volumes_list()) {
+            if (info.pdrv == pdrv && info.state == state) return true;
+        }
+        usleep(HOTPLUG_POLL_MS * 1000);
+    }
+    return false;
+}
+
+static bool testHotplug() {
+    const VolumeConfig config = {"hotplug", FM_FAT32, 512, 512ULL * 1024 * 1024, 1};
+    std::string imagePath = imageDir + "/fatfs_host_hotplug.img";
+    int fd = ::open(imagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && ftruncate(fd, (off_t)config.imageSize) == 0);
+    ::close(fd);
+    CHECK(diskio_file_attach(HOTPLUG_PDRV, imagePath.c_str(), config.sectorSize, 0) == 0);
+
+    // Starts out unformatted, so the drive is only present
+    diskio_file_set_present(HOTPLUG_PDRV, 1);
+    fatfs_volumes_start({{HOTPLUG_PDRV, "hp", true}, {3, "nothing", true}}, HOTPLUG_POLL_MS);
+    bool ok = [&] {
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Present));
+        CHECK(waitForState(3, FatfsVolumeState::Absent));
+
+        // Formatting needs the drive to itself, releasing it mounts the new volume
+        CHECK(fatfs_volumes_claim(HOTPLUG_PDRV, HOTPLUG_TIMEOUT_MS));
+        std::vector<BYTE> work(MKFS_WORK_SIZE);
+        MKFS_PARM opt = {config.fmt, 0, 0, 0, 0, nullptr};
+        CHECK(f_mkfs("2:", &opt, work.data(), (UINT)work.size()) == FR_OK);
+        fatfs_volumes_release(HOTPLUG_PDRV);
+        CHECK(fatfs_volumes_wait(HOTPLUG_PDRV, HOTPLUG_TIMEOUT_MS));
+        CHECK(writePatternFile("hp:/data.bin", 100000, 7));
+
+        // A file left open keeps the old mount alive, so the drive can't be handed out. The claim gives up
+        // instead of waiting for it, and the drive is mounted again once the file is closed.
+        int held = hostio::open("hp:/data.bin", O_RDONLY);
+        CHECK(held >= 0);
+        CHECK(!fatfs_volumes_claim(HOTPLUG_PDRV, 10 * HOTPLUG_POLL_MS));
+        char byte;
+        CHECK(hostio::read(held, &byte, 1) < 0 && errno == ENODEV);
+        CHECK(hostio::close(held) == 0);
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Mounted));
+
+        // Pulling the drive unmounts it right away, the open file only fails until it's closed
+        held = hostio::open("hp:/data.bin", O_RDONLY);
+        CHECK(held >= 0);
+        uint32_t generation = fatfs_volumes_generation();
+        diskio_file_set_present(HOTPLUG_PDRV, 0);
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Absent));
+        CHECK(fatfs_volumes_generation() != generation);
+        CHECK(hostio::read(held, &byte, 1) < 0 && errno == ENODEV);
+        struct stat st;
+        CHECK(hostio::stat("hp:/data.bin", &st) < 0 && errno == ENODEV);
+
+        // Plugged back in, the drive is left alone until the file on its old volume is closed
+        diskio_file_set_present(HOTPLUG_PDRV, 1);
+        usleep(5 * HOTPLUG_POLL_MS * 1000);
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Absent));
+        CHECK(hostio::close(held) == 0 || errno == ENODEV);
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Mounted));
+        CHECK(checkPatternFile("hp:/data.bin", 100000, 7));
+
+        CHECK(fatfs_volumes_claim(HOTPLUG_PDRV, HOTPLUG_TIMEOUT_MS));
+        CHECK(GetDeviceOpTab("hp:") == nullptr);
+        fatfs_volumes_release(HOTPLUG_PDRV);
+        CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Mounted));
+        return true;
+    }();
+    fatfs_volumes_stop();
+    ok = ok && GetDeviceOpTab("hp:") == nullptr;
+    diskio_file_detach(HOTPLUG_PDRV);
+    ::unlink(imagePath.c_str());
+    printf("%-12s %s\n", "hotplug", ok ? "PASS" : "FAIL");
+    if (!ok) failures++;
+    return ok;
+}
+
+struct PartitionLayout {
+    const char* name;
+    unsigned long long imageSize;
+    std::vector<LBA_t> sizes;           // For f_fdisk, empty formats the whole drive without partition table
+    std::vector<BYTE> formats;          // Per partition, 0 leaves it raw like the Wii U partition next to a FAT one
+    std::vector<std::string> mounts;    // What the volume manager should mount
+};
+
+static const PartitionLayout partitionLayouts[] = {
+    {"mbr", 256ULL * 1024 * 1024, {64 * 2048, 64 * 2048, 64 * 2048}, {0, FM_FAT32, FM_FAT}, {"pt", "ptp3"}},
+    // f_fdisk only writes a GPT from FF_MIN_GPT sectors on, the image is sparse
+    {"gpt", 128ULL * 1024 * 1024 * 1024, {64 * 2048, 64 * 2048}, {0, FM_EXFAT}, {"pt"}},
+    {"sfd", 64ULL * 1024 * 1024, {}, {FM_FAT | FM_SFD}, {"pt"}},
+};
+
+static bool partitionDrive(const PartitionLayout& layout, const std::string& imagePath) {
+    int fd = ::open(imagePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && ftruncate(fd, (off_t)layout.imageSize) == 0);
+    ::close(fd);
+    CHECK(diskio_file_attach(HOTPLUG_PDRV, imagePath.c_str(), 512, 0) == 0);
+    std::vector<BYTE> work(MKFS_WORK_SIZE);
+    if (!layout.sizes.empty()) {
+        std::vector<LBA_t> ptbl = layout.sizes;
+        ptbl.push_back(0);
+        CHECK(f_fdisk((void*)(uintptr_t)HOTPLUG_PDRV, ptbl.data(), work.data()) == FR_OK);
+    }
+    for (size_t i = 0; i < layout.formats.size(); i++) {
+        if (layout.formats[i] == 0) continue;
+        MKFS_PARM opt = {layout.formats[i], 1, 0, 0, 0, nullptr, (BYTE)(layout.sizes.empty() ? 0 : i + 1)};
+        DISKIO_FILE_STATS stats;
+        diskio_file_get_stats(HOTPLUG_PDRV, &stats, 1);
+        FRESULT res = f_mkfs("2:", &opt, work.data(), (UINT)work.size());
+        CHECK(res == FR_OK, "partition %zu: %d", i + 1, res);
+        // The whole volume is discarded, and only that: the partitions formatted before keep their filesystems
+        diskio_file_get_stats(HOTPLUG_PDRV, &stats, 0);
+        LBA_t volumeSectors = layout.sizes.empty() ? layout.imageSize / 512 : layout.sizes[i];
+        CHECK(stats.trims == 1 && stats.sectorsTrimmed == volumeSectors, "partition %zu: %llu sectors discarded", i + 1,
+              (unsigned long long)stats.sectorsTrimmed);
+    }
+    return true;
+}
+
+// Every FAT partition gets its own mount, whatever sits in front of it and whether the drive is partitioned at all
+static bool testPartitions() {
+    bool ok = true;
+    for (const auto& layout : partitionLayouts) {
+        std::string imagePath = imageDir + "/fatfs_host_parts.img";
+        bool layoutOk = partitionDrive(layout, imagePath) && [&] {
+            FFPART parts[8];
+            UINT count = 0;
+            BYTE buf[FF_MAX_SS];
+            CHECK(f_findparts((void*)(uintptr_t)HOTPLUG_PDRV, parts, 8, &count, buf) == FR_OK);
+            CHECK(count == layout.formats.size(), "%u partitions", count);
+            for (UINT i = 0; i < count; i++) {
+                BYTE fmt = layout.formats[i] & FM_ANY;
+                CHECK(parts[i].part == (layout.sizes.empty() ? 0 : i + 1));
+                CHECK(parts[i].fs == (fmt == 0 ? 0 : fmt == FM_EXFAT ? 2 : 1), "partition %u holds %u", parts[i].part, parts[i].fs);
+                CHECK(layout.sizes.empty() || parts[i].size == layout.sizes[i]);
+                CHECK((parts[i].system != 0) == (strcmp(layout.name, "mbr") == 0), "system ID %02X", parts[i].system); // None in a GPT
+            }
+
+            fatfs_volumes_start({{HOTPLUG_PDRV, "pt", true}}, HOTPLUG_POLL_MS);
+            bool mounted = [&] {
+                CHECK(waitForState(HOTPLUG_PDRV, FatfsVolumeState::Mounted));
+                std::vector<FatfsVolumeInfo> list = fatfs_volumes_list();
+                CHECK(list.size() == 1 && list[0].mounts == layout.mounts, "%zu mounts", list[0].mounts.size());
+                for (size_t i = 0; i < layout.mounts.size(); i++) {
+                    CHECK(writePatternFile((layout.mounts[i] + ":/part.bin").c_str(), 150000, 40 + (unsigned)i));
+                }
+                for (size_t i = 0; i < layout.mounts.size(); i++) {
+                    CHECK(checkPatternFile((layout.mounts[i] + ":/part.bin").c_str(), 150000, 40 + (unsigned)i));
+                }
+                return true;
+            }();
+            fatfs_volumes_stop();
+            return mounted;
+        }();
+        diskio_file_detach(HOTPLUG_PDRV);
+        ::unlink(imagePath.c_str());
+        if (!layoutOk) fprintf(stderr, "  %s layout failed\n", layout.name);
+        ok = ok && layoutOk;
+    }
+    printf("%-12s %s\n", "partitions", ok ? "PASS" : "FAIL");
+    if (!ok) failures++;
+    return ok;
+}
+
+static void runTestVolume(const VolumeConfig& config, unsigned queueDepth) {
+    std::string imagePath;
+    bool ok = createVolume(config, queueDepth, imagePath);
+    if (!ok) fprintf(stderr, "  couldn't create the volume\n");
+    ok = ok && testFiles();
+    ok = ok && testExtendedCalls();
+    ok = ok && testManyEntries(config);
+    ok = ok && testBatch(config, imagePath, queueDepth);
+    ok = ok && testDirtyVolume(config, imagePath, queueDepth);
+    ok = ok && testContiguous(config, imagePath);
+    ok = ok && testCheck(config, imagePath, queueDepth);
+    ok = ok && testRemount(config, imagePath, queueDepth);
+    ok = ok && testReadOnly(config, imagePath, queueDepth);
+    ok = ok && testStats(config, queueDepth);
+    ok = ok && testTrim(config);
+    destroyVolume(imagePath);
+    printf("%-12s queue %u %s\n", config.name, queueDepth, ok ? "PASS" : "FAIL");
+    if (!ok) failures++;
+}
+
+static int runTests() {
+    // Every volume once with synchronous I/O and once through the request queue
+    for (const auto& config : testConfigs) runTestVolume(config, 0);
+    for (const auto& config : testConfigs) runTestVolume(config, 4);
+    testHotplug();
+    testPartitions();
+    return failures == 0 ? 0 : 1;
+}
+
+// Benchmark
+
+struct BenchPhase {
+    const char* name;
+    QWORD start;
+    DISKIO_FILE_STATS stats;
+};
+
+static void beginPhase(BenchPhase& phase, const char* name) {
+    phase.name = name;
+    diskio_file_get_stats(HOST_PDRV, &phase.stats, 1);
+    phase.start = dbench_time_us();
+}
+
+static void endPhase(BenchPhase& phase) {
+    QWORD usec = dbench_time_us() - phase.start;
+    diskio_file_get_stats(HOST_PDRV, &phase.stats, 1);
+    printf("%s,%llu,%llu,%llu,%llu,%llu,%llu\n", phase.name, (unsigned long long)usec, (unsigned long long)phase.stats.reads,
+           (unsigned long long)phase.stats.writes, (unsigned long long)phase.stats.syncs, (unsigned long long)phase.stats.sectorsRead,
+           (unsigned long long)phase.stats.sectorsWritten);
+}
+
+// Creates fileCount files of one sector in dir, checking and creating its parents first like create_directories()
+static bool extractNested(const char* dir, int fileCount, const std::vector<BYTE>& chunk) {
+    char path[256];
+    bool ok = true;
+    for (int i = 0; ok && i < fileCount; i++) {
+        struct stat st;
+        for (const char* sep = strchr(dir + 6, '/'); ok; sep = strchr(sep + 1, '/')) {
+            std::string parent = sep ? std::string(dir, sep) : std::string(dir);
+            if (hostio::stat(parent.c_str(), &st) != 0) ok = hostio::mkdir(parent.c_str()) == 0;
+            if (!sep) break;
+        }
+        snprintf(path, sizeof(path), "%s/module %05d.wms", dir, i);
+        int fd = ok ? hostio::open(path, O_WRONLY | O_CREAT | O_TRUNC) : -1;
+        ok = fd >= 0 && hostio::write(fd, chunk.data(), 4096) == 4096 && hostio::close(fd) == 0;
+    }
+    return ok;
+}
+
+static int runBench(const VolumeConfig& config, unsigned latency, unsigned bandwidth, unsigned queueDepth, int fileCount) {
+    std::string imagePath;
+    if (!createVolume(config, queueDepth, imagePath)) {
+        fprintf(stderr, "couldn't create the %s volume\n", config.name);
+        destroyVolume(imagePath);
+        return 1;
+    }
+    diskio_file_set_latency(HOST_PDRV, latency, bandwidth);
+    printf("phase,usec,reads,writes,syncs,sectors_read,sectors_written\n");
+#if FF_USE_PROFILE
+    profile_reset();
+#endif
+
+    const size_t bigSize = 64 * 1024 * 1024;
+    std::vector<BYTE> chunk(IO_CHUNK_SIZE, 0x5A);
+    char path[256];
+    bool ok = true;
+    BenchPhase phase;
+
+    beginPhase(phase, "create_small_files");
+    ok = ok && hostio::mkdir("test:/bench") == 0;
+    for (int i = 0; ok && i < fileCount; i++) {
+        snprintf(path, sizeof(path), "test:/bench/small file %05d.dat", i);
+        int fd = hostio::open(path, O_WRONLY | O_CREAT | O_TRUNC);
+        ok = fd >= 0 && hostio::write(fd, chunk.data(), 4096) == 4096 && hostio::close(fd) == 0;
+    }
+    endPhase(phase);
+
+    // What the app does per file of a zip: create_directories() stats every parent, then the file is written
+    static const char* nestedDir = "test:/wiiu/environments/aroma/modules/setup";
+    beginPhase(phase, "extract_nested_files");
+    ok = ok && extractNested(nestedDir, fileCount, chunk);
+    endPhase(phase);
+
+    // The same in a batch as the app extracts zips, closing it writes the held back sectors
+    static const char* batchedDir = "test:/wiiu/environments/aroma/plugins";
+    beginPhase(phase, "extract_batched_files");
+    ok = ok && fatfs_batch("test:/", true);
+    ok = ok && extractNested(batchedDir, fileCount, chunk);
+    ok = fatfs_batch("test:/", false) && ok;
+    endPhase(phase);
+
+    beginPhase(phase, "stat_small_files");
+    for (int i = 0; ok && i < fileCount; i++) {
+        struct stat st;
+        snprintf(path, sizeof(path), "test:/bench/small file %05d.dat", i);
+        ok = hostio::stat(path, &st) == 0;
+    }
+    endPhase(phase);
+
+    beginPhase(phase, "list_directory");
+    std::vector<std::string> names;
+    ok = ok && hostio::listdir("test:/bench", names) == 0 && names.size() == (size_t)fileCount;
+    endPhase(phase);
+
+    beginPhase(phase, "write_large_file");
+    int fd = ok ? hostio::open("test:/large.dat", O_WRONLY | O_CREAT | O_TRUNC) : -1;
+    for (size_t done = 0; fd >= 0 && ok && done < bigSize; done += chunk.size()) ok = hostio::write(fd, chunk.data(), chunk.size()) == (ssize_t)chunk.size();
+    ok = ok && fd >= 0 && hostio::close(fd) == 0;
+    endPhase(phase);
+
+    beginPhase(phase, "read_large_file");
+    fd = ok ? hostio::open("test:/large.dat", O_RDONLY) : -1;
+    for (size_t done = 0; fd >= 0 && ok && done < bigSize; done += chunk.size()) ok = hostio::read(fd, chunk.data(), chunk.size()) == (ssize_t)chunk.size();
+    ok = ok && fd >= 0 && hostio::close(fd) == 0;
+    endPhase(phase);
+
+    beginPhase(phase, "statvfs");
+    struct statvfs vfs;
+    ok = ok && hostio::statvfs("test:/", &vfs) == 0;
+    endPhase(phase);
+
+    beginPhase(phase, "delete_all");
+    for (int i = 0; ok && i < fileCount; i++) {
+        snprintf(path, sizeof(path), "test:/bench/small file %05d.dat", i);
+        ok = hostio::unlink(path) == 0;
+    }
+    ok = ok && hostio::unlink("test:/bench") == 0 && hostio::unlink("test:/large.dat") == 0;
+    for (int i = 0; ok && i < fileCount; i++) {
+        snprintf(path, sizeof(path), "%s/module %05d.wms", nestedDir, i);
+        ok = hostio::unlink(path) == 0;
+        snprintf(path, sizeof(path), "%s/module %05d.wms", batchedDir, i);
+        ok = ok && hostio::unlink(path) == 0;
+    }
+    endPhase(phase);
+
+    destroyVolume(imagePath);
+#if FF_USE_PROFILE
+    profile_dump(stdout);
+#endif
+    if (!ok) {
+        fprintf(stderr, "benchmark failed (errno %d)\n", errno);
+        return 1;
+    }
+    return 0;
+}
+
+// Filesystem check
+
+static int runCheck(const char* imagePath, WORD sectorSize, bool repair) {
+    if (diskio_file_attach(HOST_PDRV, imagePath, sectorSize, 0) != 0) {
+        fprintf(stderr, "couldn't open %s\n", imagePath);
+        return 8;
+    }
+    std::vector<BYTE> work(CHECK_WORK_SIZE);
+    FATFS fs = {};
+    FFCHECK r;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FRESULT res = f_mount(&fs, (void*)"1:", 1);
+    if (res == FR_OK) res = f_check(&fs, repair ? FC_REPAIR : 0, &r, work.data(), (UINT)work.size());
+    if (res == FR_OK && repair) res = f_syncvol(&fs);
+    f_umount(&fs);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    diskio_file_detach(HOST_PDRV);
+    if (res != FR_OK) {
+        fprintf(stderr, res == FR_INVALID_PARAMETER ? "only FAT12/16/32 volumes can be checked\n" : "f_check failed: %d\n", res);
+        return 8;
+    }
+
+    printf("%u files, %u directories, %u clusters free\n", r.files, r.dirs, r.free_clst);
+    printf("broken chains %u, cross-links %u, size mismatches %u\n", r.bad_chains, r.cross_links, r.size_errors);
+    printf("lost chains %u (%u clusters), bad clusters %u%s\n", r.lost_chains, r.lost_clusters, r.bad_clusters,
+           r.free_wrong ? ", stored free count wrong" : "");
+    printf("checked in %.3f s%s\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, r.repaired ? ", repaired" : "");
+    bool clean = r.bad_chains == 0 && r.cross_links == 0 && r.size_errors == 0 && r.lost_chains == 0 && !r.free_wrong;
+    return clean ? 0 : r.repaired ? 1 : 4;
+}
+
+static int usage(const char* argv0) {
+    fprintf(stderr, "usage: %s test [-d dir]\n"
+                    "       %s bench [-d dir] [-f fat32|exfat] [-s sector_size] [-F fats] [-l usec_per_call] [-b kib_per_sec] [-q queue_depth] [-n files]\n"
+                    "       %s fsck [-r] [-s sector_size] image\n", argv0, argv0, argv0);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) return usage(argv[0]);
+    std::string mode = argv[1];
+    VolumeConfig benchConfig = {"bench", FM_FAT32, 512, 1024ULL * 1024 * 1024, 1};
+    unsigned latency = 0;
+    unsigned bandwidth = 0;
+    unsigned queueDepth = 0;
+    int fileCount = 1000;
+    bool repair = false;
+
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "d:f:s:F:l:b:q:n:r")) != -1) {
+        switch (opt) {
+            case 'd': imageDir = optarg; break;
+            case 'f': benchConfig.fmt = strcmp(optarg, "exfat") == 0 ? FM_EXFAT : FM_FAT32; break;
+            case 's': benchConfig.sectorSize = (WORD)strtoul(optarg, nullptr, 0); break;
+            case 'F': benchConfig.nFats = (BYTE)strtoul(optarg, nullptr, 0); break;
+            case 'l': latency = (unsigned)strtoul(optarg, nullptr, 0); break;
+            case 'b': bandwidth = (unsigned)strtoul(optarg, nullptr, 0); break;
+            case 'q': queueDepth = (unsigned)strtoul(optarg, nullptr, 0); break;
+            case 'n': fileCount = atoi(optarg); break;
+            case 'r': repair = true; break;
+            default: return usage(argv[0]);
+        }
+    }
+
+    if (mode == "test") return runTests();
+    if (mode == "bench") return runBench(benchConfig, latency, bandwidth, queueDepth, fileCount);
+    if (mode == "fsck" && optind == argc - 1) return runCheck(argv[optind], benchConfig.sectorSize, repair);
+    return usage(argv[0]);
+}
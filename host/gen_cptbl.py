@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# Generates ffcptbl.h, the two-level lookup tables ffunicode.c uses for a fixed FF_CODE_PAGE.
+#
+# The source of truth stays the upstream tables in ffunicode.c (ucNNN for SBCS, the uni2oemNNN and
+# oem2uniNNN pair lists for DBCS). Every code is split into a block number (code >> shift) and an
+# offset inside the block. The first level maps the block number to one of the deduplicated 2^shift
+# entry blocks of the second level, block 0 being all zeros for holes. The shift is chosen per table
+# so the pair is as small as possible, and the first level only covers the blocks that have entries.
+#
+# usage: gen_cptbl.py [ffunicode.c] [ffcptbl.h]
+
+import os
+import re
+import sys
+from collections import Counter
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+FATFS = os.path.join(HERE, '..', 'source', 'utils', 'fatfs')
+
+
+def parse_tables(src):
+    tables = {}
+    for m in re.finditer(r'static const WCHAR (\w+)\[\] = \{[^\n]*\n(.*?)\n\};', src, re.S):
+        tables[m.group(1)] = [int(x, 16) for x in re.findall(r'0x[0-9A-Fa-f]+', m.group(2))]
+    return tables
+
+
+def build(pairs, shift):
+    """Returns (first, last, index, blocks) for a key -> value map, keys below 0x80 excluded."""
+    size = 1 << shift
+    zero = (0,) * size
+    rows = {}
+    for key, val in pairs.items():
+        rows.setdefault(key >> shift, [0] * size)[key & (size - 1)] = val
+    first, last = min(rows), max(rows)
+    blocks = [zero]
+    lookup = {zero: 0}
+    index = []
+    for b in range(first, last + 1):
+        row = tuple(rows.get(b, zero))
+        if row not in lookup:
+            lookup[row] = len(blocks)
+            blocks.append(row)
+        index.append(lookup[row])
+    return first, last, index, blocks
+
+
+def cost(built, vsize):
+    first, last, index, blocks = built
+    isize = 1 if len(blocks) <= 256 else 2
+    return len(index) * isize + len(blocks) * len(blocks[0]) * vsize
+
+
+def best(pairs, vsize):
+    candidates = [(shift, build(pairs, shift)) for shift in range(3, 9)]
+    return min(candidates, key=lambda c: cost(c[1], vsize))
+
+
+def emit_array(out, decl, values, width, per_line):
+    out.append(decl + ' = {')
+    fmt = '0x%%0%dX' % width
+    lines = []
+    for i in range(0, len(values), per_line):
+        lines.append('\t' + ', '.join(fmt % v for v in values[i:i + per_line]))
+    out.append(',\n'.join(lines))
+    out.append('};')
+
+
+def emit_table(out, name, comment, pairs, vsize):
+    shift, (first, last, index, blocks) = best(pairs, vsize)
+    itype = 'BYTE' if len(blocks) <= 256 else 'WORD'
+    vtype = 'BYTE' if vsize == 1 else 'WCHAR'
+    vwidth = 2 if vsize == 1 else 4
+    out.append('#define %s_SHIFT %d' % (name.upper(), shift))
+    out.append('#define %s_FIRST 0x%X' % (name.upper(), first))
+    emit_array(out, 'static const %s %s_idx[%d]' % (itype, name, len(index)), index, 2 if itype == 'BYTE' else 4, 16)
+    out.append('static const %s %s_blk[%d][%d] = {\t/* %s */' % (vtype, name, len(blocks), 1 << shift, comment))
+    per_line = 16
+    rows = []
+    for blk in blocks:
+        lines = []
+        for i in range(0, len(blk), per_line):
+            lines.append('\t\t' + ', '.join(('0x%%0%dX' % vwidth) % v for v in blk[i:i + per_line]))
+        rows.append('\t{\n' + ',\n'.join(lines) + '\n\t}')
+    out.append(',\n'.join(rows))
+    out.append('};')
+    return len(index) * (1 if itype == 'BYTE' else 2) + len(blocks) * (1 << shift) * vsize
+
+
+def bsearch(keys, key):
+    """The binary search of ffunicode.c, it decides which pair of a duplicated key is used."""
+    li, hi = 0, len(keys) - 1
+    for _ in range(16):
+        i = li + (hi - li) // 2
+        if keys[i] == key:
+            return i
+        if key > keys[i]:
+            li = i
+        else:
+            hi = i
+    return None
+
+
+def pair_map(flat):
+    """Pair list -> dict of the codes above ASCII."""
+    keys, vals = flat[0::2], flat[1::2]
+    m = {}
+    for key, val in zip(keys, vals):
+        if key >= 0x80 and key not in m:
+            m[key] = val
+    for key in (k for k, n in Counter(keys).items() if n > 1):
+        i = bsearch(keys, key)
+        if i is not None:
+            m[key] = vals[i]
+    return m
+
+
+def main():
+    src_path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(FATFS, 'ffunicode.c')
+    dst_path = sys.argv[2] if len(sys.argv) > 2 else os.path.join(FATFS, 'ffcptbl.h')
+    tables = parse_tables(open(src_path).read())
+
+    out = [
+        '/*------------------------------------------------------------------------*/',
+        '/* Two-Level OEM <==> Unicode Tables for a Fixed FF_CODE_PAGE             */',
+        '/*------------------------------------------------------------------------*/',
+        '/* Generated by host/gen_cptbl.py from the tables in ffunicode.c, do not  */',
+        '/* edit. Only the tables of the configured code page are compiled in.     */',
+        '/*------------------------------------------------------------------------*/',
+        '',
+    ]
+
+    for name in sorted(tables):
+        m = re.fullmatch(r'uc(\d+)', name)
+        if not m:
+            continue
+        cp = int(m.group(1))
+        u2o = {}
+        for i, uni in enumerate(tables[name]):
+            if uni >= 0x80 and uni not in u2o:
+                u2o[uni] = 0x80 + i
+        out.append('#if FF_CODE_PAGE == %d' % cp)
+        size = emit_table(out, 'u2o', 'Unicode --> CP%d' % cp, u2o, 1)
+        out.append('#endif')
+        out.append('')
+        print('cp%d: uni2oem %d bytes' % (cp, size))
+
+    for name in sorted(tables):
+        m = re.fullmatch(r'uni2oem(\d+)', name)
+        if not m:
+            continue
+        cp = int(m.group(1))
+        out.append('#if FF_CODE_PAGE == %d' % cp)
+        s1 = emit_table(out, 'u2o', 'Unicode --> CP%d' % cp, pair_map(tables[name]), 2)
+        s2 = emit_table(out, 'o2u', 'CP%d --> Unicode' % cp, pair_map(tables['oem2uni%d' % cp]), 2)
+        out.append('#endif')
+        out.append('')
+        print('cp%d: uni2oem %d bytes, oem2uni %d bytes (pairs: %d bytes)' % (cp, s1, s2, 2 * 2 * len(tables[name])))
+
+    with open(dst_path, 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
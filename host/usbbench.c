@@ -0,0 +1,70 @@
+// Host build of the USB speed/health test: runs the same suite as the console against an image file
+//   usbbench [-s sector_size] [-f fake_size_mib] [-o results.csv] image
+// Exits with 2 if the capacity check finds sectors that don't keep their data.
+#include "diskbench.h"
+#include "diskio_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BENCH_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    FILE* csv;
+    DWORD badSectors;
+} BenchOutput;
+
+static void report(const DBENCH_RESULT* res, void* arg) {
+    BenchOutput* out = (BenchOutput*)arg;
+    char line[160];
+    dbench_csv_row(res, line, sizeof(line));
+    fputs(line, stdout);
+    if (out->csv) fputs(line, out->csv);
+    if (res->test[0] == 'v' && res->errors != 0) {
+        out->badSectors = res->errors;
+        fprintf(stderr, "capacity check: %lu sampled sectors lost their data, first at sector %llu\n",
+                (unsigned long)res->errors, (unsigned long long)res->first_bad);
+    }
+}
+
+int main(int argc, char** argv) {
+    WORD sectorSize = 512;
+    unsigned long long fakeMiB = 0;
+    const char* csvPath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:o:")) != -1) {
+        switch (opt) {
+            case 's': sectorSize = (WORD)strtoul(optarg, NULL, 0); break;
+            case 'f': fakeMiB = strtoull(optarg, NULL, 0); break;
+            case 'o': csvPath = optarg; break;
+            default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-s sector_size] [-f fake_size_mib] [-o results.csv] image\n", argv[0]);
+        return 1;
+    }
+
+    LBA_t fakeSectors = (LBA_t)(fakeMiB * 1024 * 1024 / sectorSize);
+    if (diskio_file_attach(1, argv[optind], sectorSize, fakeSectors) != 0) {
+        fprintf(stderr, "couldn't open %s as a drive with %u byte sectors\n", argv[optind], sectorSize);
+        return 1;
+    }
+
+    BYTE* buf = (BYTE*)aligned_alloc(4096, BENCH_BUFFER_SIZE);
+    BenchOutput out = {NULL, 0};
+    if (csvPath) out.csv = fopen(csvPath, "w");
+    fputs(DBENCH_CSV_HEADER, stdout);
+    if (out.csv) fputs(DBENCH_CSV_HEADER, out.csv);
+
+    int result = buf ? dbench_suite((void*)"1:", buf, BENCH_BUFFER_SIZE, report, &out) : -1;
+
+    if (out.csv) fclose(out.csv);
+    free(buf);
+    diskio_file_detach(1);
+    if (result != 0) {
+        fprintf(stderr, "benchmark failed\n");
+        return 1;
+    }
+    return out.badSectors ? 2 : 0;
+}
@@ -2,6 +2,7 @@
 #include "gui.h"
 #include "menu.h"
 #include "filesystem.h"
+#include "../utils/fatfs/fatfs_devoptab.h"
 #include "common.h"
 #include <curl/curl.h>
 #include <string>
@@ -9,6 +10,7 @@
 #include <thread>
 #include <chrono>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cerrno>
@@ -18,6 +20,7 @@
 #include <filesystem>
 #include <sstream>
 #include <functional>
+#include <set>
 
 namespace fs = std::filesystem;
 
@@ -203,6 +206,19 @@ static std::string getLatestReleaseAssetUrl(const std::string& repo, const std::
     return "";
 }
 
+static uint64_t requiredExtractBytes(miniz_cpp::zip_file& zip, uint64_t clusterSize) {
+    uint64_t bytes = 0;
+    std::set<std::string> dirs;
+    for (auto& info : zip.infolist()) {
+        bytes += (info.file_size + clusterSize - 1) / clusterSize * clusterSize;
+        // Each directory on the way to the entry, the entry itself if it is one
+        for (size_t slash = info.filename.find('/'); slash != std::string::npos; slash = info.filename.find('/', slash + 1)) {
+            dirs.insert(info.filename.substr(0, slash));
+        }
+    }
+    return bytes + dirs.size() * clusterSize;
+}
+
 static bool downloadAndExtractZip(const std::string& repo, const std::string& pattern, const std::string& displayName, const std::string& sdPath, std::function<std::string(std::string)> pathMapper = nullptr) {
     std::string zipUrl = getLatestReleaseAssetUrl(repo, pattern);
     if (zipUrl.empty()) return false;
@@ -217,6 +233,18 @@ static bool downloadAndExtractZip(const std::string& repo, const std::string& pa
         std::istringstream iss(zipData);
         miniz_cpp::zip_file zip(iss);
 
+        // Bail out before writing anything if the target can't hold the extracted files. Every file takes whole
+        // clusters, and every directory at least one, so archives of many small files need far more than their size.
+        struct statvfs vfs;
+        uint64_t requiredBytes = 0;
+        if (statvfs(sdPath.c_str(), &vfs) == 0 && vfs.f_frsize != 0) requiredBytes = requiredExtractBytes(zip, vfs.f_frsize);
+        if (requiredBytes != 0 && (uint64_t)vfs.f_bavail * vfs.f_frsize < requiredBytes) {
+            setErrorPrompt(L"Not enough free space to extract " + toWstring(displayName) + L"!\nRequired: " + std::to_wstring(requiredBytes / 1024) + L" KiB");
+            return false;
+        }
+
+        // Directory and FAT sectors are written once for the whole archive instead of per file
+        FatfsBatch batch(sdPath);
         for (auto& info : zip.infolist()) {
             std::string targetFilename = info.filename;
             if (pathMapper) {
@@ -247,6 +275,8 @@ static bool downloadAndExtractZip(const std::string& repo, const std::string& pa
         return false;
     }
 
+    // The card may be pulled right after, leave the FAT copies and the free count consistent
+    fatfs_sync(sdPath);
     return true;
 }
 
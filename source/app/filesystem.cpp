@@ -3,14 +3,35 @@
 #include "gui.h"
 #include "progress.h"
 #include "../utils/fatfs/fatfs_devoptab.h"
+#include "../utils/fatfs/fatfs_volumes.h"
 #include "../utils/fatfs/ff.h"
 #include "../utils/fatfs/diskio.h"
+#include "../utils/fatfs/diskbench.h"
+#include "../utils/fatfs/ffprofile.h"
 
 #include <dirent.h>
 #include <sys/unistd.h>
 
+// Volumes larger than this get formatted as exFAT instead of FAT32
+#define EXFAT_MIN_VOLUME_SIZE (32ULL * 1024 * 1024 * 1024)
+// f_mkfs writes the FATs in chunks of its work buffer, so a big one saves a lot of raw IPC calls
+#define FORMAT_WORK_SIZE (4 * 1024 * 1024)
+// Cluster sizes within this margin of the fastest one count as equally fast, the smallest of them wins
+#define CLUSTER_TUNE_TOLERANCE_PERCENT 5
+// How often the volume manager checks whether drives were plugged in or out
+#define FAT_VOLUME_POLL_MS 1000
+// USB drives can take a few seconds to enumerate after they were plugged in or formatted
+#define FAT_VOLUME_MOUNT_TIMEOUT_MS 5000
+// How long files still open on usb:/ get to be closed before the drive is taken over for raw access
+#define FAT_VOLUME_CLAIM_TIMEOUT_MS 5000
+// Big enough for the largest request size of the speed test
+#define USB_TEST_BUFFER_SIZE (4 * 1024 * 1024)
+// f_check reads the whole FAT through this buffer, a few hundred reads for a FAT32 drive of a few hundred GB
+#define CHECK_WORK_SIZE (4 * 1024 * 1024)
+// Where a build with USE_FATFS_PROFILE leaves the FatFs timings of the session
+#define FAT_PROFILE_PATH "fs:/vol/external01/fatfs_profile.txt"
+
 static bool systemSLCMounted = false;
-static bool usbFatMounted = false;
 static bool systemMLCMounted = false;
 static bool systemUSBMounted = false;
 static bool discMounted = false;
@@ -105,46 +126,126 @@ bool isDiscMounted() {
     return discMounted;
 }
 
+void startFatVolumes() {
+    // The SD card (drive 0) stays with IOSU, which serves it as fs:/vol/external01. Probing it would open it raw
+    // next to IOSU's own driver for nothing, a second FAT driver on it would corrupt it.
+    fatfs_volumes_start({{1, "usb", true}, {2, "usb2", true}, {3, "usb3", true}}, FAT_VOLUME_POLL_MS);
+}
+
+void stopFatVolumes() {
+    fatfs_volumes_stop();
+#if FF_USE_PROFILE
+    if (FILE* out = fopen(FAT_PROFILE_PATH, "w")) {
+        profile_dump(out);
+        fclose(out);
+    }
+#endif
+}
+
+// Hands the first USB drive back to the volume manager and waits until it mounted it as usb:/
 bool mountUsbFat() {
-    if (usbFatMounted) return true;
-    if (fatfs_mount("usb", 1)) {
-        usbFatMounted = true;
-        return true;
+    fatfs_volumes_release(1);
+    return fatfs_volumes_wait(1, FAT_VOLUME_MOUNT_TIMEOUT_MS);
+}
+
+// Unmounts usb:/ and keeps the volume manager away from the drive until mountUsbFat, fails while files stay open on it
+bool unmountUsbFat() {
+    return fatfs_volumes_claim(1, FAT_VOLUME_CLAIM_TIMEOUT_MS);
+}
+
+static WORD formatSectorSize = 512;
+static LBA_t formatSectorsDone = 0;
+
+static void formatProgress(LBA_t done, LBA_t total) {
+    if (formatSectorsDone == 0) {
+        startQueue((uint64_t)total * formatSectorSize);
+        setFile("File Allocation Table", (uint64_t)total * formatSectorSize);
     }
-    return false;
+    setFileProgress((uint64_t)(done - formatSectorsDone) * formatSectorSize);
+    formatSectorsDone = done;
+    showCurrentProgress();
 }
 
-void unmountUsbFat() {
-    if (usbFatMounted) {
-        fatfs_unmount("usb");
-        usbFatMounted = false;
+// Candidates for the cluster size benchmark, larger clusters waste too much space on Aroma's small files
+static const DWORD fat32ClusterSizes[] = {16 * 1024, 32 * 1024, 64 * 1024};
+static const DWORD exfatClusterSizes[] = {32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024};
+
+// Quick formats the drive with each candidate cluster size and times an Aroma-like set of files on it
+static DWORD pickClusterSize(bool useExFat, WORD sectorSize, DWORD align, BYTE* work, UINT workSize) {
+    const DWORD* sizes = useExFat ? exfatClusterSizes : fat32ClusterSizes;
+    size_t count = useExFat ? std::size(exfatClusterSizes) : std::size(fat32ClusterSizes);
+    QWORD times[std::size(exfatClusterSizes)] = {};
+    QWORD best = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (sizes[i] < sectorSize || (!useExFat && sizes[i] / sectorSize > 128)) continue;
+        MKFS_PARM opt = {(BYTE)(useExFat ? FM_EXFAT : FM_FAT32), 0, align, 0, sizes[i], nullptr};
+        if (f_mkfs("1:", &opt, work, workSize) != FR_OK) continue; // Not a valid size for this volume
+
+        FATFS *fs = (FATFS*)calloc(1, sizeof(FATFS));
+        if (!fs) break;
+        if (f_mount(fs, (void*)"1:", 1) == FR_OK) times[i] = dbench_fs_workload(fs, work, workSize);
+        f_umount(fs);
+        free(fs);
+        if (times[i] == 0) continue;
+
+        WHBLogPrintf(" - %u KiB clusters: %u ms", sizes[i] / 1024, (uint32_t)(times[i] / 1000));
+        WHBLogFreetypeDraw();
+        if (best == 0 || times[i] < best) best = times[i];
+    }
+    if (best == 0) return 0; // Let f_mkfs choose
+
+    for (size_t i = 0; i < count; i++) {
+        if (times[i] != 0 && times[i] * 100 <= best * (100 + CLUSTER_TUNE_TOLERANCE_PERCENT)) return sizes[i];
     }
+    return 0;
 }
 
-bool formatUsbFat() {
-    unmountUsbFat(); // Make sure it's not mounted via FatFS devoptab
+bool formatUsbFat(bool fullFormat) {
+    // Make sure it's not mounted via FatFS devoptab, the caller hands it back with mountUsbFat
+    if (!unmountUsbFat()) return false;
 
     // Initialize the drive
     if (disk_initialize((void*)1) != 0) {
         return false;
     }
 
-    BYTE work[FF_MAX_SS];
-    LBA_t plist[] = {100, 0, 0, 0};
-
-    WHBLogPrint("Creating partition table...");
+    WORD sectorSize = 512;
+    if (disk_ioctl((void*)1, GET_SECTOR_SIZE, &sectorSize) != RES_OK) return false;
+    LBA_t sectorCount = 0;
+    if (disk_ioctl((void*)1, GET_SECTOR_COUNT, &sectorCount) != RES_OK) return false;
+    // Drives above the FAT32 comfort zone get exFAT, which lifts the 4 GB file limit and allocates through a bitmap
+    bool useExFat = (uint64_t)sectorCount * sectorSize > EXFAT_MIN_VOLUME_SIZE;
+
+    // The work buffer has to hold at least one native sector (up to 4096 bytes on 4Kn drives)
+    UINT workSize = FORMAT_WORK_SIZE;
+    BYTE* work = nullptr;
+    while (workSize > FF_MAX_SS && (work = (BYTE*)memalign(0x40, workSize)) == nullptr) workSize /= 2;
+    if (!work) work = (BYTE*)memalign(0x40, workSize);
+    if (!work) return false;
+
+    // Start the partition and the data area on the size where the drive's writes stop getting faster,
+    // usually its erase block, so clusters never straddle one
+    WHBLogPrint("Measuring drive write performance...");
+    WHBLogFreetypeDraw();
+    DWORD align = dbench_probe_align((void*)1, work, workSize);
+    if (align != 0) WHBLogPrintf("Aligning partition to %u KiB", align * sectorSize / 1024);
+    else WHBLogPrint("Couldn't measure the drive, using the default alignment");
     WHBLogFreetypeDraw();
-    FRESULT res = f_fdisk((void*)1, plist, work);
-    if (res != FR_OK) {
-        WHBLogPrintf("f_fdisk failed: %d", res);
-        WHBLogFreetypeDraw();
-        return false;
-    }
 
-    WHBLogPrint("Formatting partition...");
+    WHBLogPrint("Benchmarking cluster sizes...");
     WHBLogFreetypeDraw();
-    MKFS_PARM opt = {FM_FAT32, 0, 0, 0, 0};
-    res = f_mkfs("1:", &opt, work, sizeof(work));
+    DWORD clusterSize = pickClusterSize(useExFat, sectorSize, align, work, workSize);
+    if (clusterSize != 0) WHBLogPrintf("Using %u KiB clusters", clusterSize / 1024);
+    WHBLogFreetypeDraw();
+
+    // f_mkfs creates the partition table itself since the drive is formatted as a whole ("1:" is partition 0)
+    setDumpingStatus(useExFat ? L"Formatting USB drive as exFAT..." : L"Formatting USB drive as FAT32...");
+    formatSectorSize = sectorSize;
+    formatSectorsDone = 0;
+    MKFS_PARM opt = {(BYTE)((useExFat ? FM_EXFAT : FM_FAT32) | (fullFormat ? FM_FULL : 0)), 0, align, 0, clusterSize, formatProgress};
+    FRESULT res = f_mkfs("1:", &opt, work, workSize);
+    free(work);
     if (res != FR_OK) {
         WHBLogPrintf("f_mkfs failed: %d", res);
         WHBLogFreetypeDraw();
@@ -153,12 +254,10 @@ bool formatUsbFat() {
 
     WHBLogPrint("Setting label...");
     WHBLogFreetypeDraw();
-    f_mount(NULL, (void*)"1:", 0); // Clear any previous mount
-    FATFS *fs = (FATFS*)malloc(sizeof(FATFS));
+    FATFS *fs = (FATFS*)calloc(1, sizeof(FATFS));
     if (fs) {
-        f_mount(fs, (void*)"1:", 1);
-        f_setlabel(fs, "aroma");
-        f_mount(NULL, (void*)"1:", 0);
+        if (f_mount(fs, (void*)"1:", 1) == FR_OK) f_setlabel(fs, "aroma");
+        f_umount(fs);
         free(fs);
     }
 
@@ -167,6 +266,103 @@ bool formatUsbFat() {
     return true;
 }
 
+bool checkUsbFat(bool repair, bool* clean) {
+    // A repair rewrites chains under open files otherwise
+    if (!unmountUsbFat()) return false;
+
+    UINT workSize = CHECK_WORK_SIZE;
+    BYTE* work = nullptr;
+    while (workSize > FF_MAX_SS && (work = (BYTE*)memalign(0x40, workSize)) == nullptr) workSize /= 2;
+    if (!work) work = (BYTE*)memalign(0x40, workSize);
+    if (!work) return false;
+
+    FATFS *fs = (FATFS*)calloc(1, sizeof(FATFS));
+    if (!fs) {
+        free(work);
+        return false;
+    }
+
+    WHBLogPrint(repair ? "Checking and repairing the USB drive..." : "Checking the USB drive...");
+    WHBLogFreetypeDraw();
+    FFCHECK report = {};
+    FRESULT res = f_mount(fs, (void*)"1:", 0); // The volume mounted as usb:, the first FAT one on the drive
+    if (res == FR_OK) res = f_check(fs, repair ? FC_REPAIR : 0, &report, work, workSize);
+    if (res == FR_OK && repair) res = f_syncvol(fs);
+    f_umount(fs);
+    free(fs);
+    free(work);
+    if (res == FR_INVALID_PARAMETER) {
+        WHBLogPrint("Only FAT12/16/32 drives can be checked, exFAT isn't supported");
+        WHBLogFreetypeDraw();
+        return false;
+    }
+    if (res != FR_OK) {
+        WHBLogPrintf("f_check failed: %d", res);
+        WHBLogFreetypeDraw();
+        return false;
+    }
+
+    WHBLogPrintf("%u files in %u directories, %u clusters free", report.files, report.dirs, report.free_clst);
+    WHBLogPrintf("Broken chains: %u, cross-linked: %u, wrong sizes: %u", report.bad_chains, report.cross_links, report.size_errors);
+    WHBLogPrintf("Lost chains: %u (%u clusters), bad clusters: %u", report.lost_chains, report.lost_clusters, report.bad_clusters);
+    if (report.free_wrong) WHBLogPrint("The stored free cluster count was wrong");
+    if (report.repaired) WHBLogPrint("The problems were repaired");
+    WHBLogFreetypeDraw();
+    if (clean) *clean = report.bad_chains == 0 && report.cross_links == 0 && report.size_errors == 0 && report.lost_chains == 0 && !report.free_wrong;
+    return true;
+}
+
+struct UsbTestOutput {
+    FILE* csv;
+    bool capacityOk;
+};
+
+static void printUsbTestResult(const DBENCH_RESULT* res, void* arg) {
+    UsbTestOutput* out = (UsbTestOutput*)arg;
+    char line[160];
+    dbench_csv_row(res, line, sizeof(line));
+    if (out->csv) fputs(line, out->csv);
+
+    if (res->test[0] == 'v') {
+        out->capacityOk = res->errors == 0;
+        if (out->capacityOk) WHBLogPrint("Capacity check: OK");
+        else WHBLogPrintf("Capacity check: FAILED, %u sectors lost their data (first at sector %llu)", res->errors, (unsigned long long)res->first_bad);
+    }
+    else {
+        WHBLogPrintf("%-10s %-5s %5u KiB: %6u.%02u MiB/s %6u IOPS%s", res->random ? "Random" : "Sequential", res->test[0] == 'w' ? "write" : "read",
+                     res->xfer / 1024, res->kibps / 1024, (res->kibps % 1024) * 100 / 1024, res->iops, res->errors ? " (I/O errors)" : "");
+    }
+    WHBLogFreetypeDraw();
+}
+
+bool testUsbDrive(const char* csvPath, bool* capacityOk) {
+    // The test writes all over the drive, nothing may have it mounted until the caller releases it
+    if (!unmountUsbFat()) return false;
+
+    if (disk_initialize((void*)1) != 0) {
+        return false;
+    }
+
+    BYTE* work = (BYTE*)memalign(0x40, USB_TEST_BUFFER_SIZE);
+    if (!work) return false;
+
+    WORD sectorSize = 512;
+    LBA_t sectorCount = 0;
+    disk_ioctl((void*)1, GET_SECTOR_SIZE, &sectorSize);
+    disk_ioctl((void*)1, GET_SECTOR_COUNT, &sectorCount);
+    WHBLogPrintf("Testing USB drive: %llu MiB reported, %u byte sectors", (unsigned long long)sectorCount * sectorSize / (1024 * 1024), sectorSize);
+    WHBLogFreetypeDraw();
+
+    UsbTestOutput output = {csvPath ? fopen(csvPath, "w") : nullptr, true};
+    if (output.csv) fputs(DBENCH_CSV_HEADER, output.csv);
+    int res = dbench_suite((void*)1, work, USB_TEST_BUFFER_SIZE, printUsbTestResult, &output);
+
+    if (output.csv) fclose(output.csv);
+    free(work);
+    if (capacityOk) *capacityOk = output.capacityOk;
+    return res == 0;
+}
+
 bool testStorage(TITLE_LOCATION location) {
     if (location == TITLE_LOCATION::NAND) return dirExist(convertToPosixPath("/vol/storage_mlc01/usr/").c_str());
     if (location == TITLE_LOCATION::USB) return dirExist(convertToPosixPath("/vol/storage_usb01/usr/").c_str());
@@ -3,12 +3,16 @@
 // Functions related to devices
 bool mountSystemDrives();
 bool mountDisc();
+void startFatVolumes();
 bool mountUsbFat();
 bool unmountSystemDrives();
 bool unmountDisc();
-void unmountUsbFat();
+void stopFatVolumes();
+bool unmountUsbFat();
 
-bool formatUsbFat();
+bool formatUsbFat(bool fullFormat = false);
+bool testUsbDrive(const char* csvPath, bool* capacityOk);
+bool checkUsbFat(bool repair, bool* clean);
 
 bool isDiscMounted();
 bool isSlcMounted();
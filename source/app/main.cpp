@@ -30,6 +30,7 @@ int main() {
     showLoadingScreen();
     if (testCFW() != FAILED && ((getCFWVersion() == MOCHA_FSCLIENT || getCFWVersion() == CEMU || getCFWVersion() == CUSTOM_MOCHA) || installCFW()) && initCFW() ) {
         mountSystemDrives();
+        startFatVolumes();
         WHBLogFreetypePrint(L"");
         WHBLogPrint("Finished loading!");
         WHBLogFreetypeDraw();
@@ -43,6 +44,7 @@ int main() {
     sleep_for(5s);
 
     // Close application properly
+    stopFatVolumes();
     unmountSystemDrives();
     shutdownCFW();
     ACPFinalize();
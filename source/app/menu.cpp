@@ -6,6 +6,8 @@
 #include "cfw.h"
 #include "fw_img_loader.h"
 #include "download.h"
+#include "../utils/fatfs/fatfs_devoptab.h"
+#include "../utils/fatfs/fatfs_volumes.h"
 #include <dirent.h>
 #include <algorithm>
 #include <vector>
@@ -76,8 +78,10 @@ void installAromaMenu() {
 void formatUsbAndDownloadAromaMenu() {
     uint8_t choice = showDialogPrompt(L"WARNING: This will format the USB drive and DELETE ALL DATA on it.\nDo you want to continue?", L"Yes", L"No");
     if (choice != 0) return;
+    choice = showDialogPrompt(L"Quick format only writes the filesystem structures.\nFull format also overwrites every sector, which can take a long time.", L"Quick Format", L"Full Format");
 
-    if (!formatUsbFat()) {
+    if (!formatUsbFat(choice == 1)) {
+        fatfs_volumes_release(1);
         setErrorPrompt(L"Failed to format USB drive!");
         showErrorPrompt(L"OK");
         return;
@@ -94,8 +98,120 @@ void formatUsbAndDownloadAromaMenu() {
     } else {
         showErrorPrompt(L"OK");
     }
+}
+
+void testUsbDriveMenu() {
+    uint8_t choice = showDialogPrompt(L"WARNING: The speed and health test writes all over the USB drive and DELETES ALL DATA on it.\nDo you want to continue?", L"Yes", L"No");
+    if (choice != 0) return;
+
+    WHBLogFreetypeClear();
+    bool capacityOk = true;
+    bool tested = testUsbDrive("fs:/vol/external01/usb_test.csv", &capacityOk);
+    // Whatever is left on the drive, the volume manager may look at it again
+    fatfs_volumes_release(1);
+    if (!tested) {
+        setErrorPrompt(L"Failed to test the USB drive!");
+        showErrorPrompt(L"OK");
+        return;
+    }
+
+    if (!capacityOk) {
+        showDialogPrompt(L"The USB drive doesn't keep data written to all of its reported capacity!\nIt is most likely counterfeit and will lose data, don't use it for Aroma.\nResults were saved to usb_test.csv on the SD card.", L"OK");
+        return;
+    }
+    showDialogPrompt(L"USB drive test finished, results were saved to usb_test.csv on the SD card.\nThe drive has to be formatted before it can be used again.", L"OK");
+}
+
+
+void checkUsbDriveMenu() {
+    uint8_t choice = showDialogPrompt(L"Check the USB drive's filesystem for broken, cross-linked and lost cluster chains?\nRepairing cuts broken files to the data that's left and frees lost clusters.", L"Check Only", L"Check and Repair");
+
+    WHBLogFreetypeClear();
+    bool clean = false;
+    bool checked = checkUsbFat(choice == 1, &clean);
+    mountUsbFat();
+    if (!checked) {
+        setErrorPrompt(L"Failed to check the USB drive!");
+        showErrorPrompt(L"OK");
+        return;
+    }
+
+    if (clean) showDialogPrompt(L"No problems were found on the USB drive.", L"OK");
+    else if (choice == 1) showDialogPrompt(L"Problems were found on the USB drive and repaired.\nFiles that were cut short should be downloaded again.", L"OK");
+    else showDialogPrompt(L"Problems were found on the USB drive!\nRun the check again with repair, or format the drive before using it for Aroma.", L"OK");
+}
+
+
+static double percentOf(uint64_t part, uint64_t total) {
+    return total == 0 ? 0.0 : part * 100.0 / total;
+}
+
+// Only the buckets that counted something, labeled with their upper bound
+static std::wstring latencyHistogram(const uint64_t* buckets) {
+    std::wstring line;
+    for (int i = 0; i < FATFS_LATENCY_BUCKETS; i++) {
+        if (buckets[i] == 0) continue;
+        uint32_t limit = 64u << i;
+        wchar_t entry[48];
+        if (i == FATFS_LATENCY_BUCKETS - 1) swprintf(entry, 48, L" >%ums:%llu", (64u << (i - 1)) / 1000, (unsigned long long)buckets[i]);
+        else if (limit < 1000) swprintf(entry, 48, L" <%uus:%llu", limit, (unsigned long long)buckets[i]);
+        else swprintf(entry, 48, L" <%ums:%llu", limit / 1000, (unsigned long long)buckets[i]);
+        line += entry;
+    }
+    return line.empty() ? L" -" : line;
+}
+
+void showStorageStatsMenu() {
+    bool reset = false;
+    while (true) {
+        WHBLogFreetypeStartScreen();
+        WHBLogFreetypePrint(L"Storage Statistics");
+        WHBLogFreetypePrint(L"===============================");
+        bool any = false;
+        for (const FatfsVolumeInfo& volume : fatfs_volumes_list()) {
+            // The drive counters are shared by all of its volumes, so they're shown and reset once per drive
+            FatfsDriveStats ds;
+            if (volume.mounts.empty() || !fatfs_drive_stats(volume.mounts.front() + ":/", ds, reset)) continue;
+            any = true;
+            WHBLogFreetypePrintf(L"Drive %d (%S)", volume.pdrv, toWstring(volume.name).c_str());
+            WHBLogFreetypePrintf(L" Reads: %llu (%llu KiB)  Writes: %llu (%llu KiB)  Errors: %llu",
+                                 (unsigned long long)ds.reads, (unsigned long long)(ds.bytesRead / 1024),
+                                 (unsigned long long)ds.writes, (unsigned long long)(ds.bytesWritten / 1024), (unsigned long long)ds.errors);
+            WHBLogFreetypePrintf(L" Read latency:%S", latencyHistogram(ds.readLatency).c_str());
+            WHBLogFreetypePrintf(L" Write latency:%S", latencyHistogram(ds.writeLatency).c_str());
+            for (const std::string& name : volume.mounts) {
+                FatfsVolumeStats st;
+                if (!fatfs_stats(name + ":/", st, reset)) continue;
+                WHBLogFreetypePrintf(L" %S:/", toWstring(name).c_str());
+                WHBLogFreetypePrintf(L"  Sector window: %llu loads, %.1f%% hits  FAT: %llu lookups, cache %.1f%% hits",
+                                     (unsigned long long)st.windowLoads, percentOf(st.windowHits, st.windowHits + st.windowLoads),
+                                     (unsigned long long)st.fatLookups, percentOf(st.fatCacheHits, st.fatCacheHits + st.fatCacheMisses));
+                WHBLogFreetypePrintf(L"  Directories: %llu scans over %llu entries, %llu cache hits  Paths: %.1f%% resumed",
+                                     (unsigned long long)st.dirScans, (unsigned long long)st.dirEntries, (unsigned long long)st.dirCacheHits,
+                                     percentOf(st.pathCacheHits, st.pathCacheHits + st.pathCacheMisses));
+            }
+            WHBLogFreetypePrint(L"");
+        }
+        if (!any) WHBLogFreetypePrint(L"No FAT volume is mounted.");
+        reset = false;
+        WHBLogFreetypeScreenPrintBottom(L"===============================");
+        WHBLogFreetypeScreenPrintBottom(L"\uE000 Button = Reset Counters \uE001 Button = Back to Main Menu");
+        WHBLogFreetypeScreenPrintBottom(L"");
+        WHBLogFreetypeDrawScreen();
 
-    unmountUsbFat();
+        // Redraw twice a second so the counters can be watched while something else uses the drive
+        sleep_for(200ms);
+        updateInputs();
+        for (int i = 0; i < 6; i++) {
+            updateInputs();
+            if (pressedOk()) {
+                reset = true;
+                break;
+            }
+            if (pressedBack()) return;
+            sleep_for(50ms);
+        }
+    }
 }
 
 
@@ -113,8 +229,11 @@ void showMainMenu() {
         WHBLogFreetypePrintf(L"%C Boot Installer", OPTION(2));
         WHBLogFreetypePrintf(L"%C Download Aroma", OPTION(3));
         WHBLogFreetypePrintf(L"%C Format USB and Download Aroma", OPTION(4));
+        WHBLogFreetypePrintf(L"%C Test USB Drive Speed and Health", OPTION(5));
+        WHBLogFreetypePrintf(L"%C Check and Repair USB Drive", OPTION(6));
+        WHBLogFreetypePrintf(L"%C Storage Statistics", OPTION(7));
         WHBLogFreetypePrint(L"");
-        WHBLogFreetypePrintf(L"%C Stroopwafel Plugin Manager", OPTION(6));
+        WHBLogFreetypePrintf(L"%C Stroopwafel Plugin Manager", OPTION(8));
         WHBLogFreetypeScreenPrintBottom(L"===============================");
         WHBLogFreetypeScreenPrintBottom(L"\uE000 Button = Select Option \uE001 Button = Exit ISFShax Loader");
         WHBLogFreetypeScreenPrintBottom(L"");
@@ -127,19 +246,13 @@ void showMainMenu() {
             updateInputs();
             // Check each button state
             if (navigatedUp()) {
-                if (selectedOption == 6) {
-                    selectedOption = 4;
-                    break;
-                } else if (selectedOption > 0) {
+                if (selectedOption > 0) {
                     selectedOption--;
                     break;
                 }
             }
             if (navigatedDown()) {
-                if (selectedOption == 4) {
-                    selectedOption = 6;
-                    break;
-                } else if (selectedOption < 4) {
+                if (selectedOption < 8) {
                     selectedOption++;
                     break;
                 }
@@ -177,7 +290,16 @@ void showMainMenu() {
         case 4:
             formatUsbAndDownloadAromaMenu();
             break;
+        case 5:
+            testUsbDriveMenu();
+            break;
         case 6:
+            checkUsbDriveMenu();
+            break;
+        case 7:
+            showStorageStatsMenu();
+            break;
+        case 8:
             showPluginManager();
             break;
         default:
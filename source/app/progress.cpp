@@ -4,6 +4,7 @@
 #include "menu.h"
 #include "filesystem.h"
 #include "gui.h"
+#include "../utils/fatfs/ffprofile.h"
 
 #define SMOOTHING_FACTOR 0.2
 
@@ -40,12 +41,14 @@ void startSingleDump() {
     bytesCopiedSecond = 0;
     filesCopied = 0;
 
+#if FF_USE_PROFILE
+    profile_reset();
+#endif
+
     startTime = OSGetTick();
     lastTime = (OSTick)startTime - (OSTick)OSMillisecondsToTicks(1001);
 }
 
-extern "C" double profile_getSegment(const char* segmentName);
-
 void showCurrentProgress() {
     // Calculate the bytes per second and print an estimate of the time
     OSTick timeSinceLastPeriod = OSGetTick()-lastTime;
@@ -72,12 +75,16 @@ void showCurrentProgress() {
         WHBLogFreetypePrint(L"");
         WHBLogFreetypePrintf(L"File Progress = %.1f%% done - %S", calculatePercentage(copiedFileBytes, totalFileBytes), formatByteSizes(copiedFileBytes, totalFileBytes).c_str());
 
-//        WHBLogFreetypePrintf("Total Fat32 Time Spent on %.0f files: %.0f ms", profile_getSegment("files"), profile_getSegment("total"));
-//        WHBLogFreetypePrintf(" - follow_path: %.0f ms", profile_getSegment("follow_path"));
-//        WHBLogFreetypePrintf("   - dir_find's time: %.0f ms", profile_getSegment("followfinds"));
-//        WHBLogFreetypePrintf(" - dir_register: %.0f ms", profile_getSegment("dir_register"));
-//        WHBLogFreetypePrintf("   - dir_find's time: %.0f ms", profile_getSegment("registerfinds"));
-//        WHBLogFreetypePrintf("   - dir_alloc: %.0f ms", profile_getSegment("dir_alloc"));
+#if FF_USE_PROFILE
+        WHBLogFreetypePrint(L"");
+        WHBLogFreetypePrintf(L"Total FAT Time Spent on %llu files: %.0f ms", (unsigned long long)profile_getCount("files"), profile_getSegment("total"));
+        WHBLogFreetypePrintf(L" - follow_path: %.0f ms", profile_getSegment("follow_path"));
+        WHBLogFreetypePrintf(L"   - dir_find's time: %.0f ms", profile_getSegment("followfinds"));
+        WHBLogFreetypePrintf(L" - dir_register: %.0f ms", profile_getSegment("dir_register"));
+        WHBLogFreetypePrintf(L"   - dir_find's time: %.0f ms", profile_getSegment("registerfinds"));
+        WHBLogFreetypePrintf(L"   - dir_alloc: %.0f ms", profile_getSegment("dir_alloc"));
+        WHBLogFreetypePrintf(L" - disk I/O: %.0f ms read, %.0f ms write", profile_getSegment("disk_read"), profile_getSegment("disk_write"));
+#endif
 
         WHBLogFreetypePrint(L"");
         WHBLogFreetypeScreenPrintBottom(L"===============================");
@@ -0,0 +1,284 @@
+#include "diskbench.h"
+#include "diskio.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef __WIIU__
+#include <coreinit/time.h>
+#else
+#include <time.h>
+#endif
+
+// Request sizes tried by the alignment probe, alignment never goes below the GPT default of 1 MiB
+#define PROBE_MIN_XFER (64 * 1024)
+#define PROBE_MAX_XFER (16 * 1024 * 1024)
+#define PROBE_MIN_BYTES (4 * 1024 * 1024)
+#define PROBE_MIN_ALIGN (1024 * 1024)
+// The probe writes behind the area where the partition table will go
+#define PROBE_OFFSET (16 * 1024 * 1024)
+// A request size counts as saturated once it reaches this share of the best throughput
+#define PROBE_SATURATION_PERCENT 90
+
+QWORD dbench_time_us(void) {
+#ifdef __WIIU__
+    return (QWORD)OSTicksToMicroseconds(OSGetSystemTime());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (QWORD)ts.tv_sec * 1000000 + (QWORD)ts.tv_nsec / 1000;
+#endif
+}
+
+static void st_qword_le(BYTE* p, QWORD v) {
+    for (int i = 0; i < 8; i++) p[i] = (BYTE)(v >> (i * 8));
+}
+
+static WORD get_sector_size(void* pdrv) {
+    WORD ss = 512;
+    if (disk_ioctl(pdrv, GET_SECTOR_SIZE, &ss) != RES_OK) return 0;
+    return ss;
+}
+
+DWORD dbench_seq_write(void* pdrv, LBA_t lba, DWORD xfer, QWORD total, const BYTE* buf) {
+    WORD ss = get_sector_size(pdrv);
+    if (ss == 0 || xfer < ss) return 0;
+
+    UINT count = xfer / ss;
+    QWORD start = dbench_time_us();
+    for (QWORD done = 0; done < total; done += (QWORD)count * ss, lba += count) {
+        if (disk_write(pdrv, buf, lba, count) != RES_OK) return 0;
+    }
+    disk_ioctl(pdrv, CTRL_SYNC, NULL);
+
+    QWORD elapsed = dbench_time_us() - start;
+    if (elapsed == 0) elapsed = 1;
+    return (DWORD)(total * 1000000 / 1024 / elapsed);
+}
+
+DWORD dbench_probe_align(void* pdrv, BYTE* buf, DWORD bufsize) {
+    WORD ss = get_sector_size(pdrv);
+    LBA_t sectorCount = 0;
+    if (ss == 0 || disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectorCount) != RES_OK) return 0;
+
+    DWORD maxXfer = bufsize < PROBE_MAX_XFER ? bufsize : PROBE_MAX_XFER;
+    DWORD speeds[16] = {0};
+    DWORD best = 0;
+    LBA_t lba = PROBE_OFFSET / ss;
+    int n = 0;
+    memset(buf, 0xA5, maxXfer);
+    for (DWORD xfer = PROBE_MIN_XFER; xfer <= maxXfer && n < 16; xfer *= 2, n++) {
+        QWORD total = xfer * 2 > PROBE_MIN_BYTES ? (QWORD)xfer * 2 : PROBE_MIN_BYTES;
+        if ((lba + total / ss) * ss > (QWORD)sectorCount * ss / 2) break; // Stay well inside small drives
+        speeds[n] = dbench_seq_write(pdrv, lba, xfer, total, buf);
+        if (speeds[n] == 0) return 0;
+        if (speeds[n] > best) best = speeds[n];
+        lba += total / ss;
+    }
+    if (best == 0) return 0;
+
+    // Smallest request size that gets close to the best throughput, on flash this follows the allocation unit
+    DWORD xfer = PROBE_MIN_XFER;
+    for (int i = 0; i < n; i++, xfer *= 2) {
+        if ((QWORD)speeds[i] * 100 >= (QWORD)best * PROBE_SATURATION_PERCENT) break;
+    }
+    if (xfer < PROBE_MIN_ALIGN) xfer = PROBE_MIN_ALIGN;
+    DWORD align = xfer / ss;
+    return align > 0x8000 ? 0x8000 : align;
+}
+
+// Speed/health test: writes stay inside this window behind the partition table area
+#define SUITE_SPAN_BYTES (1024ULL * 1024 * 1024)
+#define SUITE_MAX_BYTES (64ULL * 1024 * 1024)
+#define SUITE_MAX_USEC (3ULL * 1000 * 1000)
+#define SUITE_VERIFY_SAMPLES 256
+
+static const struct {
+    const char* test;
+    BYTE random;
+    DWORD xfer;
+} suiteTests[] = {
+    // Sequential writes go first so the reads hit sectors that have data on them
+    {"write", 0, 64 * 1024}, {"write", 0, 1024 * 1024}, {"write", 0, 4 * 1024 * 1024},
+    {"read", 0, 64 * 1024}, {"read", 0, 1024 * 1024}, {"read", 0, 4 * 1024 * 1024},
+    {"write", 1, 4 * 1024}, {"write", 1, 64 * 1024},
+    {"read", 1, 4 * 1024}, {"read", 1, 64 * 1024},
+};
+
+// Tag of a capacity check sample, the rest of the sector is filled with a pattern derived from the address
+#define VERIFY_MAGIC "DBVERIFY"
+// Wrap-around probes start at this offset and step in powers of two from the minimum distance
+#define VERIFY_ALIAS_BASE (3 * 1024 * 1024)
+#define VERIFY_ALIAS_MIN (16 * 1024 * 1024)
+
+static DWORD xorshift32(DWORD* state) {
+    DWORD x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void finish_result(DBENCH_RESULT* res, QWORD requests) {
+    if (res->usec == 0) res->usec = 1;
+    res->kibps = (DWORD)(res->bytes * 1000000 / 1024 / res->usec);
+    res->iops = (DWORD)(requests * 1000000 / res->usec);
+}
+
+int dbench_run(void* pdrv, LBA_t lba, LBA_t span, DBENCH_RESULT* res, QWORD max_bytes, QWORD max_us, BYTE* buf) {
+    WORD ss = get_sector_size(pdrv);
+    if (ss == 0 || res->xfer < ss) return -1;
+
+    UINT count = res->xfer / ss;
+    LBA_t slots = span / count;
+    if (slots == 0) return -1;
+
+    int write = res->test[0] == 'w';
+    DWORD seed = 0x9E3779B9;
+    QWORD requests = 0;
+    LBA_t next = 0;
+    res->bytes = 0;
+    res->errors = 0;
+    if (write) memset(buf, 0xC3, res->xfer);
+
+    QWORD start = dbench_time_us();
+    do {
+        LBA_t slot = res->random ? (LBA_t)(((QWORD)xorshift32(&seed) << 32 | xorshift32(&seed)) % slots) : next++ % slots;
+        LBA_t sect = lba + slot * count;
+        DRESULT dr = write ? disk_write(pdrv, buf, sect, count) : disk_read(pdrv, buf, sect, count);
+        if (dr != RES_OK) res->errors++;
+        res->bytes += res->xfer;
+        requests++;
+    } while (res->bytes < max_bytes && dbench_time_us() - start < max_us);
+    if (write) disk_ioctl(pdrv, CTRL_SYNC, NULL);
+
+    res->usec = dbench_time_us() - start;
+    finish_result(res, requests);
+    return 0;
+}
+
+static void fill_verify_sector(BYTE* buf, WORD ss, LBA_t sect) {
+    DWORD state = (DWORD)sect ^ (DWORD)((QWORD)sect >> 32) ^ 0xA5A5A5A5;
+    memcpy(buf, VERIFY_MAGIC, 8);
+    st_qword_le(buf + 8, (QWORD)sect);
+    for (UINT i = 16; i < ss; i += 4) {
+        DWORD v = xorshift32(&state);
+        memcpy(buf + i, &v, 4);
+    }
+}
+
+// Writes (pass 0) or checks (pass 1) one tagged sample sector
+static void verify_sample(void* pdrv, WORD ss, LBA_t sect, int pass, DBENCH_RESULT* res, BYTE* buf) {
+    BYTE* expected = buf + ss;
+    fill_verify_sector(pass == 0 ? buf : expected, ss, sect);
+    if (pass == 0) {
+        if (disk_write(pdrv, buf, sect, 1) != RES_OK) res->errors++;
+        return;
+    }
+    if (disk_read(pdrv, buf, sect, 1) != RES_OK || memcmp(buf, expected, ss) != 0) {
+        if (res->errors == 0 || sect < res->first_bad) res->first_bad = sect;
+        res->errors++;
+    }
+    res->bytes += ss;
+}
+
+int dbench_verify_capacity(void* pdrv, DWORD samples, DBENCH_RESULT* res, BYTE* buf) {
+    WORD ss = get_sector_size(pdrv);
+    LBA_t sectorCount = 0;
+    if (ss == 0 || samples < 2 || disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectorCount) != RES_OK || sectorCount < samples) return -1;
+
+    res->test = "verify";
+    res->random = 1;
+    res->xfer = ss;
+    res->bytes = 0;
+    res->errors = 0;
+    res->first_bad = 0;
+
+    // Samples spread evenly from the first to the last sector catch drives that drop or fail writes past their
+    // real end. Drives that wrap their addresses instead read back whatever they stored, so the base sector is
+    // also written again at every power of two away from it: the alias that matches the real size overwrites it.
+    LBA_t base = VERIFY_ALIAS_BASE / ss;
+    QWORD requests = 0;
+    QWORD start = dbench_time_us();
+    for (int pass = 0; pass < 2; pass++) {
+        for (DWORD i = 0; i < samples; i++) {
+            verify_sample(pdrv, ss, (LBA_t)((QWORD)(sectorCount - 1) * i / (samples - 1)), pass, res, buf);
+            requests++;
+        }
+        for (LBA_t dist = 0; base + dist < sectorCount; dist = dist ? dist * 2 : VERIFY_ALIAS_MIN / ss) {
+            verify_sample(pdrv, ss, base + dist, pass, res, buf);
+            requests++;
+        }
+        if (pass == 0) disk_ioctl(pdrv, CTRL_SYNC, NULL);
+    }
+    res->usec = dbench_time_us() - start;
+    finish_result(res, requests);
+    return 0;
+}
+
+int dbench_suite(void* pdrv, BYTE* buf, DWORD bufsize, DBENCH_CALLBACK cb, void* arg) {
+    WORD ss = get_sector_size(pdrv);
+    LBA_t sectorCount = 0;
+    if (ss == 0 || bufsize < 2 * (DWORD)ss || disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectorCount) != RES_OK) return -1;
+
+    DBENCH_RESULT res;
+    memset(&res, 0, sizeof(res));
+    if (dbench_verify_capacity(pdrv, SUITE_VERIFY_SAMPLES, &res, buf) != 0) return -1;
+    if (cb) cb(&res, arg);
+
+    LBA_t lba = PROBE_OFFSET / ss;
+    if (sectorCount <= lba * 2) return -1;
+    LBA_t span = sectorCount - lba;
+    if ((QWORD)span * ss > SUITE_SPAN_BYTES) span = SUITE_SPAN_BYTES / ss;
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(suiteTests) / sizeof(suiteTests[0]); i++) {
+        if (suiteTests[i].xfer > bufsize || suiteTests[i].xfer < ss) continue;
+        memset(&res, 0, sizeof(res));
+        res.test = suiteTests[i].test;
+        res.random = suiteTests[i].random;
+        res.xfer = suiteTests[i].xfer;
+        if (dbench_run(pdrv, lba, span, &res, SUITE_MAX_BYTES, SUITE_MAX_USEC, buf) != 0) {
+            failed = 1;
+            continue;
+        }
+        if (cb) cb(&res, arg);
+    }
+    return failed ? -1 : 0;
+}
+
+int dbench_csv_row(const DBENCH_RESULT* res, char* out, UINT len) {
+    return snprintf(out, len, "%s,%s,%lu,%llu,%llu,%lu,%lu,%lu\n", res->test, res->random ? "random" : "sequential",
+                    (unsigned long)res->xfer, (unsigned long long)res->bytes, (unsigned long long)res->usec,
+                    (unsigned long)res->kibps, (unsigned long)res->iops, (unsigned long)res->errors);
+}
+
+// File sizes of the workload, roughly what an Aroma environment with a few plugins looks like (~18 MiB in total)
+static const DWORD workloadSizes[] = {4 * 1024, 16 * 1024, 48 * 1024, 128 * 1024, 384 * 1024, 1024 * 1024, 3 * 1024 * 1024};
+#define WORKLOAD_DIRS 4
+
+QWORD dbench_fs_workload(FATFS* fs, BYTE* buf, DWORD bufsize) {
+    char path[64];
+    memset(buf, 0x5A, bufsize);
+
+    QWORD start = dbench_time_us();
+    for (int d = 0; d < WORKLOAD_DIRS; d++) {
+        snprintf(path, sizeof(path), "/bench%d", d);
+        if (f_mkdir(fs, path) != FR_OK) return 0;
+        for (size_t i = 0; i < sizeof(workloadSizes) / sizeof(workloadSizes[0]); i++) {
+            FFFIL fil;
+            snprintf(path, sizeof(path), "/bench%d/file%u.bin", d, (unsigned)i);
+            if (f_open(&fil, fs, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) return 0;
+            for (DWORD left = workloadSizes[i]; left > 0; ) {
+                UINT chunk = left < bufsize ? left : bufsize, written = 0;
+                if (f_write(&fil, buf, chunk, &written) != FR_OK || written != chunk) {
+                    f_close(&fil);
+                    return 0;
+                }
+                left -= chunk;
+            }
+            if (f_close(&fil) != FR_OK) return 0;
+        }
+    }
+    disk_ioctl(fs->pdrv, CTRL_SYNC, NULL);
+    QWORD elapsed = dbench_time_us() - start;
+    return elapsed ? elapsed : 1;
+}
@@ -0,0 +1,60 @@
+#ifndef _DISKBENCH_DEFINED
+#define _DISKBENCH_DEFINED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ff.h"
+
+/* One measurement of the speed/health test */
+typedef struct {
+    const char* test;   /* "read", "write" or "verify" */
+    BYTE random;        /* 0: sequential, 1: random offsets */
+    DWORD xfer;         /* Request size [byte] */
+    QWORD bytes;        /* Bytes transferred */
+    QWORD usec;         /* Elapsed time [us] */
+    DWORD kibps;        /* Throughput [KiB/s] */
+    DWORD iops;         /* Requests per second */
+    DWORD errors;       /* Failed requests (verify: sectors that didn't read back what was written) */
+    LBA_t first_bad;    /* First failing sector of a verify (valid if errors != 0) */
+} DBENCH_RESULT;
+
+typedef void (*DBENCH_CALLBACK)(const DBENCH_RESULT* res, void* arg);
+
+#define DBENCH_CSV_HEADER "test,pattern,xfer_bytes,bytes,usec,kib_per_s,iops,errors\n"
+
+/* Read or write (res->test, res->random, res->xfer filled in by the caller) inside [lba, lba + span)
+   until max_bytes are transferred or max_us have passed. Returns 0 on success. */
+int dbench_run (void* pdrv, LBA_t lba, LBA_t span, DBENCH_RESULT* res, QWORD max_bytes, QWORD max_us, BYTE* buf);
+
+/* Fake capacity check: tags samples sectors spread over the whole drive with their own address and reads
+   them back afterwards. Drives that report more space than they have wrap or drop those writes. */
+int dbench_verify_capacity (void* pdrv, DWORD samples, DBENCH_RESULT* res, BYTE* buf);
+
+/* Capacity check followed by sequential and random read/write tests at several request sizes, cb gets
+   every result as soon as it is measured. Destroys the data on the drive. Returns 0 if all tests ran. */
+int dbench_suite (void* pdrv, BYTE* buf, DWORD bufsize, DBENCH_CALLBACK cb, void* arg);
+
+/* Format a result as a CSV line matching DBENCH_CSV_HEADER */
+int dbench_csv_row (const DBENCH_RESULT* res, char* out, UINT len);
+
+/* Sequential write throughput in KiB/s of total bytes written from lba in xfer byte requests (0: error) */
+DWORD dbench_seq_write (void* pdrv, LBA_t lba, DWORD xfer, QWORD total, const BYTE* buf);
+
+/* Probe the request size where sequential writes stop getting faster and return it as alignment in sectors
+   (0: drive too small or error). Overwrites data near the start of the drive, only use it before formatting. */
+DWORD dbench_probe_align (void* pdrv, BYTE* buf, DWORD bufsize);
+
+/* Write an Aroma-like set of files (many small ones, a few MBs) to a freshly formatted volume.
+   Returns the elapsed time in microseconds (0: error). */
+QWORD dbench_fs_workload (FATFS* fs, BYTE* buf, DWORD bufsize);
+
+/* Monotonic time in microseconds */
+QWORD dbench_time_us (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,7 @@
 #include "ff.h"
 #include "diskio.h"
+#include "diskqueue.h"
+#include "ffprofile.h"
 #include <coreinit/filesystem.h>
 #include <coreinit/debug.h>
 #include <coreinit/time.h>
@@ -10,11 +12,28 @@
 #include <coreinit/filesystem_fsa.h>
 
 #define INTERNAL_VOLUMES 4
+#define DISK_DEFAULT_ERASE_BLOCK (1024 * 1024)
+// FSA clients (each with its own raw handle) per drive, IOSU works on the requests of different clients in parallel
+#define DISK_QUEUE_DEPTH 4
+
+typedef struct {
+    FSAClientHandle client;
+    IOSHandle handle;
+    WORD sectorSize;
+    BYTE pdrv;
+} DiskChannel;
+
 const char* fatDevPaths[INTERNAL_VOLUMES] = {"/dev/sdcard01", "/dev/usb01", "/dev/usb02", "/dev/usb03"};
 bool fatMounted[INTERNAL_VOLUMES] = {false, false, false, false};
 FSAClientHandle fatClients[INTERNAL_VOLUMES] = {0, 0, 0, 0};
 IOSHandle fatHandles[INTERNAL_VOLUMES] = {-1, -1, -1, -1};
-const WORD fatSectorSizes[INTERNAL_VOLUMES] = {512, 512, 512, 512};
+WORD fatSectorSizes[INTERNAL_VOLUMES] = {512, 512, 512, 512};
+// Channel 0 is fatClients/fatHandles, the others are only opened for the request queue
+static DiskChannel fatChannels[INTERNAL_VOLUMES][DISK_QUEUE_DEPTH];
+static UINT fatChannelCounts[INTERNAL_VOLUMES];
+static DISKQUEUE* fatQueues[INTERNAL_VOLUMES];
+// Raw IPC calls since the drive was opened, GET_DISK_STATS
+static DISK_STATS fatStats[INTERNAL_VOLUMES];
 
 static int get_pdrv_index(void* pdrv) {
     if (!pdrv) return -1;
@@ -30,6 +49,53 @@ static int get_pdrv_index(void* pdrv) {
     return -1;
 }
 
+// Every raw read and write goes through here, from the queue workers and the synchronous path alike
+static DRESULT wiiu_rawIo(const DiskChannel* ch, BYTE* buff, LBA_t sector, UINT count, BYTE write) {
+    OSTime start = OSGetSystemTime();
+    FSError status = write ? FSAEx_RawWriteEx(ch->client, buff, ch->sectorSize, count, sector, ch->handle)
+                           : FSAEx_RawReadEx(ch->client, buff, ch->sectorSize, count, sector, ch->handle);
+    DRESULT res = (status == FS_ERROR_OK) ? RES_OK : RES_ERROR;
+    disk_stats_add(&fatStats[ch->pdrv], write, count, OSTicksToMicroseconds(OSGetSystemTime() - start), res);
+    return res;
+}
+
+static DRESULT wiiu_channelIo(void* channel, BYTE* buff, LBA_t sector, UINT count, BYTE write) {
+    return wiiu_rawIo((DiskChannel*)channel, buff, sector, count, write);
+}
+
+// Opens the extra channels and starts the request queue, the drive keeps working synchronously without it
+static void wiiu_startQueue(BYTE pdrv) {
+    fatChannels[pdrv][0] = (DiskChannel){fatClients[pdrv], fatHandles[pdrv], fatSectorSizes[pdrv], pdrv};
+    UINT count = 1;
+    for (; count < DISK_QUEUE_DEPTH; count++) {
+        DiskChannel* ch = &fatChannels[pdrv][count];
+        ch->client = FSAAddClient(NULL);
+        if (ch->client <= 0) break;
+        Mocha_UnlockFSClientEx(ch->client);
+        if (FSAEx_RawOpenEx(ch->client, fatDevPaths[pdrv], &ch->handle) < 0) {
+            FSADelClient(ch->client);
+            break;
+        }
+        ch->sectorSize = fatSectorSizes[pdrv];
+        ch->pdrv = pdrv;
+    }
+    fatChannelCounts[pdrv] = count;
+
+    void* channels[DISK_QUEUE_DEPTH];
+    for (UINT i = 0; i < count; i++) channels[i] = &fatChannels[pdrv][i];
+    fatQueues[pdrv] = dq_create(wiiu_channelIo, channels, count, fatSectorSizes[pdrv]);
+}
+
+static void wiiu_stopQueue(BYTE pdrv) {
+    dq_destroy(fatQueues[pdrv]);
+    fatQueues[pdrv] = NULL;
+    for (UINT i = 1; i < fatChannelCounts[pdrv]; i++) {
+        FSAEx_RawCloseEx(fatChannels[pdrv][i].client, fatChannels[pdrv][i].handle);
+        FSADelClient(fatChannels[pdrv][i].client);
+    }
+    fatChannelCounts[pdrv] = 0;
+}
+
 DSTATUS wiiu_mountDrive(BYTE pdrv) {
     if (pdrv >= INTERNAL_VOLUMES) return STA_NOINIT;
     fatClients[pdrv] = FSAAddClient(NULL);
@@ -41,6 +107,16 @@ DSTATUS wiiu_mountDrive(BYTE pdrv) {
         fatClients[pdrv] = 0;
         return STA_NODISK;
     }
+
+    // Use the native sector size of the device (e.g. 4096 on 4Kn drives) so that raw I/O never gets emulated
+    fatSectorSizes[pdrv] = 512;
+    FSADeviceInfo deviceInfo = {};
+    if (FSAGetDeviceInfo(fatClients[pdrv], fatDevPaths[pdrv], &deviceInfo) == FS_ERROR_OK) {
+        uint32_t ss = deviceInfo.deviceSectorSize;
+        if (ss >= FF_MIN_SS && ss <= FF_MAX_SS && (ss & (ss - 1)) == 0) fatSectorSizes[pdrv] = (WORD)ss;
+    }
+    disk_stats_take(&fatStats[pdrv], NULL, 1);
+    wiiu_startQueue(pdrv);
     fatMounted[pdrv] = true;
     return 0;
 }
@@ -48,6 +124,7 @@ DSTATUS wiiu_mountDrive(BYTE pdrv) {
 DSTATUS wiiu_unmountDrive(BYTE pdrv) {
     if (pdrv >= INTERNAL_VOLUMES) return STA_NOINIT;
     if (fatMounted[pdrv]) {
+        wiiu_stopQueue(pdrv);
         FSAEx_RawCloseEx(fatClients[pdrv], fatHandles[pdrv]);
         FSADelClient(fatClients[pdrv]);
         fatMounted[pdrv] = false;
@@ -74,22 +151,37 @@ DSTATUS disk_initialize (void* pdrv) {
 DRESULT disk_read (void* pdrv, BYTE *buff, LBA_t sector, UINT count) {
     int idx = get_pdrv_index(pdrv);
     if (idx < 0 || idx >= INTERNAL_VOLUMES || !fatMounted[idx]) return RES_NOTRDY;
-    FSError status = FSAEx_RawReadEx(fatClients[idx], buff, fatSectorSizes[idx], count, sector, fatHandles[idx]);
-    return (status == FS_ERROR_OK) ? RES_OK : RES_ERROR;
+    FF_PROFILE_START(t0);
+    DRESULT res;
+    if (fatQueues[idx]) res = dq_read(fatQueues[idx], buff, sector, count);
+    else res = wiiu_rawIo(&fatChannels[idx][0], buff, sector, count, 0);
+    FF_PROFILE_STOP(FF_PROF_DISK_READ, t0);
+    return res;
 }
 
 DRESULT disk_write (void* pdrv, const BYTE *buff, LBA_t sector, UINT count) {
     int idx = get_pdrv_index(pdrv);
     if (idx < 0 || idx >= INTERNAL_VOLUMES || !fatMounted[idx]) return RES_NOTRDY;
-    FSError status = FSAEx_RawWriteEx(fatClients[idx], (void*)buff, fatSectorSizes[idx], count, sector, fatHandles[idx]);
-    return (status == FS_ERROR_OK) ? RES_OK : RES_ERROR;
+    FF_PROFILE_START(t0);
+    DRESULT res;
+    if (fatQueues[idx]) res = dq_write(fatQueues[idx], buff, sector, count);
+    else res = wiiu_rawIo(&fatChannels[idx][0], (BYTE*)buff, sector, count, 1);
+    FF_PROFILE_STOP(FF_PROF_DISK_WRITE, t0);
+    return res;
 }
 
 DRESULT disk_ioctl (void* pdrv, BYTE cmd, void *buff) {
     int idx = get_pdrv_index(pdrv);
     if (idx < 0 || idx >= INTERNAL_VOLUMES || !fatMounted[idx]) return RES_NOTRDY;
     switch (cmd) {
-        case CTRL_SYNC: return RES_OK;
+        case CTRL_SYNC: {
+            FF_PROFILE_START(t0);
+            DRESULT res = fatQueues[idx] ? dq_sync(fatQueues[idx]) : RES_OK;
+            FF_PROFILE_STOP(FF_PROF_DISK_SYNC, t0);
+            return res;
+        }
+        // The drive went away (or gets handed over), close its handles so the next disk_initialize reopens it
+        case CTRL_EJECT: return wiiu_unmountDrive((BYTE)idx) == 0 ? RES_OK : RES_ERROR;
         case GET_SECTOR_COUNT: {
              FSADeviceInfo deviceInfo = {};
              if (FSAGetDeviceInfo(fatClients[idx], fatDevPaths[idx], &deviceInfo) != FS_ERROR_OK) return RES_ERROR;
@@ -97,7 +189,19 @@ DRESULT disk_ioctl (void* pdrv, BYTE cmd, void *buff) {
              return RES_OK;
         }
         case GET_SECTOR_SIZE: *(WORD*)buff = fatSectorSizes[idx]; return RES_OK;
-        case GET_BLOCK_SIZE: *(DWORD*)buff = 1; return RES_OK;
+        case GET_SECTOR_SHIFT: {
+            BYTE shift = 0;
+            while ((1U << shift) < fatSectorSizes[idx]) shift++;
+            *(BYTE*)buff = shift;
+            return RES_OK;
+        }
+        // FSA doesn't report the erase block size, 1 MiB is a safe multiple for USB flash (the format path probes the real one)
+        case GET_BLOCK_SIZE: *(DWORD*)buff = DISK_DEFAULT_ERASE_BLOCK / fatSectorSizes[idx]; return RES_OK;
+        // The raw FSA device interface has no discard request (only open, read, write and close). On RES_PARERR
+        // FatFs stops collecting freed clusters for the volume, and f_trimfree() reports FR_DENIED.
+        case CTRL_TRIM: return RES_PARERR;
+        case GET_DISK_STATS: disk_stats_take(&fatStats[idx], (DISK_STATS*)buff, 0); return RES_OK;
+        case CTRL_RESET_STATS: disk_stats_take(&fatStats[idx], (DISK_STATS*)buff, 1); return RES_OK;
     }
     return RES_PARERR;
 }
@@ -45,12 +45,15 @@ DRESULT disk_ioctl (void* pdrv, BYTE cmd, void* buff);
 #define GET_SECTOR_SIZE		2	/* Get sector size (needed at FF_MAX_SS != FF_MIN_SS) */
 #define GET_BLOCK_SIZE		3	/* Get erase block size (needed at FF_USE_MKFS == 1) */
 #define CTRL_TRIM			4	/* Inform device that the data on the block of sectors is no longer used (needed at FF_USE_TRIM == 1) */
+#define GET_SECTOR_SHIFT	9	/* Get log2 of the sector size as BYTE (needed at FF_MAX_SS != FF_MIN_SS) */
 
 /* Generic command (Not used by FatFs) */
 #define CTRL_POWER			5	/* Get/Set power status */
 #define CTRL_LOCK			6	/* Lock/Unlock media removal */
 #define CTRL_EJECT			7	/* Eject media */
 #define CTRL_FORMAT			8	/* Create physical format on the media */
+#define GET_DISK_STATS		30	/* Copy the request counters of the drive to a DISK_STATS */
+#define CTRL_RESET_STATS	31	/* Clear the request counters of the drive, copying them to a DISK_STATS first unless buff is null */
 
 /* MMC/SDC specific ioctl command */
 #define MMC_GET_TYPE		10	/* Get card type */
@@ -67,6 +70,47 @@ DRESULT disk_ioctl (void* pdrv, BYTE cmd, void* buff);
 #define ATA_GET_MODEL		21	/* Get model name */
 #define ATA_GET_SN			22	/* Get serial number */
 
+
+
+/* Request counters of a drive (GET_DISK_STATS). They are 32 bits wide, the PowerPC has no 64-bit
+/  atomics without libatomic, and wrap around after 2^32 requests or sectors. */
+
+#define DISK_LAT_BUCKETS	12	/* Bucket n counts requests done in less than 64 << n us, the last one all slower ones */
+
+typedef struct {
+	DWORD	reads;			/* Read requests sent to the drive (raw IPC calls on the console) */
+	DWORD	writes;			/* Write requests sent to the drive */
+	DWORD	sectors_read;
+	DWORD	sectors_written;
+	DWORD	errors;			/* Requests the drive failed */
+	DWORD	read_lat[DISK_LAT_BUCKETS];		/* Latency histogram of the reads */
+	DWORD	write_lat[DISK_LAT_BUCKETS];	/* Latency histogram of the writes */
+} DISK_STATS;
+
+/* Counts a finished request, the queue workers call it from several threads */
+static inline void disk_stats_add (DISK_STATS* st, BYTE write, UINT count, QWORD usec, DRESULT res)
+{
+	UINT b = 0;
+
+	while (b < DISK_LAT_BUCKETS - 1 && usec >= (QWORD)64 << b) b++;
+	__atomic_fetch_add(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(write ? &st->sectors_written : &st->sectors_read, (DWORD)count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(write ? &st->write_lat[b] : &st->read_lat[b], 1, __ATOMIC_RELAXED);
+	if (res != RES_OK) __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+}
+
+/* Copies the counters (out != 0) and clears them (reset), each counter on its own */
+static inline void disk_stats_take (DISK_STATS* st, DISK_STATS* out, int reset)
+{
+	DWORD *src = (DWORD*)st, *dst = (DWORD*)out, v;
+	UINT i;
+
+	for (i = 0; i < sizeof (DISK_STATS) / sizeof (DWORD); i++) {
+		v = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		if (dst) dst[i] = v;
+	}
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,279 @@
+#include "diskqueue.h"
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Transfers are split into requests of this size and spread over the workers
+#define DQ_CHUNK_BYTES (256 * 1024)
+// Writes up to this size are copied and completed in the background
+#define DQ_WRITEBACK_MAX_BYTES (256 * 1024)
+// Memory for the copies of background writes, writers wait once it is used up
+#define DQ_WRITEBACK_BYTES (4 * 1024 * 1024)
+// Sequential reads fetch ahead in the background, starting with a small window that doubles on every
+// hit so metadata scans don't pull in whole megabytes they never use
+#define DQ_READAHEAD_MIN_BYTES (32 * 1024)
+#define DQ_READAHEAD_BYTES (1024 * 1024)
+// Raw FSA transfers need cache line aligned buffers
+#define DQ_BUFFER_ALIGN 0x40
+
+struct DqRequest {
+    BYTE* buff;
+    LBA_t sector;
+    UINT count;
+    BYTE write;
+    DQ_DONE_FUNC done;
+    void* arg;
+    uint64_t id;
+};
+
+// Write that was queued but hasn't reached the drive yet
+struct DqPendingWrite {
+    LBA_t sector;
+    UINT count;
+    uint64_t id;
+};
+
+// Requests of one synchronous transfer that the caller waits for
+struct DqGroup {
+    DISKQUEUE* q;
+    UINT remaining;
+    DRESULT result;
+};
+
+// Header in front of the copy of a background write
+struct DqStaged {
+    DISKQUEUE* q;
+    size_t size;
+    BYTE pad[DQ_BUFFER_ALIGN - sizeof(DISKQUEUE*) - sizeof(size_t)];
+};
+
+struct DISKQUEUE {
+    DQ_IO_FUNC io;
+    WORD ss;
+    UINT chunkSectors;
+    void* directChannel;
+
+    std::mutex mutex;
+    std::condition_variable workCv;
+    std::condition_variable doneCv;
+    std::deque<DqRequest> queue;
+    std::vector<DqPendingWrite> writes;
+    std::vector<std::thread> workers;
+    uint64_t nextWriteId = 1;
+    bool stop = false;
+
+    size_t stagedBytes = 0;
+    DRESULT writeError = RES_OK;
+
+    BYTE* raBuff = nullptr;
+    UINT raMax = 0;
+    UINT raMin = 0;
+    UINT raWindow = 0;
+    LBA_t raSector = 0;
+    UINT raCount = 0;
+    UINT raPending = 0;
+    bool raValid = false;
+    bool raStale = false;
+    DRESULT raResult = RES_OK;
+    LBA_t lastReadEnd = 0;
+};
+
+static bool overlaps(LBA_t a, UINT aCount, LBA_t b, UINT bCount) {
+    return a < b + bCount && b < a + aCount;
+}
+
+static bool write_pending(const DISKQUEUE* q, LBA_t sector, UINT count) {
+    for (const auto& w : q->writes) {
+        if (overlaps(sector, count, w.sector, w.count)) return true;
+    }
+    return false;
+}
+
+static void worker(DISKQUEUE* q, void* channel) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    while (true) {
+        q->workCv.wait(lock, [q] { return q->stop || !q->queue.empty(); });
+        if (q->queue.empty()) return;
+        DqRequest req = q->queue.front();
+        q->queue.pop_front();
+        lock.unlock();
+
+        DRESULT res = q->io(channel, req.buff, req.sector, req.count, req.write);
+        if (req.done) req.done(res, req.arg);
+
+        lock.lock();
+        if (req.write) {
+            q->writes.erase(std::find_if(q->writes.begin(), q->writes.end(), [&](const DqPendingWrite& w) { return w.id == req.id; }));
+        }
+        q->doneCv.notify_all();
+    }
+}
+
+static void submit_locked(DISKQUEUE* q, std::unique_lock<std::mutex>& lock, BYTE* buff, LBA_t sector, UINT count, BYTE write, DQ_DONE_FUNC done, void* arg) {
+    uint64_t id = 0;
+    if (write) {
+        // Overlapping writes have to reach the drive in order, and whatever was read ahead there is outdated now
+        q->doneCv.wait(lock, [&] { return !write_pending(q, sector, count); });
+        if (q->raCount != 0 && overlaps(sector, count, q->raSector, q->raCount)) {
+            q->raValid = false;
+            q->raStale = true;
+        }
+        id = q->nextWriteId++;
+        q->writes.push_back({sector, count, id});
+    }
+    q->queue.push_back({buff, sector, count, write, done, arg, id});
+    q->workCv.notify_one();
+}
+
+static void group_done(DRESULT res, void* arg) {
+    DqGroup* group = (DqGroup*)arg;
+    std::lock_guard<std::mutex> lock(group->q->mutex);
+    if (res != RES_OK) group->result = res;
+    group->remaining--;
+}
+
+// Splits a transfer over the workers and waits for all of its parts
+static DRESULT transfer_locked(DISKQUEUE* q, std::unique_lock<std::mutex>& lock, BYTE* buff, LBA_t sector, UINT count, BYTE write) {
+    DqGroup group = {q, 0, RES_OK};
+    for (UINT done = 0; done < count;) {
+        UINT n = std::min(q->chunkSectors, count - done);
+        group.remaining++;
+        submit_locked(q, lock, buff + (size_t)done * q->ss, sector + done, n, write, group_done, &group);
+        done += n;
+    }
+    q->doneCv.wait(lock, [&] { return group.remaining == 0; });
+    return group.result;
+}
+
+static void readahead_done(DRESULT res, void* arg) {
+    DISKQUEUE* q = (DISKQUEUE*)arg;
+    std::lock_guard<std::mutex> lock(q->mutex);
+    if (res != RES_OK) q->raResult = res;
+    if (--q->raPending == 0) q->raValid = !q->raStale && q->raResult == RES_OK;
+}
+
+static void start_readahead_locked(DISKQUEUE* q, std::unique_lock<std::mutex>& lock, LBA_t sector, UINT window) {
+    if (q->raBuff == nullptr || q->raPending != 0 || write_pending(q, sector, window)) return;
+    q->raWindow = window;
+    q->raSector = sector;
+    q->raCount = window;
+    q->raValid = false;
+    q->raStale = false;
+    q->raResult = RES_OK;
+    for (UINT done = 0; done < q->raCount; done += q->chunkSectors) {
+        q->raPending++;
+        submit_locked(q, lock, q->raBuff + (size_t)done * q->ss, sector + done, std::min(q->chunkSectors, q->raCount - done), 0, readahead_done, q);
+    }
+}
+
+static void staged_done(DRESULT res, void* arg) {
+    DqStaged* staged = (DqStaged*)arg;
+    DISKQUEUE* q = staged->q;
+    {
+        std::lock_guard<std::mutex> lock(q->mutex);
+        if (res != RES_OK && q->writeError == RES_OK) q->writeError = res;
+        q->stagedBytes -= staged->size;
+    }
+    free(staged);
+}
+
+DISKQUEUE* dq_create(DQ_IO_FUNC io, void* const* channels, UINT nchannels, WORD sectorSize) {
+    if (io == nullptr || nchannels == 0 || sectorSize == 0) return nullptr;
+    DISKQUEUE* q = new DISKQUEUE();
+    q->io = io;
+    q->ss = sectorSize;
+    q->chunkSectors = std::max<UINT>(1, DQ_CHUNK_BYTES / sectorSize);
+    q->directChannel = nchannels >= 2 ? channels[0] : nullptr;
+    q->raMax = std::max<UINT>(1, DQ_READAHEAD_BYTES / sectorSize);
+    q->raMin = std::max<UINT>(1, DQ_READAHEAD_MIN_BYTES / sectorSize);
+    q->raBuff = (BYTE*)memalign(DQ_BUFFER_ALIGN, (size_t)q->raMax * sectorSize);
+
+    for (UINT i = q->directChannel ? 1 : 0; i < nchannels; i++) q->workers.emplace_back(worker, q, channels[i]);
+    return q;
+}
+
+void dq_destroy(DISKQUEUE* q) {
+    if (q == nullptr) return;
+    dq_sync(q);
+    {
+        std::lock_guard<std::mutex> lock(q->mutex);
+        q->stop = true;
+    }
+    q->workCv.notify_all();
+    for (auto& t : q->workers) t.join();
+    free(q->raBuff);
+    delete q;
+}
+
+int dq_submit(DISKQUEUE* q, BYTE* buff, LBA_t sector, UINT count, BYTE write, DQ_DONE_FUNC done, void* arg) {
+    if (q == nullptr || count == 0) return -1;
+    std::unique_lock<std::mutex> lock(q->mutex);
+    submit_locked(q, lock, buff, sector, count, write, done, arg);
+    return 0;
+}
+
+DRESULT dq_read(DISKQUEUE* q, BYTE* buff, LBA_t sector, UINT count) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    // Data still on its way to the drive has to land first
+    q->doneCv.wait(lock, [&] { return !write_pending(q, sector, count); });
+
+    bool sequential = sector == q->lastReadEnd;
+    q->lastReadEnd = sector + count;
+    if (q->raCount != 0 && sector >= q->raSector && sector + count <= q->raSector + q->raCount) {
+        q->doneCv.wait(lock, [q] { return q->raPending == 0; });
+        if (q->raValid) {
+            memcpy(buff, q->raBuff + (size_t)(sector - q->raSector) * q->ss, (size_t)count * q->ss);
+            if (sector + count == q->raSector + q->raCount) start_readahead_locked(q, lock, sector + count, std::min(q->raWindow * 2, q->raMax));
+            return RES_OK;
+        }
+    }
+
+    DRESULT res;
+    if (q->directChannel != nullptr && count <= q->chunkSectors) {
+        lock.unlock();
+        res = q->io(q->directChannel, buff, sector, count, 0);
+        lock.lock();
+    }
+    else {
+        res = transfer_locked(q, lock, buff, sector, count, 0);
+    }
+    // Only streams of reads smaller than the window are worth fetching ahead, big ones are pipelined already
+    if (res == RES_OK && sequential && count < q->raMax) start_readahead_locked(q, lock, sector + count, std::min(std::max(q->raMin, count * 2), q->raMax));
+    return res;
+}
+
+DRESULT dq_write(DISKQUEUE* q, const BYTE* buff, LBA_t sector, UINT count) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (q->writeError != RES_OK) {
+        DRESULT res = q->writeError;
+        q->writeError = RES_OK;
+        return res;
+    }
+
+    size_t size = (size_t)count * q->ss;
+    if (size > DQ_WRITEBACK_MAX_BYTES) return transfer_locked(q, lock, (BYTE*)buff, sector, count, 1);
+
+    q->doneCv.wait(lock, [&] { return q->stagedBytes + size <= DQ_WRITEBACK_BYTES; });
+    DqStaged* staged = (DqStaged*)memalign(DQ_BUFFER_ALIGN, sizeof(DqStaged) + size);
+    if (staged == nullptr) return transfer_locked(q, lock, (BYTE*)buff, sector, count, 1);
+    staged->q = q;
+    staged->size = size;
+    memcpy(staged + 1, buff, size);
+    q->stagedBytes += size;
+    submit_locked(q, lock, (BYTE*)(staged + 1), sector, count, 1, staged_done, staged);
+    return RES_OK;
+}
+
+DRESULT dq_sync(DISKQUEUE* q) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    q->doneCv.wait(lock, [q] { return q->queue.empty() && q->writes.empty() && q->raPending == 0; });
+    DRESULT res = q->writeError;
+    q->writeError = RES_OK;
+    return res;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "ff.h"
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Queue of raw drive requests served by one worker thread per I/O channel (e.g. an FSA client with
+// its own raw handle), so the drive sees several requests in flight instead of one at a time.
+// On top of the queue, dq_read/dq_write/dq_sync give diskio a synchronous interface that pipelines
+// large transfers, completes small writes in the background and reads ahead on sequential access.
+
+typedef struct DISKQUEUE DISKQUEUE;
+
+// Performs one request on a channel, called from the worker thread that owns the channel
+typedef DRESULT (*DQ_IO_FUNC)(void* channel, BYTE* buff, LBA_t sector, UINT count, BYTE write);
+// Called from a worker thread once a request submitted with dq_submit finished
+typedef void (*DQ_DONE_FUNC)(DRESULT res, void* arg);
+
+// With two or more channels the first one is kept for small reads made directly on the calling thread
+DISKQUEUE* dq_create(DQ_IO_FUNC io, void* const* channels, UINT nchannels, WORD sectorSize);
+// Writes everything that is still queued and stops the workers
+void dq_destroy(DISKQUEUE* q);
+
+// Queues a request and returns right away, buff has to stay valid until done was called.
+// Writes overlapping an unfinished write are held back until it completed.
+int dq_submit(DISKQUEUE* q, BYTE* buff, LBA_t sector, UINT count, BYTE write, DQ_DONE_FUNC done, void* arg);
+
+DRESULT dq_read(DISKQUEUE* q, BYTE* buff, LBA_t sector, UINT count);
+// Small writes are copied and finish in the background, a failure is reported by the next dq_write or dq_sync
+DRESULT dq_write(DISKQUEUE* q, const BYTE* buff, LBA_t sector, UINT count);
+// Waits until every queued request reached the drive
+DRESULT dq_sync(DISKQUEUE* q);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,20 +4,34 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
-#include <vector>
 #include <string>
 #include <mutex>
+#include <thread>
+#include <atomic>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
 #include "ff.h"
 #include "diskio.h"
+#include "fatfs_mount_table.h"
+
+// Clusters loaded into the free cluster bitmap per volume lock, keeps other callers responsive
+#define FREEMAP_STEP_CLUSTERS (64 * 1024)
+// Zeros written per f_write when ftruncate grows a file, whole sectors go straight to the drive
+#define FATFS_ZERO_CHUNK (32 * 1024)
 
 struct FatfsMount {
     std::string name;
     std::string drive_prefix; // e.g. "1:"
+    int pdrv;
     FATFS *fs;
     devoptab_t *devoptab;
+    std::thread freemap_thread;
+    std::atomic<bool> freemap_stop{false};
+    std::atomic<int> refs{1};      // The table's, devoptab calls in progress and the open files and directories
+    std::atomic<bool> dead{false}; // Being unmounted, lookups don't hand it out anymore
 };
 
 // Structure for a file
@@ -33,8 +47,49 @@ typedef struct {
     FatfsMount *mount;
 } fatfs_dir_t;
 
-static std::vector<FatfsMount*> mounted_fs;
+// mount_mutex only serializes fatfs_mount/fatfs_unmount, path lookups don't take it
+static FatfsMountTable<FatfsMount, 16> mounted_fs;
 static std::mutex mount_mutex;
+// Mounts per drive that weren't freed yet, unmounted ones stay until their last file or directory is closed
+static std::atomic<int> drive_mounts[FF_VOLUMES];
+
+// Writes back what the volume still holds and frees it, once nothing references it anymore
+static void destroy_mount(FatfsMount *m) {
+#if FF_WRITE_BATCH
+    if (!m->fs->rdonly) f_batch(m->fs, 2); // Write back what batches left open hold, f_umount would discard it
+#endif
+    if (!m->fs->rdonly) f_syncvol(m->fs); // Marks the volume clean, else the next mount repairs it
+    f_umount(m->fs);
+    drive_mounts[m->pdrv].fetch_sub(1, std::memory_order_release);
+    free((void*)m->devoptab->name);
+    free(m->devoptab);
+    free(m->fs);
+    delete m;
+}
+
+static void put_mount(FatfsMount *m) {
+    if (mounted_fs.release(m)) destroy_mount(m);
+}
+
+// Holds a reference on a mount for the length of a call, the last one of an unmounted volume frees it
+class MountRef {
+public:
+    explicit MountRef(FatfsMount *m) : m(m) {}
+    ~MountRef() { if (m) put_mount(m); }
+    MountRef(const MountRef&) = delete;
+    MountRef& operator=(const MountRef&) = delete;
+    FatfsMount* operator->() const { return m; }
+    explicit operator bool() const { return m != nullptr; }
+    // Hands the reference over to an open file or directory
+    FatfsMount* detach() {
+        FatfsMount *d = m;
+        m = nullptr;
+        return d;
+    }
+
+private:
+    FatfsMount *m;
+};
 
 static int fatfs_to_errno(FRESULT res) {
     switch (res) {
@@ -62,17 +117,45 @@ static int fatfs_to_errno(FRESULT res) {
     }
 }
 
-static FatfsMount* get_mount_from_path(const char *path) {
-    std::string p(path);
-    size_t colon = p.find(':');
-    if (colon == std::string::npos) return nullptr;
-    std::string name = p.substr(0, colon);
+// newlib hands us the deviceData of the devoptab it picked for the path, so the path only has
+// to be matched when a call comes in without it. Either way the mount comes back referenced,
+// the deviceData pointer is checked against the table as its mount may be gone already.
+static FatfsMount* get_mount(struct _reent *r, const char *path) {
+    if (r->deviceData != nullptr) return mounted_fs.acquire((FatfsMount *)r->deviceData);
+    return mounted_fs.acquire(path);
+}
 
-    std::lock_guard<std::mutex> lock(mount_mutex);
-    for (const auto& m : mounted_fs) {
-        if (m->name == name) return m;
-    }
-    return nullptr;
+// Preferred I/O size of a volume: one cluster in the native sector size of the drive
+static blksize_t get_block_size(const FATFS *fs) {
+#if FF_MAX_SS != FF_MIN_SS
+    return (blksize_t)fs->csize << fs->sshift;
+#else
+    return (blksize_t)fs->csize * FF_MAX_SS;
+#endif
+}
+
+// FAT timestamps are local time with two second resolution
+static time_t fat_to_time(WORD fdate, WORD ftime) {
+    struct tm tm = {};
+    tm.tm_year = (fdate >> 9) + 80;
+    tm.tm_mon = ((fdate >> 5) & 15) - 1;
+    tm.tm_mday = fdate & 31;
+    tm.tm_hour = ftime >> 11;
+    tm.tm_min = (ftime >> 5) & 63;
+    tm.tm_sec = (ftime & 31) * 2;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static void fill_stat(struct stat *st, const FATFS *fs, FSIZE_t size, BYTE attrib) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_size = size;
+    st->st_mode = (attrib & AM_DIR) ? S_IFDIR : S_IFREG;
+    st->st_mode |= S_IRUSR | S_IRGRP | S_IROTH;
+    if (!fs->rdonly) st->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+    st->st_nlink = 1;
+    st->st_blksize = get_block_size(fs);
+    st->st_blocks = (st->st_size + 511) / 512; // st_blocks is always in 512-byte units
 }
 
 static const char* strip_prefix(const char *path) {
@@ -83,12 +166,11 @@ static const char* strip_prefix(const char *path) {
 
 static int _fatfs_open_r(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
     fatfs_file_t *file = (fatfs_file_t *)fileStruct;
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) {
         r->_errno = ENODEV;
         return -1;
     }
-    file->mount = m;
 
     BYTE fat_flags = 0;
     int accmode = (flags & O_ACCMODE);
@@ -113,21 +195,29 @@ static int _fatfs_open_r(struct _reent *r, void *fileStruct, const char *path, i
         return -1;
     }
 
+    file->mount = m.detach();
     return 0;
 }
 
+// Open files keep their mount, but once it is being unmounted only closing them is allowed
+static bool file_usable(struct _reent *r, FatfsMount *m) {
+    if (!m->dead.load(std::memory_order_acquire)) return true;
+    r->_errno = ENODEV;
+    return false;
+}
+
 static int _fatfs_close_r(struct _reent *r, void *fd) {
     fatfs_file_t *file = (fatfs_file_t *)fd;
     FRESULT res = f_close(&file->fil);
-    if (res != FR_OK) {
-        r->_errno = fatfs_to_errno(res);
-        return -1;
-    }
-    return 0;
+    // The descriptor is gone either way, on a pulled drive whatever f_close couldn't write is lost
+    if (res != FR_OK) r->_errno = file->mount->dead ? ENODEV : fatfs_to_errno(res);
+    put_mount(file->mount);
+    return res == FR_OK ? 0 : -1;
 }
 
 static ssize_t _fatfs_read_r(struct _reent *r, void *fd, char *ptr, size_t len) {
     fatfs_file_t *file = (fatfs_file_t *)fd;
+    if (!file_usable(r, file->mount)) return -1;
     UINT read = 0;
     FRESULT res = f_read(&file->fil, ptr, len, &read);
     if (res != FR_OK) {
@@ -139,6 +229,7 @@ static ssize_t _fatfs_read_r(struct _reent *r, void *fd, char *ptr, size_t len)
 
 static ssize_t _fatfs_write_r(struct _reent *r, void *fd, const char *ptr, size_t len) {
     fatfs_file_t *file = (fatfs_file_t *)fd;
+    if (!file_usable(r, file->mount)) return -1;
     UINT written = 0;
     FRESULT res = f_write(&file->fil, (void*)ptr, len, &written);
     if (res != FR_OK) {
@@ -150,6 +241,7 @@ static ssize_t _fatfs_write_r(struct _reent *r, void *fd, const char *ptr, size_
 
 static off_t _fatfs_seek_r(struct _reent *r, void *fd, off_t pos, int dir) {
     fatfs_file_t *file = (fatfs_file_t *)fd;
+    if (!file_usable(r, file->mount)) return -1;
     FSIZE_t target_pos = 0;
 
     switch (dir) {
@@ -169,17 +261,13 @@ static off_t _fatfs_seek_r(struct _reent *r, void *fd, off_t pos, int dir) {
 
 static int _fatfs_fstat_r(struct _reent *r, void *fd, struct stat *st) {
     fatfs_file_t *file = (fatfs_file_t *)fd;
-    memset(st, 0, sizeof(struct stat));
-    st->st_size = f_size(&file->fil);
-    st->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-    st->st_nlink = 1;
-    st->st_blksize = 512;
-    st->st_blocks = (st->st_size + 511) / 512;
+    if (!file_usable(r, file->mount)) return -1;
+    fill_stat(st, file->mount->fs, f_size(&file->fil), 0);
     return 0;
 }
 
 static int _fatfs_stat_r(struct _reent *r, const char *path, struct stat *st) {
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) { r->_errno = ENODEV; return -1; }
     FILINFO info;
     FRESULT res = f_stat(m->fs, strip_prefix(path), &info);
@@ -188,19 +276,13 @@ static int _fatfs_stat_r(struct _reent *r, const char *path, struct stat *st) {
         return -1;
     }
 
-    memset(st, 0, sizeof(struct stat));
-    st->st_size = info.fsize;
-    st->st_mode = (info.fattrib & AM_DIR) ? S_IFDIR : S_IFREG;
-    st->st_mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-    st->st_nlink = 1;
-    st->st_blksize = 512;
-    st->st_blocks = (st->st_size + 511) / 512;
-
+    fill_stat(st, m->fs, info.fsize, info.fattrib);
+    st->st_mtime = st->st_atime = st->st_ctime = fat_to_time(info.fdate, info.ftime);
     return 0;
 }
 
 static int _fatfs_unlink_r(struct _reent *r, const char *path) {
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) { r->_errno = ENODEV; return -1; }
     FRESULT res = f_unlink(m->fs, strip_prefix(path), 0); // 0 = files and directories
     if (res != FR_OK) {
@@ -211,7 +293,7 @@ static int _fatfs_unlink_r(struct _reent *r, const char *path) {
 }
 
 static int _fatfs_chdir_r(struct _reent *r, const char *path) {
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) { r->_errno = ENODEV; return -1; }
     FRESULT res = f_chdir(m->fs, strip_prefix(path));
     if (res != FR_OK) {
@@ -222,7 +304,7 @@ static int _fatfs_chdir_r(struct _reent *r, const char *path) {
 }
 
 static int _fatfs_rename_r(struct _reent *r, const char *oldName, const char *newName) {
-    FatfsMount *m = get_mount_from_path(oldName);
+    MountRef m(get_mount(r, oldName));
     if (!m) { r->_errno = ENODEV; return -1; }
     // newName should also be on the same mount.
     FRESULT res = f_rename(m->fs, strip_prefix(oldName), strip_prefix(newName));
@@ -234,7 +316,7 @@ static int _fatfs_rename_r(struct _reent *r, const char *oldName, const char *ne
 }
 
 static int _fatfs_mkdir_r(struct _reent *r, const char *path, int mode) {
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) { r->_errno = ENODEV; return -1; }
     FRESULT res = f_mkdir(m->fs, strip_prefix(path));
     if (res != FR_OK) {
@@ -246,30 +328,29 @@ static int _fatfs_mkdir_r(struct _reent *r, const char *path, int mode) {
 
 static DIR_ITER* _fatfs_diropen_r(struct _reent *r, DIR_ITER *dirState, const char *path) {
     fatfs_dir_t *dir = (fatfs_dir_t *)(dirState->dirStruct);
-    FatfsMount *m = get_mount_from_path(path);
+    MountRef m(get_mount(r, path));
     if (!m) { r->_errno = ENODEV; return NULL; }
-    dir->mount = m;
 
     FRESULT res = f_opendir(&dir->dir, m->fs, strip_prefix(path));
     if (res != FR_OK) {
         r->_errno = fatfs_to_errno(res);
         return NULL;
     }
+    dir->mount = m.detach();
     return dirState;
 }
 
 static int _fatfs_dirclose_r(struct _reent *r, DIR_ITER *dirState) {
     fatfs_dir_t *dir = (fatfs_dir_t *)(dirState->dirStruct);
     FRESULT res = f_closedir(&dir->dir);
-    if (res != FR_OK) {
-        r->_errno = fatfs_to_errno(res);
-        return -1;
-    }
-    return 0;
+    if (res != FR_OK) r->_errno = dir->mount->dead ? ENODEV : fatfs_to_errno(res);
+    put_mount(dir->mount);
+    return res == FR_OK ? 0 : -1;
 }
 
 static int _fatfs_dirnext_r(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *st) {
     fatfs_dir_t *dir = (fatfs_dir_t *)(dirState->dirStruct);
+    if (!file_usable(r, dir->mount)) return -1;
     FRESULT res = f_readdir(&dir->dir, &dir->info);
     if (res != FR_OK) {
         r->_errno = fatfs_to_errno(res);
@@ -278,59 +359,173 @@ static int _fatfs_dirnext_r(struct _reent *r, DIR_ITER *dirState, char *filename
 
     if (dir->info.fname[0] == 0) return -1; // End of directory
 
-    strncpy(filename, dir->info.fname, NAME_MAX);
+    size_t len = strnlen(dir->info.fname, NAME_MAX);
+    memcpy(filename, dir->info.fname, len);
+    filename[len] = '\0';
     if (st) {
-        memset(st, 0, sizeof(struct stat));
-        st->st_size = dir->info.fsize;
-        st->st_mode = (dir->info.fattrib & AM_DIR) ? S_IFDIR : S_IFREG;
-        st->st_mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-        st->st_nlink = 1;
-        st->st_blksize = 512;
-        st->st_blocks = (st->st_size + 511) / 512;
+        fill_stat(st, dir->mount->fs, dir->info.fsize, dir->info.fattrib);
+        st->st_mtime = st->st_atime = st->st_ctime = fat_to_time(dir->info.fdate, dir->info.ftime);
+    }
+
+    return 0;
+}
+
+static int _fatfs_statvfs_r(struct _reent *r, const char *path, struct statvfs *buf) {
+    MountRef m(get_mount(r, path));
+    if (!m) { r->_errno = ENODEV; return -1; }
+    // Constant time once the free cluster bitmap is loaded, otherwise this finishes loading it. Read-only
+    // volumes have no bitmap, they count the free clusters once and keep the count.
+    DWORD free_clusters = 0;
+    FRESULT res = f_getfree(m->fs, &free_clusters);
+    if (res != FR_OK) {
+        r->_errno = fatfs_to_errno(res);
+        return -1;
+    }
+
+    memset(buf, 0, sizeof(struct statvfs));
+    buf->f_bsize = get_block_size(m->fs);
+    buf->f_frsize = buf->f_bsize;
+    buf->f_blocks = m->fs->n_fatent - 2;
+    buf->f_bfree = free_clusters;
+    buf->f_bavail = free_clusters;
+    buf->f_flag = ST_NOSUID | (m->fs->rdonly ? ST_RDONLY : 0);
+    buf->f_namemax = FF_MAX_LFN;
+    return 0;
+}
+
+// Shrinking frees the clusters past the new end. Growing allocates them in one go first, so the file gets a
+// single run where the volume has one, then overwrites the grown part with zeros, the clusters still hold
+// whatever deleted files left in them.
+static int _fatfs_ftruncate_r(struct _reent *r, void *fd, off_t len) {
+    static const BYTE zeros[FATFS_ZERO_CHUNK] = {};
+    fatfs_file_t *file = (fatfs_file_t *)fd;
+    if (!file_usable(r, file->mount)) return -1;
+    if (len < 0) { r->_errno = EINVAL; return -1; }
+    if (!(file->fil.flag & FA_WRITE)) { r->_errno = EBADF; return -1; }
+
+    FSIZE_t pos = f_tell(&file->fil);
+    FSIZE_t size = f_size(&file->fil);
+    FRESULT res = f_lseek(&file->fil, (FSIZE_t)len); // Stretches the file in write mode
+    if (res == FR_OK && f_tell(&file->fil) != (FSIZE_t)len) res = FR_DENIED; // Volume full
+    if (res == FR_OK && (FSIZE_t)len < size) res = f_truncate(&file->fil);
+    if (res == FR_OK && (FSIZE_t)len > size) res = f_lseek(&file->fil, size);
+    for (FSIZE_t done = size; res == FR_OK && done < (FSIZE_t)len;) {
+        UINT chunk = (UINT)((FSIZE_t)len - done < sizeof(zeros) ? (FSIZE_t)len - done : sizeof(zeros));
+        UINT written = 0;
+        res = f_write(&file->fil, zeros, chunk, &written);
+        if (res == FR_OK && written != chunk) res = FR_DENIED;
+        done += written;
+    }
+    // Seeking back past the new end would grow the file again, so the position stops there
+    if (res == FR_OK) res = f_lseek(&file->fil, pos < (FSIZE_t)len ? pos : (FSIZE_t)len);
+    if (res != FR_OK) {
+        r->_errno = (res == FR_DENIED) ? ENOSPC : fatfs_to_errno(res);
+        return -1;
     }
+    return 0;
+}
 
+// Writes back the buffered data and directory entry of this file only, then drains the drive's write queue
+static int _fatfs_fsync_r(struct _reent *r, void *fd) {
+    fatfs_file_t *file = (fatfs_file_t *)fd;
+    if (!file_usable(r, file->mount)) return -1;
+    FRESULT res = f_sync(&file->fil);
+    if (res != FR_OK) {
+        r->_errno = fatfs_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+static int _fatfs_rmdir_r(struct _reent *r, const char *path) {
+    MountRef m(get_mount(r, path));
+    if (!m) { r->_errno = ENODEV; return -1; }
+    FRESULT res = f_unlink(m->fs, strip_prefix(path), 1); // 1 = directories only
+    if (res != FR_OK) {
+        r->_errno = fatfs_to_errno(res);
+        return -1;
+    }
+    return 0;
+}
+
+// FAT only keeps the modification time, the access time is ignored
+static int _fatfs_utimes_r(struct _reent *r, const char *filename, const struct timeval times[2]) {
+    MountRef m(get_mount(r, filename));
+    if (!m) { r->_errno = ENODEV; return -1; }
+
+    DWORD fattime = get_fattime();
+    if (times != nullptr) {
+        time_t mtime = times[1].tv_sec;
+        struct tm tm;
+        if (localtime_r(&mtime, &tm) == nullptr || tm.tm_year < 80 || tm.tm_year > 207) { r->_errno = EINVAL; return -1; }
+        fattime = (DWORD)(tm.tm_year - 80) << 25 | (DWORD)(tm.tm_mon + 1) << 21 | (DWORD)tm.tm_mday << 16 |
+                  (DWORD)tm.tm_hour << 11 | (DWORD)tm.tm_min << 5 | (DWORD)tm.tm_sec >> 1;
+    }
+    FILINFO info = {};
+    info.fdate = (WORD)(fattime >> 16);
+    info.ftime = (WORD)fattime;
+    FRESULT res = f_utime(m->fs, strip_prefix(filename), &info);
+    if (res != FR_OK) {
+        r->_errno = fatfs_to_errno(res);
+        return -1;
+    }
     return 0;
 }
 
 static const devoptab_t fatfs_devoptab = {
-    NULL, // name
-    sizeof(fatfs_file_t),
-    _fatfs_open_r,
-    _fatfs_close_r,
-    _fatfs_write_r,
-    _fatfs_read_r,
-    _fatfs_seek_r,
-    _fatfs_fstat_r,
-    _fatfs_stat_r,
-    NULL, // link_r
-    _fatfs_unlink_r,
-    _fatfs_chdir_r,
-    _fatfs_rename_r,
-    _fatfs_mkdir_r,
-    sizeof(fatfs_dir_t),
-    _fatfs_diropen_r,
-    _fatfs_dirclose_r,
-    _fatfs_dirnext_r,
-    NULL, // mount_r
-    NULL, // umount_r
-    NULL, // lstat_r
-    NULL  // utimes_r
+    .name         = NULL,
+    .structSize   = sizeof(fatfs_file_t),
+    .open_r       = _fatfs_open_r,
+    .close_r      = _fatfs_close_r,
+    .write_r      = _fatfs_write_r,
+    .read_r       = _fatfs_read_r,
+    .seek_r       = _fatfs_seek_r,
+    .fstat_r      = _fatfs_fstat_r,
+    .stat_r       = _fatfs_stat_r,
+    .link_r       = NULL,
+    .unlink_r     = _fatfs_unlink_r,
+    .chdir_r      = _fatfs_chdir_r,
+    .rename_r     = _fatfs_rename_r,
+    .mkdir_r      = _fatfs_mkdir_r,
+    .dirStateSize = sizeof(fatfs_dir_t),
+    .diropen_r    = _fatfs_diropen_r,
+    .dirreset_r   = NULL,
+    .dirnext_r    = _fatfs_dirnext_r,
+    .dirclose_r   = _fatfs_dirclose_r,
+    .statvfs_r    = _fatfs_statvfs_r,
+    .ftruncate_r  = _fatfs_ftruncate_r,
+    .fsync_r      = _fatfs_fsync_r,
+    .deviceData   = NULL,
+    .chmod_r      = NULL,
+    .fchmod_r     = NULL,
+    .rmdir_r      = _fatfs_rmdir_r,
+    .lstat_r      = _fatfs_stat_r, // No symbolic links on FAT
+    .utimes_r     = _fatfs_utimes_r,
 };
 
-bool fatfs_mount(const std::string& name, int pdrv) {
+// Loads the free cluster bitmap in the background so allocations and statvfs stop scanning the FAT
+static void freemap_worker(FatfsMount *m) {
+    DWORD left = 1;
+    while (left != 0 && !m->freemap_stop) {
+        if (f_buildfreemap(m->fs, FREEMAP_STEP_CLUSTERS, &left) != FR_OK) break;
+    }
+}
+
+bool fatfs_mount(const std::string& name, int pdrv, bool readOnly, int partition) {
+    if (pdrv < 0 || pdrv >= FF_VOLUMES) return false;
     std::lock_guard<std::mutex> lock(mount_mutex);
 
-    for (const auto& m : mounted_fs) {
-        if (m->name == name) return true;
-    }
+    if (mounted_fs.findName(name.c_str()) != nullptr) return true;
 
     FatfsMount *m = new FatfsMount();
     m->name = name;
     m->drive_prefix = std::to_string(pdrv) + ":";
-    m->fs = (FATFS *)malloc(sizeof(FATFS));
+    m->pdrv = pdrv;
+    m->fs = (FATFS *)calloc(1, sizeof(FATFS));
 
-    FRESULT res = f_mount(m->fs, (void*)m->drive_prefix.c_str(), 1);
+    FRESULT res = f_mount(m->fs, (void*)m->drive_prefix.c_str(), (UINT)partition | (readOnly ? FV_RDONLY : 0));
     if (res != FR_OK) {
+        f_umount(m->fs);
         free(m->fs);
         delete m;
         return false;
@@ -341,8 +536,9 @@ bool fatfs_mount(const std::string& name, int pdrv) {
     m->devoptab->name = strdup(name.c_str());
     m->devoptab->deviceData = m;
 
-    if (AddDevice(m->devoptab) < 0) {
-        f_mount(NULL, (void*)m->drive_prefix.c_str(), 0);
+    if (!mounted_fs.insert(m) || AddDevice(m->devoptab) < 0) {
+        mounted_fs.remove(m);
+        f_umount(m->fs);
         free((void*)m->devoptab->name);
         free(m->devoptab);
         free(m->fs);
@@ -350,23 +546,106 @@ bool fatfs_mount(const std::string& name, int pdrv) {
         return false;
     }
 
-    mounted_fs.push_back(m);
+    drive_mounts[pdrv].fetch_add(1, std::memory_order_relaxed);
+    // Nothing gets allocated on a read-only volume, so the bitmap would only cost memory
+    if (!readOnly) m->freemap_thread = std::thread(freemap_worker, m);
+    return true;
+}
+
+bool fatfs_batch(const std::string& path, bool on) {
+    MountRef m(mounted_fs.acquire(path.c_str()));
+    if (!m) return false;
+#if FF_WRITE_BATCH
+    return f_batch(m->fs, on ? 1 : 0) == FR_OK;
+#else
+    return false;
+#endif
+}
+
+bool fatfs_sync(const std::string& path) {
+    MountRef m(mounted_fs.acquire(path.c_str()));
+    if (!m) return false;
+    return f_syncvol(m->fs) == FR_OK;
+}
+
+int fatfs_trim(const std::string& path, uint64_t& bytes) {
+    bytes = 0;
+    MountRef m(mounted_fs.acquire(path.c_str()));
+    if (!m) return ENODEV;
+#if FF_USE_TRIM && FF_USE_FREEMAP
+    DWORD clusters = 0;
+    FRESULT res = f_trimfree(m->fs, &clusters);
+    bytes = (uint64_t)clusters * get_block_size(m->fs);
+    return res == FR_DENIED ? ENOTSUP : fatfs_to_errno(res);
+#else
+    return ENOTSUP;
+#endif
+}
+
+static_assert(FATFS_LATENCY_BUCKETS == DISK_LAT_BUCKETS, "fatfs_devoptab.h and diskio.h disagree on the latency buckets");
+
+bool fatfs_stats(const std::string& path, FatfsVolumeStats& stats, bool reset) {
+    MountRef m(mounted_fs.acquire(path.c_str()));
+    if (!m) return false;
+    stats = {};
+#if FF_USE_STATS
+    FFSTATS vs;
+    if (f_getstats(m->fs, &vs, reset ? 1 : 0) != FR_OK) return false;
+    stats.windowHits = vs.win_hits;
+    stats.windowLoads = vs.win_loads;
+    stats.fatLookups = vs.fat_lookups;
+    stats.fatCacheHits = vs.fcache_hits;
+    stats.fatCacheMisses = vs.fcache_misses;
+    stats.dirCacheHits = vs.dcache_hits;
+    stats.dirScans = vs.dir_scans;
+    stats.dirEntries = vs.dir_entries;
+    stats.pathCacheHits = vs.pcache_hits;
+    stats.pathCacheMisses = vs.pcache_misses;
+#endif
+    return true;
+}
+
+bool fatfs_drive_stats(const std::string& path, FatfsDriveStats& stats, bool reset) {
+    MountRef m(mounted_fs.acquire(path.c_str()));
+    if (!m) return false;
+    DISK_STATS ds;
+    WORD sectorSize = 0;
+    if (disk_ioctl(m->fs->pdrv, GET_SECTOR_SIZE, &sectorSize) != RES_OK) return false;
+    if (disk_ioctl(m->fs->pdrv, reset ? CTRL_RESET_STATS : GET_DISK_STATS, &ds) != RES_OK) return false;
+    stats.reads = ds.reads;
+    stats.writes = ds.writes;
+    stats.sectorsRead = ds.sectors_read;
+    stats.sectorsWritten = ds.sectors_written;
+    stats.bytesRead = stats.sectorsRead * sectorSize;
+    stats.bytesWritten = stats.sectorsWritten * sectorSize;
+    stats.errors = ds.errors;
+    for (int i = 0; i < FATFS_LATENCY_BUCKETS; i++) {
+        stats.readLatency[i] = ds.read_lat[i];
+        stats.writeLatency[i] = ds.write_lat[i];
+    }
     return true;
 }
 
 bool fatfs_unmount(const std::string& name) {
-    std::lock_guard<std::mutex> lock(mount_mutex);
-    for (auto it = mounted_fs.begin(); it != mounted_fs.end(); ++it) {
-        if ((*it)->name == name) {
-            f_mount(NULL, (void*)(*it)->drive_prefix.c_str(), 0);
-            RemoveDevice(name.c_str());
-            free((void*)(*it)->devoptab->name);
-            free((*it)->devoptab);
-            free((*it)->fs);
-            delete *it;
-            mounted_fs.erase(it);
-            return true;
-        }
+    FatfsMount *m;
+    {
+        std::lock_guard<std::mutex> lock(mount_mutex);
+        m = mounted_fs.findName(name.c_str());
+        if (m == nullptr) return false;
+        m->dead = true;
+        RemoveDevice(name.c_str());
+        mounted_fs.remove(m);
     }
-    return false;
+
+    // Nothing finds the mount anymore, so waiting doesn't hold up the mounts of other drives
+    m->freemap_stop = true;
+    if (m->freemap_thread.joinable()) m->freemap_thread.join();
+    // Calls already inside FatFs finish, open files and directories have to be closed by their owners and every
+    // other call on them fails with ENODEV. Whoever drops the last reference writes the volume back and frees it.
+    put_mount(m);
+    return true;
+}
+
+bool fatfs_drive_in_use(int pdrv) {
+    return pdrv >= 0 && pdrv < FF_VOLUMES && drive_mounts[pdrv].load(std::memory_order_acquire) != 0;
 }
@@ -1,5 +1,82 @@
 #pragma once
+#include <stdint.h>
 #include <string>
 
-bool fatfs_mount(const std::string& name, int pdrv);
+// readOnly refuses every write with EROFS and keeps the FAT sectors and the free space count in
+// memory for as long as the volume stays mounted, without ever writing to the drive (not even to
+// repair a volume that wasn't unmounted cleanly).
+// partition is the number f_findparts lists it with, 0 takes the first FAT volume on the drive
+// (the whole drive, or the first partition holding one).
+bool fatfs_mount(const std::string& name, int pdrv, bool readOnly = false, int partition = 0);
+// Takes the mount away from new calls right away. Files and directories still open on it fail with
+// ENODEV and keep it in memory until they are closed, the last close writes the volume back.
 bool fatfs_unmount(const std::string& name);
+// Whether a volume of drive pdrv is mounted or still kept by files left open after fatfs_unmount
+bool fatfs_drive_in_use(int pdrv);
+
+// Opens (on) or closes a batch on the FatFs volume holding path. While one is open, directory
+// and FAT sectors are written once when the last batch on the volume closes instead of with
+// every file, so a power loss in between can lose the files created in it. fsync() still writes
+// everything the batch holds and flushes the drive, the batch stays open.
+// Returns false when path isn't on a FatFs mount or the batch couldn't be opened or written.
+bool fatfs_batch(const std::string& path, bool on);
+
+// Writes what file syncs leave for later on the FatFs volume holding path (the 2nd FAT, FSInfo and
+// held back sectors) and marks it clean. Returns false when path isn't on a FatFs mount or on errors.
+bool fatfs_sync(const std::string& path);
+
+// Tells the drive holding path that all free space of the volume is unused, so flash drives can
+// erase it ahead of the next writes. bytes gets the amount discarded. Returns 0, ENOTSUP when the
+// drive has no discard command, or the errno of the failure.
+int fatfs_trim(const std::string& path, uint64_t& bytes);
+
+// Latency bucket n counts requests done in less than 64 << n us, the last one all slower ones
+#define FATFS_LATENCY_BUCKETS 12
+
+// Requests that reached a drive (raw FSA IPC calls on the console) since it was opened or the counters
+// were last reset. All volumes on the drive share them. The drive counts in 32 bits, so they wrap around.
+struct FatfsDriveStats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectorsRead;
+    uint64_t sectorsWritten;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t errors;
+    uint64_t readLatency[FATFS_LATENCY_BUCKETS];
+    uint64_t writeLatency[FATFS_LATENCY_BUCKETS];
+};
+
+// What the FatFs layer did on a volume since it was mounted or the counters were last reset
+struct FatfsVolumeStats {
+    uint64_t windowHits;     // Metadata sectors already in the sector window
+    uint64_t windowLoads;    // Sectors read into the sector window
+    uint64_t fatLookups;     // FAT entries followed (FAT walks)
+    uint64_t fatCacheHits;   // FAT sectors served by the cache of a read-only mount
+    uint64_t fatCacheMisses;
+    uint64_t dirCacheHits;   // Names found where the directory lookup cache remembered them
+    uint64_t dirScans;       // Names searched from the top of their directory
+    uint64_t dirEntries;     // Directory entries tested by those searches
+    uint64_t pathCacheHits;  // Paths resumed below the root by the path prefix cache
+    uint64_t pathCacheMisses;
+};
+
+// Fills stats for the FatFs volume holding path, reset clears its counters afterwards. Returns false
+// when path isn't on a FatFs mount.
+bool fatfs_stats(const std::string& path, FatfsVolumeStats& stats, bool reset = false);
+// The same for the drive of the volume holding path, reset clears them for every volume on it
+bool fatfs_drive_stats(const std::string& path, FatfsDriveStats& stats, bool reset = false);
+
+// Keeps a batch open on the volume holding path for the lifetime of the object, does nothing
+// for other paths
+class FatfsBatch {
+public:
+    explicit FatfsBatch(const std::string& path) : path(path), active(fatfs_batch(path, true)) {}
+    ~FatfsBatch() { if (active) fatfs_batch(path, false); }
+    FatfsBatch(const FatfsBatch&) = delete;
+    FatfsBatch& operator=(const FatfsBatch&) = delete;
+
+private:
+    std::string path;
+    bool active;
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+
+// Fixed-size registry of mounted volumes that maps a "name:/path" to its mount.
+// Lookups never allocate or lock, so they are safe on every devoptab call. Inserting
+// and removing entries must be serialized by the caller (see mount_mutex).
+// T needs a std::string-like `name` member, and for acquire() an std::atomic<int> `refs`
+// and an std::atomic<bool> `dead` member.
+template<typename T, size_t N>
+class FatfsMountTable {
+public:
+    // Only for callers that serialize with remove(), the mount can be freed right after
+    T* find(const char* path) const {
+        const char* colon = strchr(path, ':');
+        if (colon == nullptr) return nullptr;
+        size_t len = colon - path;
+        for (const auto& slot : slots) {
+            T* m = slot.mount.load(std::memory_order_acquire);
+            if (m != nullptr && m->name.size() == len && memcmp(m->name.data(), path, len) == 0) return m;
+        }
+        return nullptr;
+    }
+
+    T* findName(const char* name) const {
+        for (const auto& slot : slots) {
+            T* m = slot.mount.load(std::memory_order_acquire);
+            if (m != nullptr && m->name == name) return m;
+        }
+        return nullptr;
+    }
+
+    // Finds the mount for path and takes a reference on it, which keeps it from being freed
+    // until release(). Mounts marked dead are not handed out anymore.
+    T* acquire(const char* path) {
+        const char* colon = strchr(path, ':');
+        if (colon == nullptr) return nullptr;
+        size_t len = colon - path;
+        for (auto& slot : slots) {
+            T* m = pin(slot, [&](T* c) { return c->name.size() == len && memcmp(c->name.data(), path, len) == 0; });
+            if (m != nullptr) return m;
+        }
+        return nullptr;
+    }
+
+    // The same for a mount pointer that may be stale, like the deviceData newlib passes in
+    T* acquire(T* mount) {
+        for (auto& slot : slots) {
+            // Comparing the pointer doesn't touch the mount, only the slot holding it needs pinning
+            if (slot.mount.load(std::memory_order_relaxed) != mount) continue;
+            return pin(slot, [&](T* c) { return c == mount; });
+        }
+        return nullptr;
+    }
+
+    // Returns true when that was the last reference, the caller frees the mount then
+    static bool release(T* m) {
+        return m->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    bool insert(T* m) {
+        for (auto& slot : slots) {
+            if (slot.mount.load(std::memory_order_relaxed) == nullptr) {
+                slot.mount.store(m, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns once no lookup can still be looking at m, references taken before stay valid. The mount
+    // itself is the caller's to free, e.g. when the last reference goes.
+    void remove(T* m) {
+        for (auto& slot : slots) {
+            if (slot.mount.load(std::memory_order_relaxed) != m) continue;
+            slot.mount.store(nullptr, std::memory_order_seq_cst);
+            while (slot.readers.load(std::memory_order_seq_cst) != 0) std::this_thread::yield();
+        }
+    }
+
+    template<typename F>
+    void forEach(F&& func) const {
+        for (const auto& slot : slots) {
+            if (T* m = slot.mount.load(std::memory_order_acquire)) func(m);
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<T*> mount{nullptr};
+        std::atomic<unsigned> readers{0}; // Lookups between loading mount and taking the reference
+    };
+
+    // remove() waits for the readers of the slot, so the mount can't be freed while it's checked here
+    template<typename F>
+    static T* pin(Slot& slot, F&& match) {
+        slot.readers.fetch_add(1, std::memory_order_seq_cst);
+        T* m = slot.mount.load(std::memory_order_seq_cst);
+        if (m != nullptr && (!match(m) || m->dead.load(std::memory_order_acquire))) m = nullptr;
+        if (m != nullptr) m->refs.fetch_add(1, std::memory_order_acquire);
+        slot.readers.fetch_sub(1, std::memory_order_release);
+        return m;
+    }
+
+    Slot slots[N];
+};
@@ -0,0 +1,236 @@
+#include "fatfs_volumes.h"
+#include "fatfs_devoptab.h"
+#include "ff.h"
+#include "diskio.h"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// FAT partitions mounted per drive at most
+#define MAX_PARTITION_MOUNTS 8
+// How often a claimed drive is checked for files still open on its old mounts
+#define CLAIM_POLL_MS 10
+
+struct FatfsVolume {
+    FatfsVolumeConfig config;
+    std::string drive;         // "N:", the disk_* calls take the drive number as a string since 0 would be NULL
+    FatfsVolumeState state = FatfsVolumeState::Absent;
+    uint32_t sectorSize = 0;
+    uint64_t sectorCount = 0;
+    bool initialized = false;  // diskio has the drive open
+    bool tried = false;        // Mounting was already attempted since the drive showed up
+    bool claimed = false;
+    DWORD requests = 0;        // Requests and errors of the drive after the last probe, see probe()
+    DWORD errors = 0;
+    std::vector<std::string> mounts; // Devoptab names of the mounted FAT partitions, changed by the drive's thread only
+    std::thread thread;
+    alignas(0x40) BYTE probeBuffer[FF_MAX_SS];
+};
+
+static std::vector<std::unique_ptr<FatfsVolume>> volumes;
+static std::mutex volumes_mutex;
+static std::condition_variable volumes_cv;
+static uint32_t poll_interval_ms = 1000;
+static uint32_t generation = 0;
+static bool stopping = false;
+
+static FatfsVolume* find_volume(int pdrv) {
+    for (auto& v : volumes) {
+        if (v->config.pdrv == pdrv) return v.get();
+    }
+    return nullptr;
+}
+
+static void set_state(FatfsVolume* v, FatfsVolumeState state) {
+    if (v->state == state) return;
+    v->state = state;
+    generation++;
+    volumes_cv.notify_all();
+}
+
+static void unmount_all(const std::vector<std::string>& mounts) {
+    for (const auto& name : mounts) fatfs_unmount(name);
+}
+
+// Closes the drive after it went away or before it gets handed out, called without the lock held
+static void release_drive(FatfsVolume* v, const std::vector<std::string>& mounts) {
+    void* pdrv = (void*)v->drive.c_str();
+    unmount_all(mounts);
+    disk_ioctl(pdrv, CTRL_EJECT, NULL);
+}
+
+// Mounts every FAT partition of the drive, the first one under the configured name and the others with their
+// partition number appended ("usbp2"), so a FAT partition next to a Wii U one is reachable without a reformat
+static std::vector<std::string> mount_partitions(FatfsVolume* v) {
+    std::vector<std::string> mounts;
+    FFPART parts[MAX_PARTITION_MOUNTS];
+    UINT count = 0;
+    if (f_findparts((void*)v->drive.c_str(), parts, MAX_PARTITION_MOUNTS, &count, v->probeBuffer) != FR_OK) return mounts;
+    for (UINT i = 0; i < count; i++) {
+        if (parts[i].fs == 0) continue;
+        std::string name = mounts.empty() ? v->config.name : v->config.name + "p" + std::to_string(parts[i].part);
+        if (fatfs_mount(name, v->config.pdrv, v->config.readOnly, parts[i].part)) mounts.push_back(name);
+    }
+    return mounts;
+}
+
+// One probe of a drive. disk_* calls can take long, so they happen without the lock held.
+static void probe(FatfsVolume* v, std::unique_lock<std::mutex>& lock) {
+    void* pdrv = (void*)v->drive.c_str();
+    FatfsVolumeState state = v->state;
+    bool tried = v->tried;
+    std::vector<std::string> mounts = v->mounts;
+    lock.unlock();
+
+    LBA_t sectorCount = 0;
+    WORD sectorSize = 512;
+    // Files left open on the volumes of a drive that went away could still write to whatever gets plugged in
+    // next, so it's only picked up again once they are closed
+    bool attached = (v->initialized || !fatfs_drive_in_use(v->config.pdrv)) &&
+                    !(disk_initialize(pdrv) & (STA_NOINIT | STA_NODISK)) &&
+                    disk_ioctl(pdrv, GET_SECTOR_COUNT, &sectorCount) == RES_OK && sectorCount != 0;
+    if (attached) disk_ioctl(pdrv, GET_SECTOR_SIZE, &sectorSize);
+    // A drive that got swapped between two polls still answers GET_SECTOR_COUNT, reads through the old handle fail though.
+    // Requests FatFs got through since the last poll show that as well, and reading sector 0 in between would cut
+    // into the read-ahead of a file being streamed, so only idle drives and ones that failed requests are read.
+    DISK_STATS ds = {};
+    if (attached && v->initialized) {
+        disk_ioctl(pdrv, GET_DISK_STATS, &ds);
+        bool answered = !mounts.empty() && ds.reads + ds.writes != v->requests && ds.errors == v->errors;
+        attached = sectorCount == v->sectorCount && (answered || disk_read(pdrv, v->probeBuffer, 0, 1) == RES_OK);
+    }
+
+    bool mounted = state == FatfsVolumeState::Mounted;
+    if (!attached) {
+        if (mounted || v->initialized) release_drive(v, mounts);
+        mounts.clear();
+        mounted = false;
+        tried = false;
+    }
+    else if (!mounted && !tried && v->config.mount && !fatfs_drive_in_use(v->config.pdrv)) {
+        mounts = mount_partitions(v);
+        mounted = !mounts.empty();
+        tried = true;
+    }
+    // Taken after the probe's own requests, so only what FatFs does until the next poll counts
+    if (attached) disk_ioctl(pdrv, GET_DISK_STATS, &ds);
+
+    lock.lock();
+    v->initialized = attached;
+    v->tried = tried;
+    v->requests = ds.reads + ds.writes;
+    v->errors = ds.errors;
+    v->mounts = mounts;
+    v->sectorCount = attached ? sectorCount : 0;
+    v->sectorSize = attached ? sectorSize : 0;
+    set_state(v, mounted ? FatfsVolumeState::Mounted : attached ? FatfsVolumeState::Present : FatfsVolumeState::Absent);
+}
+
+static void volume_thread(FatfsVolume* v) {
+    std::unique_lock<std::mutex> lock(volumes_mutex);
+    while (!stopping) {
+        if (v->claimed) {
+            if (!v->mounts.empty()) {
+                // The claimer gets the drive initialized but not mounted
+                std::vector<std::string> mounts = v->mounts;
+                lock.unlock();
+                unmount_all(mounts);
+                lock.lock();
+                v->mounts.clear();
+                v->tried = false;
+                set_state(v, v->initialized ? FatfsVolumeState::Present : FatfsVolumeState::Absent);
+            }
+            if (v->state != FatfsVolumeState::Claimed) {
+                // Files still open on the old mounts write back when they are closed, until then the drive isn't free
+                if (fatfs_drive_in_use(v->config.pdrv)) {
+                    volumes_cv.wait_for(lock, std::chrono::milliseconds(CLAIM_POLL_MS), [v] { return stopping || !v->claimed; });
+                    continue;
+                }
+                set_state(v, FatfsVolumeState::Claimed);
+            }
+            volumes_cv.wait(lock, [v] { return stopping || !v->claimed; });
+            v->tried = false;
+            continue;
+        }
+
+        probe(v, lock);
+        volumes_cv.wait_for(lock, std::chrono::milliseconds(poll_interval_ms), [v] { return stopping || v->claimed; });
+    }
+
+    std::vector<std::string> mounts = v->mounts;
+    bool initialized = v->initialized;
+    lock.unlock();
+    if (!mounts.empty() || initialized) release_drive(v, mounts);
+}
+
+void fatfs_volumes_start(const std::vector<FatfsVolumeConfig>& configs, uint32_t pollMs) {
+    std::lock_guard<std::mutex> lock(volumes_mutex);
+    if (!volumes.empty()) return;
+    stopping = false;
+    poll_interval_ms = pollMs;
+    for (const auto& config : configs) {
+        auto v = std::make_unique<FatfsVolume>();
+        v->config = config;
+        v->drive = std::to_string(config.pdrv) + ":";
+        volumes.push_back(std::move(v));
+    }
+    // All drives get probed at once, a slow one doesn't hold up the others
+    for (auto& v : volumes) v->thread = std::thread(volume_thread, v.get());
+}
+
+void fatfs_volumes_stop() {
+    {
+        std::lock_guard<std::mutex> lock(volumes_mutex);
+        stopping = true;
+    }
+    volumes_cv.notify_all();
+    for (auto& v : volumes) {
+        if (v->thread.joinable()) v->thread.join();
+    }
+    std::lock_guard<std::mutex> lock(volumes_mutex);
+    volumes.clear();
+}
+
+std::vector<FatfsVolumeInfo> fatfs_volumes_list() {
+    std::lock_guard<std::mutex> lock(volumes_mutex);
+    std::vector<FatfsVolumeInfo> list;
+    for (const auto& v : volumes) list.push_back({v->config.pdrv, v->config.name, v->state, v->sectorSize, v->sectorCount, v->mounts});
+    return list;
+}
+
+uint32_t fatfs_volumes_generation() {
+    std::lock_guard<std::mutex> lock(volumes_mutex);
+    return generation;
+}
+
+bool fatfs_volumes_wait(int pdrv, uint32_t timeoutMs) {
+    std::unique_lock<std::mutex> lock(volumes_mutex);
+    FatfsVolume* v = find_volume(pdrv);
+    if (v == nullptr) return false;
+    return volumes_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [v] { return v->state == FatfsVolumeState::Mounted; });
+}
+
+bool fatfs_volumes_claim(int pdrv, uint32_t timeoutMs) {
+    std::unique_lock<std::mutex> lock(volumes_mutex);
+    FatfsVolume* v = find_volume(pdrv);
+    if (v == nullptr) return false;
+    bool claimedBefore = v->claimed;
+    v->claimed = true;
+    volumes_cv.notify_all();
+    if (volumes_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [v] { return v->state == FatfsVolumeState::Claimed; })) return true;
+    // The manager mounts the drive again once the files keeping it busy are closed
+    if (!claimedBefore) v->claimed = false;
+    volumes_cv.notify_all();
+    return false;
+}
+
+void fatfs_volumes_release(int pdrv) {
+    std::lock_guard<std::mutex> lock(volumes_mutex);
+    FatfsVolume* v = find_volume(pdrv);
+    if (v == nullptr || !v->claimed) return;
+    v->claimed = false;
+    volumes_cv.notify_all();
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Keeps the FatFs drives mounted as they come and go. Every drive gets a thread that probes it
+// (enumerating a USB drive can take seconds), mounts its FAT volume under the configured devoptab
+// name and polls it afterwards to notice when it gets unplugged or plugged back in.
+
+enum class FatfsVolumeState {
+    Absent,       // Nothing attached, or it didn't answer yet
+    Present,      // Attached, but not mounted (no FAT volume or mounting it is turned off)
+    Mounted,      // Reachable as "name:/", further FAT partitions as "namepN:/" (see mounts)
+    Claimed,      // Reserved by fatfs_volumes_claim for raw access
+};
+
+struct FatfsVolumeConfig {
+    int pdrv;
+    std::string name;
+    bool mount; // false only tracks whether the drive is there
+    bool readOnly = false; // mounts it with fatfs_mount's readOnly
+};
+
+struct FatfsVolumeInfo {
+    int pdrv;
+    std::string name;
+    FatfsVolumeState state;
+    uint32_t sectorSize;
+    uint64_t sectorCount;
+    std::vector<std::string> mounts; // Devoptab names of its mounted FAT partitions, name first
+};
+
+void fatfs_volumes_start(const std::vector<FatfsVolumeConfig>& configs, uint32_t pollMs);
+// Unmounts everything and stops the probing threads
+void fatfs_volumes_stop();
+
+// Snapshot of all drives, never waits for a probe
+std::vector<FatfsVolumeInfo> fatfs_volumes_list();
+// Counts every state change, menus can compare it to know when to redraw
+uint32_t fatfs_volumes_generation();
+// Waits until the drive got mounted, returns false if it didn't within timeoutMs
+bool fatfs_volumes_wait(int pdrv, uint32_t timeoutMs);
+
+// Unmounts the drive and keeps the manager away from it until fatfs_volumes_release, for
+// formatting or testing it through diskio directly. Returns once the drive is free, claiming it again is fine.
+// Files left open on its volumes keep it busy, returns false and leaves the drive to the manager if they
+// aren't closed within timeoutMs.
+bool fatfs_volumes_claim(int pdrv, uint32_t timeoutMs);
+// Probes the drive again, e.g. to mount a freshly formatted volume
+void fatfs_volumes_release(int pdrv);
@@ -22,9 +22,9 @@
 #include <string.h>
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
+#include "ffprofile.h"	/* Profiling segments (FF_USE_PROFILE) */
 
 #define LD2PD(vol) (vol)
-#define LD2PT(vol) 0
 
 #include <stdint.h>
 
@@ -79,6 +79,14 @@ static int get_ldnumber (const TCHAR** path)
 #define IsSurrogateL(c)	((c) >= 0xDC00 && (c) <= 0xDFFF)
 
 
+/* Profiled functions keep their body as name_body() behind a wrapper that accounts its time */
+#if FF_USE_PROFILE
+#define PROFILED(func)	func##_body
+#else
+#define PROFILED(func)	func
+#endif
+
+
 /* Additional file access control and file status flags for internal use */
 #define FA_SEEKEND	0x20	/* Seek to end of the file on file open */
 #define FA_MODIFIED	0x40	/* File has been modified */
@@ -270,6 +278,14 @@ static int get_ldnumber (const TCHAR** path)
 #endif
 
 
+/* Volume statistics (f_getstats), counted under the volume lock */
+#if FF_USE_STATS
+#define STAT_INC(fs, n)		((fs)->stats.n++)
+#else
+#define STAT_INC(fs, n)
+#endif
+
+
 /* Definitions of sector size */
 #if (FF_MAX_SS < FF_MIN_SS) || (FF_MAX_SS != 512 && FF_MAX_SS != 1024 && FF_MAX_SS != 2048 && FF_MAX_SS != 4096) || (FF_MIN_SS != 512 && FF_MIN_SS != 1024 && FF_MIN_SS != 2048 && FF_MIN_SS != 4096)
 #error Wrong sector size configuration
@@ -292,6 +308,23 @@ static int get_ldnumber (const TCHAR** path)
 #endif
 
 
+#if FF_USE_FREEMAP && FF_FS_READONLY
+#error FF_USE_FREEMAP must be 0 at read-only configuration
+#endif
+#if FF_LAZY_MIRROR && FF_FS_READONLY
+#error FF_LAZY_MIRROR must be 0 at read-only configuration
+#endif
+#if FF_USE_CHECK && FF_FS_READONLY
+#error FF_USE_CHECK must be 0 at read-only configuration
+#endif
+#if FF_WRITE_BATCH && (FF_FS_READONLY || !FF_FS_TINY)
+#error FF_WRITE_BATCH needs FF_FS_TINY and a writable configuration
+#endif
+#if FF_USE_TRIM && (FF_TRIM_BATCH < 1 || FF_TRIM_BATCH > 255)
+#error Wrong FF_TRIM_BATCH setting
+#endif
+
+
 /* File lock controls */
 #if FF_FS_LOCK
 #if FF_FS_READONLY
@@ -478,7 +511,7 @@ static WORD Fsid;					/* Filesystem mount ID */
 #if FF_FS_LOCK
 static FILESEM Files[FF_FS_LOCK];	/* Open object lock semaphores */
 #if FF_FS_REENTRANT
-static volatile BYTE SysLock;		/* System lock flag to protect Files[] (0:no mutex, 1:unlocked, 2:locked) */
+static volatile BYTE SysLock;		/* System lock flag to protect Files[] (0/1:unlocked, 2:locked), ffsystem.c creates the mutex at startup */
 static volatile FATFS* SysLockVolume;	/* Volume id who is locking Files[] */
 #endif
 #endif
@@ -915,6 +948,9 @@ static int lock_volume (	/* 1:Ok, 0:timeout */
 	}
 #else
 	rv = syslock ? ff_mutex_take(fs) : ff_mutex_take(fs);	/* Lock the volume (this is to prevent compiler warning) */
+#endif
+#if FF_USE_PROFILE
+	if (rv && fs->prof_depth++ == 0) fs->prof_start = ff_profile_ticks();	/* Outermost lock starts the "total" segment */
 #endif
 	return rv;
 }
@@ -931,6 +967,9 @@ static void unlock_volume (
 			SysLock = 1;
 			ff_mutex_give(NULL);
 		}
+#endif
+#if FF_USE_PROFILE
+		if (fs->prof_depth && --fs->prof_depth == 0) FF_PROFILE_STOP(FF_PROF_TOTAL, fs->prof_start);
 #endif
 		ff_mutex_give(fs);	/* Unlock the volume */
 	}
@@ -1051,6 +1090,162 @@ static void clear_share (	/* Clear all lock entries of the volume */
 
 
 
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Reflect a sector written into the 1st FAT to the 2nd FAT              */
+/*-----------------------------------------------------------------------*/
+
+static void mirror_fat (
+	FATFS* fs,			/* Filesystem object */
+	const BYTE* buf,	/* Sector data that was written */
+	LBA_t sect			/* Sector it was written to */
+)
+{
+	if (sect - fs->fatbase < fs->fsize && fs->n_fats == 2) {	/* Is it in the 1st FAT and is there a 2nd one? */
+#if FF_LAZY_MIRROR
+		if (fs->vflag == 1 && fs->mdirty) {	/* Copied by f_syncvol(), the volume is marked dirty until then */
+			sect -= fs->fatbase;
+			fs->mdirty[sect / 8] |= (BYTE)(1 << sect % 8);
+			return;
+		}
+#endif
+		disk_write(fs->pdrv, buf, sect + fs->fsize, 1);
+	}
+}
+#endif
+
+
+
+#if FF_WRITE_BATCH
+/*-----------------------------------------------------------------------*/
+/* Sectors held back by an open batch (f_batch)                          */
+/*-----------------------------------------------------------------------*/
+
+static int wb_find (	/* Slot holding the sector (-1:not held) */
+	FATFS* fs,
+	LBA_t sect
+)
+{
+	int i;
+
+	for (i = 0; i < FF_WRITE_BATCH; i++) {
+		if (fs->wbsect[i] == sect) return i;
+	}
+	return -1;
+}
+
+
+static FRESULT wb_write (	/* Write a slot into the volume and free it */
+	FATFS* fs,
+	int i
+)
+{
+	BYTE *buf = fs->wbuf + (UINT)i * SS(fs);
+	LBA_t sect = fs->wbsect[i];
+
+
+	if (disk_write(fs->pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;
+	mirror_fat(fs, buf, sect);
+	fs->wbsect[i] = (LBA_t)0 - 1;
+	return FR_OK;
+}
+
+
+static FRESULT wb_flush (	/* Write all held sectors in ascending order (FAT before directories) */
+	FATFS* fs
+)
+{
+	int i, n;
+
+
+	for (;;) {
+		for (n = 0, i = 1; i < FF_WRITE_BATCH; i++) {
+			if (fs->wbsect[i] < fs->wbsect[n]) n = i;
+		}
+		if (fs->wbsect[n] == (LBA_t)0 - 1) return FR_OK;	/* All slots are free */
+		if (wb_write(fs, n) != FR_OK) return FR_DISK_ERR;
+	}
+}
+
+
+static FRESULT wb_park (	/* Move the dirty window into its slot instead of writing it */
+	FATFS* fs
+)
+{
+	int i;
+
+
+	i = wb_find(fs, fs->winsect);
+	if (i < 0) {	/* Take a free slot */
+		i = wb_find(fs, (LBA_t)0 - 1);
+		if (i < 0) {	/* None free: write all of them in the order of the batch end, never a directory sector ahead of its FAT sectors */
+			if (wb_flush(fs) != FR_OK) return FR_DISK_ERR;
+			i = 0;
+		}
+		fs->wbsect[i] = fs->winsect;
+	}
+	memcpy(fs->wbuf + (UINT)i * SS(fs), fs->win, SS(fs));
+	fs->wflag = 0;
+	return FR_OK;
+}
+
+
+static int wb_load (	/* 1:The sector was held and is now in the window */
+	FATFS* fs,
+	LBA_t sect
+)
+{
+	int i = wb_find(fs, sect);
+
+
+	if (i < 0) return 0;
+	memcpy(fs->win, fs->wbuf + (UINT)i * SS(fs), SS(fs));
+	return 1;
+}
+
+
+static void wb_patch (	/* Replace the held sectors in a buffer read directly from the volume */
+	FATFS* fs,
+	BYTE* buf,
+	LBA_t sect,
+	UINT cnt
+)
+{
+	int i;
+
+	for (i = 0; i < FF_WRITE_BATCH; i++) {
+		if (fs->wbsect[i] - sect < cnt) memcpy(buf + (UINT)(fs->wbsect[i] - sect) * SS(fs), fs->wbuf + (UINT)i * SS(fs), SS(fs));
+	}
+}
+
+
+static void wb_drop (	/* Forget the held sectors in a range written directly to the volume */
+	FATFS* fs,
+	LBA_t sect,
+	UINT cnt
+)
+{
+	int i;
+
+	for (i = 0; i < FF_WRITE_BATCH; i++) {
+		if (fs->wbsect[i] - sect < cnt) fs->wbsect[i] = (LBA_t)0 - 1;
+	}
+}
+
+
+static void wb_reset (	/* Discard the batch (volume re-mounted or unregistered) */
+	FATFS* fs
+)
+{
+	if (fs->wbuf) ff_memfree(fs->wbuf);
+	fs->wbuf = 0;
+	fs->wbdepth = 0;
+}
+
+#endif /* FF_WRITE_BATCH */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
@@ -1063,11 +1258,12 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (fs->wflag) {	/* Is the disk access window dirty? */
+#if FF_WRITE_BATCH
+		if (fs->wbuf) return wb_park(fs);	/* Hold it back until the batch ends */
+#endif
 		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
 			fs->wflag = 0;	/* Clear window dirty flag */
-			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
-			}
+			mirror_fat(fs, fs->win, fs->winsect);	/* Reflect it to 2nd FAT if needed */
 		} else {
 			res = FR_DISK_ERR;
 		}
@@ -1077,7 +1273,7 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 #endif
 
 
-static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
+static FRESULT PROFILED(move_window) (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs,		/* Filesystem object */
 	LBA_t sect		/* Sector LBA to make appearance in the fs->win[] */
 )
@@ -1090,16 +1286,36 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 		res = sync_window(fs);		/* Flush the window */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
+#if FF_WRITE_BATCH
+			if (fs->wbuf && wb_load(fs, sect)) {	/* Held back by the batch, the volume has older data */
+				fs->winsect = sect;
+				return FR_OK;
+			}
+#endif
+			STAT_INC(fs, win_loads);
 			if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
 				sect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
 				res = FR_DISK_ERR;
 			}
 			fs->winsect = sect;
 		}
+	} else {
+		STAT_INC(fs, win_hits);
 	}
 	return res;
 }
 
+#if FF_USE_PROFILE
+static FRESULT move_window (FATFS* fs, LBA_t sect)
+{
+	FF_PROFILE_START(t0);
+	FRESULT rv = move_window_body(fs, sect);
+
+	FF_PROFILE_STOP(FF_PROF_MOVE_WINDOW, t0);
+	return rv;
+}
+#endif
+
 
 
 
@@ -1108,43 +1324,138 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 /* Synchronize filesystem and data on the storage                        */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
+static void sync_fsinfo (
 	FATFS* fs		/* Filesystem object */
 )
 {
-	FRESULT res;
-
-
-	res = sync_window(fs);
-	if (res == FR_OK) {
-		if (fs->fsi_flag == 1) {	/* Allocation changed? */
-			fs->fsi_flag = 0;
-			if (fs->fs_type == FS_FAT32) {	/* FAT32: Update FSInfo sector */
-				/* Create FSInfo structure */
-				memset(fs->win, 0, sizeof fs->win);
-				st_dword(fs->win + FSI_LeadSig, 0x41615252);		/* Leading signature */
-				st_dword(fs->win + FSI_StrucSig, 0x61417272);		/* Structure signature */
-				st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
-				st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
-				st_dword(fs->win + FSI_TrailSig, 0xAA550000);		/* Trailing signature */
-				disk_write(fs->pdrv, fs->win, fs->winsect = fs->volbase + 1, 1);	/* Write it into the FSInfo sector (Next to VBR) */
-			}
+	if (fs->fsi_flag == 1) {	/* Allocation changed? */
+		fs->fsi_flag = 0;
+		if (fs->fs_type == FS_FAT32) {	/* FAT32: Update FSInfo sector */
+			/* Create FSInfo structure */
+			memset(fs->win, 0, sizeof fs->win);
+			st_dword(fs->win + FSI_LeadSig, 0x41615252);		/* Leading signature */
+			st_dword(fs->win + FSI_StrucSig, 0x61417272);		/* Structure signature */
+			st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
+			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
+			st_dword(fs->win + FSI_TrailSig, 0xAA550000);		/* Trailing signature */
+			disk_write(fs->pdrv, fs->win, fs->winsect = fs->volbase + 1, 1);	/* Write it into the FSInfo sector (Next to VBR) */
+#if FF_WRITE_BATCH
+			if (fs->wbuf) wb_drop(fs, fs->winsect, 1);	/* A held back copy is older */
+#endif
+		}
 #if FF_FS_EXFAT
-			else if (fs->fs_type == FS_EXFAT) {	/* exFAT: Update PercInUse field in BPB */
-				if (disk_read(fs->pdrv, fs->win, fs->winsect = fs->volbase, 1) == RES_OK) {	/* Load VBR */
-					BYTE perc_inuse = (fs->free_clst <= fs->n_fatent - 2) ? (BYTE)((QWORD)(fs->n_fatent - 2 - fs->free_clst) * 100 / (fs->n_fatent - 2)) : 0xFF;	/* Precent in use 0-100 or 0xFF(unknown) */
+		else if (fs->fs_type == FS_EXFAT) {	/* exFAT: Update PercInUse field in BPB */
+			if (disk_read(fs->pdrv, fs->win, fs->winsect = fs->volbase, 1) == RES_OK) {	/* Load VBR */
+				BYTE perc_inuse = (fs->free_clst <= fs->n_fatent - 2) ? (BYTE)((QWORD)(fs->n_fatent - 2 - fs->free_clst) * 100 / (fs->n_fatent - 2)) : 0xFF;	/* Precent in use 0-100 or 0xFF(unknown) */
 
-					if (fs->win[BPB_PercInUseEx] != perc_inuse) {	/* Write it back into VBR if needed */
-						fs->win[BPB_PercInUseEx] = perc_inuse;
-						disk_write(fs->pdrv, fs->win, fs->winsect, 1);
-					}
+				if (fs->win[BPB_PercInUseEx] != perc_inuse) {	/* Write it back into VBR if needed */
+					fs->win[BPB_PercInUseEx] = perc_inuse;
+					disk_write(fs->pdrv, fs->win, fs->winsect, 1);
 				}
 			}
+		}
 #endif
+	}
+}
+
+
+#if FF_USE_TRIM
+/*-----------------------------------------------------------------------*/
+/* Discard freed clusters in batches                                     */
+/*-----------------------------------------------------------------------*/
+/* Freed cluster runs are collected instead of being discarded one by one.
+/  They have to reach the drive before any of the clusters is allocated
+/  again, else the discard could wipe the new data, so the allocators
+/  call trim_flush() first. A drive that does not support CTRL_TRIM is
+/  not asked again until the volume is re-mounted.
+*/
+
+static DRESULT trim_clusters (	/* Discard the data area of clusters scl..ecl */
+	FATFS* fs,
+	DWORD scl,		/* First cluster */
+	DWORD ecl		/* Last cluster */
+)
+{
+	DRESULT dr;
+	LBA_t rt[2];
+
+
+	rt[0] = fs->database + (LBA_t)fs->csize * (scl - 2);		/* Start of data area to be freed */
+	rt[1] = fs->database + (LBA_t)fs->csize * (ecl - 1) - 1;	/* End of data area to be freed */
+	dr = disk_ioctl(fs->pdrv, CTRL_TRIM, rt);	/* Inform storage device that the data in the block may be erased */
+	if (dr == RES_PARERR) fs->notrim = 1;
+	return dr;
+}
+
+
+static void trim_flush (	/* Discard the collected cluster runs */
+	FATFS* fs
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < fs->ntrim && !fs->notrim; i++) {
+		trim_clusters(fs, fs->trim[i][0], fs->trim[i][1]);	/* A failed discard only costs speed */
+	}
+	fs->ntrim = 0;
+}
+
+
+static void trim_add (	/* Collect a freed cluster run */
+	FATFS* fs,
+	DWORD scl,		/* First cluster */
+	DWORD ecl		/* Last cluster */
+)
+{
+	UINT i;
+
+
+	if (fs->notrim) return;
+	for (i = 0; i < fs->ntrim; i++) {	/* Merge it into an adjacent run */
+		if (fs->trim[i][1] + 1 == scl) {
+			fs->trim[i][1] = ecl; return;
+		}
+		if (ecl + 1 == fs->trim[i][0]) {
+			fs->trim[i][0] = scl; return;
 		}
-		/* Make sure that no pending write process in the lower layer */
-		if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
 	}
+	if (fs->ntrim == FF_TRIM_BATCH) trim_flush(fs);
+	fs->trim[fs->ntrim][0] = scl;
+	fs->trim[fs->ntrim][1] = ecl;
+	fs->ntrim++;
+}
+#endif
+
+
+static FRESULT flush_fs (	/* Write FSInfo and flush the drive once the FAT and directories are written */
+	FATFS* fs		/* Filesystem object */
+)
+{
+#if FF_USE_TRIM
+	if (fs->ntrim) trim_flush(fs);	/* The FAT freeing the clusters is written by now */
+#endif
+#if FF_LAZY_MIRROR
+	if (fs->vflag != 1)	/* Else FSInfo waits for f_syncvol(), the volume is marked dirty until then */
+#endif
+	sync_fsinfo(fs);
+	/* Make sure that no pending write process in the lower layer */
+	return disk_ioctl(fs->pdrv, CTRL_SYNC, 0) == RES_OK ? FR_OK : FR_DISK_ERR;
+}
+
+
+static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	FRESULT res;
+
+
+	res = sync_window(fs);
+#if FF_WRITE_BATCH
+	if (fs->wbuf) return res;	/* FSInfo and the drive flush wait for the end of the batch or f_sync() */
+#endif
+	if (res == FR_OK) res = flush_fs(fs);
 
 	return res;
 }
@@ -1153,6 +1464,117 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+#if FF_LAZY_MIRROR
+/*-----------------------------------------------------------------------*/
+/* Deferred 2nd FAT and the dirty volume flag                            */
+/*-----------------------------------------------------------------------*/
+
+#define CLNSHUT_OFS(fs)	((fs)->fs_type == FS_FAT32 ? 7 : 3)		/* Byte of FAT[1] with the clean shutdown bit */
+#define CLNSHUT_BIT(fs)	((fs)->fs_type == FS_FAT32 ? 0x08 : 0x80)	/* (FAT32: bit 27, FAT16: bit 15) */
+#define MIRROR_COPY		0x8000	/* Bytes per request when the 2nd FAT is rebuilt (>= FF_MAX_SS) */
+
+
+static void lazy_reset (	/* Forget the deferred sectors (volume re-mounted or unregistered) */
+	FATFS* fs
+)
+{
+	if (fs->mdirty) ff_memfree(fs->mdirty);
+	fs->mdirty = 0;
+	fs->vflag = 0x80;
+}
+
+
+static FRESULT mark_volume (	/* Set (1) or clear (0) the dirty flag, written at once past the batch */
+	FATFS* fs,
+	int dirty
+)
+{
+	BYTE *p;
+
+
+	if (move_window(fs, fs->fatbase) != FR_OK) return FR_DISK_ERR;
+	p = fs->win + CLNSHUT_OFS(fs);
+	*p = dirty ? (BYTE)(*p & ~CLNSHUT_BIT(fs)) : (BYTE)(*p | CLNSHUT_BIT(fs));
+	if (disk_write(fs->pdrv, fs->win, fs->fatbase, 1) != RES_OK) return FR_DISK_ERR;
+	if (!dirty && fs->n_fats == 2 && disk_write(fs->pdrv, fs->win, fs->fatbase + fs->fsize, 1) != RES_OK) return FR_DISK_ERR;	/* Both FATs are equal again */
+	fs->wflag = 0;
+#if FF_WRITE_BATCH
+	if (fs->wbuf) wb_drop(fs, fs->fatbase, 1);	/* The window is the newest copy */
+#endif
+	if (fs->mdirty) {
+		if (dirty) fs->mdirty[0] |= 1;	/* Other changes of this sector may have gone with it */
+		else fs->mdirty[0] &= (BYTE)~1;
+	}
+	fs->vflag = (BYTE)dirty;
+	return FR_OK;
+}
+
+
+static FRESULT sync_mirror (	/* Copy the changed sectors to the 2nd FAT, write FSInfo and mark the volume clean */
+	FATFS* fs
+)
+{
+	DWORD i;
+
+
+	for (i = 0; fs->mdirty && i < fs->fsize; i++) {
+		if (!fs->mdirty[i / 8]) {	/* Skip 8 clean sectors at once */
+			i |= 7;
+			continue;
+		}
+		if (fs->mdirty[i / 8] & (1 << i % 8)) {
+			if (move_window(fs, fs->fatbase + i) != FR_OK) return FR_DISK_ERR;
+			if (disk_write(fs->pdrv, fs->win, fs->fatbase + fs->fsize + i, 1) != RES_OK) return FR_DISK_ERR;
+			fs->mdirty[i / 8] &= (BYTE)~(1 << i % 8);
+		}
+	}
+	sync_fsinfo(fs);
+	if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;	/* Everything is on the medium before the flag says so */
+	return mark_volume(fs, 0);
+}
+
+
+static FRESULT repair_volume (	/* Rebuild the 2nd FAT and FSInfo if the volume was not marked clean, enables the flag */
+	FATFS* fs
+)
+{
+	DWORD n, szb;
+	BYTE *ibuf;
+	FRESULT res = FR_OK;
+
+
+	if (move_window(fs, fs->fatbase) != FR_OK) return FR_DISK_ERR;
+	fs->vflag = 0;
+	if (fs->win[CLNSHUT_OFS(fs)] & CLNSHUT_BIT(fs)) return FR_OK;	/* Clean shutdown */
+
+	if (fs->n_fats == 2) {	/* The 1st FAT is always written first, copy it over the 2nd one */
+		for (szb = MIRROR_COPY, ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
+		if (!ibuf) {
+			ibuf = fs->win; szb = SS(fs);	/* Use window buffer */
+		}
+		fs->winsect = (LBA_t)0 - 1;			/* The window may be overwritten */
+		szb /= SS(fs);						/* Bytes -> Sectors */
+		for (n = 0; res == FR_OK && n < fs->fsize; n += szb) {
+			if (szb > fs->fsize - n) szb = fs->fsize - n;
+			if (disk_read(fs->pdrv, ibuf, fs->fatbase + n, szb) != RES_OK || disk_write(fs->pdrv, ibuf, fs->fatbase + fs->fsize + n, szb) != RES_OK) res = FR_DISK_ERR;
+		}
+		if (ibuf != fs->win) ff_memfree(ibuf);
+		if (res != FR_OK) return res;
+	}
+
+	/* The free cluster count may be stale, it is counted again and FSInfo says unknown until then */
+	fs->last_clst = fs->free_clst = 0xFFFFFFFF;
+	if (fs->fsi_flag == 0) fs->fsi_flag = 1;
+	sync_fsinfo(fs);
+	if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
+	if (mark_volume(fs, 0) != FR_OK || disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
+	return FR_OK;
+}
+
+#endif /* FF_LAZY_MIRROR */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get physical sector number from cluster number                        */
 /*-----------------------------------------------------------------------*/
@@ -1170,80 +1592,321 @@ static LBA_t clst2sect (	/* !=0:Sector number, 0:Failed (invalid cluster#) */
 
 
 
-/*-----------------------------------------------------------------------*/
-/* FAT access - Read value of an FAT entry                               */
-/*-----------------------------------------------------------------------*/
+#if FF_FAT_CACHE
+/*-----------------------------------------------------------------------*/
+/* FAT access - Sector cache of read-only volumes                        */
+/*-----------------------------------------------------------------------*/
+/* Nothing changes the FAT of a volume mounted with FV_RDONLY, so the FAT
+/  sectors read by get_fat() are kept in a direct mapped cache until the
+/  volume is unmounted or re-mounted, without any invalidation. */
+
+static void fcache_reset (	/* Discard the cache (volume re-mounted or unregistered) */
+	FATFS* fs
+)
+{
+	if (fs->fcache) ff_memfree(fs->fcache);
+	fs->fcache = 0;
+}
+
+
+static void fcache_init (	/* Allocate the cache, the window is used without memory for it */
+	FATFS* fs
+)
+{
+	UINT i;
+
+
+	fs->fcache = ff_memalloc((UINT)FF_FAT_CACHE * SS(fs));
+	for (i = 0; i < FF_FAT_CACHE; i++) fs->fcsect[i] = (LBA_t)0 - 1;
+}
+#endif
+
+
+static BYTE* fat_sector (	/* Pointer to the FAT sector in memory (null:disk error) */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* FAT sector to get */
+)
+{
+#if FF_FAT_CACHE
+	UINT i;
+
+
+	if (fs->fcache) {
+		i = (UINT)((sect - fs->fatbase) % FF_FAT_CACHE);
+		if (fs->fcsect[i] != sect) {
+			STAT_INC(fs, fcache_misses);
+			fs->fcsect[i] = (LBA_t)0 - 1;
+			if (disk_read(fs->pdrv, fs->fcache + i * SS(fs), sect, 1) != RES_OK) return 0;
+			fs->fcsect[i] = sect;
+		} else {
+			STAT_INC(fs, fcache_hits);
+		}
+		return fs->fcache + i * SS(fs);
+	}
+#endif
+	return (move_window(fs, sect) == FR_OK) ? fs->win : 0;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Read value of an FAT entry                               */
+/*-----------------------------------------------------------------------*/
+
+static DWORD PROFILED(get_fat) (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluster status */
+	FFOBJID* obj,	/* Corresponding object */
+	DWORD clst		/* Cluster number to get the value */
+)
+{
+	UINT wc, bc;
+	DWORD val;
+	BYTE *p;
+	FATFS *fs = obj->fs;
+
+
+	if (clst < 2 || clst >= fs->n_fatent) {	/* Check if in valid range */
+		val = 1;	/* Internal error */
+
+	} else {
+		val = 0xFFFFFFFF;	/* Default value falls on disk error */
+		STAT_INC(fs, fat_lookups);
+
+		switch (fs->fs_type) {
+		case FS_FAT12 :
+			bc = (UINT)clst; bc += bc / 2;
+			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
+			wc = fs->win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
+			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
+			wc |= fs->win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
+			val = (clst & 1) ? (wc >> 4) : (wc & 0xFFF);	/* Adjust bit position */
+			break;
+
+		case FS_FAT16 :
+			if ((p = fat_sector(fs, fs->fatbase + (clst / (SS(fs) / 2)))) == 0) break;
+			val = ld_word(p + clst * 2 % SS(fs));		/* Simple WORD array */
+			break;
+
+		case FS_FAT32 :
+			if ((p = fat_sector(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+			val = ld_dword(p + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
+			break;
+#if FF_FS_EXFAT
+		case FS_EXFAT :
+			if ((obj->objsize != 0 && obj->sclust != 0) || obj->stat == 0) {	/* Object except root dir must have valid data length */
+				DWORD cofs = clst - obj->sclust;	/* Offset from start cluster */
+				DWORD clen = (DWORD)((LBA_t)((obj->objsize - 1) / SS(fs)) / fs->csize);	/* Number of clusters - 1 */
+
+				if (obj->stat == 2 && cofs <= clen) {	/* Is it a contiguous chain? */
+					val = (cofs == clen) ? 0x7FFFFFFF : clst + 1;	/* No data on the FAT, generate the value */
+					break;
+				}
+				if (obj->stat == 3 && cofs < obj->n_cont) {	/* Is it in the 1st fragment? */
+					val = clst + 1; 	/* Generate the value */
+					break;
+				}
+				if (obj->stat != 2) {	/* Get value from FAT if FAT chain is valid */
+					if (obj->n_frag != 0) {	/* Is it on the growing edge? */
+						val = 0x7FFFFFFF;	/* Generate EOC */
+					} else {
+						if ((p = fat_sector(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+						val = ld_dword(p + clst * 4 % SS(fs)) & 0x7FFFFFFF;
+					}
+					break;
+				}
+			}
+			val = 1;	/* Internal error */
+			break;
+#endif
+		default:
+			val = 1;	/* Internal error */
+		}
+	}
+
+	return val;
+}
+
+#if FF_USE_PROFILE
+static DWORD get_fat (FFOBJID* obj, DWORD clst)
+{
+	FF_PROFILE_START(t0);
+	DWORD rv = get_fat_body(obj, clst);
+
+	FF_PROFILE_STOP(FF_PROF_GET_FAT, t0);
+	return rv;
+}
+#endif
+
+
+
+
+#if FF_USE_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Free cluster bitmap                                                   */
+/*-----------------------------------------------------------------------*/
+
+static int fmap_done (	/* 1:Bitmap is complete and can replace the FAT/allocation bitmap scan */
+	FATFS* fs
+)
+{
+	return fs->fmap && fs->fmap_scan >= fs->n_fatent;
+}
+
+
+static void fmap_reset (	/* Discard the bitmap (volume re-mounted or unregistered) */
+	FATFS* fs
+)
+{
+	if (fs->fmap) ff_memfree(fs->fmap);
+	fs->fmap = 0;
+	fs->fmap_scan = 0;
+	fs->fmap_free = 0;
+}
+
+
+static int fmap_test (	/* 1:Cluster is in use, 0:Free */
+	FATFS* fs,
+	DWORD clst
+)
+{
+	clst -= 2;
+	return (fs->fmap[clst / 32] >> (clst % 32)) & 1;
+}
+
+
+static void fmap_put (	/* Reflect a change of the cluster status in the bitmap */
+	FATFS* fs,
+	DWORD clst,		/* First cluster changed */
+	DWORD ncl,		/* Number of clusters changed */
+	int used		/* New status (1:in use, 0:free) */
+)
+{
+	DWORD i, m, *p;
+
+
+	if (!fs->fmap) return;
+	for ( ; ncl && clst < fs->fmap_scan; clst++, ncl--) {	/* Clusters not loaded yet will be read from the FAT later */
+		i = clst - 2;
+		p = &fs->fmap[i / 32]; m = (DWORD)1 << (i % 32);
+		if (used) {
+			if (!(*p & m)) { *p |= m; fs->fmap_free--; }
+		} else {
+			if (*p & m) { *p &= ~m; fs->fmap_free++; }
+		}
+	}
+}
+
+
+static DWORD fmap_run (	/* Bit index of the first run of ncl free clusters in [bit, end), 0xFFFFFFFF:Not found */
+	FATFS* fs,
+	DWORD bit,
+	DWORD end,
+	DWORD ncl
+)
+{
+	DWORD w, run = 0;
+
+
+	while (bit < end) {
+		w = fs->fmap[bit / 32];
+		if (bit % 32 == 0 && end - bit >= 32) {	/* Skip whole words where possible */
+			if (w == 0xFFFFFFFF) {
+				run = 0; bit += 32; continue;
+			}
+			if (w == 0 && run + 32 < ncl) {
+				run += 32; bit += 32; continue;
+			}
+		}
+		if (w & ((DWORD)1 << (bit % 32))) {
+			run = 0;
+		} else {
+			if (++run == ncl) return bit + 1 - ncl;
+		}
+		bit++;
+	}
+	return 0xFFFFFFFF;
+}
+
+
+static DWORD fmap_find (	/* 0:Not found, 2..:Top of the free cluster block */
+	FATFS* fs,
+	DWORD clst,		/* Cluster number to scan from (next-fit, wraps around) */
+	DWORD ncl		/* Number of contiguous clusters to find (1..) */
+)
+{
+	DWORD nbit = fs->n_fatent - 2, bit, end;
+
+
+	bit = (clst >= 2 && clst < fs->n_fatent) ? clst - 2 : 0;
+	clst = fmap_run(fs, bit, nbit, ncl);
+	if (clst == 0xFFFFFFFF && bit > 0) {	/* Wrap around */
+		end = (bit + ncl - 1 < nbit) ? bit + ncl - 1 : nbit;
+		clst = fmap_run(fs, 0, end, ncl);
+	}
+	return (clst == 0xFFFFFFFF) ? 0 : clst + 2;
+}
+
 
-static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluster status */
-	FFOBJID* obj,	/* Corresponding object */
-	DWORD clst		/* Cluster number to get the value */
+static FRESULT fmap_load (	/* Load the cluster status up to cluster end into the bitmap */
+	FATFS* fs,
+	DWORD end
 )
 {
-	UINT wc, bc;
-	DWORD val;
-	FATFS *fs = obj->fs;
-
-
-	if (clst < 2 || clst >= fs->n_fatent) {	/* Check if in valid range */
-		val = 1;	/* Internal error */
+	FRESULT res = FR_OK;
+	DWORD clst, stat = 0, i;
+	UINT sz;
+	FFOBJID obj;
 
-	} else {
-		val = 0xFFFFFFFF;	/* Default value falls on disk error */
 
+	if (!fs->fmap) {	/* Allocate the bitmap at first call */
+		sz = (UINT)((fs->n_fatent - 2 + 31) / 32 * 4);
+		fs->fmap = ff_memalloc(sz);
+		if (!fs->fmap) return FR_NOT_ENOUGH_CORE;
+		memset(fs->fmap, 0, sz);
+		fs->fmap_scan = 2; fs->fmap_free = 0;
+	}
+	if (end > fs->n_fatent) end = fs->n_fatent;
+	obj.fs = fs;
+	for (clst = fs->fmap_scan; clst < end; clst++) {
 		switch (fs->fs_type) {
-		case FS_FAT12 :
-			bc = (UINT)clst; bc += bc / 2;
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc = fs->win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc |= fs->win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
-			val = (clst & 1) ? (wc >> 4) : (wc & 0xFFF);	/* Adjust bit position */
+		case FS_FAT12:
+			stat = get_fat(&obj, clst);
+			if (stat == 0xFFFFFFFF) res = FR_DISK_ERR;
+			if (stat == 1) res = FR_INT_ERR;
 			break;
-
-		case FS_FAT16 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2))) != FR_OK) break;
-			val = ld_word(fs->win + clst * 2 % SS(fs));		/* Simple WORD array */
+		case FS_FAT16:
+			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
+			stat = ld_word(fs->win + clst * 2 % SS(fs));
 			break;
-
-		case FS_FAT32 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-			val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
+		case FS_FAT32:
+			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
+			stat = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x0FFFFFFF;
 			break;
 #if FF_FS_EXFAT
-		case FS_EXFAT :
-			if ((obj->objsize != 0 && obj->sclust != 0) || obj->stat == 0) {	/* Object except root dir must have valid data length */
-				DWORD cofs = clst - obj->sclust;	/* Offset from start cluster */
-				DWORD clen = (DWORD)((LBA_t)((obj->objsize - 1) / SS(fs)) / fs->csize);	/* Number of clusters - 1 */
-
-				if (obj->stat == 2 && cofs <= clen) {	/* Is it a contiguous chain? */
-					val = (cofs == clen) ? 0x7FFFFFFF : clst + 1;	/* No data on the FAT, generate the value */
-					break;
-				}
-				if (obj->stat == 3 && cofs < obj->n_cont) {	/* Is it in the 1st fragment? */
-					val = clst + 1; 	/* Generate the value */
-					break;
-				}
-				if (obj->stat != 2) {	/* Get value from FAT if FAT chain is valid */
-					if (obj->n_frag != 0) {	/* Is it on the growing edge? */
-						val = 0x7FFFFFFF;	/* Generate EOC */
-					} else {
-						if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-						val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x7FFFFFFF;
-					}
-					break;
-				}
-			}
-			val = 1;	/* Internal error */
+		case FS_EXFAT:	/* The allocation bitmap has the same layout as fmap[] */
+			i = clst - 2;
+			res = move_window(fs, fs->bitbase + i / 8 / SS(fs));
+			stat = fs->win[i / 8 % SS(fs)] & (1 << (i % 8));
 			break;
 #endif
-		default:
-			val = 1;	/* Internal error */
+		}
+		if (res != FR_OK) break;
+		if (stat) {
+			i = clst - 2;
+			fs->fmap[i / 32] |= (DWORD)1 << (i % 32);
+		} else {
+			fs->fmap_free++;
 		}
 	}
-
-	return val;
+	fs->fmap_scan = clst;
+	if (res == FR_OK && clst >= fs->n_fatent && fs->free_clst != fs->fmap_free) {	/* Completed? */
+		fs->free_clst = fs->fmap_free;	/* The count is exact, so it replaces a stale FSInfo value */
+		fs->fsi_flag |= 1;
+	}
+	return res;
 }
 
+#endif /* FF_USE_FREEMAP */
 
 
 
@@ -1261,9 +1924,15 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 	UINT bc;
 	BYTE *p;
 	FRESULT res = FR_INT_ERR;
+#if FF_USE_FREEMAP
+	int used = (val & 0x0FFFFFFF) != 0;
+#endif
 
 
 	if (clst >= 2 && clst < fs->n_fatent) {	/* Check if in valid range */
+#if FF_LAZY_MIRROR
+		if (fs->vflag == 0 && mark_volume(fs, 1) != FR_OK) return FR_DISK_ERR;	/* Dirty before the first change */
+#endif
 		switch (fs->fs_type) {
 		case FS_FAT12:
 			bc = (UINT)clst; bc += bc / 2;	/* bc: byte offset of the entry */
@@ -1299,6 +1968,9 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if FF_USE_FREEMAP
+		if (res == FR_OK && fs->fs_type != FS_EXFAT) fmap_put(fs, clst, 1, used);
+#endif
 	}
 	return res;
 }
@@ -1328,6 +2000,9 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	DWORD val, scl, ctr;
 
 
+#if FF_USE_FREEMAP
+	if (fmap_done(fs)) return fmap_find(fs, clst, ncl);
+#endif
 	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
 	if (clst >= fs->n_fatent - 2) clst = 0;
 	scl = val = clst; ctr = 0;
@@ -1369,6 +2044,9 @@ static FRESULT change_bitmap (
 	LBA_t sect;
 
 
+#if FF_USE_FREEMAP
+	fmap_put(fs, clst, ncl, bv);	/* On error the volume is inconsistent anyway */
+#endif
 	clst -= 2;	/* The first bit corresponds to cluster #2 */
 	sect = fs->bitbase + clst / 8 / SS(fs);	/* Sector address */
 	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
@@ -1454,9 +2132,6 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 #if FF_FS_EXFAT || FF_USE_TRIM
 	DWORD scl = clst, ecl = clst;
 #endif
-#if FF_USE_TRIM
-	LBA_t rt[2];
-#endif
 
 	if (clst < 2 || clst >= fs->n_fatent) return FR_INT_ERR;	/* Check if in valid range */
 
@@ -1491,9 +2166,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			}
 #endif
 #if FF_USE_TRIM
-			rt[0] = clst2sect(fs, scl);					/* Start of data area to be freed */
-			rt[1] = clst2sect(fs, ecl) + fs->csize - 1;	/* End of data area to be freed */
-			disk_ioctl(fs->pdrv, CTRL_TRIM, rt);		/* Inform storage device that the data in the block may be erased */
+			trim_add(fs, scl, ecl);		/* The block is discarded at the next sync or allocation */
 #endif
 			scl = ecl = nxt;
 		}
@@ -1537,7 +2210,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 /* FAT handling - Stretch a chain or Create a new chain                  */
 /*-----------------------------------------------------------------------*/
 
-static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
+static DWORD PROFILED(create_chain) (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
 	FFOBJID* obj,		/* Corresponding object */
 	DWORD clst			/* Cluster# to stretch, 0:Create a new chain */
 )
@@ -1547,6 +2220,9 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	FATFS *fs = obj->fs;
 
 
+#if FF_USE_TRIM
+	if (fs->ntrim) trim_flush(fs);	/* The freed clusters could be taken again */
+#endif
 	if (clst == 0) {	/* Create a new chain */
 		scl = fs->last_clst;				/* Suggested cluster to start to find */
 		if (scl == 0 || scl >= fs->n_fatent) scl = 1;
@@ -1585,6 +2261,24 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 			}
 		}
 	} else
+#endif
+#if FF_USE_FREEMAP
+	if (fmap_done(fs)) {	/* On the FAT/FAT32 volume with a complete free cluster bitmap */
+		if (scl == clst && clst + 1 < fs->n_fatent && !fmap_test(fs, clst + 1)) {	/* Can the chain stay contiguous? */
+			ncl = clst + 1;
+		} else {
+			if (scl == clst) {					/* Start at suggested cluster if it is valid */
+				cs = fs->last_clst;
+				if (cs >= 2 && cs < fs->n_fatent) scl = cs;
+			}
+			ncl = fmap_find(fs, scl + 1, 1);	/* Next-fit search */
+			if (ncl == 0) return 0;				/* No free cluster found? */
+		}
+		res = put_fat(fs, ncl, 0xFFFFFFFF);		/* Mark the new cluster 'EOC' */
+		if (res == FR_OK && clst != 0) {
+			res = put_fat(fs, clst, ncl);		/* Link it from the previous one if needed */
+		}
+	} else
 #endif
 	{	/* On the FAT/FAT32 volume */
 		ncl = 0;
@@ -1632,6 +2326,167 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	return ncl;		/* Return new cluster number or error status */
 }
 
+#if FF_USE_PROFILE
+static DWORD create_chain (FFOBJID* obj, DWORD clst)
+{
+	FF_PROFILE_START(t0);
+	DWORD rv = create_chain_body(obj, clst);
+
+	FF_PROFILE_STOP(FF_PROF_CREATE_CHAIN, t0);
+	return rv;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch a chain by a run of contiguous clusters        */
+/*-----------------------------------------------------------------------*/
+
+static DWORD create_run (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:First cluster of the run */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst,			/* Cluster# to stretch, 0:Create a new chain */
+	DWORD ncl,			/* Number of clusters wanted (1..) */
+	DWORD* lcl			/* Returns the last cluster of the run */
+)
+{
+	DWORD cs;
+#if FF_USE_FREEMAP
+	DWORD scl;
+	FRESULT res = FR_OK;
+	FATFS *fs = obj->fs;
+#endif
+
+
+	*lcl = 0;
+#if FF_USE_FREEMAP
+	if (ncl >= 2 && clst != 0) {	/* (create_chain() checks this itself) */
+		cs = get_fat(obj, clst);			/* Check the cluster status */
+		if (cs < 2) return 1;				/* Test for insanity */
+		if (cs == 0xFFFFFFFF) return cs;	/* Test for disk error */
+		if (cs < fs->n_fatent) {			/* It is already followed by next cluster, nothing to allocate */
+			*lcl = cs;
+			return cs;
+		}
+	}
+	if (ncl >= 2 && !fmap_done(fs)) {	/* Finish the free cluster bitmap before allocating a run */
+		res = fmap_load(fs, fs->n_fatent);
+		if (res == FR_DISK_ERR) return 0xFFFFFFFF;
+	}
+	if (ncl < 2 || !fmap_done(fs))
+#endif
+	{	/* One cluster at a time without the free cluster bitmap */
+		cs = create_chain(obj, clst);
+		if (cs >= 2 && cs != 0xFFFFFFFF) *lcl = cs;
+		return cs;
+	}
+#if FF_USE_FREEMAP
+	if (ncl > fs->free_clst) ncl = fs->free_clst;	/* The count is exact once the bitmap is complete */
+	if (ncl == 0) return 0;					/* No free cluster */
+#if FF_USE_TRIM
+	if (fs->ntrim) trim_flush(fs);			/* The freed clusters could be taken again */
+#endif
+
+	/* First fit from the end of the chain, or the next-fit point for a new chain, shrunk until a run is found */
+	cs = (clst != 0) ? clst : fs->last_clst;
+	if (cs < 2 || cs >= fs->n_fatent) cs = 1;
+	while ((scl = fmap_find(fs, cs + 1, ncl)) == 0 && ncl > 1) ncl /= 2;
+	if (scl == 0) return 0;
+
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume, the FAT is only written for fragmented chains */
+		res = change_bitmap(fs, scl, ncl, 1);		/* Mark the run 'in use' */
+		if (res == FR_OK) {
+			if (clst == 0) {							/* Is it a new chain? */
+				obj->stat = 2;							/* Set status 'contiguous' */
+			} else if (obj->stat == 2 && scl != clst + 1) {	/* Is the chain got fragmented? */
+				obj->n_cont = clst - obj->sclust;		/* Set size of the contiguous part */
+				obj->stat = 3;							/* Change status 'just fragmented' */
+			}
+			if (obj->stat != 2) {	/* Is the file non-contiguous? */
+				if (scl == clst + 1) {	/* Does the run continue the last fragment? */
+					obj->n_frag = obj->n_frag ? obj->n_frag + ncl : ncl + 1;
+				} else {				/* New fragment */
+					if (obj->n_frag == 0) obj->n_frag = 1;
+					res = fill_last_frag(obj, clst, scl);	/* Fill last fragment on the FAT and link it to the run */
+					if (res == FR_OK) obj->n_frag = ncl;
+				}
+			}
+		}
+	} else
+#endif
+	{	/* On the FAT/FAT32 volume, the whole run is linked in one pass over its FAT sectors */
+		for (cs = scl; res == FR_OK && cs < scl + ncl - 1; cs++) {
+			res = put_fat(fs, cs, cs + 1);
+		}
+		if (res == FR_OK) res = put_fat(fs, scl + ncl - 1, 0xFFFFFFFF);	/* Mark the last cluster 'EOC' */
+		if (res == FR_OK && clst != 0) res = put_fat(fs, clst, scl);	/* Link it from the previous one if needed */
+	}
+	if (res != FR_OK) return (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
+
+	fs->last_clst = scl + ncl - 1;	/* Update allocation information */
+	if (fs->free_clst <= fs->n_fatent - 2) {
+		fs->free_clst -= ncl;
+		fs->fsi_flag |= 1;
+	}
+	*lcl = scl + ncl - 1;
+	return scl;
+#endif
+}
+
+
+static DWORD run_size (	/* Number of clusters to allocate at the growing edge of a file */
+	FFFIL* fp,
+	FSIZE_t nbyte		/* Number of bytes to be placed from the cluster boundary (1..) */
+)
+{
+	DWORD bcs = (DWORD)fp->obj.fs->csize * SS(fp->obj.fs);
+	FSIZE_t ncl = (nbyte - 1) / bcs + 1, ahead = fp->obj.objsize / bcs;
+
+
+	if (ahead > FF_ALLOC_AHEAD) ahead = FF_ALLOC_AHEAD;	/* Reserve as much as the file has up to the limit */
+	if (ncl < ahead) ncl = ahead;
+	if (ncl > fp->obj.fs->n_fatent) ncl = fp->obj.fs->n_fatent;	/* create_run() clips it at the free clusters */
+	return (DWORD)ncl;
+}
+
+
+static FRESULT trim_run (	/* Give back the clusters allocated past the end of the file */
+	FFFIL* fp
+)
+{
+	FRESULT res = FR_OK;
+	FATFS *fs = fp->obj.fs;
+	DWORD clst, n;
+
+
+	if (fp->run_end > fp->clust) {	/* The file pointer is on the last data cluster if there are any */
+		n = fp->run_end - fp->clust;
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {
+			res = change_bitmap(fs, fp->clust + 1, n, 0);
+			if (fp->obj.n_frag > n) fp->obj.n_frag -= n;	/* The last fragment ends on the current cluster */
+		} else
+#endif
+		{
+			res = put_fat(fs, fp->clust, 0xFFFFFFFF);
+			for (clst = fp->clust + 1; res == FR_OK && clst <= fp->run_end; clst++) {
+				res = put_fat(fs, clst, 0);
+			}
+		}
+		if (res == FR_OK) {
+			if (fs->free_clst <= fs->n_fatent - 2 - n) {	/* Update allocation information if it is valid */
+				fs->free_clst += n;
+				fs->fsi_flag |= 1;
+			}
+			if (fs->last_clst == fp->run_end) fs->last_clst = fp->clust;
+		}
+	}
+	fp->run_end = 0;
+	return res;
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -1685,6 +2540,9 @@ static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
 
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
+#if FF_WRITE_BATCH
+	if (fs->wbuf) wb_drop(fs, sect, fs->csize);	/* Held back contents of the cluster are stale */
+#endif
 	fs->winsect = sect;				/* Set window to top of the cluster */
 	memset(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
@@ -1821,9 +2679,10 @@ static FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DEN
 /* Directory handling - Reserve a block of directory entries             */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
+static FRESULT PROFILED(dir_alloc) (	/* FR_OK(0):succeeded, !=0:error */
 	FFDIR* dp,				/* Pointer to the directory object */
-	UINT n_ent				/* Number of contiguous entries to allocate */
+	UINT n_ent,				/* Number of contiguous entries to allocate */
+	DWORD ofs				/* Offset to start at, there is no block large enough before it */
 )
 {
 	FRESULT res;
@@ -1831,7 +2690,7 @@ static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	FATFS *fs = dp->obj.fs;
 
 
-	res = dir_sdi(dp, 0);
+	res = dir_sdi(dp, ofs);
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -1854,6 +2713,17 @@ static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	return res;
 }
 
+#if FF_USE_PROFILE
+static FRESULT dir_alloc (FFDIR* dp, UINT n_ent, DWORD ofs)
+{
+	FF_PROFILE_START(t0);
+	FRESULT rv = dir_alloc_body(dp, n_ent, ofs);
+
+	FF_PROFILE_STOP(FF_PROF_DIR_ALLOC, t0);
+	return rv;
+}
+#endif
+
 #endif	/* !FF_FS_READONLY */
 
 
@@ -2011,21 +2881,16 @@ static void put_lfn (
 /* FAT-LFN: Create a Numbered SFN                                        */
 /*-----------------------------------------------------------------------*/
 
-static void gen_numname (
-	BYTE* dst,			/* Pointer to the buffer to store numbered SFN */
-	const BYTE* src,	/* Pointer to SFN in directory form */
+static UINT numname_seq (	/* Returns the number to put into the SFN */
 	const WCHAR* lfn,	/* Pointer to LFN */
 	UINT seq			/* Sequence number */
 )
 {
-	BYTE ns[8], c;
-	UINT i, j;
+	UINT i;
 	WCHAR wc;
 	DWORD crc_sreg;
 
 
-	memcpy(dst, src, 11);	/* Prepare the SFN to be modified */
-
 	if (seq > 5) {	/* In case of many collisions, generate a hash number instead of sequential number */
 		crc_sreg = seq;
 		while (*lfn) {	/* Create a CRC value as a hash of LFN */
@@ -2038,6 +2903,21 @@ static void gen_numname (
 		}
 		seq = (UINT)crc_sreg;
 	}
+	return seq;
+}
+
+
+static void gen_numname (
+	BYTE* dst,			/* Pointer to the buffer to store numbered SFN */
+	const BYTE* src,	/* Pointer to SFN in directory form */
+	UINT seq			/* Number to append (see numname_seq) */
+)
+{
+	BYTE ns[8], c;
+	UINT i, j;
+
+
+	memcpy(dst, src, 11);	/* Prepare the SFN to be modified */
 
 	/* Make suffix (~ + hexdecimal) */
 	i = 7;
@@ -2386,15 +3266,180 @@ static FRESULT dir_read (
 			}
 #endif
 		}
-		res = dir_next(dp, 0);		/* Next entry */
-		if (res != FR_OK) break;
+		res = dir_next(dp, 0);		/* Next entry */
+		if (res != FR_OK) break;
+	}
+
+	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
+	return res;
+}
+
+#endif	/* FF_FS_MINIMIZE <= 1 || FF_USE_LABEL || FF_FS_RPATH >= 2 */
+
+
+
+#if FF_DIR_CACHE
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Lookup cache                                     */
+/*-----------------------------------------------------------------------*/
+/* Remembers where dir_find() found a name, keyed by the start cluster of the
+/  directory and a hash of the up-cased name. The offset is only a hint that
+/  dir_find() checks before it trusts it, so a stale slot costs a rescan but
+/  never gives a wrong result. */
+
+static DWORD dircache_hash (	/* Returns the hash of the name to find (never 0) */
+	FFDIR* dp					/* Directory object with the file name */
+)
+{
+	DWORD h = 2166136261;		/* FNV-1a */
+#if FF_USE_LFN
+	const WCHAR* lfn = dp->obj.fs->lfnbuf;
+
+	while (*lfn) h = (h ^ ff_wtoupper(*lfn++)) * 16777619;
+#else
+	UINT i;
+
+	for (i = 0; i < 11; i++) h = (h ^ dp->fn[i]) * 16777619;
+#endif
+	return h ? h : 1;
+}
+
+
+static FF_DIRCACHE* dircache_slot (
+	FATFS* fs,		/* Filesystem object */
+	DWORD clust,	/* Start cluster of the directory (0:root directory) */
+	DWORD hash		/* Name hash */
+)
+{
+	return &fs->dcache[(hash ^ clust * 0x9E3779B1) & (FF_DIR_CACHE - 1)];
+}
+
+
+static void dircache_put (
+	FATFS* fs,		/* Filesystem object */
+	DWORD clust,	/* Start cluster of the directory (0:root directory) */
+	DWORD hash,		/* Name hash */
+	DWORD ofs		/* Offset of the entry block in the directory */
+)
+{
+	FF_DIRCACHE* dc = dircache_slot(fs, clust, hash);
+
+	dc->clust = clust; dc->hash = hash; dc->ofs = ofs;
+}
+
+
+#if !FF_FS_READONLY
+static void dircache_drop (
+	FATFS* fs,		/* Filesystem object */
+	DWORD clust,	/* Start cluster of the directory (0:root directory) */
+	DWORD ofs		/* Offset of the removed entry block (0xFFFFFFFF:the whole directory is gone) */
+)
+{
+	UINT i;
+
+	for (i = 0; i < FF_DIR_CACHE; i++) {
+		if (fs->dcache[i].hash && fs->dcache[i].clust == clust && (ofs == 0xFFFFFFFF || fs->dcache[i].ofs == ofs)) {
+			fs->dcache[i].hash = 0;
+		}
+	}
+}
+#endif
+
+#endif	/* FF_DIR_CACHE */
+
+
+
+#if FF_PATH_CACHE
+/*-----------------------------------------------------------------------*/
+/* Path prefix cache                                                     */
+/*-----------------------------------------------------------------------*/
+/* Maps the hash of a directory path from the root to the directory object,
+/  so that follow_path() resumes at the deepest known ancestor instead of
+/  looking up every segment again. Unlike the lookup cache of dir_find() the
+/  slots are trusted as they are, so the whole table is dropped whenever a
+/  directory is moved, removed or (exFAT) changes its size. */
+
+static QWORD pathcache_next (	/* Returns the hash extended by the next segment of the path */
+	QWORD hash,					/* Hash of the path so far */
+	const TCHAR** path			/* Pointer to the segment, moved to the next one */
+)
+{
+	const TCHAR* p = *path;
+	DWORD c;
+
+	while (!IsSeparator(*p) && !IsTerminator(*p)) {
+		c = (DWORD)*p++;
+		if (IsLower(c)) c -= 0x20;		/* Only ASCII is folded, other case variants just get their own slot */
+		hash = (hash ^ c) * 0x100000001B3;	/* FNV-1a */
+	}
+	while (IsSeparator(*p)) p++;
+	*path = p;
+	return (hash ^ '/') * 0x100000001B3;
+}
+
+
+static const TCHAR* pathcache_find (	/* Returns the part of the path left to follow */
+	FFDIR* dp,				/* Directory object at the root directory, moved to the deepest known ancestor */
+	const TCHAR* path,		/* Path relative to the root directory */
+	QWORD* hash				/* Returns the hash of the skipped part */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	FF_PATHCACHE *pc, *hit = 0;
+	const TCHAR* rest = path;
+	QWORD h = 0xCBF29CE484222325;
+
+
+	*hash = h;
+	for (;;) {
+		h = pathcache_next(h, &path);
+		if (IsTerminator(*path)) break;		/* The last segment has to be looked up anyway */
+		pc = &fs->pcache[h & (FF_PATH_CACHE - 1)];
+		if (pc->hash == h) {
+			hit = pc; rest = path; *hash = h;
+		}
 	}
+	if (hit) {
+		dp->obj.sclust = hit->sclust;
+#if FF_FS_EXFAT
+		dp->obj.objsize = hit->objsize;
+		dp->obj.stat = hit->stat;
+		dp->obj.c_scl = hit->c_scl;
+		dp->obj.c_size = hit->c_size;
+		dp->obj.c_ofs = hit->c_ofs;
+#endif
+	}
+	return rest;
+}
 
-	if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
-	return res;
+
+static void pathcache_put (
+	FFDIR* dp,		/* Directory object that was just opened */
+	QWORD hash		/* Hash of its path */
+)
+{
+	FF_PATHCACHE *pc = &dp->obj.fs->pcache[hash & (FF_PATH_CACHE - 1)];
+
+	pc->hash = hash;
+	pc->sclust = dp->obj.sclust;
+#if FF_FS_EXFAT
+	pc->objsize = dp->obj.objsize;
+	pc->stat = dp->obj.stat;
+	pc->c_scl = dp->obj.c_scl;
+	pc->c_size = dp->obj.c_size;
+	pc->c_ofs = dp->obj.c_ofs;
+#endif
 }
 
-#endif	/* FF_FS_MINIMIZE <= 1 || FF_USE_LABEL || FF_FS_RPATH >= 2 */
+
+static void pathcache_clear (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	memset(fs->pcache, 0, sizeof fs->pcache);
+}
+
+#endif	/* FF_PATH_CACHE */
 
 
 
@@ -2402,8 +3447,10 @@ static FRESULT dir_read (
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
-	FFDIR* dp					/* Pointer to the directory object with the file name */
+static FRESULT dir_scan (	/* FR_OK(0):succeeded, !=0:error */
+	FFDIR* dp,				/* Pointer to the directory object with the file name */
+	DWORD ofs,				/* Offset to start the search at */
+	int single				/* 0:Search to the end of the directory, 1:Only test the entry block at ofs */
 )
 {
 	FRESULT res;
@@ -2413,7 +3460,7 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	BYTE a, ord, sum;
 #endif
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
+	res = dir_sdi(dp, ofs);			/* Rewind directory object */
 	if (res != FR_OK) return res;
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
@@ -2422,6 +3469,8 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
 
 		while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
+			if (single && dp->blk_ofs != ofs) { res = FR_NO_FILE; break; }	/* Left the entry block to test */
+			STAT_INC(fs, dir_entries);
 #if FF_MAX_LFN < 255
 			if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) continue;		/* Skip comparison if inaccessible object name */
 #endif
@@ -2440,8 +3489,14 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
 	do {
+#if FF_USE_LFN
+		if (single && ord == 0xFF && dp->dptr != ofs) { res = FR_NO_FILE; break; }	/* Left the entry block to test */
+#else
+		if (single && dp->dptr != ofs) { res = FR_NO_FILE; break; }
+#endif
 		res = move_window(fs, dp->sect);
 		if (res != FR_OK) break;
+		STAT_INC(fs, dir_entries);
 		c = dp->dir[DIR_Name];
 		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached end of directory table */
 #if FF_USE_LFN		/* LFN configuration */
@@ -2477,6 +3532,127 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 }
 
 
+static FRESULT PROFILED(dir_find) (	/* FR_OK(0):succeeded, !=0:error */
+	FFDIR* dp					/* Pointer to the directory object with the file name */
+)
+{
+#if FF_DIR_CACHE
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DWORD hash = 0;
+	FF_DIRCACHE* dc;
+
+
+	if (!(dp->fn[NSFLAG] & NS_NOLFN)) {	/* SFN-only lookups are never cached */
+		hash = dircache_hash(dp);
+		dc = dircache_slot(fs, dp->obj.sclust, hash);
+		if (dc->hash == hash && dc->clust == dp->obj.sclust) {	/* Seen it before? */
+			res = dir_scan(dp, dc->ofs, 1);		/* Test the remembered entry block */
+			if (res == FR_OK) STAT_INC(fs, dcache_hits);
+			if (res == FR_OK || res == FR_DISK_ERR) return res;
+		}
+	}
+	STAT_INC(fs, dir_scans);
+	res = dir_scan(dp, 0, 0);
+	if (res == FR_OK && hash) {
+#if FF_USE_LFN
+		dircache_put(fs, dp->obj.sclust, hash, dp->blk_ofs != 0xFFFFFFFF ? dp->blk_ofs : dp->dptr);
+#else
+		dircache_put(fs, dp->obj.sclust, hash, dp->dptr);
+#endif
+	}
+	return res;
+#else
+	STAT_INC(dp->obj.fs, dir_scans);
+	return dir_scan(dp, 0, 0);
+#endif
+}
+
+#if FF_USE_PROFILE
+static FRESULT dir_find (FFDIR* dp)
+{
+	FF_PROFILE_START(t0);
+	FRESULT rv = dir_find_body(dp);
+
+	FF_PROFILE_STOP(FF_PROF_DIR_FIND, t0);
+	return rv;
+}
+#endif
+
+
+
+
+#if FF_USE_LFN && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT-LFN: Find the Numbered SFNs Taken in the Directory                */
+/*-----------------------------------------------------------------------*/
+/* Instead of looking up BODY~1, BODY~2... one after another, every SFN
+/  entry with a ~ suffix is matched against the numbers 1-99 once. The
+/  same pass finds where dir_alloc can start, so a create with a numbered
+/  SFN costs a single pass over the directory however many names collide.
+*/
+
+#define NUMNAME_MAX	100		/* Sequence numbers 1-99 are tried */
+
+static FRESULT find_numnames (	/* FR_OK:succeeded, FR_DISK_ERR:disk error */
+	FFDIR* dp,			/* Directory to scan */
+	const BYTE* sn,		/* SFN in directory form the numbered names are made of */
+	UINT n_ent,			/* Number of contiguous entries the name needs */
+	BYTE* used,			/* Bit n is set if sequence number n is taken */
+	DWORD* alloc_ofs	/* Offset dir_alloc can start at */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	WORD hash[NUMNAME_MAX - 6];	/* Numbers of the sequences 6-99 (numname_seq) */
+	BYTE fn[11], c, hashed = 0;
+	DWORD num, run_ofs = 0;
+	UINT i, n, run = 0;
+
+
+	memset(used, 0, (NUMNAME_MAX + 7) / 8);
+	*alloc_ofs = 0xFFFFFFFF;
+	res = dir_sdi(dp, 0);
+	while (res == FR_OK) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+		if (c == 0) {			/* Reached end of directory table */
+			if (*alloc_ofs == 0xFFFFFFFF) *alloc_ofs = run ? run_ofs : dp->dptr;
+			break;
+		}
+		if (c == DDEM) {		/* Free entry */
+			if (run++ == 0) run_ofs = dp->dptr;
+			if (run >= n_ent && *alloc_ofs == 0xFFFFFFFF) *alloc_ofs = run_ofs;	/* First block large enough */
+		} else {
+			run = 0;
+			if (!(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir + 8, sn + 8, 3)) {	/* SFN with the same extension? */
+				for (i = 8; i && dp->dir[i - 1] != '~'; i--) ;	/* Find the suffix, digits and spaces follow the last ~ */
+				for (num = 0; i && i < 8 && dp->dir[i] != ' '; i++) {	/* Get the number */
+					c = dp->dir[i];
+					if (!IsDigit(c) && (c < 'A' || c > 'F')) break;
+					num = num * 16 + (c <= '9' ? c - '0' : c - 'A' + 10);
+				}
+				if (i && (i == 8 || dp->dir[i] == ' ')) {
+					if (!hashed) {	/* Hash the LFN only once there is a candidate */
+						for (n = 6; n < NUMNAME_MAX; n++) hash[n - 6] = (WORD)numname_seq(fs->lfnbuf, n);
+						hashed = 1;
+					}
+					for (n = 1; n < NUMNAME_MAX; n++) {
+						if ((n <= 5 ? n : hash[n - 6]) != num) continue;
+						gen_numname(fn, sn, num);
+						if (!memcmp(dp->dir, fn, 11)) used[n / 8] |= 1 << (n % 8);	/* Collides with this SFN? */
+					}
+				}
+			}
+		}
+		res = dir_next(dp, 0);	/* Next entry */
+	}
+	if (*alloc_ofs == 0xFFFFFFFF) *alloc_ofs = 0;	/* Table is full, dir_alloc has to stretch it */
+	return res == FR_NO_FILE ? FR_OK : res;
+}
+#endif	/* FF_USE_LFN && !FF_FS_READONLY */
+
 
 
 #if !FF_FS_READONLY
@@ -2484,7 +3660,7 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 /* Register an object to the directory                                   */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many SFN collision, FR_DISK_ERR:disk error */
+static FRESULT PROFILED(dir_register) (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many SFN collision, FR_DISK_ERR:disk error */
 	FFDIR* dp						/* Target directory with object name to be created */
 )
 {
@@ -2492,6 +3668,7 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	FATFS *fs = dp->obj.fs;
 #if FF_USE_LFN		/* LFN configuration */
 	UINT n, len, n_ent;
+	DWORD ofs;
 	BYTE sn[12], sum;
 
 
@@ -2501,12 +3678,15 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
 		n_ent = (len + 14) / 15 + 2;	/* Number of entries to allocate (85+C0+C1s) */
-		res = dir_alloc(dp, n_ent);		/* Allocate directory entries */
+		res = dir_alloc(dp, n_ent, 0);	/* Allocate directory entries */
 		if (res != FR_OK) return res;
 		dp->blk_ofs = dp->dptr - SZDIRE * (n_ent - 1);	/* Set the allocated entry block offset */
 
 		if (dp->obj.stat & 4) {			/* Has the directory been stretched by new allocation? */
 			dp->obj.stat &= ~4;
+#if FF_PATH_CACHE
+			pathcache_clear(fs);		/* Cached objects of the directory have the old size */
+#endif
 			res = fill_first_frag(&dp->obj);	/* Fill the first fragment on the FAT if needed */
 			if (res != FR_OK) return res;
 			res = fill_last_frag(&dp->obj, dp->clust, 0xFFFFFFFF);	/* Fill the last fragment on the FAT if needed */
@@ -2526,26 +3706,33 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 		}
 
 		create_xdir(fs->dirbuf, fs->lfnbuf);	/* Create on-memory directory block to be written later */
+#if FF_DIR_CACHE
+		dircache_put(fs, dp->obj.sclust, dircache_hash(dp), dp->blk_ofs);	/* The new name is likely to be opened soon */
+#endif
 		return FR_OK;
 	}
 #endif
 	/* On the FAT/FAT32 volume */
 	memcpy(sn, dp->fn, 12);
+	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
+	ofs = 0;
 	if (sn[NSFLAG] & NS_LOSS) {			/* When LFN is out of 8.3 format, generate a numbered name */
-		dp->fn[NSFLAG] = NS_NOLFN;		/* Find only SFN */
-		for (n = 1; n < 100; n++) {
-			gen_numname(dp->fn, sn, fs->lfnbuf, n);	/* Generate a numbered name */
-			res = dir_find(dp);				/* Check if the name collides with existing SFN */
-			if (res != FR_OK) break;
-		}
-		if (n == 100) return FR_DENIED;		/* Abort if too many collisions */
-		if (res != FR_NO_FILE) return res;	/* Abort if the result is other than 'not collided' */
-		dp->fn[NSFLAG] = sn[NSFLAG];
+		BYTE used[(NUMNAME_MAX + 7) / 8];
+
+		FF_PROFILE_START(t0);
+		res = find_numnames(dp, sn, n_ent, used, &ofs);	/* Collect the numbered names taken in a single pass */
+		FF_PROFILE_STOP(FF_PROF_REGISTER_FINDS, t0);
+		if (res != FR_OK) return res;
+		for (n = 1; n < NUMNAME_MAX && (used[n / 8] & (1 << (n % 8))); n++) ;	/* Lowest free sequence number */
+		if (n == NUMNAME_MAX) return FR_DENIED;	/* Abort if too many collisions */
+		gen_numname(dp->fn, sn, numname_seq(fs->lfnbuf, n));	/* Generate a numbered name */
 	}
 
 	/* Create an SFN with/without LFNs. */
-	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
-	res = dir_alloc(dp, n_ent);		/* Allocate entries */
+	res = dir_alloc(dp, n_ent, ofs);	/* Allocate entries */
+#if FF_DIR_CACHE
+	if (res == FR_OK) dircache_put(fs, dp->obj.sclust, dircache_hash(dp), dp->dptr - (n_ent - 1) * SZDIRE);
+#endif
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
 		if (res == FR_OK) {
@@ -2561,7 +3748,10 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	}
 
 #else	/* Non LFN configuration */
-	res = dir_alloc(dp, 1);		/* Allocate an entry for SFN */
+	res = dir_alloc(dp, 1, 0);	/* Allocate an entry for SFN */
+#if FF_DIR_CACHE
+	if (res == FR_OK) dircache_put(fs, dp->obj.sclust, dircache_hash(dp), dp->dptr);
+#endif
 
 #endif
 
@@ -2581,6 +3771,17 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	return res;
 }
 
+#if FF_USE_PROFILE
+static FRESULT dir_register (FFDIR* dp)
+{
+	FF_PROFILE_START(t0);
+	FRESULT rv = dir_register_body(dp);
+
+	FF_PROFILE_STOP(FF_PROF_DIR_REGISTER, t0);
+	return rv;
+}
+#endif
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -2599,6 +3800,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if FF_USE_LFN		/* LFN configuration */
 	DWORD last = dp->dptr;
 
+#if FF_DIR_CACHE
+	dircache_drop(fs, dp->obj.sclust, (dp->blk_ofs == 0xFFFFFFFF) ? dp->dptr : dp->blk_ofs);
+#endif
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -2617,6 +3821,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 	}
 #else			/* Non LFN configuration */
 
+#if FF_DIR_CACHE
+	dircache_drop(fs, dp->obj.sclust, dp->dptr);
+#endif
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
 		dp->dir[DIR_Name] = DDEM;	/* Mark the entry 'deleted'.*/
@@ -2687,6 +3894,7 @@ static void get_fileinfo (
 		fno->fsize = (fno->fattrib & AM_DIR) ? 0 : ld_qword(fs->dirbuf + XDIR_FileSize);	/* Size */
 		fno->ftime = ld_word(fs->dirbuf + XDIR_ModTime + 0);	/* Time */
 		fno->fdate = ld_word(fs->dirbuf + XDIR_ModTime + 2);	/* Date */
+		fno->cl = ld_dword(fs->dirbuf + XDIR_FstClus);			/* Cluster number */
 		return;
 	} else
 #endif
@@ -3072,7 +4280,7 @@ static FRESULT create_name (	/* FR_OK: successful, FR_INVALID_NAME: could not cr
 /* Follow a file path                                                    */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
+static FRESULT PROFILED(follow_path) (	/* FR_OK(0): successful, !=0: error code */
 	FFDIR* dp,					/* Directory object to return last directory and found object */
 	const TCHAR* path			/* Full-path string to find a file or directory */
 )
@@ -3080,6 +4288,11 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	FRESULT res;
 	BYTE ns;
 	FATFS *fs = dp->obj.fs;
+#if FF_PATH_CACHE
+	QWORD ph = 0;
+	const TCHAR* seg;
+	BYTE cache;
+#endif
 
 
 #if FF_FS_RPATH != 0
@@ -3106,6 +4319,18 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		dp->obj.stat = fs->dirbuf[XDIR_GenFlags] & 2;
 	}
 #endif
+#endif
+#if FF_PATH_CACHE
+	cache = (dp->obj.sclust == 0);			/* Paths are cached from the root directory only */
+	if (cache) {
+		seg = path;
+		path = pathcache_find(dp, path, &ph);	/* Skip the known part of the path */
+		if (path != seg) {
+			STAT_INC(fs, pcache_hits);
+		} else {
+			STAT_INC(fs, pcache_misses);
+		}
+	}
 #endif
 
 	if ((UINT)*path < ' ') {				/* Null path name is the origin directory itself */
@@ -3114,9 +4339,17 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 
 	} else {								/* Follow path */
 		for (;;) {
+#if FF_PATH_CACHE
+			seg = path;
+#endif
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if FF_PATH_CACHE
+			if (cache) ph = pathcache_next(ph, &seg);
+#endif
+			FF_PROFILE_START(t0);
 			res = dir_find(dp);				/* Find an object with the segment name */
+			FF_PROFILE_STOP(FF_PROF_FOLLOW_FINDS, t0);
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
 				if (res == FR_NO_FILE) {	/* Object is not found */
@@ -3146,12 +4379,26 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 			{
 				dp->obj.sclust = ld_clust(fs, fs->win + dp->dptr % SS(fs));	/* Open next directory */
 			}
+#if FF_PATH_CACHE
+			if (cache) pathcache_put(dp, ph);
+#endif
 		}
 	}
 
 	return res;
 }
 
+#if FF_USE_PROFILE
+static FRESULT follow_path (FFDIR* dp, const TCHAR* path)
+{
+	FF_PROFILE_START(t0);
+	FRESULT rv = follow_path_body(dp, path);
+
+	FF_PROFILE_STOP(FF_PROF_FOLLOW_PATH, t0);
+	return rv;
+}
+#endif
+
 
 
 
@@ -3233,36 +4480,33 @@ static DWORD make_rand (	/* Returns a seed value for next */
 
 /* Check what the sector is */
 
-static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS, 3:Not FAT and invalid BS, 4:Disk error */
-	FATFS* fs,			/* Filesystem object */
-	LBA_t sect			/* Sector to load and check if it is an FAT-VBR or not */
+static UINT check_vbr (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS, 3:Not FAT and invalid BS */
+	const BYTE* vbr		/* Sector to check if it is an FAT-VBR or not */
 )
 {
 	WORD w, sign;
 	BYTE b;
 
 
-	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
-	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
-	sign = ld_word(fs->win + BS_55AA);
+	sign = ld_word(vbr + BS_55AA);
 #if FF_FS_EXFAT
-	if (sign == 0xAA55 && !memcmp(fs->win + BS_JmpBoot, "\xEB\x76\x90" "EXFAT   ", 11)) return 1;	/* It is an exFAT VBR */
+	if (sign == 0xAA55 && !memcmp(vbr + BS_JmpBoot, "\xEB\x76\x90" "EXFAT   ", 11)) return 1;	/* It is an exFAT VBR */
 #endif
-	b = fs->win[BS_JmpBoot];
+	b = vbr[BS_JmpBoot];
 	if (b == 0xEB || b == 0xE9 || b == 0xE8) {	/* Valid JumpBoot code? (short jump, near jump or near call) */
-		if (sign == 0xAA55 && !memcmp(fs->win + BS_FilSysType32, "FAT32   ", 8)) {
+		if (sign == 0xAA55 && !memcmp(vbr + BS_FilSysType32, "FAT32   ", 8)) {
 			return 0;	/* It is an FAT32 VBR */
 		}
 		/* FAT volumes created in the early MS-DOS era lack BS_55AA and BS_FilSysType, so FAT VBR needs to be identified without them. */
-		w = ld_word(fs->win + BPB_BytsPerSec);
-		b = fs->win[BPB_SecPerClus];
+		w = ld_word(vbr + BPB_BytsPerSec);
+		b = vbr[BPB_SecPerClus];
 		if ((w & (w - 1)) == 0 && w >= FF_MIN_SS && w <= FF_MAX_SS	/* Properness of sector size (512-4096 and 2^n) */
 			&& b != 0 && (b & (b - 1)) == 0				/* Properness of cluster size (2^n) */
-			&& ld_word(fs->win + BPB_RsvdSecCnt) != 0	/* Properness of number of reserved sectors (MNBZ) */
-			&& (UINT)fs->win[BPB_NumFATs] - 1 <= 1		/* Properness of number of FATs (1 or 2) */
-			&& ld_word(fs->win + BPB_RootEntCnt) != 0	/* Properness of root dir size (MNBZ) */
-			&& (ld_word(fs->win + BPB_TotSec16) >= 128 || ld_dword(fs->win + BPB_TotSec32) >= 0x10000)	/* Properness of volume size (>=128) */
-			&& ld_word(fs->win + BPB_FATSz16) != 0) {	/* Properness of FAT size (MNBZ) */
+			&& ld_word(vbr + BPB_RsvdSecCnt) != 0	/* Properness of number of reserved sectors (MNBZ) */
+			&& (UINT)vbr[BPB_NumFATs] - 1 <= 1		/* Properness of number of FATs (1 or 2) */
+			&& ld_word(vbr + BPB_RootEntCnt) != 0	/* Properness of root dir size (MNBZ) */
+			&& (ld_word(vbr + BPB_TotSec16) >= 128 || ld_dword(vbr + BPB_TotSec32) >= 0x10000)	/* Properness of volume size (>=128) */
+			&& ld_word(vbr + BPB_FATSz16) != 0) {	/* Properness of FAT size (MNBZ) */
 				return 0;	/* It can be presumed an FAT VBR */
 		}
 	}
@@ -3270,6 +4514,17 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 }
 
 
+static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS, 3:Not FAT and invalid BS, 4:Disk error */
+	FATFS* fs,			/* Filesystem object */
+	LBA_t sect			/* Sector to load and check if it is an FAT-VBR or not */
+)
+{
+	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
+	return check_vbr(fs->win);
+}
+
+
 /* Find an FAT volume */
 /* (It supports only generic partitioning rules, MBR, GPT and SFD) */
 
@@ -3349,7 +4604,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	if (fs->fs_type != 0) {				/* If the volume has been mounted */
 		stat = disk_status(fs->pdrv);
 		if (!(stat & STA_NOINIT)) {		/* and the physical drive is kept initialized */
-			if (!FF_FS_READONLY && mode && (stat & STA_PROTECT)) {	/* Check write protection if needed */
+			if (!FF_FS_READONLY && mode && ((stat & STA_PROTECT) || fs->rdonly)) {	/* Check write protection if needed */
 				return FR_WRITE_PROTECTED;
 			}
 			return FR_OK;				/* The filesystem object is already valid */
@@ -3360,11 +4615,27 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	/* Following code attempts to mount the volume. (find an FAT volume, analyze the BPB and initialize the filesystem object) */
 
 	fs->fs_type = 0;					/* Invalidate the filesystem object */
+#if FF_USE_FREEMAP
+	fmap_reset(fs);						/* The bitmap belongs to the previous medium */
+#endif
+#if FF_WRITE_BATCH
+	wb_reset(fs);						/* So do the held back sectors */
+#endif
+#if FF_LAZY_MIRROR
+	lazy_reset(fs);						/* and the deferred 2nd FAT */
+#endif
+#if FF_FAT_CACHE
+	fcache_reset(fs);					/* and the cached FAT sectors */
+#endif
+#if !FF_FS_READONLY && FF_USE_TRIM
+	fs->ntrim = 0;						/* and the freed clusters not discarded yet */
+	fs->notrim = 0;
+#endif
 	stat = disk_initialize(fs->pdrv);	/* Initialize the volume hosting physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
 	}
-	if (!FF_FS_READONLY && mode && (stat & STA_PROTECT)) { /* Check disk write protection if needed */
+	if (!FF_FS_READONLY && mode && ((stat & STA_PROTECT) || fs->rdonly)) { /* Check disk write protection if needed */
 		return FR_WRITE_PROTECTED;
 	}
 #if FF_MAX_SS != FF_MIN_SS				/* Get sector size (multiple sector size cfg only) */
@@ -3522,6 +4793,12 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type (the filesystem object gets valid) */
 	fs->id = ++Fsid;		/* Volume mount ID */
+#if FF_DIR_CACHE
+	memset(fs->dcache, 0, sizeof fs->dcache);	/* Lookups of the previous mount are meaningless */
+#endif
+#if FF_PATH_CACHE
+	pathcache_clear(fs);
+#endif
 #if FF_USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if FF_FS_EXFAT
@@ -3533,6 +4810,27 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #endif
 #if FF_FS_LOCK				/* Clear file lock semaphores */
 	clear_share(fs);
+#endif
+#if FF_LAZY_MIRROR
+	if ((fmt == FS_FAT16 || fmt == FS_FAT32) && !(stat & STA_PROTECT) && !fs->rdonly) {	/* (FAT12 and exFAT have no such flag) */
+		if (repair_volume(fs) != FR_OK) {	/* A crash left the 2nd FAT or FSInfo behind? */
+			fs->fs_type = 0;
+			return FR_DISK_ERR;
+		}
+		if (fs->n_fats == 2) {	/* Defer the 2nd FAT if there is memory for the bitmap */
+			fs->mdirty = ff_memalloc((UINT)((fs->fsize + 7) / 8));
+			if (fs->mdirty) memset(fs->mdirty, 0, (fs->fsize + 7) / 8);
+		}
+	} else if (fmt == FS_FAT16 || fmt == FS_FAT32) {	/* Cannot be repaired, but the FSInfo count of a dirty volume is not trusted */
+		if (move_window(fs, fs->fatbase) != FR_OK) {
+			fs->fs_type = 0;
+			return FR_DISK_ERR;
+		}
+		if (!(fs->win[CLNSHUT_OFS(fs)] & CLNSHUT_BIT(fs))) fs->free_clst = 0xFFFFFFFF;
+	}
+#endif
+#if FF_FAT_CACHE
+	if ((FF_FS_READONLY || fs->rdonly) && fmt != FS_FAT12) fcache_init(fs);	/* (FAT12 entries straddle the sectors) */
 #endif
 	return FR_OK;
 }
@@ -3591,29 +4889,45 @@ static FRESULT validate (	/* Returns FR_OK or FR_INVALID_OBJECT */
 FRESULT f_mount (
 	FATFS* fs,			/* Pointer to the filesystem object to be mounted */
 	void* pdrv,			/* Physical drive object to be mounted */
-	UINT part			/* Partition to find = 0:find as SFD and partitions, >0:forced partition number */
+	UINT part			/* Partition to find = 0:find as SFD and partitions, >0:forced partition number, OR'ed with FV_RDONLY */
 )
 {
 	FRESULT res;
 
 	if (fs) {					/* Register new filesystem object */
 		fs->pdrv = pdrv;		/* Physical drive object */
+		fs->rdonly = (part & FV_RDONLY) ? 1 : 0;
 #if FF_FS_REENTRANT				/* Create a volume mutex */
 		if (!ff_mutex_create(fs)) return FR_INT_ERR;
-#if FF_FS_LOCK
-		if (SysLock == 0) {		/* Create a system mutex if needed */
-			if (!ff_mutex_create(NULL)) {
-				ff_mutex_delete(fs);
-				return FR_INT_ERR;
-			}
-			SysLock = 1;		/* System mutex is ready */
-		}
 #endif
+#if FF_USE_FREEMAP
+		fs->fmap = 0;			/* No free cluster bitmap yet */
+#endif
+#if FF_WRITE_BATCH
+		fs->wbuf = 0;			/* No batch open */
+		fs->wbdepth = 0;
+#endif
+#if FF_LAZY_MIRROR
+		fs->mdirty = 0;			/* No deferred 2nd FAT */
+		fs->vflag = 0x80;
+#endif
+#if FF_FAT_CACHE
+		fs->fcache = 0;			/* No cached FAT sectors */
+#endif
+#if !FF_FS_READONLY && FF_USE_TRIM
+		fs->ntrim = 0;			/* No freed clusters to discard */
+		fs->notrim = 0;
+#endif
+#if FF_USE_PROFILE
+		fs->prof_depth = 0;		/* Not locked */
+#endif
+#if FF_USE_STATS
+		memset(&fs->stats, 0, sizeof fs->stats);	/* Count from the mount on */
 #endif
 		fs->fs_type = 0;		/* Invalidate the new filesystem object */
 	}
 
-	res = mount_volume(fs, part, 0);	/* Force mounted the volume */
+	res = mount_volume(fs, part & ~FV_RDONLY, 0);	/* Force mounted the volume */
 	LEAVE_FF(fs, res);
 }
 
@@ -3625,6 +4939,18 @@ FRESULT f_umount (
 #if FF_FS_LOCK
 		clear_share(cfs);
 #endif
+#if FF_USE_FREEMAP
+		fmap_reset(cfs);
+#endif
+#if FF_WRITE_BATCH
+		wb_reset(cfs);			/* An open batch is discarded, close it before */
+#endif
+#if FF_LAZY_MIRROR
+		lazy_reset(cfs);		/* Without f_syncvol() the next mount repairs the volume */
+#endif
+#if FF_FAT_CACHE
+		fcache_reset(cfs);
+#endif
 #if FF_FS_REENTRANT				/* Discard mutex of the current volume */
 		ff_mutex_delete(cfs);
 #endif
@@ -3637,11 +4963,100 @@ FRESULT f_umount (
 
 
 
+#if FF_MULTI_PARTITION
+/*-----------------------------------------------------------------------*/
+/* List the Partitions of a Physical Drive                               */
+/*-----------------------------------------------------------------------*/
+/* Lists the partitions f_mount() can be forced to, in the order of their
+/  numbers: the MBR entries or the MS basic data partitions of a GPT. A drive
+/  without partition table holding a single volume gives one entry numbered
+/  0. Nothing is mounted, the drive is only read.
+*/
+
+FRESULT f_findparts (
+	void* pdrv,			/* Physical drive object */
+	FFPART* tbl,		/* Table to fill */
+	UINT max,			/* Number of entries of tbl[] */
+	UINT* n,			/* Returns the number of entries filled */
+	void* work			/* Working buffer of FF_MAX_SS bytes */
+)
+{
+	BYTE *buf = (BYTE*)work, *pte;
+	UINT ss, i, fmt, cnt = 0;
+	LBA_t sz_drv;
+
+
+	*n = 0;
+	if (!tbl || !buf) return FR_INVALID_PARAMETER;
+	if (disk_initialize(pdrv) & STA_NOINIT) return FR_NOT_READY;
+#if FF_MAX_SS != FF_MIN_SS
+	BYTE sshift;
+	if (disk_ioctl(pdrv, GET_SECTOR_SHIFT, &sshift) != RES_OK) return FR_DISK_ERR;
+	ss = 1U << sshift;
+	if (ss > FF_MAX_SS || ss < FF_MIN_SS) return FR_DISK_ERR;
+#else
+	ss = FF_MAX_SS;
+#endif
+	if (disk_read(pdrv, buf, 0, 1) != RES_OK) return FR_DISK_ERR;
+	fmt = check_vbr(buf);
+	if (fmt <= 1) {			/* The whole drive is a volume */
+		if (disk_ioctl(pdrv, GET_SECTOR_COUNT, &sz_drv) != RES_OK) return FR_DISK_ERR;
+		if (max == 0) return FR_OK;
+		tbl[0].part = 0; tbl[0].fs = (BYTE)(fmt + 1); tbl[0].system = 0;
+		tbl[0].start = 0; tbl[0].size = sz_drv;
+		*n = 1;
+		return FR_OK;
+	}
+	if (fmt == 3) return FR_OK;	/* Neither a volume nor a partition table */
+
+#if FF_LBA64
+	if (buf[MBR_Table + PTE_System] == 0xEE) {	/* GPT protective MBR? */
+		DWORD n_ent, ofs = 0, v_ent = 0;
+		QWORD pt_lba;
+
+		if (disk_read(pdrv, buf, 1, 1) != RES_OK) return FR_DISK_ERR;	/* Load GPT header sector (next to MBR) */
+		if (!test_gpt_header(buf)) return FR_OK;
+		n_ent = ld_dword(buf + GPTH_PtNum);
+		pt_lba = ld_qword(buf + GPTH_PtOfs);
+		for (; n_ent && cnt < max; n_ent--, ofs = (ofs + SZ_GPTE) % ss) {	/* Same order find_volume() counts them in */
+			if (ofs == 0 && disk_read(pdrv, buf, pt_lba++, 1) != RES_OK) return FR_DISK_ERR;	/* PT sector */
+			if (memcmp(buf + ofs + GPTE_PtGuid, GUID_MS_Basic, 16)) continue;	/* Not an MS basic data partition */
+			tbl[cnt].part = (BYTE)++v_ent; tbl[cnt].system = 0;
+			tbl[cnt].start = ld_qword(buf + ofs + GPTE_FstLba);
+			tbl[cnt].size = ld_qword(buf + ofs + GPTE_LstLba) - tbl[cnt].start + 1;
+			cnt++;
+		}
+	} else
+#endif
+	{
+		for (i = 0; i < 4 && cnt < max; i++) {
+			pte = buf + MBR_Table + i * SZ_PTE;
+			if (pte[PTE_System] == 0 || ld_dword(pte + PTE_StLba) == 0) continue;	/* Empty entry */
+			tbl[cnt].part = (BYTE)(i + 1); tbl[cnt].system = pte[PTE_System];
+			tbl[cnt].start = ld_dword(pte + PTE_StLba);
+			tbl[cnt].size = ld_dword(pte + PTE_SizLba);
+			cnt++;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {	/* See what the partitions hold */
+		if (disk_read(pdrv, buf, tbl[i].start, 1) != RES_OK) return FR_DISK_ERR;
+		fmt = check_vbr(buf);
+		tbl[i].fs = (BYTE)(fmt <= 1 ? fmt + 1 : 0);
+	}
+	*n = cnt;
+	return FR_OK;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Open or Create a File                                                 */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_open (
+FRESULT PROFILED(f_open) (
 	FFFIL* fp,			/* Pointer to the blank file object */
 	FATFS* fs,			/* Pointer to filesystem object */
 	const TCHAR* path,	/* Pointer to the file name */
@@ -3792,6 +5207,7 @@ FRESULT f_open (
 			fp->sect = 0;		/* Invalidate current data sector */
 			fp->fptr = 0;		/* Set file pointer top of the file */
 #if !FF_FS_READONLY
+			fp->run_end = 0;	/* No clusters allocated ahead */
 #if !FF_FS_TINY
 			memset(fp->buf, 0, sizeof fp->buf);	/* Clear sector buffer */
 #endif
@@ -3831,6 +5247,17 @@ FRESULT f_open (
 	LEAVE_FF(fs, res);
 }
 
+#if FF_USE_PROFILE
+FRESULT f_open (FFFIL* fp, FATFS* fs, const TCHAR* path, BYTE mode)
+{
+	FF_PROFILE_START(t0);
+	FRESULT res = f_open_body(fp, fs, path, mode);
+
+	FF_PROFILE_STOP(FF_PROF_FILES, t0);
+	return res;
+}
+#endif
+
 
 
 
@@ -3890,6 +5317,9 @@ FRESULT f_read (
 					cc = fs->csize - csect;
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#if FF_WRITE_BATCH
+				if (fs->wbuf) wb_patch(fs, rbuff, sect, cc);	/* Sectors held back by the batch are newer */
+#endif
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if FF_FS_TINY
 				if (fs->wflag && fs->winsect - sect < cc) {
@@ -3970,7 +5400,7 @@ FRESULT f_write (
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
-						clst = create_chain(&fp->obj, 0);	/* create a new cluster chain */
+						clst = create_run(&fp->obj, 0, run_size(fp, btw), &fp->run_end);	/* create a new cluster chain */
 					}
 				} else {					/* On the middle or end of the file */
 #if FF_USE_FASTSEEK
@@ -3978,8 +5408,10 @@ FRESULT f_write (
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					} else
 #endif
-					{
-						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+					if (fp->clust < fp->run_end) {
+						clst = fp->clust + 1;	/* Next cluster of the run allocated ahead */
+					} else {
+						clst = create_run(&fp->obj, fp->clust, run_size(fp, btw), &fp->run_end);	/* Follow or stretch cluster chain on the FAT */
 					}
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
@@ -4005,6 +5437,9 @@ FRESULT f_write (
 					cc = fs->csize - csect;
 				}
 				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#if FF_WRITE_BATCH
+				if (fs->wbuf) wb_drop(fs, sect, cc);	/* Sectors held back by the batch are older */
+#endif
 #if FF_FS_MINIMIZE <= 2
 #if FF_FS_TINY
 				if (fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -4059,75 +5494,96 @@ FRESULT f_write (
 /* Synchronize the File                                                  */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_sync (
-	FFFIL* fp		/* Open file to be synced */
+static FRESULT sync_file (	/* Write back the cached data and the directory entry of a file, the volume is locked */
+	FFFIL* fp,		/* Open file to be synced */
+	FATFS* fs		/* Its filesystem object */
 )
 {
-	FRESULT res;
-	FATFS *fs;
+	FRESULT res = FR_OK;
 	DWORD tm;
 	BYTE *dir;
 
 
-	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
-	if (res == FR_OK) {
-		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+	if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+		res = trim_run(fp);			/* Give back the clusters allocated ahead */
+		if (res != FR_OK) return res;
 #if !FF_FS_TINY
-			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
+		if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+			if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) return FR_DISK_ERR;
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
 #endif
-			/* Update the directory entry */
-			tm = GET_FATTIME();				/* Modified time */
+		/* Update the directory entry */
+		tm = GET_FATTIME();				/* Modified time */
 #if FF_FS_EXFAT
-			if (fs->fs_type == FS_EXFAT) {
-				res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
-				if (res == FR_OK) {
-					res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
-				}
-				if (res == FR_OK) {
-					FFDIR dj;
-					DEF_NAMBUF
+		if (fs->fs_type == FS_EXFAT) {
+			res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
+			if (res == FR_OK) {
+				res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
+			}
+			if (res == FR_OK) {
+				FFDIR dj;
+				DEF_NAMBUF
 
-					INIT_NAMBUF(fs);
-					res = load_obj_xdir(&dj, &fp->obj);	/* Load directory entry block */
+				INIT_NAMBUF(fs);
+				res = load_obj_xdir(&dj, &fp->obj);	/* Load directory entry block */
+				if (res == FR_OK) {
+					fs->dirbuf[XDIR_Attr] |= AM_ARC;				/* Set archive attribute to indicate that the file has been changed */
+					fs->dirbuf[XDIR_GenFlags] = fp->obj.stat | 1;	/* Update file allocation information */
+					st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.sclust);		/* Update start cluster */
+					st_qword(fs->dirbuf + XDIR_FileSize, fp->obj.objsize);		/* Update file size */
+					st_qword(fs->dirbuf + XDIR_ValidFileSize, fp->obj.objsize);	/* (FatFs does not support Valid File Size feature) */
+					st_dword(fs->dirbuf + XDIR_ModTime, tm);		/* Update modified time */
+					fs->dirbuf[XDIR_ModTime10] = 0;
+					st_dword(fs->dirbuf + XDIR_AccTime, 0);
+					res = store_xdir(&dj);	/* Restore it to the directory */
 					if (res == FR_OK) {
-						fs->dirbuf[XDIR_Attr] |= AM_ARC;				/* Set archive attribute to indicate that the file has been changed */
-						fs->dirbuf[XDIR_GenFlags] = fp->obj.stat | 1;	/* Update file allocation information */
-						st_dword(fs->dirbuf + XDIR_FstClus, fp->obj.sclust);		/* Update start cluster */
-						st_qword(fs->dirbuf + XDIR_FileSize, fp->obj.objsize);		/* Update file size */
-						st_qword(fs->dirbuf + XDIR_ValidFileSize, fp->obj.objsize);	/* (FatFs does not support Valid File Size feature) */
-						st_dword(fs->dirbuf + XDIR_ModTime, tm);		/* Update modified time */
-						fs->dirbuf[XDIR_ModTime10] = 0;
-						st_dword(fs->dirbuf + XDIR_AccTime, 0);
-						res = store_xdir(&dj);	/* Restore it to the directory */
-						if (res == FR_OK) {
-							res = sync_fs(fs);
-							fp->flag &= (BYTE)~FA_MODIFIED;
-						}
+						res = sync_fs(fs);
+						fp->flag &= (BYTE)~FA_MODIFIED;
 					}
-					FREE_NAMBUF();
 				}
-			} else
+				FREE_NAMBUF();
+			}
+		} else
 #endif
-			{
-				res = move_window(fs, fp->dir_sect);
-				if (res == FR_OK) {
-					dir = fp->dir_ptr;
-					dir[DIR_Attr] |= AM_ARC;						/* Set archive attribute to indicate that the file has been changed */
-					st_clust(fp->obj.fs, dir, fp->obj.sclust);		/* Update file allocation information  */
-					st_dword(dir + DIR_FileSize, (DWORD)fp->obj.objsize);	/* Update file size */
-					st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
-					st_word(dir + DIR_LstAccDate, 0);
-					fs->wflag = 1;
-					res = sync_fs(fs);					/* Restore it to the directory */
-					fp->flag &= (BYTE)~FA_MODIFIED;
-				}
+		{
+			res = move_window(fs, fp->dir_sect);
+			if (res == FR_OK) {
+				dir = fp->dir_ptr;
+				dir[DIR_Attr] |= AM_ARC;						/* Set archive attribute to indicate that the file has been changed */
+				st_clust(fp->obj.fs, dir, fp->obj.sclust);		/* Update file allocation information  */
+				st_dword(dir + DIR_FileSize, (DWORD)fp->obj.objsize);	/* Update file size */
+				st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
+				st_word(dir + DIR_LstAccDate, 0);
+				fs->wflag = 1;
+				res = sync_fs(fs);					/* Restore it to the directory */
+				fp->flag &= (BYTE)~FA_MODIFIED;
 			}
 		}
 	}
 
+	return res;
+}
+
+
+FRESULT f_sync (
+	FFFIL* fp		/* Open file to be synced */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) res = sync_file(fp, fs);
+#if FF_WRITE_BATCH
+	if (res == FR_OK && fs->wbuf) {	/* The file has to be on the medium, so the batch writes what it holds and goes on */
+		res = sync_window(fs);
+		if (res == FR_OK) res = wb_flush(fs);
+		if (res == FR_OK) res = flush_fs(fs);
+	}
+#endif
+
 	LEAVE_FF(fs, res);
 }
 
@@ -4147,23 +5603,23 @@ FRESULT f_close (
 	FRESULT res;
 	FATFS *fs;
 
+	res = validate(&fp->obj, &fs);	/* Lock volume */
+	if (res == FR_OK) {
 #if !FF_FS_READONLY
-	res = f_sync(fp);					/* Flush cached data */
-	if (res == FR_OK)
+		res = sync_file(fp, fs);		/* Flush cached data, an open batch keeps holding the metadata */
+		if (res == FR_OK)
 #endif
-	{
-		res = validate(&fp->obj, &fs);	/* Lock volume */
-		if (res == FR_OK) {
+		{
 #if FF_FS_LOCK
 			res = dec_share(fp->obj.lockid);		/* Decrement file open counter */
 			if (res == FR_OK) fp->obj.fs = 0;	/* Invalidate file object */
 #else
 			fp->obj.fs = 0;	/* Invalidate file object */
 #endif
+		}
 #if FF_FS_REENTRANT
-			unlock_volume(fs, FR_OK);		/* Unlock volume */
+		unlock_volume(fs, FR_OK);		/* Unlock volume */
 #endif
-		}
 	}
 	return res;
 }
@@ -4325,6 +5781,9 @@ FRESULT f_lseek (
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res == FR_OK) res = (FRESULT)fp->err;
+#if !FF_FS_READONLY
+	if (res == FR_OK) res = trim_run(fp);	/* Give back the clusters allocated ahead */
+#endif
 #if FF_FS_EXFAT && !FF_FS_READONLY
 	if (res == FR_OK && fs->fs_type == FS_EXFAT) {
 		res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
@@ -4405,7 +5864,7 @@ FRESULT f_lseek (
 				clst = fp->obj.sclust;					/* start from the first cluster */
 #if !FF_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
-					clst = create_chain(&fp->obj, 0);
+					clst = create_run(&fp->obj, 0, run_size(fp, ofs), &fp->run_end);
 					if (clst == 1) ABORT(fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					fp->obj.sclust = clst;
@@ -4422,7 +5881,11 @@ FRESULT f_lseek (
 							fp->obj.objsize = fp->fptr;
 							fp->flag |= FA_MODIFIED;
 						}
-						clst = create_chain(&fp->obj, clst);	/* Follow chain with forceed stretch */
+						if (clst < fp->run_end) {
+							clst++;						/* Next cluster of the run just allocated */
+						} else {
+							clst = create_run(&fp->obj, clst, run_size(fp, ofs), &fp->run_end);	/* Follow chain with forceed stretch */
+						}
 						if (clst == 0) {				/* Clip file size in case of disk full */
 							ofs = 0; break;
 						}
@@ -4723,6 +6186,11 @@ FRESULT f_getfree (
 		/* If free_clst is valid, return it without full FAT scan */
 		if (fs->free_clst <= fs->n_fatent - 2) {
 			*nclst = fs->free_clst;
+#if FF_USE_FREEMAP
+		} else if (fs->fmap) {	/* Finish the bitmap being loaded instead, it yields the exact count */
+			res = fmap_load(fs, fs->n_fatent);
+			if (res == FR_OK) *nclst = fs->fmap_free;
+#endif
 		} else {
 			/* Scan FAT to obtain the correct free cluster count */
 			nfree = 0;
@@ -4793,6 +6261,583 @@ FRESULT f_getfree (
 
 
 
+#if FF_USE_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Load the Free Cluster Bitmap in Steps                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_buildfreemap (
+	FATFS* fs,			/* Pointer to filesystem object */
+	DWORD nclst,		/* Number of clusters to load in this call (0:all remaining) */
+	DWORD* left			/* Pointer to return the number of clusters still to be loaded (null:not needed) */
+)
+{
+	FRESULT res;
+	DWORD end;
+
+
+	res = mount_volume(fs, 0, 0);
+	if (res == FR_OK) {
+		end = fs->n_fatent;
+		if (nclst && fs->fmap && nclst < fs->n_fatent - fs->fmap_scan) end = fs->fmap_scan + nclst;
+		if (nclst && !fs->fmap && nclst < fs->n_fatent - 2) end = 2 + nclst;
+		res = fmap_load(fs, end);
+		if (left) *left = fs->fmap ? fs->n_fatent - fs->fmap_scan : fs->n_fatent - 2;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+#if FF_USE_TRIM && FF_USE_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Discard the Free Clusters                                             */
+/*-----------------------------------------------------------------------*/
+/* Tells the drive that every free cluster is unused, which also covers
+/  the space freed by other systems or before discards were enabled. The
+/  free cluster bitmap is completed first. FR_DENIED is returned when the
+/  drive does not support CTRL_TRIM.
+*/
+
+FRESULT f_trimfree (
+	FATFS* fs,			/* Pointer to filesystem object */
+	DWORD* nclst		/* Pointer to return the number of clusters discarded (null:not needed) */
+)
+{
+	FRESULT res;
+	DRESULT dr;
+	DWORD clst, scl, n = 0;
+
+
+	res = mount_volume(fs, 0, FA_WRITE);
+	if (res == FR_OK) res = sync_window(fs);	/* The FAT on the drive has to free the clusters first */
+	if (res == FR_OK) res = fmap_load(fs, fs->n_fatent);
+	if (res == FR_OK) {
+		fs->ntrim = 0;		/* The collected runs are free clusters as well */
+		clst = 2;
+		while (res == FR_OK && clst < fs->n_fatent) {
+			if (fmap_test(fs, clst)) {	/* Skip the clusters in use */
+				clst++; continue;
+			}
+			scl = clst;
+			while (clst < fs->n_fatent && !fmap_test(fs, clst)) clst++;
+			dr = trim_clusters(fs, scl, clst - 1);	/* Discard the free run */
+			if (dr == RES_OK) {
+				n += clst - scl;
+			} else {
+				res = (dr == RES_PARERR) ? FR_DENIED : FR_DISK_ERR;
+			}
+		}
+		if (nclst) *nclst = n;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+#if FF_WRITE_BATCH
+/*-----------------------------------------------------------------------*/
+/* Open or Close a Batch of Held Back Writes                             */
+/*-----------------------------------------------------------------------*/
+/* While a batch is open, sectors leaving the disk access window stay in
+/  memory, so creating many files writes each directory and FAT sector
+/  once instead of once per file. FSInfo and the drive flush of f_close()
+/  are deferred as well, f_sync() still writes all of it and keeps the
+/  batch open. Batches nest, the last f_batch(fs, 0) writes the
+/  held sectors in ascending order (FAT before directories) and syncs the
+/  volume. A batch that runs out of slots writes all of them the same way
+/  and goes on. Until then the volume only has the metadata written before
+/  the batch or by a full batch, so a power loss can lose the files created
+/  in the batch. f_batch(fs, 2) closes all nested batches, before unmounting.
+*/
+
+FRESULT f_batch (
+	FATFS* fs,			/* Pointer to filesystem object */
+	BYTE on				/* 1:Open a batch, 0:Close it, 2:Close all of them (no effect when none is open) */
+)
+{
+	FRESULT res;
+	int i;
+
+
+	res = mount_volume(fs, 0, FA_WRITE);
+	if (res == FR_OK) {
+		if (on == 1) {
+			if (!fs->wbuf) {	/* Outermost batch */
+				fs->wbuf = ff_memalloc((UINT)FF_WRITE_BATCH * SS(fs));
+				if (!fs->wbuf) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE);
+				for (i = 0; i < FF_WRITE_BATCH; i++) fs->wbsect[i] = (LBA_t)0 - 1;
+			}
+			if (fs->wbdepth == 255) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+			fs->wbdepth++;
+		} else if (fs->wbdepth && (on == 2 || --fs->wbdepth == 0)) {	/* Last batch ends */
+			res = sync_window(fs);		/* Park the window with the rest */
+			if (res == FR_OK) res = wb_flush(fs);
+			if (res == FR_OK) {
+				wb_reset(fs);
+				res = sync_fs(fs);		/* Write FSInfo and flush the drive */
+			} else {
+				fs->wbdepth = 1;		/* Keep the held sectors, closing can be retried */
+			}
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Synchronize the Volume                                                */
+/*-----------------------------------------------------------------------*/
+/* Writes what file syncs leave for later: the sectors held back by an open
+/  batch (it stays open), the deferred 2nd FAT and FSInfo. The volume is
+/  marked clean afterwards, call it before unmounting or removing the
+/  medium and at points a power loss should find the volume consistent.
+*/
+
+FRESULT f_syncvol (
+	FATFS* fs			/* Pointer to filesystem object */
+)
+{
+	FRESULT res;
+
+
+	res = mount_volume(fs, 0, FA_WRITE);
+	if (res == FR_OK) res = sync_window(fs);
+#if FF_WRITE_BATCH
+	if (res == FR_OK && fs->wbuf) res = wb_flush(fs);
+#endif
+#if FF_LAZY_MIRROR
+	if (res == FR_OK && fs->vflag == 1) res = sync_mirror(fs);
+#endif
+#if FF_USE_TRIM
+	if (res == FR_OK && fs->ntrim) trim_flush(fs);
+#endif
+	if (res == FR_OK) {
+		sync_fsinfo(fs);
+		if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
+#if FF_USE_STATS
+/*-----------------------------------------------------------------------*/
+/* Get Volume Statistics                                                 */
+/*-----------------------------------------------------------------------*/
+/* The counters only cover what FatFs does on the volume, the requests
+/  that reach the drive are counted by the disk I/O layer.
+*/
+
+FRESULT f_getstats (
+	FATFS* fs,			/* Pointer to filesystem object */
+	FFSTATS* st,		/* Pointer to the structure to copy the counters to */
+	BYTE reset			/* 1:Clear the counters after copying them */
+)
+{
+	FRESULT res;
+
+
+	res = mount_volume(fs, 0, 0);
+	if (res == FR_OK) {
+		*st = fs->stats;
+		if (reset) memset(&fs->stats, 0, sizeof fs->stats);
+	}
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
+#if FF_USE_CHECK
+/*-----------------------------------------------------------------------*/
+/* Check and Repair the FAT Structure                                    */
+/*-----------------------------------------------------------------------*/
+/* The FAT is read once in large chunks into three bitmaps (clusters in use,
+/  clusters linked to the following one, clusters reached from a directory)
+/  and a sorted list of all other links: ends of chains, jumps and bad
+/  clusters. Chains are then followed on that copy while walking the tree,
+/  so the FAT is not read again cluster by cluster.
+*/
+
+#define CHK_BAD		0x0FFFFFF7	/* Bad cluster mark, FAT12/16 values are widened to it */
+#define CHK_EOC		0x0FFFFFF8	/* Lowest end of chain mark */
+#define CHK_TEST(map, c)	(((map)[(c) / 32] >> ((c) % 32)) & 1)
+#define CHK_SET(map, c)		((map)[(c) / 32] |= (DWORD)1 << ((c) % 32))
+
+typedef struct {
+	FATFS* fs;
+	FFCHECK* rpt;
+	BYTE opt;
+	DWORD* used;	/* Clusters not free on the FAT */
+	DWORD* seq;		/* Clusters linked to the next one */
+	DWORD* refd;	/* Clusters reached from the directory tree */
+	DWORD* link;	/* Other links as {cluster, value} pairs in ascending order */
+	DWORD nlink, szlink;
+	DWORD* stack;	/* Directories left to walk as {start cluster, number of clusters} pairs */
+	DWORD nstack, szstack;
+} CHKWORK;
+
+
+static int chk_push (	/* 1:Added, 0:Not enough core */
+	DWORD** tbl,	/* Table of pairs, grown as needed */
+	DWORD* n,		/* Number of pairs in it */
+	DWORD* sz,		/* Number of pairs it can take */
+	DWORD v0,
+	DWORD v1
+)
+{
+	DWORD *nt;
+
+
+	if (*n == *sz) {
+		*sz = *sz ? *sz * 2 : 1024;
+		nt = ff_memalloc((UINT)(*sz * 8));
+		if (!nt) return 0;
+		if (*tbl) {
+			memcpy(nt, *tbl, (size_t)*n * 8);
+			ff_memfree(*tbl);
+		}
+		*tbl = nt;
+	}
+	(*tbl)[*n * 2] = v0; (*tbl)[*n * 2 + 1] = v1;
+	(*n)++;
+	return 1;
+}
+
+
+static DWORD chk_next (	/* Value of the FAT entry on the copy */
+	CHKWORK* cw,
+	DWORD clst
+)
+{
+	DWORD lo = 0, hi = cw->nlink, i;
+
+
+	if (!CHK_TEST(cw->used, clst)) return 0;
+	if (CHK_TEST(cw->seq, clst)) return clst + 1;
+	while (lo < hi) {	/* Every other used cluster is in the list */
+		i = (lo + hi) / 2;
+		if (cw->link[i * 2] == clst) return cw->link[i * 2 + 1];
+		if (cw->link[i * 2] < clst) lo = i + 1; else hi = i;
+	}
+	return 1;
+}
+
+
+static int chk_put (	/* Add a FAT entry to the copy, 0:Not enough core */
+	CHKWORK* cw,
+	DWORD clst,
+	DWORD val,		/* Entry value, bad and end of chain marks widened to FAT32 */
+	DWORD* nfree	/* Free cluster counter */
+)
+{
+	if (val == 0) {
+		(*nfree)++;
+		return 1;
+	}
+	CHK_SET(cw->used, clst);
+	if (val == clst + 1) {
+		CHK_SET(cw->seq, clst);
+		return 1;
+	}
+	return chk_push(&cw->link, &cw->nlink, &cw->szlink, clst, val);
+}
+
+
+static FRESULT chk_load (	/* Copy the FAT into the bitmaps with large reads */
+	CHKWORK* cw,
+	BYTE* buf,		/* Work buffer */
+	UINT nsect,		/* Its size in sectors */
+	DWORD* nfree	/* Returns the number of free clusters */
+)
+{
+	FATFS *fs = cw->fs;
+	DWORD clst, val, sect, n;
+	UINT i;
+	FFOBJID obj;
+
+
+	*nfree = 0;
+	if (fs->fs_type == FS_FAT12) {	/* Entries straddle the sectors, but the FAT is small */
+		obj.fs = fs;
+		for (clst = 2; clst < fs->n_fatent; clst++) {
+			val = get_fat(&obj, clst);
+			if (val == 0xFFFFFFFF) return FR_DISK_ERR;
+			if (val >= 0xFF7) val |= 0x0FFFF000;
+			if (!chk_put(cw, clst, val, nfree)) return FR_NOT_ENOUGH_CORE;
+		}
+		return FR_OK;
+	}
+	for (sect = clst = 0; clst < fs->n_fatent; sect += n) {
+		n = fs->fsize - sect;
+		if (n > nsect) n = nsect;
+		if (n == 0) return FR_INT_ERR;
+		if (disk_read(fs->pdrv, buf, fs->fatbase + sect, (UINT)n) != RES_OK) return FR_DISK_ERR;
+		for (i = 0; i < (UINT)n * SS(fs) && clst < fs->n_fatent; clst++) {
+			if (fs->fs_type == FS_FAT32) {
+				val = ld_dword(buf + i) & 0x0FFFFFFF; i += 4;
+			} else {
+				val = ld_word(buf + i); i += 2;
+				if (val >= 0xFFF7) val |= 0x0FFF0000;
+			}
+			if (clst >= 2 && !chk_put(cw, clst, val, nfree)) return FR_NOT_ENOUGH_CORE;
+		}
+	}
+	return FR_OK;
+}
+
+
+static DWORD chk_chain (	/* Number of clusters in the chain up to the first problem */
+	CHKWORK* cw,
+	DWORD clst,		/* First cluster */
+	DWORD limit,	/* Number of clusters the chain should have at most */
+	DWORD* lcl,		/* Returns the last good cluster (0:none) */
+	BYTE* err		/* Returns 0:Good, 1:Bad link, 2:Cross-link, 3:Longer than limit */
+)
+{
+	FATFS *fs = cw->fs;
+	DWORD n = 0;
+
+
+	*lcl = 0; *err = 0;
+	for (;;) {
+		if (clst < 2 || clst >= fs->n_fatent || !CHK_TEST(cw->used, clst)) {
+			*err = 1; break;
+		}
+		if (CHK_TEST(cw->refd, clst)) {	/* Reached before by this or another chain */
+			*err = 2; break;
+		}
+		if (n == limit) {
+			*err = 3; break;
+		}
+		CHK_SET(cw->refd, clst);
+		*lcl = clst; n++;
+		clst = chk_next(cw, clst);
+		if (clst >= CHK_EOC) break;
+	}
+	return n;
+}
+
+
+static FRESULT chk_entry (	/* Check the chain and size of the entry in the window */
+	CHKWORK* cw,
+	UINT ofs		/* Offset of the entry in the window */
+)
+{
+	FATFS *fs = cw->fs;
+	FFCHECK *rpt = cw->rpt;
+	BYTE *dir = fs->win + ofs, err;
+	DWORD scl, size, n, lcl, bcs = (DWORD)fs->csize * SS(fs);
+	int isdir = (dir[DIR_Attr] & AM_DIR) != 0, short_size;
+
+
+	scl = ld_clust(fs, dir);
+	size = isdir ? 0 : ld_dword(dir + DIR_FileSize);
+	if (isdir) rpt->dirs++; else rpt->files++;
+	n = lcl = 0; err = isdir ? 1 : 0;	/* A directory needs a cluster */
+	if (scl != 0) n = chk_chain(cw, scl, isdir ? 0xFFFFFFFF : (size ? (size - 1) / bcs + 1 : 0), &lcl, &err);
+	short_size = !isdir && (QWORD)n * bcs < size;
+	if (err == 1) rpt->bad_chains++;
+	if (err == 2) rpt->cross_links++;
+	if (err == 3 || (err == 0 && short_size)) rpt->size_errors++;
+	if (isdir && n > 0 && !chk_push(&cw->stack, &cw->nstack, &cw->szstack, scl, n)) return FR_NOT_ENOUGH_CORE;
+
+	if (!(cw->opt & FC_REPAIR) || (err == 0 && !short_size)) return FR_OK;
+	if (isdir && n == 0) {			/* A directory without a single good cluster is removed */
+		dir[DIR_Name] = DDEM;
+	} else {						/* Keep what the chain holds and cut it after that */
+		if (n == 0) st_clust(fs, dir, 0);
+		if (short_size) st_dword(dir + DIR_FileSize, n * bcs);
+	}
+	fs->wflag = 1;
+	rpt->repaired = 1;
+	return (err != 0 && lcl != 0) ? put_fat(fs, lcl, 0x0FFFFFFF) : FR_OK;
+}
+
+
+static FRESULT chk_dir (	/* Check the entries in a block of directory sectors */
+	CHKWORK* cw,
+	LBA_t sect,		/* First sector */
+	UINT nsect,		/* Number of sectors */
+	int* end		/* Set when the end of the directory was found */
+)
+{
+	FATFS *fs = cw->fs;
+	FRESULT res = FR_OK;
+	UINT ofs;
+	BYTE *dir, c;
+
+
+	for ( ; nsect > 0 && res == FR_OK; sect++, nsect--) {
+		for (ofs = 0; ofs < SS(fs) && res == FR_OK; ofs += SZDIRE) {
+			res = move_window(fs, sect);	/* The repair of the previous entry may have moved it */
+			if (res != FR_OK) break;
+			dir = fs->win + ofs;
+			c = dir[DIR_Name];
+			if (c == 0) {
+				*end = 1; return FR_OK;
+			}
+			if (c == DDEM || c == '.' || dir[DIR_Attr] == AM_LFN || (dir[DIR_Attr] & AM_VOL)) continue;
+			res = chk_entry(cw, ofs);
+		}
+	}
+	return res;
+}
+
+
+static FRESULT chk_lost (	/* Count the clusters in use no directory leads to, free them on repair */
+	CHKWORK* cw
+)
+{
+	FATFS *fs = cw->fs;
+	FFCHECK *rpt = cw->rpt;
+	FRESULT res = FR_OK;
+	DWORD i, clst, nxt, nw = (fs->n_fatent + 31) / 32;
+
+
+	for (i = 0; i < nw; i++) cw->used[i] &= ~cw->refd[i];	/* used[] becomes lost clusters */
+	for (clst = 2; clst < fs->n_fatent; clst++) {	/* Mark the lost clusters another lost one links to */
+		if (cw->used[clst / 32] == 0) {
+			clst |= 31; continue;
+		}
+		if (!CHK_TEST(cw->used, clst)) continue;
+		nxt = chk_next(cw, clst);
+		if (nxt == CHK_BAD) {
+			rpt->bad_clusters++;
+			cw->used[clst / 32] &= ~((DWORD)1 << (clst % 32));
+		} else if (nxt >= 2 && nxt < fs->n_fatent && CHK_TEST(cw->used, nxt)) {
+			CHK_SET(cw->refd, nxt);
+		}
+	}
+	for (clst = 2; clst < fs->n_fatent && res == FR_OK; clst++) {
+		if (cw->used[clst / 32] == 0) {
+			clst |= 31; continue;
+		}
+		if (!CHK_TEST(cw->used, clst)) continue;
+		rpt->lost_clusters++;
+		if (!CHK_TEST(cw->refd, clst)) rpt->lost_chains++;	/* Head of a chain */
+		if (cw->opt & FC_REPAIR) res = put_fat(fs, clst, 0);
+	}
+	return res;
+}
+
+
+FRESULT f_check (
+	FATFS* fs,			/* Pointer to filesystem object */
+	BYTE opt,			/* Check options (FC_REPAIR: fix the problems found) */
+	FFCHECK* rpt,		/* Pointer to the report to fill */
+	void* work,			/* Pointer to working buffer for the FAT reads */
+	UINT len			/* Size of working buffer in unit of byte */
+)
+{
+	FRESULT res;
+	CHKWORK cw;
+	DWORD nfree, clst, n, lcl, nw;
+	UINT nsect;
+	int end;
+	BYTE err;
+
+
+	memset(rpt, 0, sizeof (FFCHECK));
+	res = mount_volume(fs, 0, (opt & FC_REPAIR) ? FA_WRITE : 0);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	if (fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_INVALID_PARAMETER);	/* FAT chains only */
+	nsect = len / SS(fs);
+	if (nsect == 0) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE);
+#if FF_FS_LOCK
+	if (opt & FC_REPAIR) {	/* Open objects would lose their clusters */
+		for (n = 0; n < FF_FS_LOCK; n++) {
+			if (Files[n].fs == fs) LEAVE_FF(fs, FR_LOCKED);
+		}
+	}
+#endif
+	res = sync_window(fs);	/* The FAT is read past the window and the batch */
+#if FF_WRITE_BATCH
+	if (res == FR_OK && fs->wbuf) res = wb_flush(fs);
+#endif
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	memset(&cw, 0, sizeof cw);
+	cw.fs = fs; cw.rpt = rpt; cw.opt = opt;
+	nw = (fs->n_fatent + 31) / 32;
+	cw.used = ff_memalloc((UINT)(nw * 4));
+	cw.seq = ff_memalloc((UINT)(nw * 4));
+	cw.refd = ff_memalloc((UINT)(nw * 4));
+	if (!cw.used || !cw.seq || !cw.refd) res = FR_NOT_ENOUGH_CORE;
+	if (res == FR_OK) {
+		memset(cw.used, 0, nw * 4); memset(cw.seq, 0, nw * 4); memset(cw.refd, 0, nw * 4);
+		res = chk_load(&cw, (BYTE*)work, nsect, &nfree);
+	}
+
+	/* Walk the tree from the root directory */
+	end = 0;
+	if (res == FR_OK && fs->fs_type != FS_FAT32) {
+		res = chk_dir(&cw, fs->dirbase, fs->n_rootdir * SZDIRE / SS(fs), &end);
+	}
+	if (res == FR_OK && fs->fs_type == FS_FAT32) {
+		n = chk_chain(&cw, (DWORD)fs->dirbase, 0xFFFFFFFF, &lcl, &err);
+		if (err == 1) rpt->bad_chains++;
+		if (err == 2) rpt->cross_links++;
+		if (err != 0 && lcl != 0 && (opt & FC_REPAIR)) {
+			res = put_fat(fs, lcl, 0x0FFFFFFF);
+			rpt->repaired = 1;
+		}
+		if (n > 0 && !chk_push(&cw.stack, &cw.nstack, &cw.szstack, (DWORD)fs->dirbase, n)) res = FR_NOT_ENOUGH_CORE;
+	}
+	while (res == FR_OK && cw.nstack > 0) {
+		cw.nstack--;
+		clst = cw.stack[cw.nstack * 2]; n = cw.stack[cw.nstack * 2 + 1];
+		for (end = 0; res == FR_OK && !end && n > 0; n--, clst = chk_next(&cw, clst)) {
+			res = chk_dir(&cw, clst2sect(fs, clst), fs->csize, &end);
+		}
+	}
+
+	/* Clusters nobody owns, then the free count */
+	if (res == FR_OK && fs->free_clst <= fs->n_fatent - 2 && fs->free_clst != nfree) rpt->free_wrong = 1;
+	if (res == FR_OK) res = chk_lost(&cw);
+	if (res == FR_OK) {
+		rpt->free_clst = nfree;
+		if (opt & FC_REPAIR) {
+			rpt->free_clst += rpt->lost_clusters;
+			if (rpt->lost_clusters || rpt->free_wrong) rpt->repaired = 1;
+			fs->free_clst = rpt->free_clst;
+			fs->fsi_flag |= 1;
+			if (rpt->repaired) {	/* Names and paths may lead to removed entries */
+#if FF_DIR_CACHE
+				memset(fs->dcache, 0, sizeof fs->dcache);
+#endif
+#if FF_PATH_CACHE
+				pathcache_clear(fs);
+#endif
+			}
+			res = sync_fs(fs);
+		}
+	}
+
+	if (cw.used) ff_memfree(cw.used);
+	if (cw.seq) ff_memfree(cw.seq);
+	if (cw.refd) ff_memfree(cw.refd);
+	if (cw.link) ff_memfree(cw.link);
+	if (cw.stack) ff_memfree(cw.stack);
+	LEAVE_FF(fs, res);
+}
+#endif /* FF_USE_CHECK */
+
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
@@ -4810,6 +6855,8 @@ FRESULT f_truncate (
 	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+	res = trim_run(fp);					/* Give back the clusters allocated ahead */
+	if (res != FR_OK) ABORT(fs, res);
 
 	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
@@ -4931,6 +6978,12 @@ FRESULT f_unlink (
 			}
 			if (res == FR_OK) {
 				res = dir_remove(&dj);			/* Remove the directory entry */
+#if FF_DIR_CACHE
+				if (res == FR_OK && (dj.obj.attr & AM_DIR)) dircache_drop(fs, dclst, 0xFFFFFFFF);	/* Forget the names in the removed directory */
+#endif
+#if FF_PATH_CACHE
+				if (res == FR_OK && (dj.obj.attr & AM_DIR)) pathcache_clear(fs);	/* Its path (and cluster) are gone */
+#endif
 				if (res == FR_OK && dclst != 0) {	/* Remove the cluster chain if exist */
 #if FF_FS_EXFAT
 					res = remove_chain(&obj, dclst, 0);
@@ -5121,6 +7174,9 @@ FRESULT f_rename (
 					}
 				}
 			}
+#if FF_PATH_CACHE
+			if (res == FR_OK && (djo.obj.attr & AM_DIR)) pathcache_clear(fs);	/* Paths below the old name are gone */
+#endif
 			if (res == FR_OK) {
 				res = dir_remove(&djo);		/* Remove old entry */
 				if (res == FR_OK) {
@@ -5429,7 +7485,7 @@ FRESULT f_setlabel (
 			if (res == FR_NO_FILE) {
 				res = FR_OK;
 				if (di != 0) {	/* Create a volume label entry */
-					res = dir_alloc(&dj, 1);	/* Allocate an entry */
+					res = dir_alloc(&dj, 1, 0);	/* Allocate an entry */
 					if (res == FR_OK) {
 						memset(dj.dir, 0, SZDIRE);	/* Clean the entry */
 						if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) {
@@ -5482,6 +7538,9 @@ FRESULT f_expand (
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+#if FF_USE_TRIM
+	if (fs->ntrim) trim_flush(fs);	/* The freed clusters could be taken again */
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
@@ -5639,6 +7698,7 @@ static FRESULT create_partition (
 	void* drv,			/* Physical drive number */
 	const LBA_t plst[],	/* Partition list */
 	BYTE sys,			/* System ID for each partition (for only MBR) */
+	DWORD palign,		/* Partition start alignment [sector] (0,1:default) */
 	BYTE *buf			/* Working buffer for a sector */
 )
 {
@@ -5669,6 +7729,7 @@ static FRESULT create_partition (
 #endif
 		rnd = (DWORD)sz_drv + GET_FATTIME();	/* Random seed */
 		align = GPT_ALIGN / ss;				/* Partition alignment for GPT [sector] */
+		if (palign > align) align = palign;	/* Coarser alignment requested (erase block) */
 		sz_ptbl = GPT_ITEMS * SZ_GPTE / ss;	/* Size of partition table [sector] */
 		top_bpt = sz_drv - sz_ptbl - 1;		/* Backup partition table start LBA */
 		nxt_alloc = 2 + sz_ptbl;			/* First allocatable LBA */
@@ -5744,7 +7805,10 @@ static FRESULT create_partition (
 
 		memset(buf, 0, FF_MAX_SS);		/* Clear MBR */
 		pte = buf + MBR_Table;	/* Partition table in the MBR */
-		for (i = 0, nxt_alloc32 = n_sc; i < 4 && nxt_alloc32 != 0 && nxt_alloc32 < sz_drv32; i++, nxt_alloc32 += sz_part32) {
+		if (palign < 2) palign = 1;
+		for (i = 0, nxt_alloc32 = (palign > 1) ? palign : n_sc; i < 4 && nxt_alloc32 != 0 && nxt_alloc32 < sz_drv32; i++, nxt_alloc32 += sz_part32) {
+			nxt_alloc32 = (nxt_alloc32 + palign - 1) / palign * palign;	/* Align partition start LBA */
+			if (nxt_alloc32 >= sz_drv32) break;
 			sz_part32 = (DWORD)plst[i];	/* Get partition size */
 			if (sz_part32 <= 100) sz_part32 = (sz_part32 == 100) ? sz_drv32 : sz_drv32 / 100 * sz_part32;	/* Size in percentage? */
 			if (nxt_alloc32 + sz_part32 > sz_drv32 || nxt_alloc32 + sz_part32 < nxt_alloc32) sz_part32 = sz_drv32 - nxt_alloc32;	/* Clip at drive size */
@@ -5780,6 +7844,8 @@ static FRESULT create_partition (
 
 
 
+#define MKFS_PROGRESS(n)	{ pg_done += (n); if (opt->progress) opt->progress(pg_done, pg_total); }
+
 FRESULT f_mkfs (
 	const TCHAR* path,		/* Logical drive number */
 	const MKFS_PARM* opt,	/* Format options */
@@ -5800,6 +7866,7 @@ FRESULT f_mkfs (
 	LBA_t sect, lba[2];
 	DWORD sz_rsv, sz_fat, sz_dir, sz_au;	/* Size of reserved area, FAT area, directry area, data area and cluster */
 	UINT n_fat, n_root, i;					/* Number of FATs, number of roor directory entries and some index */
+	LBA_t b_free, pg_done, pg_total;		/* First sector not used by the system, progress of bulk writes */
 	int vol;
 	DSTATUS ds;
 	FRESULT res;
@@ -5810,7 +7877,6 @@ FRESULT f_mkfs (
 	if (vol < 0) return FR_INVALID_DRIVE;
 	if (FatFs[vol]) FatFs[vol]->fs_type = 0;	/* Clear the fs object if mounted */
 	pdrv = (void*)(uintptr_t)LD2PD(vol);		/* Hosting physical drive */
-	ipart = LD2PT(vol);		/* Hosting partition (0:create as new, 1..:existing partition) */
 
 	/* Initialize the hosting physical drive */
 	ds = disk_initialize(pdrv);
@@ -5819,6 +7885,7 @@ FRESULT f_mkfs (
 
 	/* Get physical drive parameters (sz_drv, sz_blk and ss) */
 	if (!opt) opt = &defopt;	/* Use default parameter if it is not given */
+	ipart = FF_MULTI_PARTITION ? opt->part : 0;	/* Hosting partition (0:create as new, 1..:existing partition) */
 	sz_blk = opt->align;
 	if (sz_blk == 0) disk_ioctl(pdrv, GET_BLOCK_SIZE, &sz_blk);					/* Block size from the parameter or lower layer */
 	if (sz_blk == 0 || sz_blk > 0x8000 || (sz_blk & (sz_blk - 1))) sz_blk = 1;	/* Use default if the block size is invalid */
@@ -5890,12 +7957,16 @@ FRESULT f_mkfs (
 #if FF_LBA64
 			if (sz_vol >= FF_MIN_GPT) {	/* Which partition type to create, MBR or GPT? */
 				fsopt |= 0x80;		/* Partitioning is in GPT */
-				b_vol = GPT_ALIGN / ss; sz_vol -= b_vol + GPT_ITEMS * SZ_GPTE / ss + 1;	/* Estimated partition offset and size */
+				b_vol = (sz_blk > GPT_ALIGN / ss) ? sz_blk : GPT_ALIGN / ss;
+				sz_vol -= b_vol + GPT_ITEMS * SZ_GPTE / ss + 1;	/* Estimated partition offset and size */
 			} else
 #endif
 			{	/* Partitioning is in MBR */
-				if (sz_vol > N_SEC_TRACK) {
-					b_vol = N_SEC_TRACK; sz_vol -= b_vol;	/* Estimated partition offset and size */
+				b_vol = (sz_blk > 1) ? sz_blk : N_SEC_TRACK;	/* Start the partition at the erase block boundary if known */
+				if (sz_vol > b_vol) {
+					sz_vol -= b_vol;	/* Estimated partition offset and size */
+				} else {
+					b_vol = 0;
 				}
 			}
 		}
@@ -5924,10 +7995,11 @@ FRESULT f_mkfs (
 	} while (0);
 
 	vsn = (DWORD)sz_vol + GET_FATTIME();	/* VSN generated from current time and partition size */
+	pg_done = 0;
 
 #if FF_FS_EXFAT
 	if (fsty == FS_EXFAT) {	/* Create an exFAT volume */
-		DWORD szb_bit, szb_case, sum, nbit, clu, clen[3];
+		DWORD szb_bit, szb_case, sum, nbit, clu, clen[3], szw_fat;
 		WCHAR ch, si;
 		UINT j, st;
 
@@ -5991,6 +8063,12 @@ FRESULT f_mkfs (
 		clen[1] = (szb_case + sz_au * ss - 1) / (sz_au * ss);	/* Number of up-case table clusters */
 		clen[2] = 1;	/* Number of root directory clusters */
 
+		/* FAT sectors to write. Quick format only writes the system chains, FAT entries of free clusters are don't-care on exFAT */
+		szw_fat = sz_fat;
+		if (!(opt->fmt & FM_FULL)) szw_fat = ((clen[0] + clen[1] + clen[2] + 2) * 4 + ss - 1) / ss;
+		pg_total = (szb_bit + ss - 1) / ss + szw_fat + sz_au;	/* Bulk writes: bitmap, FAT and root directory */
+		if (opt->fmt & FM_FULL) pg_total += b_vol + sz_vol - b_data - sz_au * (clen[0] + clen[1] + clen[2]);	/* and the data area */
+
 		/* Initialize the allocation bitmap */
 		sect = b_data; nsect = (szb_bit + ss - 1) / ss;	/* Start of bitmap and number of bitmap sectors */
 		nbit = clen[0] + clen[1] + clen[2];				/* Number of clusters in-use by system (bitmap, up-case and root-dir) */
@@ -5999,11 +8077,12 @@ FRESULT f_mkfs (
 			for (i = 0; nbit != 0 && i / 8 < sz_buf * ss; buf[i / 8] |= 1 << (i % 8), i++, nbit--) ;	/* Mark used clusters */
 			n = (nsect > sz_buf) ? sz_buf : nsect;		/* Write the buffered data */
 			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			MKFS_PROGRESS(n);
 			sect += n; nsect -= n;
 		} while (nsect);
 
 		/* Initialize the FAT */
-		sect = b_fat; nsect = sz_fat;	/* Start of FAT and number of FAT sectors */
+		sect = b_fat; nsect = szw_fat;	/* Start of FAT and number of FAT sectors */
 		j = nbit = clu = 0;
 		do {
 			memset(buf, 0, sz_buf * ss); i = 0;	/* Clear work area and reset write offset */
@@ -6021,6 +8100,7 @@ FRESULT f_mkfs (
 			} while (nbit != 0 && i < sz_buf * ss);
 			n = (nsect > sz_buf) ? sz_buf : nsect;	/* Write the buffered data */
 			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			MKFS_PROGRESS(n);
 			sect += n; nsect -= n;
 		} while (nsect);
 
@@ -6038,9 +8118,11 @@ FRESULT f_mkfs (
 		do {	/* Fill root directory sectors */
 			n = (nsect > sz_buf) ? sz_buf : nsect;
 			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			MKFS_PROGRESS(n);
 			memset(buf, 0, ss);	/* Rest of entries are filled with zero */
 			sect += n; nsect -= n;
 		} while (nsect);
+		b_free = sect;
 
 		/* Create two set of the exFAT VBR blocks */
 		sect = b_vol;
@@ -6216,6 +8298,8 @@ FRESULT f_mkfs (
 		}
 
 		/* Initialize FAT area */
+		pg_total = (LBA_t)sz_fat * n_fat + ((fsty == FS_FAT32) ? pau : sz_dir);	/* Bulk writes: FATs and root directory */
+		if (opt->fmt & FM_FULL) pg_total = b_vol + sz_vol - b_fat;	/* and the data area */
 		memset(buf, 0, sz_buf * ss);
 		sect = b_fat;		/* FAT start sector */
 		for (i = 0; i < n_fat; i++) {			/* Initialize FATs each */
@@ -6230,6 +8314,7 @@ FRESULT f_mkfs (
 			do {	/* Fill FAT sectors */
 				n = (nsect > sz_buf) ? sz_buf : nsect;
 				if (disk_write(pdrv, buf, sect, (UINT)n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+				MKFS_PROGRESS(n);
 				memset(buf, 0, ss);	/* Rest of FAT area is initially zero */
 				sect += n; nsect -= n;
 			} while (nsect);
@@ -6240,8 +8325,19 @@ FRESULT f_mkfs (
 		do {
 			n = (nsect > sz_buf) ? sz_buf : nsect;
 			if (disk_write(pdrv, buf, sect, (UINT)n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			MKFS_PROGRESS(n);
 			sect += n; nsect -= n;
 		} while (nsect);
+		b_free = sect;
+	}
+
+	if (opt->fmt & FM_FULL) {	/* Full format: clear the rest of the data area */
+		memset(buf, 0, sz_buf * ss);
+		for (sect = b_free; sect < b_vol + sz_vol; sect += n) {
+			n = (b_vol + sz_vol - sect > sz_buf) ? sz_buf : (DWORD)(b_vol + sz_vol - sect);
+			if (disk_write(pdrv, buf, sect, (UINT)n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			MKFS_PROGRESS(n);
+		}
 	}
 
 	/* A FAT volume has been created here */
@@ -6270,7 +8366,7 @@ FRESULT f_mkfs (
 	} else {								/* Volume as a new single partition */
 		if (!(fsopt & FM_SFD)) {			/* Create partition table if not in SFD format */
 			lba[0] = sz_vol; lba[1] = 0;
-			res = create_partition(pdrv, lba, sys, buf);
+			res = create_partition(pdrv, lba, sys, sz_blk, buf);
 			if (res != FR_OK) LEAVE_MKFS(res);
 		}
 	}
@@ -6309,7 +8405,7 @@ FRESULT f_fdisk (
 #endif
 	if (!buf) return FR_NOT_ENOUGH_CORE;
 
-	res = create_partition(pdrv, ptbl, 0x07, buf);	/* Create partitions (system ID is temporary setting and determined by f_mkfs) */
+	res = create_partition(pdrv, ptbl, 0x07, 0, buf);	/* Create partitions (system ID is temporary setting and determined by f_mkfs) */
 
 	LEAVE_MKFS(res);
 }
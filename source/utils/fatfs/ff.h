@@ -109,14 +109,74 @@ typedef char TCHAR;
 
 
 
+#if FF_DIR_CACHE
+/* Directory lookup cache slot (FATFS.dcache) */
+
+typedef struct {
+	DWORD	clust;			/* Start cluster of the directory (0:root directory) */
+	DWORD	hash;			/* Hash of the up-cased name (0:empty slot) */
+	DWORD	ofs;			/* Offset of the entry block in the directory */
+} FF_DIRCACHE;
+#endif
+
+
+
+#if FF_PATH_CACHE
+/* Path prefix cache slot (FATFS.pcache) */
+
+typedef struct {
+	QWORD	hash;			/* Hash of the directory path from the root (0:empty slot) */
+	DWORD	sclust;			/* Start cluster of the directory */
+#if FF_FS_EXFAT
+	DWORD	c_scl;			/* Containing directory start cluster */
+	DWORD	c_size;			/* b31-b8:Size of containing directory, b7-b0: Chain status */
+	DWORD	c_ofs;			/* Offset in the containing directory */
+	FSIZE_t	objsize;		/* Size of the directory */
+	BYTE	stat;			/* Chain status of the directory */
+#endif
+} FF_PATHCACHE;
+#endif
+
+
+
+#if FF_USE_STATS
+/* Volume statistics structure (FFSTATS, FATFS.stats) */
+
+typedef struct {
+	QWORD	win_hits;		/* move_window() calls finding the sector in win[] */
+	QWORD	win_loads;		/* Sectors read into win[] */
+	QWORD	fat_lookups;	/* FAT entries read by get_fat() */
+	QWORD	fcache_hits;	/* FAT sectors found in the read-only FAT cache */
+	QWORD	fcache_misses;	/* FAT sectors read into the read-only FAT cache */
+	QWORD	dcache_hits;	/* Names found at the entry block the directory lookup cache remembered */
+	QWORD	dir_scans;		/* Names searched from the top of their directory */
+	QWORD	dir_entries;	/* Directory entries (FAT) or entry blocks (exFAT) tested by the searches */
+	QWORD	pcache_hits;	/* Absolute paths resumed below the root by the path prefix cache */
+	QWORD	pcache_misses;	/* Absolute paths followed from the root */
+} FFSTATS;
+#endif
+
+
+
 /* Filesystem object structure (FATFS) */
 
 typedef struct {
 	void*	pdrv;			/* Physical drive object */
+#if FF_FS_REENTRANT
+	void*	mutex;			/* Volume mutex (owned by ff_mutex_*) */
+#endif
+#if FF_USE_PROFILE
+	BYTE	prof_depth;		/* Lock nesting of the "total" profiling segment */
+	QWORD	prof_start;		/* Tick the outermost lock was taken at */
+#endif
+#if FF_USE_STATS
+	FFSTATS	stats;			/* Counters read by f_getstats() */
+#endif
 	BYTE	fs_type;		/* Filesystem type (0:not mounted) */
 	BYTE	n_fats;			/* Number of FATs (1 or 2) */
 	BYTE	wflag;			/* win[] status (1:dirty) */
 	BYTE	fsi_flag;		/* Allocation information control (b7:disabled, b0:dirty) */
+	BYTE	rdonly;			/* Mounted with FV_RDONLY (1:write access is refused) */
 	WORD	id;				/* Volume mount ID */
 	WORD	n_rootdir;		/* Number of root directory entries (FAT12/16) */
 	WORD	csize;			/* Cluster size [sectors] */
@@ -132,6 +192,25 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster (Unknown if >= n_fatent) */
 	DWORD	free_clst;		/* Number of free clusters (Unknown if >= n_fatent-2) */
+#if FF_USE_FREEMAP
+	DWORD*	fmap;			/* Free cluster bitmap, bit n is cluster n+2 (1:in use) */
+	DWORD	fmap_scan;		/* Next cluster to load into fmap[] (complete if >= n_fatent) */
+	DWORD	fmap_free;		/* Number of free clusters found in fmap[] so far */
+#endif
+#if FF_LAZY_MIRROR
+	BYTE*	mdirty;			/* 1st FAT sectors not copied to the 2nd FAT yet, bit n is sector n (null:copied at once) */
+	BYTE	vflag;			/* Dirty volume flag control (b7:not used on this volume, b0:marked dirty in FAT[1]) */
+#endif
+#if FF_WRITE_BATCH
+	BYTE*	wbuf;			/* Held back sectors, FF_WRITE_BATCH * SS (null:no batch open) */
+	LBA_t	wbsect[FF_WRITE_BATCH];	/* Sector held in each slot (-1:free) */
+	BYTE	wbdepth;		/* Nesting count of f_batch() */
+#endif
+#if FF_USE_TRIM
+	DWORD	trim[FF_TRIM_BATCH][2];	/* Freed cluster runs not discarded yet (first and last cluster) */
+	BYTE	ntrim;			/* Number of runs in trim[] */
+	BYTE	notrim;			/* The drive answered CTRL_TRIM with RES_PARERR (1:no more discards) */
+#endif
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -149,6 +228,16 @@ typedef struct {
 	LBA_t	database;		/* Data base sector */
 #if FF_FS_EXFAT
 	LBA_t	bitbase;		/* Allocation bitmap base sector */
+#endif
+#if FF_FAT_CACHE
+	BYTE*	fcache;			/* FAT sectors of a read-only volume, FF_FAT_CACHE * SS (null:not used) */
+	LBA_t	fcsect[FF_FAT_CACHE];	/* Sector held in each slot (-1:empty) */
+#endif
+#if FF_DIR_CACHE
+	FF_DIRCACHE	dcache[FF_DIR_CACHE];	/* Where dir_find() found recently looked up names */
+#endif
+#if FF_PATH_CACHE
+	FF_PATHCACHE	pcache[FF_PATH_CACHE];	/* Directories recently opened by follow_path() */
 #endif
 	LBA_t	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
@@ -191,6 +280,7 @@ typedef struct {
 #if !FF_FS_READONLY
 	LBA_t	dir_sect;		/* Sector number containing the directory entry (not used at exFAT) */
 	BYTE*	dir_ptr;		/* Pointer to the directory entry in the win[] (not used at exFAT) */
+	DWORD	run_end;		/* Last cluster of the run allocated at the growing edge (0:none) */
 #endif
 #if FF_USE_FASTSEEK
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (nulled on open, set by application) */
@@ -239,18 +329,50 @@ typedef struct {
 
 
 
+/* Volume check report structure (FFCHECK) */
+
+typedef struct {
+	DWORD files;			/* Number of files checked */
+	DWORD dirs;				/* Number of directories checked */
+	DWORD bad_chains;		/* Chains running into a free, bad or out of range cluster */
+	DWORD cross_links;		/* Chains running into a cluster reached before (shared or looped) */
+	DWORD size_errors;		/* Files whose size does not match the length of their chain */
+	DWORD lost_chains;		/* Chains no directory entry leads to */
+	DWORD lost_clusters;	/* Clusters in the lost chains */
+	DWORD bad_clusters;		/* Clusters marked bad on the FAT, not counted as lost */
+	DWORD free_clst;		/* Free clusters counted on the FAT (after the repair if any) */
+	BYTE free_wrong;		/* The free cluster count held by the volume was wrong */
+	BYTE repaired;			/* Something was fixed on the volume */
+} FFCHECK;
+
+
+
 /* Format parameter structure (MKFS_PARM) */
 
 typedef struct {
-	BYTE fmt;			/* Format option (FM_FAT, FM_FAT32, FM_EXFAT and FM_SFD) */
+	BYTE fmt;			/* Format option (FM_FAT, FM_FAT32, FM_EXFAT, FM_SFD and FM_FULL) */
 	BYTE n_fat;			/* Number of FATs */
 	UINT align;			/* Data area alignment (sector) */
 	UINT n_root;		/* Number of root directory entries */
 	DWORD au_size;		/* Cluster size (byte) */
+	void (*progress)(LBA_t done, LBA_t total);	/* Called after each bulk write with sectors written so far (null:none) */
+	BYTE part;			/* Existing partition to format (0:the whole drive, with a new partition table unless FM_SFD) */
 } MKFS_PARM;
 
 
 
+/* Partition information structure (FFPART) */
+
+typedef struct {
+	BYTE	part;		/* Partition number f_mount() takes (0:whole drive without partition table) */
+	BYTE	fs;			/* Volume in it (1:FAT12/16/32, 2:exFAT, 0:something else) */
+	BYTE	system;		/* MBR system ID (0:GPT or no partition table) */
+	LBA_t	start;		/* First sector */
+	LBA_t	size;		/* Number of sectors */
+} FFPART;
+
+
+
 /* File function return code (FRESULT) */
 
 typedef enum {
@@ -304,12 +426,19 @@ FRESULT f_utime (FATFS* fs, const TCHAR* path, const FILINFO* fno);			/* Change
 FRESULT f_chdir (FATFS* fs, const TCHAR* path);						/* Change current directory */
 FRESULT f_getcwd (FATFS* fs, TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (FATFS* fs, DWORD* nclst);						/* Get number of free clusters on the drive */
+FRESULT f_buildfreemap (FATFS* fs, DWORD nclst, DWORD* left);			/* Load the next nclst clusters into the free cluster bitmap */
+FRESULT f_batch (FATFS* fs, BYTE on);								/* Open (1) or close (0) a batch of held back metadata writes, 2 closes all */
+FRESULT f_syncvol (FATFS* fs);										/* Write the deferred 2nd FAT and FSInfo, mark the volume clean */
+FRESULT f_check (FATFS* fs, BYTE opt, FFCHECK* rpt, void* work, UINT len);	/* Check the FAT chains against the directory tree, repair them on FC_REPAIR */
+FRESULT f_getstats (FATFS* fs, FFSTATS* st, BYTE reset);			/* Copy the counters of the volume, clear them if reset */
+FRESULT f_trimfree (FATFS* fs, DWORD* nclst);						/* Discard all free clusters of the volume */
 FRESULT f_getlabel (FATFS* fs, TCHAR* label, DWORD* vsn);			/* Get volume label */
 FRESULT f_setlabel (FATFS* fs, const TCHAR* label);					/* Set volume label */
 FRESULT f_forward (FFFIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FFFIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
 FRESULT f_mount (FATFS* fs, void* pdrv, UINT part);					/* Mount a logical drive */
 FRESULT f_umount (FATFS* fs);										/* Unmount a logical drive */
+FRESULT f_findparts (void* pdrv, FFPART* tbl, UINT max, UINT* n, void* work);	/* List the partitions of a physical drive and the volumes in them */
 FRESULT f_mkfs (const TCHAR* path, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (void* pdrv, const LBA_t ptbl[], void* work);		/* Divide a physical drive into some partitions */
 FRESULT f_setcp (WORD cp);											/* Set current code page */
@@ -349,7 +478,7 @@ DWORD ff_wtoupper (DWORD uni);			/* Unicode upper-case conversion */
 
 /* O/S dependent functions (samples available in ffsystem.c) */
 
-#if FF_USE_LFN == 3		/* Dynamic memory allocation */
+#if FF_USE_LFN == 3 || FF_USE_FREEMAP || FF_WRITE_BATCH || FF_LAZY_MIRROR || FF_USE_CHECK || FF_FAT_CACHE	/* Dynamic memory allocation */
 void* ff_memalloc (UINT msize);		/* Allocate memory block */
 void ff_memfree (void* mblock);		/* Free memory block */
 #endif
@@ -385,6 +514,13 @@ void ff_mutex_give (FATFS* fs);		/* Unlock sync object */
 #define FM_EXFAT	0x04
 #define FM_ANY		0x07
 #define FM_SFD		0x08
+#define FM_FULL		0x10	/* Zero the data area too (default is quick format) */
+
+/* Mount options (OR'ed into the 3rd argument of f_mount function) */
+#define FV_RDONLY	0x100	/* Refuse write access, the FAT and the free cluster count are then cached for good */
+
+/* Check options (2nd argument of f_check function) */
+#define FC_REPAIR	0x01	/* Cut bad chains, fix file sizes and free lost clusters */
 
 /* Filesystem type (FATFS.fs_type) */
 #define FS_FAT12	1
@@ -36,6 +36,13 @@
 /* This option switches f_mkfs(). (0:Disable or 1:Enable) */
 
 
+#define FF_USE_CHECK	1
+/* This option switches f_check(). (0:Disable or 1:Enable) It checks the FAT
+/  chains of a FAT12/16/32 volume against its directory tree and can repair them.
+/  While it runs it takes (number of clusters / 8 * 3) bytes of heap plus 8 bytes
+/  per fragment and end of chain. Needs FF_FS_READONLY == 0. */
+
+
 #define FF_USE_FASTSEEK	0
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
@@ -44,6 +51,68 @@
 /* This option switches f_expand(). (0:Disable or 1:Enable) */
 
 
+#define FF_USE_FREEMAP	1
+/* This option switches the in-memory free cluster bitmap and f_buildfreemap().
+/  (0:Disable or 1:Enable) Once the bitmap is complete, cluster allocation and
+/  f_getfree() no longer read the FAT. It takes (number of clusters / 8) bytes of
+/  heap per volume, allocated with ff_memalloc(). Needs FF_FS_READONLY == 0. */
+
+
+#define FF_ALLOC_AHEAD	256
+/* This option sets how many clusters f_write() may reserve past the data it
+/  writes when a file grows (0:Only the size of the write). With FF_USE_FREEMAP, a
+/  growing file takes a contiguous run sized from the write, or from the target
+/  offset of f_lseek() in write mode, and at least from its own size up to this
+/  limit, so files streamed in small writes stay mostly contiguous. The first run
+/  completes the free cluster bitmap. A run is linked on the FAT in one pass and
+/  the clusters still unused beyond the end of the file are given back by
+/  f_sync(), f_lseek() and f_truncate(). */
+
+
+#define FF_DIR_CACHE	1024
+/* This option sets the number of slots of the directory lookup cache in each
+/  filesystem object (0:Disable or power of 2). dir_find() remembers where it found
+/  a name and tests that entry block first the next time, instead of scanning the
+/  directory from the top. Every slot takes 12 bytes, it is direct mapped so it
+/  should be well above the number of names in the busiest directory. */
+
+
+#define FF_PATH_CACHE	64
+/* This option sets the number of slots of the path prefix cache in each
+/  filesystem object (0:Disable or power of 2). Absolute paths resume at the
+/  deepest directory that was opened before, instead of looking up every segment
+/  from the root again. It is dropped whenever a directory is moved or removed. */
+
+
+#define FF_FAT_CACHE	32
+/* This option sets the number of FAT sectors kept in memory by a volume mounted
+/  with FV_RDONLY (0:Disable). Nothing can change the FAT of such a volume, so
+/  the sectors get_fat() reads stay valid until it is unmounted and chains are
+/  followed without taking the disk access window from directory and file data.
+/  It takes this many sectors of heap per read-only volume. FAT12 volumes still
+/  read their FAT through the window. */
+
+
+#define FF_LAZY_MIRROR	1
+/* This option defers the 2nd FAT and the FAT32 FSInfo sector to f_syncvol()
+/  (0:Disable, 1:Enable). FAT sectors are only written to the 1st FAT, the ones
+/  changed since the last f_syncvol() are tracked in a bitmap of (sectors per
+/  FAT / 8) bytes of heap. The volume is marked dirty in FAT[1] before the first
+/  change and clean again by f_syncvol(). When a volume is mounted dirty, its
+/  2nd FAT is rebuilt from the 1st one and the free cluster count is counted
+/  again. Applies to FAT16/32 volumes with two FATs. */
+
+
+#define FF_WRITE_BATCH	32
+/* This option sets the number of sectors f_batch() can hold back in each
+/  filesystem object (0:Disable). While a batch is open, sectors leaving the disk
+/  access window (directory, FAT, FSInfo and at tiny cfg partial file data) are
+/  kept in memory and written once when the last batch ends, f_sync() is
+/  called or they run out of slots. The slots take FF_WRITE_BATCH * sector size
+/  bytes of heap, allocated with ff_memalloc() while a batch is open. Needs
+/  FF_FS_TINY == 1 and FF_FS_READONLY == 0. */
+
+
 #define FF_USE_CHMOD	1
 /* This option switches attribute control API functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
@@ -62,9 +131,15 @@
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_CODE_PAGE 0
+#ifndef FF_CODE_PAGE
+#define FF_CODE_PAGE 437
+#endif
 /* This option specifies the OEM code page to be used on the target system.
-/  Incorrect code page setting can cause a file open failure.
+/  Incorrect code page setting can cause a file open failure. It only affects
+/  the short names generated for long file names, so the default can be changed
+/  from the command line (make FATFS_CODE_PAGE=932). A fixed code page links in
+/  the two-level tables of ffcptbl.h for that code page alone, 0 links all of
+/  the tables in ffunicode.c (about 470 KiB) for f_setcp().
 /
 /   437 - U.S.
 /   720 - Arabic
@@ -146,17 +221,18 @@
 
 #define FF_MIN_SS		512
 #ifndef FF_MAX_SS
-#define FF_MAX_SS		512
+#define FF_MAX_SS		4096
 #endif
 /* This set of options configures the range of sector size to be supported. (512,
 /  1024, 2048 or 4096) Always set both 512 for most systems, generic memory card and
 /  harddisk, but a larger value may be required for on-board flash memory and some
 /  type of optical media. When FF_MAX_SS is larger than FF_MIN_SS, FatFs is
 /  configured for variable sector size mode and disk_ioctl() needs to implement
-/  GET_SECTOR_SIZE command. */
+/  GET_SECTOR_SHIFT command. 4096 is allowed here so that 4Kn (4K native) USB
+/  drives are accessed in their native sector size. */
 
 
-#define FF_LBA64		0
+#define FF_LBA64		1
 /* This option switches support for 64-bit LBA. (0:Disable or 1:Enable)
 /  To enable the 64-bit LBA, also exFAT needs to be enabled. (FF_FS_EXFAT == 1) */
 
@@ -166,10 +242,21 @@
 /  f_fdisk(). 2^32 sectors maximum. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable this feature, also CTRL_TRIM command should be implemented to
-/  the disk_ioctl(). */
+/  the disk_ioctl(). f_mkfs() discards the whole volume, the clusters freed by
+/  f_unlink(), f_truncate() and the like are collected and discarded when the
+/  volume is synced or before clusters get allocated again, and f_trimfree()
+/  discards all free clusters (needs FF_USE_FREEMAP). Drives answering
+/  CTRL_TRIM with RES_PARERR are left alone until the volume is re-mounted. */
+
+
+#define FF_TRIM_BATCH	16
+/* This option sets the number of freed cluster runs each filesystem object
+/  collects before it has to discard them (1..255). Adjacent runs are merged,
+/  so deleting many files within an f_batch() issues few CTRL_TRIM requests.
+/  Has no effect when FF_USE_TRIM == 0. */
 
 
 
@@ -184,7 +271,7 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
-#define FF_FS_EXFAT		0
+#define FF_FS_EXFAT		1
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
@@ -216,7 +303,7 @@
 */
 
 
-#define FF_FS_LOCK		0
+#define FF_FS_LOCK		32
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
 /  is 1.
@@ -228,8 +315,8 @@
 /      lock control is independent of re-entrancy. */
 
 
-#define FF_FS_REENTRANT	0
-#define FF_FS_TIMEOUT	1000
+#define FF_FS_REENTRANT	1
+#define FF_FS_TIMEOUT	0
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -241,8 +328,26 @@
 /      ff_mutex_create(), ff_mutex_delete(), ff_mutex_take() and ff_mutex_give(),
 /      must be added to the project. Samples are available in ffsystem.c.
 /
-/  The FF_FS_TIMEOUT defines timeout period in unit of O/S time tick.
-*/
+/  The FF_FS_TIMEOUT defines timeout period in unit of O/S time tick. The coreinit
+/  port in ffsystem.c takes it in milliseconds and 0 waits for the volume without
+/  a timeout, so that a long f_write() on one thread never fails another one. */
+
+
+#define FF_USE_STATS	1
+/* This option switches the per-volume counters and f_getstats(). (0:Disable or
+/  1:Enable) Every filesystem object counts its sector window loads, FAT lookups,
+/  hits of the FAT, directory and path caches and the directory entries it
+/  scans, so the effect of those caches can be watched on a mounted volume. The
+/  counters are plain increments made under the volume lock. */
+
+
+#ifndef FF_USE_PROFILE
+#define FF_USE_PROFILE	0
+#endif
+/* This option switches the profiling segments of ffprofile.c. (0:Disable or 1:Enable)
+/  The hot internal functions of ff.c and the disk I/O calls accumulate their
+/  time and call counts, see profile_getSegment() and profile_dump(). It is set
+/  from the build (make USE_FATFS_PROFILE=1) and costs nothing when disabled. */
 
 
 
@@ -0,0 +1,126 @@
+/*------------------------------------------------------------------------*/
+/* Profiling segments for the FatFs stack (FF_USE_PROFILE)                */
+/*------------------------------------------------------------------------*/
+
+#include "ffprofile.h"
+
+#if FF_USE_PROFILE
+
+#ifdef __WIIU__
+#include <coreinit/time.h>
+#else
+#include <time.h>
+#endif
+#include <string.h>
+
+// 64-bit counter kept as two 32-bit halves. The PowerPC only has 32-bit atomics, 64-bit ones would need libatomic.
+// A reader can see a sum that is short by 2^32 while a carry is on its way, good enough for a profile.
+typedef struct {
+    DWORD lo;
+    DWORD hi;
+} PROFILE_COUNTER;
+
+typedef struct {
+    const char* name;
+    PROFILE_COUNTER ticks;
+    PROFILE_COUNTER calls;
+} PROFILE_SEGMENT;
+
+// Indexed by FF_PROF_SEGMENT. Volumes are locked independently and the diskio layer runs outside of any
+// lock, so the counters are only ever touched with relaxed atomics.
+static PROFILE_SEGMENT segments[FF_PROF_SEGMENTS] = {
+    [FF_PROF_TOTAL]          = {"total"},
+    [FF_PROF_FILES]          = {"files"},
+    [FF_PROF_FOLLOW_PATH]    = {"follow_path"},
+    [FF_PROF_FOLLOW_FINDS]   = {"followfinds"},
+    [FF_PROF_DIR_FIND]       = {"dir_find"},
+    [FF_PROF_DIR_REGISTER]   = {"dir_register"},
+    [FF_PROF_REGISTER_FINDS] = {"registerfinds"},
+    [FF_PROF_DIR_ALLOC]      = {"dir_alloc"},
+    [FF_PROF_MOVE_WINDOW]    = {"move_window"},
+    [FF_PROF_GET_FAT]        = {"get_fat"},
+    [FF_PROF_CREATE_CHAIN]   = {"create_chain"},
+    [FF_PROF_DISK_READ]      = {"disk_read"},
+    [FF_PROF_DISK_WRITE]     = {"disk_write"},
+    [FF_PROF_DISK_SYNC]      = {"disk_sync"},
+};
+
+QWORD ff_profile_ticks (void) {
+#ifdef __WIIU__
+    return (QWORD)OSGetSystemTime();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (QWORD)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double ticks_to_ms (QWORD ticks) {
+#ifdef __WIIU__
+    return (double)ticks / (double)OSMillisecondsToTicks(1);
+#else
+    return (double)ticks / 1000000.0;
+#endif
+}
+
+static void counter_add (PROFILE_COUNTER* c, QWORD n) {
+    DWORD lo = (DWORD)n;
+    DWORD hi = (DWORD)(n >> 32);
+    if (__atomic_fetch_add(&c->lo, lo, __ATOMIC_RELAXED) > 0xFFFFFFFF - lo) hi++; // Low half wrapped around
+    if (hi != 0) __atomic_fetch_add(&c->hi, hi, __ATOMIC_RELAXED);
+}
+
+static QWORD counter_get (PROFILE_COUNTER* c) {
+    DWORD hi, lo;
+    do {
+        hi = __atomic_load_n(&c->hi, __ATOMIC_RELAXED);
+        lo = __atomic_load_n(&c->lo, __ATOMIC_RELAXED);
+    } while (__atomic_load_n(&c->hi, __ATOMIC_RELAXED) != hi);
+    return (QWORD)hi << 32 | lo;
+}
+
+static void counter_reset (PROFILE_COUNTER* c) {
+    __atomic_store_n(&c->lo, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->hi, 0, __ATOMIC_RELAXED);
+}
+
+void ff_profile_add (FF_PROF_SEGMENT seg, QWORD ticks) {
+    counter_add(&segments[seg].ticks, ticks);
+    counter_add(&segments[seg].calls, 1);
+}
+
+static PROFILE_SEGMENT* find_segment (const char* name) {
+    for (int i = 0; i < FF_PROF_SEGMENTS; i++) {
+        if (strcmp(segments[i].name, name) == 0) return &segments[i];
+    }
+    return NULL;
+}
+
+double profile_getSegment (const char* segmentName) {
+    PROFILE_SEGMENT* seg = find_segment(segmentName);
+    return seg ? ticks_to_ms(counter_get(&seg->ticks)) : 0.0;
+}
+
+QWORD profile_getCount (const char* segmentName) {
+    PROFILE_SEGMENT* seg = find_segment(segmentName);
+    return seg ? counter_get(&seg->calls) : 0;
+}
+
+void profile_reset (void) {
+    for (int i = 0; i < FF_PROF_SEGMENTS; i++) {
+        counter_reset(&segments[i].ticks);
+        counter_reset(&segments[i].calls);
+    }
+}
+
+void profile_dump (FILE* out) {
+    fprintf(out, "%-14s %12s %12s %10s\n", "segment", "calls", "total_ms", "avg_us");
+    for (int i = 0; i < FF_PROF_SEGMENTS; i++) {
+        QWORD calls = counter_get(&segments[i].calls);
+        if (calls == 0) continue;
+        double ms = ticks_to_ms(counter_get(&segments[i].ticks));
+        fprintf(out, "%-14s %12llu %12.3f %10.2f\n", segments[i].name, (unsigned long long)calls, ms, ms * 1000.0 / (double)calls);
+    }
+}
+
+#endif /* FF_USE_PROFILE */
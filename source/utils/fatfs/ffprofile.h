@@ -0,0 +1,60 @@
+#ifndef _FFPROFILE_DEFINED
+#define _FFPROFILE_DEFINED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "ff.h"
+
+/* Named profiling segments, every one accumulates the ticks spent inside it and how often it was entered.
+   Segments nest, follow_path includes the dir_find calls it makes and "total" includes everything. */
+typedef enum {
+    FF_PROF_TOTAL,          /* "total": a volume was locked by an API function */
+    FF_PROF_FILES,          /* "files": f_open, the call count is the number of opened files */
+    FF_PROF_FOLLOW_PATH,    /* "follow_path" */
+    FF_PROF_FOLLOW_FINDS,   /* "followfinds": dir_find called from follow_path */
+    FF_PROF_DIR_FIND,       /* "dir_find": all dir_find calls */
+    FF_PROF_DIR_REGISTER,   /* "dir_register" */
+    FF_PROF_REGISTER_FINDS, /* "registerfinds": numbered SFN collision scan of dir_register */
+    FF_PROF_DIR_ALLOC,      /* "dir_alloc" */
+    FF_PROF_MOVE_WINDOW,    /* "move_window" */
+    FF_PROF_GET_FAT,        /* "get_fat" */
+    FF_PROF_CREATE_CHAIN,   /* "create_chain" */
+    FF_PROF_DISK_READ,      /* "disk_read" */
+    FF_PROF_DISK_WRITE,     /* "disk_write" */
+    FF_PROF_DISK_SYNC,      /* "disk_sync": disk_ioctl(CTRL_SYNC) */
+    FF_PROF_SEGMENTS
+} FF_PROF_SEGMENT;
+
+#if FF_USE_PROFILE
+
+QWORD ff_profile_ticks (void);
+void ff_profile_add (FF_PROF_SEGMENT seg, QWORD ticks);
+
+/* Brackets a code block: FF_PROFILE_START(t0); ... FF_PROFILE_STOP(FF_PROF_xxx, t0); */
+#define FF_PROFILE_START(t)         QWORD t = ff_profile_ticks()
+#define FF_PROFILE_STOP(seg, t)     ff_profile_add((seg), ff_profile_ticks() - (t))
+
+/* Milliseconds accumulated in a segment by name (0 for unknown names) */
+double profile_getSegment (const char* segmentName);
+/* Number of times a segment was entered */
+QWORD profile_getCount (const char* segmentName);
+/* Clear all segments */
+void profile_reset (void);
+/* Write a table of all segments that were entered */
+void profile_dump (FILE* out);
+
+#else
+
+#define FF_PROFILE_START(t)
+#define FF_PROFILE_STOP(seg, t)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FFPROFILE_DEFINED */
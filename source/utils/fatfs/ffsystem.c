@@ -5,7 +5,7 @@
 #include "ff.h"
 
 
-#if FF_USE_LFN == 3	/* Use dynamic memory allocation */
+#if FF_USE_LFN == 3 || FF_USE_FREEMAP || FF_WRITE_BATCH || FF_LAZY_MIRROR || FF_USE_CHECK || FF_FAT_CACHE	/* Use dynamic memory allocation */
 
 /*------------------------------------------------------------------------*/
 /* Allocate/Free a Memory Block                                           */
@@ -38,33 +38,75 @@ void ff_memfree (
 /*------------------------------------------------------------------------*/
 /* Definitions of Mutex                                                   */
 /*------------------------------------------------------------------------*/
+/* Each volume owns a mutex that is created in f_mount and stored in its
+/  FATFS object. The system mutex (fs == NULL) protects the file lock table
+/  shared by all volumes (FF_FS_LOCK). It is created once before main() runs,
+/  as volumes get mounted from several threads.
+*/
 
-#define OS_TYPE	0	/* 0:Win32, 1:uITRON4.0, 2:uC/OS-II, 3:FreeRTOS, 4:CMSIS-RTOS */
+#include <stdlib.h>
+
+#ifdef __WIIU__		/* coreinit mutexes (recursive) */
+#include <coreinit/mutex.h>
+#include <coreinit/thread.h>
+#include <coreinit/time.h>
+
+typedef OSMutex FF_MUTEX;
+#define MUTEX_INIT(m, name)	OSInitMutexEx(m, name)
+#define MUTEX_LOCK(m)		OSLockMutex(m)
+#define MUTEX_TRYLOCK(m)	OSTryLockMutex(m)
+#define MUTEX_UNLOCK(m)		OSUnlockMutex(m)
+#define MUTEX_NAP()			OSSleepTicks(OSMicrosecondsToTicks(100))
+#define TIME_MS()			((unsigned long long)OSTicksToMilliseconds(OSGetSystemTime()))
+
+#else				/* POSIX threads for host builds, made recursive to behave like coreinit */
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef pthread_mutex_t FF_MUTEX;
+#define MUTEX_INIT(m, name)	posix_mutex_init(m)
+#define MUTEX_LOCK(m)		pthread_mutex_lock(m)
+#define MUTEX_TRYLOCK(m)	(pthread_mutex_trylock(m) == 0)
+#define MUTEX_UNLOCK(m)		pthread_mutex_unlock(m)
+#define MUTEX_NAP()			usleep(100)
+#define TIME_MS()			posix_time_ms()
+
+static void posix_mutex_init (pthread_mutex_t* m)
+{
+	pthread_mutexattr_t attr;
 
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
 
-#if   OS_TYPE == 0	/* Win32 */
-#include <windows.h>
-static HANDLE Mutex[FF_VOLUMES + 1];	/* Table of mutex handle */
+#if FF_FS_TIMEOUT > 0
+static unsigned long long posix_time_ms (void)
+{
+	struct timespec ts;
 
-#elif OS_TYPE == 1	/* uITRON */
-#include "itron.h"
-#include "kernel.h"
-static mtxid Mutex[FF_VOLUMES + 1];		/* Table of mutex ID */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#endif
+#endif
 
-#elif OS_TYPE == 2	/* uc/OS-II */
-#include "includes.h"
-static OS_EVENT *Mutex[FF_VOLUMES + 1];	/* Table of mutex pinter */
+static FF_MUTEX SysMutex;	/* System mutex */
 
-#elif OS_TYPE == 3	/* FreeRTOS */
-#include "FreeRTOS.h"
-#include "semphr.h"
-static SemaphoreHandle_t Mutex[FF_VOLUMES + 1];	/* Table of mutex handle */
 
-#elif OS_TYPE == 4	/* CMSIS-RTOS */
-#include "cmsis_os.h"
-static osMutexId Mutex[FF_VOLUMES + 1];	/* Table of mutex ID */
+__attribute__((constructor))
+static void sys_mutex_init (void)
+{
+	MUTEX_INIT(&SysMutex, "FatFs system");
+}
 
-#endif
+
+static FF_MUTEX* get_mutex (FATFS* fs)
+{
+	return fs ? (FF_MUTEX*)fs->mutex : &SysMutex;
+}
 
 
 
@@ -77,68 +119,38 @@ static osMutexId Mutex[FF_VOLUMES + 1];	/* Table of mutex ID */
 */
 
 int ff_mutex_create (	/* Returns 1:Function succeeded or 0:Could not create the mutex */
-	int vol				/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+	FATFS* fs			/* Volume to create the mutex for */
 )
 {
-#if OS_TYPE == 0	/* Win32 */
-	Mutex[vol] = CreateMutex(NULL, FALSE, NULL);
-	return (int)(Mutex[vol] != INVALID_HANDLE_VALUE);
-
-#elif OS_TYPE == 1	/* uITRON */
-	T_CMTX cmtx = {TA_TPRI,1};
-
-	Mutex[vol] = acre_mtx(&cmtx);
-	return (int)(Mutex[vol] > 0);
-
-#elif OS_TYPE == 2	/* uC/OS-II */
-	OS_ERR err;
-
-	Mutex[vol] = OSMutexCreate(0, &err);
-	return (int)(err == OS_NO_ERR);
-
-#elif OS_TYPE == 3	/* FreeRTOS */
-	Mutex[vol] = xSemaphoreCreateMutex();
-	return (int)(Mutex[vol] != NULL);
-
-#elif OS_TYPE == 4	/* CMSIS-RTOS */
-	osMutexDef(cmsis_os_mutex);
-
-	Mutex[vol] = osMutexCreate(osMutex(cmsis_os_mutex));
-	return (int)(Mutex[vol] != NULL);
-
-#endif
+	FF_MUTEX* mutex;
+
+	/* fs->mutex is not initialized yet, the object may come from the stack */
+	mutex = (FF_MUTEX*)malloc(sizeof(FF_MUTEX));
+	if (!mutex) return 0;
+	fs->mutex = mutex;
+	MUTEX_INIT(mutex, "FatFs volume");
+	return 1;
 }
 
 
 /*------------------------------------------------------------------------*/
 /* Delete a Mutex                                                         */
 /*------------------------------------------------------------------------*/
-/* This function is called in f_mount function to delete a mutex or
-/  semaphore of the volume created with ff_mutex_create function.
+/* This function is called in f_umount function to delete a mutex of the
+/  volume created with ff_mutex_create function.
 */
 
-void ff_mutex_delete (	/* Returns 1:Function succeeded or 0:Could not delete due to an error */
-	int vol				/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+void ff_mutex_delete (
+	FATFS* fs			/* Volume to delete the mutex of (NULL: system mutex) */
 )
 {
-#if OS_TYPE == 0	/* Win32 */
-	CloseHandle(Mutex[vol]);
-
-#elif OS_TYPE == 1	/* uITRON */
-	del_mtx(Mutex[vol]);
-
-#elif OS_TYPE == 2	/* uC/OS-II */
-	OS_ERR err;
-
-	OSMutexDel(Mutex[vol], OS_DEL_ALWAYS, &err);
-
-#elif OS_TYPE == 3	/* FreeRTOS */
-	vSemaphoreDelete(Mutex[vol]);
-
-#elif OS_TYPE == 4	/* CMSIS-RTOS */
-	osMutexDelete(Mutex[vol]);
-
+	if (fs && fs->mutex) {
+#ifndef __WIIU__
+		pthread_mutex_destroy((FF_MUTEX*)fs->mutex);
 #endif
+		free(fs->mutex);
+		fs->mutex = 0;
+	}
 }
 
 
@@ -150,28 +162,22 @@ void ff_mutex_delete (	/* Returns 1:Function succeeded or 0:Could not delete due
 */
 
 int ff_mutex_take (	/* Returns 1:Succeeded or 0:Timeout */
-	int vol			/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+	FATFS* fs		/* Volume to lock (NULL: system mutex) */
 )
 {
-#if OS_TYPE == 0	/* Win32 */
-	return (int)(WaitForSingleObject(Mutex[vol], FF_FS_TIMEOUT) == WAIT_OBJECT_0);
-
-#elif OS_TYPE == 1	/* uITRON */
-	return (int)(tloc_mtx(Mutex[vol], FF_FS_TIMEOUT) == E_OK);
-
-#elif OS_TYPE == 2	/* uC/OS-II */
-	OS_ERR err;
-
-	OSMutexPend(Mutex[vol], FF_FS_TIMEOUT, &err));
-	return (int)(err == OS_NO_ERR);
-
-#elif OS_TYPE == 3	/* FreeRTOS */
-	return (int)(xSemaphoreTake(Mutex[vol], FF_FS_TIMEOUT) == pdTRUE);
-
-#elif OS_TYPE == 4	/* CMSIS-RTOS */
-	return (int)(osMutexWait(Mutex[vol], FF_FS_TIMEOUT) == osOK);
-
+	FF_MUTEX* mutex = get_mutex(fs);
+
+	if (!mutex) return 0;
+#if FF_FS_TIMEOUT > 0
+	unsigned long long deadline = TIME_MS() + FF_FS_TIMEOUT;
+	while (!MUTEX_TRYLOCK(mutex)) {
+		if (TIME_MS() >= deadline) return 0;
+		MUTEX_NAP();
+	}
+#else
+	MUTEX_LOCK(mutex);
 #endif
+	return 1;
 }
 
 
@@ -183,25 +189,12 @@ int ff_mutex_take (	/* Returns 1:Succeeded or 0:Timeout */
 */
 
 void ff_mutex_give (
-	int vol			/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+	FATFS* fs		/* Volume to unlock (NULL: system mutex) */
 )
 {
-#if OS_TYPE == 0	/* Win32 */
-	ReleaseMutex(Mutex[vol]);
-
-#elif OS_TYPE == 1	/* uITRON */
-	unl_mtx(Mutex[vol]);
+	FF_MUTEX* mutex = get_mutex(fs);
 
-#elif OS_TYPE == 2	/* uC/OS-II */
-	OSMutexPost(Mutex[vol]);
-
-#elif OS_TYPE == 3	/* FreeRTOS */
-	xSemaphoreGive(Mutex[vol]);
-
-#elif OS_TYPE == 4	/* CMSIS-RTOS */
-	osMutexRelease(Mutex[vol]);
-
-#endif
+	if (mutex) MUTEX_UNLOCK(mutex);
 }
 
 #endif	/* FF_FS_REENTRANT */
@@ -24,6 +24,7 @@
 
 
 #include "ff.h"
+#include <string.h>
 
 #if FF_USE_LFN != 0	/* This module will be blanked if in non-LFN configuration */
 
@@ -35,7 +36,7 @@
 /* Code Conversion Tables                                                 */
 /*------------------------------------------------------------------------*/
 
-#if FF_CODE_PAGE == 932 || FF_CODE_PAGE == 0	/* Japanese */
+#if FF_CODE_PAGE == 0	/* Japanese, fixed code page uses ffcptbl.h */
 static const WCHAR uni2oem932[] = {	/* Unicode --> Shift_JIS pairs */
 	0x00A7, 0x8198, 0x00A8, 0x814E, 0x00B0, 0x818B, 0x00B1, 0x817D,	0x00B4, 0x814C, 0x00B6, 0x81F7, 0x00D7, 0x817E, 0x00F7, 0x8180,
 	0x0391, 0x839F, 0x0392, 0x83A0, 0x0393, 0x83A1, 0x0394, 0x83A2,	0x0395, 0x83A3, 0x0396, 0x83A4, 0x0397, 0x83A5, 0x0398, 0x83A6,
@@ -1891,7 +1892,7 @@ static const WCHAR oem2uni932[] = {	/* Shift_JIS --> Unicode pairs */
 };
 #endif
 
-#if FF_CODE_PAGE == 936 || FF_CODE_PAGE == 0	/* Simplified Chinese */
+#if FF_CODE_PAGE == 0	/* Simplified Chinese, fixed code page uses ffcptbl.h */
 static const WCHAR uni2oem936[] = {	/* Unicode --> GBK pairs */
 	0x00A4, 0xA1E8, 0x00A7, 0xA1EC, 0x00A8, 0xA1A7, 0x00B0, 0xA1E3,	0x00B1, 0xA1C0, 0x00B7, 0xA1A4, 0x00D7, 0xA1C1, 0x00E0, 0xA8A4,
 	0x00E1, 0xA8A2, 0x00E8, 0xA8A8, 0x00E9, 0xA8A6, 0x00EA, 0xA8BA,	0x00EC, 0xA8AC, 0x00ED, 0xA8AA, 0x00F2, 0xA8B0, 0x00F3, 0xA8AE,
@@ -7349,7 +7350,7 @@ static const WCHAR oem2uni936[] = {	/* GBK --> Unicode pairs */
 };
 #endif
 
-#if FF_CODE_PAGE == 949 || FF_CODE_PAGE == 0	/* Korean */
+#if FF_CODE_PAGE == 0	/* Korean, fixed code page uses ffcptbl.h */
 static const WCHAR uni2oem949[] = {	/* Unicode --> Korean pairs */
 	0x00A1, 0xA2AE, 0x00A4, 0xA2B4, 0x00A7, 0xA1D7, 0x00A8, 0xA1A7,	0x00AA, 0xA8A3, 0x00AD, 0xA1A9, 0x00AE, 0xA2E7, 0x00B0, 0xA1C6,
 	0x00B1, 0xA1BE, 0x00B2, 0xA9F7, 0x00B3, 0xA9F8, 0x00B4, 0xA2A5,	0x00B6, 0xA2D2, 0x00B7, 0xA1A4, 0x00B8, 0xA2AC, 0x00B9, 0xA9F6,
@@ -11621,7 +11622,7 @@ static const WCHAR oem2uni949[] = {	/* Korean --> Unicode pairs */
 };
 #endif
 
-#if FF_CODE_PAGE == 950 || FF_CODE_PAGE == 0	/* Traditional Chinese */
+#if FF_CODE_PAGE == 0	/* Traditional Chinese, fixed code page uses ffcptbl.h */
 static const WCHAR uni2oem950[] = {	/* Unicode --> Big5 pairs */
 	0x00A7, 0xA1B1, 0x00AF, 0xA1C2, 0x00B0, 0xA258, 0x00B1, 0xA1D3,	0x00B7, 0xA150, 0x00D7, 0xA1D1, 0x00F7, 0xA1D2, 0x02C7, 0xA3BE,
 	0x02C9, 0xA3BC, 0x02CA, 0xA3BD, 0x02CB, 0xA3BF, 0x02CD, 0xA1C5,	0x02D9, 0xA3BB, 0x0391, 0xA344, 0x0392, 0xA345, 0x0393, 0xA346,
@@ -15213,6 +15214,25 @@ static const WCHAR uc869[] = {	/*  CP869(Greek 2) to Unicode conversion table */
 
 
 
+/*------------------------------------------------------------------------*/
+/* Two-Level Tables for Static Code Page Configuration                    */
+/*------------------------------------------------------------------------*/
+/* A fixed code page looks its codes up in the generated ffcptbl.h instead
+/  of searching the tables above. The first level maps code >> SHIFT to a
+/  block of the second level, codes outside of the first level are not
+/  mapped. Run host/gen_cptbl.py after changing the tables above.
+*/
+
+#if FF_CODE_PAGE != 0
+#include "ffcptbl.h"
+
+#define CPTBL_GET(tbl, TBL, c) \
+	((UINT)((c) >> TBL##_SHIFT) - TBL##_FIRST < sizeof tbl##_idx / sizeof tbl##_idx[0] ? \
+	tbl##_blk[tbl##_idx[((c) >> TBL##_SHIFT) - TBL##_FIRST]][(c) & ((1 << TBL##_SHIFT) - 1)] : 0)
+#endif
+
+
+
 /*------------------------------------------------------------------------*/
 /* OEM <==> Unicode Conversions for Static Code Page Configuration with   */
 /* SBCS Fixed Code Page                                                   */
@@ -15225,7 +15245,6 @@ WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 )
 {
 	WCHAR c = 0;
-	const WCHAR* p = CVTBL(uc, FF_CODE_PAGE);
 
 
 	if (uni < 0x80) {	/* ASCII? */
@@ -15233,8 +15252,7 @@ WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 
 	} else {			/* Non-ASCII */
 		if (uni < 0x10000 && cp == FF_CODE_PAGE) {	/* Is it in BMP and valid code page? */
-			for (c = 0; c < 0x80 && uni != p[c]; c++) ;
-			c = (c + 0x80) & 0xFF;
+			c = CPTBL_GET(u2o, U2O, uni);
 		}
 	}
 
@@ -15277,9 +15295,7 @@ WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 	WORD	cp		/* Code page for the conversion */
 )
 {
-	const WCHAR* p;
-	WCHAR c = 0, uc;
-	UINT i = 0, n, li, hi;
+	WCHAR c = 0;
 
 
 	if (uni < 0x80) {	/* ASCII? */
@@ -15287,20 +15303,7 @@ WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 
 	} else {			/* Non-ASCII */
 		if (uni < 0x10000 && cp == FF_CODE_PAGE) {	/* Is it in BMP and valid code page? */
-			uc = (WCHAR)uni;
-			p = CVTBL(uni2oem, FF_CODE_PAGE);
-			hi = sizeof CVTBL(uni2oem, FF_CODE_PAGE) / 4 - 1;
-			li = 0;
-			for (n = 16; n; n--) {
-				i = li + (hi - li) / 2;
-				if (uc == p[i * 2]) break;
-				if (uc > p[i * 2]) {
-					li = i;
-				} else {
-					hi = i;
-				}
-			}
-			if (n != 0) c = p[i * 2 + 1];
+			c = CPTBL_GET(u2o, U2O, uni);
 		}
 	}
 
@@ -15313,9 +15316,7 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 	WORD	cp		/* Code page for the conversion */
 )
 {
-	const WCHAR* p;
 	WCHAR c = 0;
-	UINT i = 0, n, li, hi;
 
 
 	if (oem < 0x80) {	/* ASCII? */
@@ -15323,19 +15324,7 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 
 	} else {			/* Extended char */
 		if (cp == FF_CODE_PAGE) {	/* Is it valid code page? */
-			p = CVTBL(oem2uni, FF_CODE_PAGE);
-			hi = sizeof CVTBL(oem2uni, FF_CODE_PAGE) / 4 - 1;
-			li = 0;
-			for (n = 16; n; n--) {
-				i = li + (hi - li) / 2;
-				if (oem == p[i * 2]) break;
-				if (oem > p[i * 2]) {
-					li = i;
-				} else {
-					hi = i;
-				}
-			}
-			if (n != 0) c = p[i * 2 + 1];
+			c = CPTBL_GET(o2u, O2U, oem);
 		}
 	}
 
@@ -15460,8 +15449,22 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 /*------------------------------------------------------------------------*/
 /* Unicode Up-case Conversion                                             */
 /*------------------------------------------------------------------------*/
+/* Every name compare and hash up-cases each character, so ff_wtoupper
+/  handles ASCII inline and looks the rest of the BMP up in a map of
+/  256-character pages. A page is expanded from the compressed tables
+/  the first time one of its characters is converted. Pages without any
+/  case pair (all but 14) only get marked, the others take a slot of
+/  UpPool, which leaves room for more than the current tables need.
+*/
 
-DWORD ff_wtoupper (	/* Returns up-converted code point */
+#define UP_POOL	16		/* Number of expanded pages */
+
+static WCHAR UpPool[UP_POOL][256];	/* Expanded pages */
+static UINT UpUsed;					/* Number of UpPool slots taken */
+static WCHAR* UpPage[256];			/* Expanded page for each high byte of the BMP, UpNone:no case pairs, null:not expanded yet */
+static WCHAR UpNone[1];
+
+static DWORD wtoupper_cvt (	/* Returns up-converted code point */
 	DWORD uni		/* Unicode code point to be up-converted */
 )
 {
@@ -15590,4 +15593,47 @@ DWORD ff_wtoupper (	/* Returns up-converted code point */
 }
 
 
+static WCHAR* wtoupper_page (	/* Returns the expanded page, UpNone or null if UpPool is exhausted */
+	UINT hb			/* High byte of the BMP characters */
+)
+{
+	WCHAR buf[256], *page = UpNone, *expect = 0;
+	UINT i, slot;
+
+
+	for (i = 0; i < 256; i++) {
+		buf[i] = (WCHAR)wtoupper_cvt(hb << 8 | i);
+		if (buf[i] != (hb << 8 | i)) page = 0;
+	}
+	if (!page) {	/* Has case pairs, take a slot */
+		slot = __atomic_fetch_add(&UpUsed, 1, __ATOMIC_RELAXED);
+		if (slot >= UP_POOL) return 0;
+		page = UpPool[slot];
+		memcpy(page, buf, sizeof buf);
+	}
+	if (!__atomic_compare_exchange_n(&UpPage[hb], &expect, page, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		page = expect;		/* Another task was faster, its page is the same */
+	}
+	return page;
+}
+
+
+DWORD ff_wtoupper (	/* Returns up-converted code point */
+	DWORD uni		/* Unicode code point to be up-converted */
+)
+{
+	WCHAR* page;
+
+
+	if (uni < 0x80) {	/* ASCII */
+		return (uni >= 'a' && uni <= 'z') ? uni - 0x20 : uni;
+	}
+	if (uni >= 0x10000) return uni;	/* Out of BMP */
+	page = __atomic_load_n(&UpPage[uni >> 8], __ATOMIC_ACQUIRE);
+	if (!page) page = wtoupper_page(uni >> 8);
+	if (!page) return wtoupper_cvt(uni);	/* UpPool exhausted */
+	return page == UpNone ? uni : page[uni & 0xFF];
+}
+
+
 #endif /* #if FF_USE_LFN != 0 */